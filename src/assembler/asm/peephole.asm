@@ -0,0 +1,49 @@
+;=======================================================
+;                         peephole
+;=======================================================
+;
+; One case of each rule of the peephole pass (see peephole.rb). Assembled
+; with and without -O, the program prints the same values:
+;   ruby assemble.rb -O -o out/peephole.bin asm/peephole.asm
+; and with -O, the pass saves 9 of its 30 instructions. The rules on r0 only
+; apply to an executable assembled alone (Assembler#exec), not from the
+; command line: there, add r4,r1,r0 and seq r5,r0,r4 keep their register form.
+;
+    add r1 r0 3              ; r1 = 3
+; identities: removed
+    add r1 r1 0
+    sub r1 r1 0
+    mul r1 r1 1
+    div r1 r1 1
+    or r1 r1 0
+    and r1 r1 -1
+; multiplications: by 8, a shli; by 1, an addi
+    mul r2 r1 8              ; r2 = 24
+    mul r3 r1 1              ; r3 = 3
+; dead code: r9 is written again before it is read, removed
+    add r9 r1 r2
+; r0 operands: immediate forms, except from the command line
+    add r4 r1 r0             ; r4 = 3
+    seq r5 r0 r4             ; r5 = 0
+    add r9 r2 r3             ; r9 = 27
+    add r20 r9 0
+    scall 1
+    add r20 r4 r5            ; r20 = 3
+    scall 1
+; seqi then braz: a branz on r1, the seqi being dead then
+loop:
+    sub r1 r1 1
+    seq r6 r1 0
+    braz r6 loop             ; while r1 != 0
+    add r6 r1 0
+    add r20 r6 0             ; r20 = 0
+    scall 1
+; seqi then branz: a braz on r2
+    seq r7 r2 0
+    branz r7 skip
+    add r7 r0 1
+    add r20 r7 0             ; r20 = 1
+    scall 1
+skip:
+    add r7 r0 0
+    stop
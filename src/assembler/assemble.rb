@@ -1,10 +1,36 @@
 require 'colorize'
+require 'set'
+require_relative 'objfile'
+require_relative 'peephole'
 # class Assembler
 # Opens an asm file and extracts the instructions to binary
 # instantiate with Assembler.new('path_to_file', 'path_to_output_file')
 #
+# The output is an object file read by the VM (see src/vm/object.h):
+# a header, the code, the words of the .data section, the symbol table and
+# the control-flow graph of the code (see cfg.rb).
+# Source directives:
+#   .data / .text   switch between the data and the code
+#   .word v, ...    data words, numbers or labels
+#   .entry label    first instruction to run (address 0 by default)
+#   .global label   label other modules can refer to, when linked
+#
+# Assembly makes two passes, both linear in the size of the source:
+#   1. read the source line by line, record labels in a hash and encode each
+#      instruction as soon as it is read. An operand naming a label that is
+#      not known yet, such as a forward branch or any data label, is left at
+#      0 and recorded as a fixup.
+#   2. once the size of the code, and so every label, is known, patch the
+#      fixups.
+# A relocatable object skips the second pass: the fixups are left to the
+# Linker, see link.rb. With optimize, every label is a fixup, and the
+# Peephole pass (see peephole.rb) rewrites the code between the two passes.
+#
+# From the command line, see usage below:
+#   ruby assemble.rb -o out/chenillard.bin asm/chenillard.asm
+#
 class Assembler
-  def initialize(file, output = 'out/output.bin')
+  def initialize(file, output = 'out/output.bin', verbose: true, optimize: false)
     @opcodes = {
       'add' => 2, 'addi' => 3,
       'sub' => 4, 'subi' => 5,
@@ -23,212 +49,329 @@ class Assembler
       'jmp' => 30, 'jmpi' => 31,
       'braz' => 32, 'branz' => 33,
       'scall' => 34,
-      'stop' => 35
+      'stop' => 35,
+      'vload' => 36, 'vstore' => 37,
+      'vadd' => 38, 'vmul' => 39, 'vdot' => 40,
+      'vcopy' => 41, 'vset' => 42,
+      'amoadd' => 43, 'cas' => 44, 'fence' => 45
     }
-    @regs = %w[r0 r1 r2 r3 r4 r5 r6 r7 r8 r9 r10 r11 r12 r13 r14 r15 r16 r17 r18 r19 r20 r21 r22 r23 r24 r25 r26 r27 r28 r29 r30 r31]
+    @regs = (0..31).to_h { |i| ["r#{i}", i] }
     @regexes = {
-      'stop' => /stop/,
-      'add' => /add\s(r[0-9]|r[0-9][0-9]),((r|)[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'sub' => /sub\s(r[0-9]|r[0-9][0-9]),((r|)[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'mul' => /mul\s(r[0-9]|r[0-9][0-9]),((r|)[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'div' => /div\s(r[0-9]|r[0-9][0-9]),((r|)[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'and' => /and\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'or' => /or\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'xor' => /xor\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'shl' => /shl\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'shr' => /shr\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'slt' => /slt\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'sle' => /sle\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'seq' => /seq\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9])/,
-      'load' => /load\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),([0-9]|r[0-9][0-9])/,
-      'store' => /store\s(r[0-9]|r[0-9][0-9]),(r[0-9]|r[0-9][0-9]),([0-9]|r[0-9][0-9])/,
-      'jmp' => /jmp\s(\w*),(r[0-9]|r[0-9][0-9])/,
-      'braz' => /braz\s(r[0-9]|r[0-9][0-9]),(\w*)/,
-      'branz' => /branz\s(r[0-9]|r[0-9][0-9]),([0-9]|r[0-9][0-9])/,
-      'scall' => /scall\s([0-9]|r[0-9][0-9])/,
-      'label' => /([a-z]+):/,
-      'comment' => /;.*/
+      'label' => /\A(\w+):(.*)\z/,
+      'comment' => /[;#].*/,
+      'entry' => /\A\.entry\s+(\S+)\z/,
+      'global' => /\A\.global\s+(\S+)\z/,
+      'number' => /\A-?\d+\z/,
+      'hex' => /\A0x\h+\z/
     }
 
     @source = file
-    @content = _readfile
-    @operations = []
-    @labels = {}
     @output = output
-    @assembled = ''
+    @verbose = verbose
+    @sourcelines = {}
+    @oplines = []
+    @labels = {}
+    @datalabels = {}
+    @fixups = []
+    @assembled = []
+    @datawords = []
+    @dataaddr = 0
+    @entry = nil
+    @entryline = 0
+    @globals = {}
+    @relocatable = false
+    @optimize = optimize
+    @lineno = 0
+    @errors = 0
   end
 
-  def _readfile
-    res = []
-    content = File.open(@source, 'r').readlines
-    content.each do |line|
-      line.gsub!(@regexes['comment'], '')
-      line.strip!
-      res << line unless line.empty?
+  # format is :object, or :hex for the former text output with a .sym file
+  # pagealign puts the sections on pages, so that the VM can map them
+  def exec(save = true, symbols = true, format = :object, pagealign: false)
+    _readsource
+    _optimize if @optimize && @errors.zero?
+    _resolve(pagealign)
+    if @errors.positive?
+      puts "[Log/E]: #{@errors} errors, nothing saved".red
+      return false
     end
-    res
-  end
-
-  def exec(save = true)
-    @labels = _readlabels
-    @operations = _readops
-    @assembled = _assemble
-    res = _gencontent
     if save
-      File.open(@output, 'w') do |f|
-        f.write(res)
+      if format == :hex
+        File.write(@output, _gencontent)
+        _savesymbols if symbols
+      else
+        File.binwrite(@output, ObjectFile.executable(@assembled, @datawords, @dataaddr,
+                                                     @entry.nil? ? 0 : @labels[@entry],
+                                                     symbols ? _gensymbols : '', pagealign))
       end
       puts "[Log/I]: Assembled file saved to #{@output}"
     else
       printbinary
     end
+    true
   end
 
-  def _readlabels
-    puts '=========== Reading  labels ==========='.light_blue
-    labels = {}
-    @content.each do |line|
-      next unless line.include?(':')
+  # Relocatable object for the Linker, or nil on error: labels are offsets
+  # in their section, and every reference to a label is a relocation
+  def relocatable
+    @relocatable = true
+    _readsource
+    _optimize if @optimize && @errors.zero?
+    @globals.each do |label, lineno|
+      _error("Global #{label} undefined", lineno) unless @labels.include?(label) || @datalabels.include?(label)
+    end
+    if @errors.positive?
+      puts "[Log/E]: #{@errors} errors in #{@source}, nothing saved".red
+      return nil
+    end
+
+    symbols = @labels.map { |label, addr| ObjectFile::Label.new(label, :code, addr, @globals.include?(label)) } +
+              @datalabels.map { |label, addr| ObjectFile::Label.new(label, :data, addr, @globals.include?(label)) }
+    relocs = @fixups.map do |words, index, label, mask|
+      ObjectFile::Reloc.new(words.equal?(@datawords) ? :data : :code, index, mask, label)
+    end
+    lines = @oplines.each_with_index.map { |lineno, addr| ObjectFile::Line.new(addr, lineno, @sourcelines[lineno]) }
+    ObjectFile::Relocatable.new(@source, @assembled, @datawords, symbols, relocs, lines, @entry,
+                                @optimize ? ObjectFile::OPTIMIZED : 0)
+  end
+
+  def _log(message)
+    puts message if @verbose
+  end
 
-      label, newline = line.split(':')
-      labels[label] = @content.index(line)
-      if newline.nil? || newline.empty?
-        @content.delete(line)
+  def _error(message, lineno)
+    puts "[Log/E]: #{message} at line #{lineno}"
+    @errors += 1
+  end
+
+  # First pass: labels, data and instructions, in source order
+  def _readsource
+    puts '=========== Assembling ==========='.light_green
+    section = :text
+    File.foreach(@source, encoding: Encoding::UTF_8).with_index(1) do |line, lineno|
+      line = line.scrub.sub(@regexes['comment'], '').strip
+      next if line.empty?
+
+      @lineno = lineno
+      @sourcelines[lineno] = line
+      case line
+      when '.text'
+        section = :text
+        next
+      when '.data'
+        section = :data
+        next
+      when @regexes['entry']
+        @entry = Regexp.last_match(1)
+        @entryline = lineno
+        next
+      when @regexes['global']
+        @globals[Regexp.last_match(1)] = lineno
+        next
+      end
+
+      label = line.match(@regexes['label'])
+      unless label.nil?
+        _deflabel(label[1], section, lineno)
+        line = label[2].strip
+        next if line.empty?
+      end
+      if section == :text
+        _readop(line, lineno)
       else
-        newline.strip!
-        @content[@content.index(line)] = newline
+        _readwords(line, lineno)
       end
-      puts "[Log/I]: Label #{label} found at line #{labels[label]}"
     end
-    puts '========= Done reading labels ========='.light_blue
-    labels
-  end
-
-  # def _readops
-  #   ops = []
-  #   @content.each do |line|
-  #     next if line[0] == ';' || line.nil?
-  #
-  #     line = line.split(': ')[1] if line.include?(':')
-  #     next if line.nil?
-  #
-  #     line = line.split(';')[0] if line.include?(';')
-  #     @regexes.each do |op, regex|
-  #       next unless line.match(regex)
-  #
-  #       params = line.split(' ')[1]
-  #       ops << [op.to_s, params.to_s]
-  #       puts "[Log/I]: Operation #{op} found with params #{params}"
-  #     end
-  #   end
-  #   ops
-  # end
-  def _readops
-    puts '=========== Reading operations ==========='.green
-    ops = []
-    @content.each do |line|
-      next if line[0] == ';' || line.nil? || line.empty?
-
-      line = line.split(';', 2)[0]
-      next if line.nil? || line.empty?
-
-      op, params = line.split(' ', 2)
-      if @opcodes.include?(op)
-        ops << [op, params]
-        puts "[Log/I]: Operation #{op} found with params #{params}"
-      else
-        puts "[Log/E]: Operation #{op} unknown at line #{line}"
+    puts '========= Done assembling ========='.light_green
+  end
+
+  # Code labels are known at once, data labels once the code is complete
+  def _deflabel(label, section, lineno)
+    if @labels.include?(label) || @datalabels.include?(label)
+      _error("Label #{label} defined twice", lineno)
+    elsif section == :text
+      @labels[label] = @assembled.length
+      _log "[Log/I]: Label #{label} found at address #{@labels[label]}"
+    else
+      @datalabels[label] = @datawords.length
+      _log "[Log/I]: Data label #{label} found at word #{@datalabels[label]}"
+    end
+  end
+
+  def _readop(line, lineno)
+    op, params = line.split(' ', 2)
+    # A bare number in the code is a literal word
+    if params.nil? && (op.match?(@regexes['number']) || op.match?(@regexes['hex']))
+      @assembled << _operand(op, 0xffffffff)
+      @oplines << lineno
+      return
+    end
+    unless @opcodes.include?(op)
+      _error("Operation #{op} unknown", lineno)
+      return
+    end
+
+    _log "[Log/I]: Assembling #{op} with #{params}"
+    word = if respond_to?(op)
+             send(op, params)
+           elsif _isbinary(params)
+             op_binary(op, params)
+           end
+    if word.nil?
+      _error("Invalid operands #{params} for #{op}", lineno)
+      return
+    end
+    @assembled << word
+    @oplines << lineno
+  end
+
+  def _readwords(line, lineno)
+    unless line.start_with?('.word')
+      _error("Directive #{line} unknown", lineno)
+      return
+    end
+
+    line.delete_prefix('.word').split(',').each do |value|
+      @datawords << _operand(value.strip, 0xffffffff, @datawords)
+    end
+  end
+
+  # Peephole pass over the code, between the two passes: the labels follow
+  # the instructions that move
+  def _optimize
+    targets = {}
+    fixed = Set.new
+    @fixups.each do |words, index, label|
+      next unless words.equal?(@assembled)
+
+      fixed << index
+      targets[index] = @labels[label]
+    end
+    entries = Set.new(@labels.values)
+    r0zero = !@relocatable
+    @assembled.each_with_index do |word, i|
+      op = word >> 26
+      if op >= Peephole::JMPI && op <= Peephole::BRANZ && !fixed.include?(i)
+        puts "[Log/W]: Peephole pass skipped, the branch at line #{@oplines[i]} has no label".yellow
+        return
+      end
+      # Return addresses
+      entries << i + 1 if [Peephole::JMP, Peephole::JMPI].include?(op)
+      r0zero = false if (word >> 21 & 0x1F).zero? && op >= Peephole::ADD && op <= Peephole::JMPI && op != Peephole::STORE
+      r0zero = false if (word >> 21 & 0x1F).zero? && [Peephole::VLOAD, Peephole::VDOT, Peephole::AMOADD,
+                                                        Peephole::CAS].include?(op)
+    end
+
+    removed = Peephole.new(@assembled, targets, fixed, entries, r0zero).run
+    # New address of each word, or of the next word kept
+    newaddr = Array.new(@assembled.length + 1)
+    kept = 0
+    removed.each_with_index do |gone, i|
+      newaddr[i] = kept
+      kept += 1 unless gone
+    end
+    newaddr[@assembled.length] = kept
+
+    @labels.transform_values! { |addr| newaddr[addr] }
+    @fixups.reject! { |words, index| words.equal?(@assembled) && removed[index] }
+    @fixups.each { |fixup| fixup[1] = newaddr[fixup[1]] if fixup[0].equal?(@assembled) }
+    saved = @assembled.length - kept
+    @oplines = @oplines.reject.with_index { |_, i| removed[i] }
+    @assembled.replace(@assembled.reject.with_index { |_, i| removed[i] })
+    puts "[Log/I]: Peephole pass saved #{saved} of #{saved + kept} instructions"
+  end
+
+  # Second pass: place the data after the code and patch the fixups
+  def _resolve(pagealign)
+    puts '=========== Resolving labels ==========='.light_blue
+    @dataaddr = pagealign ? ObjectFile.align(@assembled.length, ObjectFile::PAGE_SIZE / 4) : @assembled.length
+    @datalabels.each do |label, offset|
+      @labels[label] = @dataaddr + offset
+    end
+    @fixups.each do |words, index, label, mask, lineno|
+      addr = @labels[label]
+      if addr.nil?
+        _error("Label #{label} undefined", lineno)
+        next
       end
+      words[index] |= _fits(label, addr, mask, lineno)
     end
-    puts '========= Done reading operations ========='.green
-    ops
-  end
-
-  #   def op_ternary(op, params)
-  #     r1, v, r2 = params.split(',')
-  #     raise "Error in #{op} #{params}" unless @regs.include?(r1) && @regs.include?(r2)
-  #
-  #     res = @opcodes[op] << 27
-  #     r1 = @regs.index(r1)
-  #     r2 = @regs.index(r2)
-  #     res += r1 << 22
-  #     if @regs.include?(v)
-  #       v = @regs.index(v)
-  #       res += (0xFFF & v) << 5
-  #     else
-  #       res += 1 << 21
-  #       v = v.to_i
-  #       res += (0xFFFFF & v) << 5
-  #     end
-  #     res += (0b11111 & r2)
-  #     res
-  #   end
-
-  def _getaddr(reg)
-    if @regs.include?(reg)
-      @regs.index(reg)
-    elsif @labels.include?(reg)
-      @labels[reg]
+    _error("Entry #{@entry} undefined", @entryline) unless @entry.nil? || @labels.include?(@entry)
+    _log "[Log/I]: #{@labels.length} labels, #{@fixups.length} fixups"
+    puts '========= Done resolving labels ========='.light_blue
+  end
+
+  # Value of an operand. A label that is not known yet, or any label of a
+  # relocatable object, reads as 0 and the word about to be appended to
+  # words is patched by _resolve or by the Linker.
+  def _operand(value, mask, words = @assembled)
+    if @regs.include?(value)
+      @regs[value]
+    elsif @labels.include?(value) && !@relocatable && !@optimize
+      _fits(value, @labels[value], mask, @lineno)
+    elsif value.match?(@regexes['number'])
+      value.to_i & mask
+    elsif value.match?(@regexes['hex'])
+      value.to_i(16) & mask
     else
-      reg.to_i
+      @fixups << [words, words.length, value, mask, @lineno]
+      0
     end
   end
 
+  # Address of a label, if it fits in the field of the instruction
+  def _fits(label, addr, mask, lineno)
+    _error("Label #{label} at address #{addr} out of range", lineno) if addr > mask
+    addr & mask
+  end
+
   def _isvalue(reg)
     !@regs.include?(reg)
   end
 
   def op_binary(op, params)
-    r1, v, r2 = params.include?(',') ? params.split(',') : params.split(' ')
+    r1, v, r2 = splitparams(params)
 
     r2, v = v, r2 unless @regs.include?(v)
 
+    return nil unless @regs.include?(r1) && @regs.include?(v)
+
     if _isvalue(r2)
-      op = @opcodes["#{op}i"] << 26
-      r2 = _getaddr(r2) & 0x0000FFFF
+      # load and store only have an immediate form
+      op = (@opcodes["#{op}i"] || @opcodes[op]) << 26
+      r2 = _operand(r2, 0x0000FFFF)
     else
       op = @opcodes[op] << 26
-      r2 = _getaddr(r2) << 11
+      r2 = @regs[r2] << 11
     end
 
-    r1 = _getaddr(r1) << 21
-    v = _getaddr(v) << 16
-    op | r1 | v | r2
+    op | (@regs[r1] << 21) | (@regs[v] << 16) | r2
   end
 
+  # jmp target,rd: jump to a label or to the address in a register,
+  # saving the return address in rd
   def jmp(params)
-    ra, rd = splitparams(params)
-    rd, ra = ra, rd unless @regs.include?(rd)
+    target, rd = splitparams(params)
+    return nil if rd.nil?
 
-    if _isvalue(rd)
-      op = @opcodes['jmpi'] << 26
-      rd = _getaddr(rd) & 0x000fffff
+    target, rd = rd, target unless @regs.include?(rd)
+    return nil unless @regs.include?(rd)
+
+    if _isvalue(target)
+      (@opcodes['jmpi'] << 26) | (@regs[rd] << 21) | _operand(target, 0x001fffff)
     else
-      op = @opcodes['jmp'] << 26
-      rd = _getaddr(rd) << 16
+      (@opcodes['jmp'] << 26) | (@regs[rd] << 21) | (@regs[target] << 16)
     end
-
-    rd = _getaddr(rd) << 21
-
-    op | rd | ra
-    # res = @opcodes.index('jmp') << 26
-    # label, r1 = r1, label unless @labels.include?(label)
-    # r1 = _getaddr(r1)
-    # label = _getaddr(label)
-    # incl = @regs.include?(r1) ? 0 : 1
-    # res += incl << 26
-    # res += r1 << 5
-    # res += label
-    # res
   end
 
   def braz(params, op = 'braz')
     rs, addr = splitparams(params)
+    return nil if addr.nil?
+
     rs, addr = addr, rs unless @regs.include?(rs)
-    op = @opcodes[op] << 26
-    rs = _getaddr(rs) << 21
-    addr = _getaddr(addr) & 0x000fffff
-    op | rs | addr
+    return nil unless @regs.include?(rs)
+
+    (@opcodes[op] << 26) | (@regs[rs] << 21) | _operand(addr, 0x0001ffff)
   end
 
   def branz(params)
@@ -236,18 +379,90 @@ class Assembler
   end
 
   def scall(param)
-    op = @opcodes['scall'] << 26
-    n = _getaddr(param) & 0x03ffffff
-    op | n
+    return nil if param.nil?
+
+    (@opcodes['scall'] << 26) | _operand(param.strip, 0x03ffffff)
   end
 
   def stop(_params)
     @opcodes['stop'] << 26
   end
 
+  # vload rd,rs,n: loads the n registers from rd with the words at the
+  # address in rs; vstore stores them there
+  def vload(params, op = 'vload')
+    return nil if params.nil?
+
+    rd, rs, n = splitparams(params)
+    return nil unless @regs.include?(rd) && @regs.include?(rs) && n&.match?(@regexes['number'])
+    return nil if n.to_i.negative? || @regs[rd] + n.to_i > @regs.length
+
+    (@opcodes[op] << 26) | (@regs[rd] << 21) | (@regs[rs] << 16) | n.to_i
+  end
+
+  def vstore(params)
+    vload(params, 'vstore')
+  end
+
+  # vadd rd,rs1,rs2,rn: operation on the blocks of memory at the addresses in
+  # rd, rs1 and rs2, as long as the value of rn. vcopy and vset have no rs2.
+  def op_vector(op, params, operands = 4)
+    return nil if params.nil?
+
+    regs = splitparams(params)
+    return nil unless regs.length == operands && regs.all? { |r| @regs.include?(r) }
+
+    regs.insert(2, 'r0') if operands == 3
+    rd, rs1, rs2, rn = regs.map { |r| @regs[r] }
+    (@opcodes[op] << 26) | (rd << 21) | (rs1 << 16) | (rs2 << 11) | (rn << 6)
+  end
+
+  def vadd(params)
+    op_vector('vadd', params)
+  end
+
+  def vmul(params)
+    op_vector('vmul', params)
+  end
+
+  # vdot rd,rs1,rs2,rn adds the dot product of the two blocks to rd
+  def vdot(params)
+    op_vector('vdot', params)
+  end
+
+  def vcopy(params)
+    op_vector('vcopy', params, 3)
+  end
+
+  # vset rd,rs,rn fills the block with the value of rs
+  def vset(params)
+    op_vector('vset', params, 3)
+  end
+
+  # amoadd rd,rs1,rs2 adds rs2 to the word at the address in rs1, and cas
+  # rd,rs1,rs2 replaces it with rs2 if it equals rd: both in one step the
+  # other harts see as a whole, leaving the former word in rd
+  def amoadd(params, op = 'amoadd')
+    return nil if params.nil?
+
+    regs = splitparams(params)
+    return nil unless regs.length == 3 && regs.all? { |r| @regs.include?(r) }
+
+    rd, rs1, rs2 = regs.map { |r| @regs[r] }
+    (@opcodes[op] << 26) | (rd << 21) | (rs1 << 16) | (rs2 << 11)
+  end
+
+  def cas(params)
+    amoadd(params, 'cas')
+  end
+
+  def fence(_params)
+    @opcodes['fence'] << 26
+  end
+
   def splitparams(params)
     sep = params.include?(',') ? ',' : ' '
-    params.split(sep)
+    params.split(sep).map(&:strip).reject(&:empty?)
   end
 
   def _isbinary(params)
@@ -262,37 +477,143 @@ class Assembler
     bin.to_i.to_s(16).rjust(8, '0')
   end
 
-  def _assemble
-    puts '=========== Assembling ==========='.light_green
-    res = []
-
-    @operations.each do |op, params|
-      next unless @opcodes.include?(op)
-
-      puts "[Log/I]: Assembling #{op} with #{params}"
-      res.append(if _isbinary(params)
-                   bin2hex(op_binary(op, params))
-                 else
-                   bin2hex(send(op, params))
-                 end)
+  def _gencontent
+    res = String.new(capacity: 9 * @assembled.length)
+    @assembled.each do |instruction|
+      res << bin2hex(instruction) << "\n"
     end
-    puts '========= Done assembling ========='.light_green
     res
   end
 
-  def _gencontent
-    res = ''
-    @assembled.each do |instruction|
-      res += "#{instruction}\n"
+  # Symbol file of the program, read by the VM to profile it:
+  #   label <address> <name>
+  #   line <address> <source line number> <source text>
+  def _gensymbols
+    res = String.new("# symbols of #{@source}\n", capacity: 64 * (@labels.length + @oplines.length))
+    @labels.sort_by { |_, addr| addr }.each do |label, addr|
+      res << "label #{addr} #{label}\n"
+    end
+    @oplines.each_with_index do |lineno, addr|
+      res << "line #{addr} #{lineno} #{@sourcelines[lineno]}\n"
     end
     res
   end
 
+  def _savesymbols
+    symfile = "#{@output.sub(/\.[^.\/]*\z/, '')}.sym"
+    File.write(symfile, _gensymbols)
+    puts "[Log/I]: Symbols saved to #{symfile}"
+  end
+
   def printbinary
-    puts @assembled
+    puts _gencontent
+  end
+end
+
+# class AssemblerCLI
+# Assembles many sources at once, each in its own relocatable object, then
+# links them into one image. Sources are dealt to forked workers; a source
+# whose object is newer than it, and was built with the same -O, is not
+# assembled again.
+#
+class AssemblerCLI
+  def initialize(argv)
+    @argv = argv
+    @output = 'out/output.bin'
+    @objdir = 'out/obj'
+    @jobs = Etc.nprocessors
+    @compileonly = false
+    @force = false
+    @pagealign = false
+    @symbols = true
+    @verbose = false
+    @optimize = false
+  end
+
+  def usage(parser)
+    puts parser
+    false
+  end
+
+  def run
+    parser = OptionParser.new do |opts|
+      opts.banner = 'Usage: ruby assemble.rb [options] <sources.asm and objects.o>'
+      opts.on('-o FILE', 'Linked image (default out/output.bin)') { |v| @output = v }
+      opts.on('-c', 'Only assemble the sources into objects') { @compileonly = true }
+      opts.on('--objdir DIR', 'Directory of the objects (default out/obj)') { |v| @objdir = v }
+      opts.on('-j N', Integer, 'Number of workers (default: number of cores)') { |v| @jobs = [v, 1].max }
+      opts.on('-f', '--force', 'Assemble sources even if their object is up to date') { @force = true }
+      opts.on('--align', 'Put the sections of the image on pages') { @pagealign = true }
+      opts.on('--no-symbols', 'Leave the symbol table out of the image') { @symbols = false }
+      opts.on('-O', 'Run the peephole optimizer') { @optimize = true }
+      opts.on('-v', '--verbose', 'Log every label and instruction') { @verbose = true }
+    end
+    inputs = parser.parse(@argv)
+    return usage(parser) if inputs.empty?
+
+    objects = inputs.map { |input| input.end_with?('.o') ? input : _objpath(input) }
+    if objects.uniq.length != objects.length
+      puts '[Log/E]: Two sources have the same name'.red
+      return false
+    end
+    return false unless _assemble(inputs.zip(objects).reject { |src, obj| src == obj || _uptodate(src, obj) })
+    return true if @compileonly
+
+    _link(objects)
+  end
+
+  def _objpath(source)
+    File.join(@objdir, "#{File.basename(source, '.*')}.o")
+  end
+
+  def _uptodate(source, object)
+    !@force && File.exist?(object) && File.mtime(object) >= File.mtime(source) &&
+      ObjectFile.relocatable_flags(object) == (@optimize ? ObjectFile::OPTIMIZED : 0)
+  end
+
+  def _assemble_one(source, object)
+    obj = Assembler.new(source, object, verbose: @verbose, optimize: @optimize).relocatable
+    return false if obj.nil?
+
+    File.binwrite(object, ObjectFile.write_relocatable(obj))
+    puts "[Log/I]: Assembled #{source} into #{object}"
+    true
+  end
+
+  # Sources are dealt round-robin to the workers
+  def _assemble(jobs)
+    return true if jobs.empty?
+
+    FileUtils.mkdir_p(@objdir)
+    slices = Array.new([@jobs, jobs.length].min) { [] }
+    jobs.each_with_index { |job, i| slices[i % slices.length] << job }
+    unless Process.respond_to?(:fork) && slices.length > 1
+      return jobs.map { |src, obj| _assemble_one(src, obj) }.all?
+    end
+
+    pids = slices.map do |slice|
+      fork { exit(slice.map { |src, obj| _assemble_one(src, obj) }.all?) }
+    end
+    pids.map { |pid| Process.wait2(pid)[1].success? }.all?
+  end
+
+  def _link(objects)
+    objs = objects.map do |file|
+      obj = ObjectFile.read_relocatable(file)
+      puts "[Log/E]: #{file} is not a relocatable object".red if obj.nil?
+      obj
+    end
+    return false if objs.include?(nil)
+
+    Linker.new(objs, @output, pagealign: @pagealign).exec(@symbols)
   end
 end
 
+if __FILE__ == $PROGRAM_NAME
+  require 'etc'
+  require 'fileutils'
+  require 'optparse'
+  require_relative 'link'
 
-a = Assembler.new('asm/test_asm.asm', 'out/test_asm.bin')
-a.exec(true)
+  exit(AssemblerCLI.new(ARGV).run)
+end
@@ -0,0 +1,131 @@
+# class ControlFlowGraph
+# Basic blocks of the encoded code of an image, and its loops, as the VM
+# builds them (see src/vm/cfg.h): the object file holds them so that the VM
+# does not have to find them at load.
+#
+# The code is split at the targets of jmpi, braz and branz, at the entry
+# point, and after every jump, branch and stop. A depth-first walk from the
+# entry point, then from the blocks it did not reach, finds the back edges:
+# the edges to a block still on the walk, which is then the header of a loop.
+#
+# instantiate with ControlFlowGraph.new(code, entry), then pack for the
+# section of the object file
+#
+class ControlFlowGraph
+  NONE = 0xFFFFFFFF
+
+  # Flags of a block
+  LOOP = 1          # header of a loop: the target of a back edge
+  BACK_TAKEN = 2    # the jump or branch ending the block is a back edge
+  BACK_NEXT = 4     # falling through, or returning from the call, is a back edge
+  CALL = 8          # ends on jmpi: next is the return address, in case it is a call
+  INDIRECT = 16     # ends on a jump to a register, or to an address outside the code
+  EXIT = 32         # ends on stop, or on a word that is not an instruction
+
+  JMP = 30
+  JMPI = 31
+  BRAZ = 32
+  BRANZ = 33
+  # Opcodes of the instructions, all the others stop the VM
+  OPCODES = [*2..25, 27, 29, *30..34, *36..45].freeze
+
+  # A block, as written in the object file: successors are addresses
+  Block = Struct.new(:start, :words, :taken, :next, :flags)
+
+  attr_reader :blocks
+
+  def initialize(code, entry)
+    @code = code
+    @blocks = []
+    return if code.empty?
+
+    _split(entry)
+    @blocks.each { |b| _link(b) }
+    @index = @blocks.each_with_index.to_h { |b, i| [b.start, i] }
+    @state = Array.new(@blocks.length, 0)
+    _walk(@index[entry]) if entry < code.length
+    @blocks.each_index { |i| _walk(i) if @state[i].zero? }
+  end
+
+  # The section of the object file: the five words of each block
+  def pack
+    @blocks.flat_map(&:to_a).pack('V*')
+  end
+
+  def _ends(op)
+    (op >= JMP && op <= BRANZ) || !OPCODES.include?(op)
+  end
+
+  # Jump and branch target
+  def _target(word)
+    word >> 26 == JMPI ? word & 0x1FFFFF : word & 0x1FFFF
+  end
+
+  def _split(entry)
+    leaders = Array.new(@code.length, false)
+    leaders[0] = true
+    leaders[entry] = true if entry < @code.length
+    @code.each_with_index do |word, pc|
+      op = word >> 26
+      next unless _ends(op)
+
+      leaders[pc + 1] = true if pc + 1 < @code.length
+      leaders[_target(word)] = true if op >= JMPI && op <= BRANZ && _target(word) < @code.length
+    end
+    leaders.each_with_index do |leader, pc|
+      @blocks << Block.new(pc, 0, NONE, NONE, 0) if leader
+      @blocks.last.words += 1
+    end
+  end
+
+  # Successors and flags from the last instruction of the block
+  def _link(block)
+    finish = block.start + block.words
+    word = @code[finish - 1]
+    op = word >> 26
+    block.next = finish if finish < @code.length
+    if op == JMP
+      block.next = NONE
+      block.flags = INDIRECT
+    elsif op >= JMPI && op <= BRANZ
+      if _target(word) < @code.length
+        block.taken = _target(word)
+      else
+        block.flags = INDIRECT
+      end
+      block.flags |= CALL if op == JMPI
+    elsif !OPCODES.include?(op)
+      block.next = NONE
+      block.flags = EXIT
+    end
+  end
+
+  # Depth first, next then taken: the state of a block is the count of its
+  # successors followed, 3 once it leaves the walk
+  def _walk(root)
+    stack = [[root, 0]]
+    @state[root] = 1
+    until stack.empty?
+      i, followed = stack.last
+      if followed == 2
+        @state[i] = 3
+        stack.pop
+        next
+      end
+
+      stack.last[1] += 1
+      block = @blocks[i]
+      succ, edge = followed.zero? ? [block.next, BACK_NEXT] : [block.taken, BACK_TAKEN]
+      next if succ == NONE
+
+      j = @index[succ]
+      if @state[j].zero?
+        @state[j] = 1
+        stack << [j, 0]
+      elsif @state[j] != 3
+        block.flags |= edge
+        @blocks[j].flags |= LOOP
+      end
+    end
+  end
+end
@@ -0,0 +1,133 @@
+require 'colorize'
+require_relative 'objfile'
+
+# class Linker
+# Links relocatable objects into one executable object.
+# instantiate with Linker.new([objects], 'path_to_output_file')
+#
+# The code of the objects is laid out in order, followed by their data.
+# A label is local to its object unless the object declares it .global:
+# a reference resolves to the local label first, then to the global one.
+# Exactly one global may have a given name, and at most one object .entry.
+#
+class Linker
+  def initialize(objects, output = 'out/output.bin', pagealign: false)
+    @objects = objects
+    @output = output
+    @pagealign = pagealign
+    @code = []
+    @data = []
+    @dataaddr = 0
+    @globals = {}
+    @locals = []
+    @errors = 0
+  end
+
+  def exec(symbols = true)
+    puts '=========== Linking ==========='.light_blue
+    _layout
+    _relocate
+    entry = _entry
+    puts '========= Done linking ========='.light_blue
+    if @errors.positive?
+      puts "[Log/E]: #{@errors} errors, nothing saved".red
+      return false
+    end
+
+    File.binwrite(@output, ObjectFile.executable(@code, @data, @dataaddr, entry,
+                                                 symbols ? _gensymbols : '', @pagealign))
+    puts "[Log/I]: Linked #{@objects.length} objects into #{@output}"
+    true
+  end
+
+  def _error(message, obj)
+    puts "[Log/E]: #{message} in #{obj.source}"
+    @errors += 1
+  end
+
+  # Base address of the code and the data of each object, and the address of
+  # each label
+  def _layout
+    @codebases = []
+    @objects.each do |obj|
+      @codebases << @code.length
+      @code.concat(obj.code)
+    end
+    @dataaddr = @pagealign ? ObjectFile.align(@code.length, ObjectFile::PAGE_SIZE / 4) : @code.length
+    @database = []
+    @objects.each do |obj|
+      @database << @dataaddr + @data.length
+      @data.concat(obj.data)
+    end
+
+    @objects.each_with_index do |obj, i|
+      locals = {}
+      obj.symbols.each do |label|
+        addr = label.value + (label.section == :code ? @codebases[i] : @database[i])
+        locals[label.name] = addr
+        next unless label.global
+
+        if @globals.include?(label.name)
+          _error("Global #{label.name} already defined in #{@objects[@globals[label.name][1]].source}", obj)
+        else
+          @globals[label.name] = [addr, i]
+        end
+      end
+      @locals << locals
+    end
+  end
+
+  def _resolve(name, i)
+    return @locals[i][name] if @locals[i].include?(name)
+
+    @globals[name]&.first
+  end
+
+  def _relocate
+    @objects.each_with_index do |obj, i|
+      obj.relocs.each do |reloc|
+        addr = _resolve(reloc.name, i)
+        if addr.nil?
+          _error("Label #{reloc.name} undefined", obj)
+          next
+        end
+        _error("Label #{reloc.name} at address #{addr} out of range", obj) if addr > reloc.mask
+
+        if reloc.section == :code
+          @code[@codebases[i] + reloc.index] |= addr & reloc.mask
+        else
+          @data[@database[i] - @dataaddr + reloc.index] |= addr & reloc.mask
+        end
+      end
+    end
+  end
+
+  def _entry
+    entries = @objects.each_index.reject { |i| @objects[i].entry.nil? }
+    return 0 if entries.empty?
+
+    if entries.length > 1
+      _error("Entry already defined in #{@objects[entries[0]].source}", @objects[entries[1]])
+      return 0
+    end
+    i = entries[0]
+    addr = _resolve(@objects[i].entry, i)
+    _error("Entry #{@objects[i].entry} undefined", @objects[i]) if addr.nil?
+    addr || 0
+  end
+
+  # Symbol table of the image, in the format of Assembler#_gensymbols
+  def _gensymbols
+    res = String.new("# symbols of #{@output}\n")
+    labels = @locals.flat_map(&:to_a).sort_by { |_, addr| addr }
+    labels.each do |label, addr|
+      res << "label #{addr} #{label}\n"
+    end
+    @objects.each_with_index do |obj, i|
+      obj.lines.each do |line|
+        res << "line #{@codebases[i] + line.addr} #{line.lineno} #{line.text}\n"
+      end
+    end
+    res
+  end
+end
@@ -0,0 +1,125 @@
+# module ObjectFile
+# Reads and writes the files of the assembler, all little-endian.
+#
+# Executable object, loaded by the VM (see src/vm/object.h):
+#   header, code (loaded at 0), data (loaded at dataaddr), symbol table,
+#   control-flow graph of the code (see cfg.rb)
+#
+# Relocatable object, written by Assembler#relocatable and read by the Linker:
+#   header      magic 'AVMR', version, header words, then the counts below,
+#               then the flags: OPTIMIZED if assembled with the peephole pass
+#   code, data  words, with the label fields of the relocations left at 0
+#   symbols     name, section, value (offset in its section), flags
+#   relocations section and index of the word, mask of the field, name
+#   lines       code offset, source line number, source text
+#   strings     NUL-terminated, the first one is the name of the source
+#
+require_relative 'cfg'
+
+module ObjectFile
+  MAGIC = 0x4F4D5641
+  VERSION = 1
+  HEADER_WORDS = 12
+  PAGE_SIZE = 4096
+
+  RELOC_MAGIC = 0x524D5641
+  RELOC_VERSION = 2
+  RELOC_HEADER_WORDS = 10
+
+  SECTIONS = %i[code data].freeze
+  GLOBAL = 1
+  OPTIMIZED = 1
+
+  # A module assembled without addresses: labels are offsets in its sections
+  Relocatable = Struct.new(:source, :code, :data, :symbols, :relocs, :lines, :entry, :flags)
+  Label = Struct.new(:name, :section, :value, :global)
+  Reloc = Struct.new(:section, :index, :mask, :name)
+  Line = Struct.new(:addr, :lineno, :text)
+
+  module_function
+
+  def align(offset, align)
+    (offset + align - 1) / align * align
+  end
+
+  # Executable object: pagealign puts the sections on pages, so that the VM
+  # can map them
+  def executable(code, data, dataaddr, entry, syms, pagealign)
+    align = pagealign ? PAGE_SIZE : 4
+    codeoffset = align(HEADER_WORDS * 4, align)
+    dataoffset = align(codeoffset + 4 * code.length, align)
+    symoffset = dataoffset + 4 * data.length
+    cfgoffset = align(symoffset + syms.bytesize, 4)
+    cfg = ControlFlowGraph.new(code, entry).pack
+
+    res = String.new(capacity: cfgoffset + cfg.bytesize, encoding: Encoding::BINARY)
+    [MAGIC, VERSION, HEADER_WORDS, entry,
+     codeoffset, code.length, dataoffset, dataaddr, data.length,
+     symoffset, syms.bytesize, cfgoffset, cfg.bytesize].pack('VvvV10', buffer: res)
+    res << "\0" * (codeoffset - res.bytesize)
+    code.pack('V*', buffer: res)
+    res << "\0" * (dataoffset - res.bytesize)
+    data.pack('V*', buffer: res)
+    res << syms.b
+    res << "\0" * (cfgoffset - res.bytesize)
+    res << cfg
+  end
+
+  def write_relocatable(obj)
+    strings = String.new(encoding: Encoding::BINARY)
+    offsets = {}
+    str = lambda do |s|
+      offsets[s] ||= strings.bytesize.tap { strings << s.b << "\0" }
+    end
+    str.call(obj.source)
+
+    symbols = obj.symbols.flat_map do |s|
+      [str.call(s.name), SECTIONS.index(s.section), s.value, s.global ? GLOBAL : 0]
+    end
+    relocs = obj.relocs.flat_map { |r| [SECTIONS.index(r.section), r.index, r.mask, str.call(r.name)] }
+    lines = obj.lines.flat_map { |l| [l.addr, l.lineno, str.call(l.text)] }
+    entry = obj.entry.nil? ? 0 : str.call(obj.entry) + 1
+
+    res = String.new(encoding: Encoding::BINARY)
+    [RELOC_MAGIC, RELOC_VERSION, RELOC_HEADER_WORDS, obj.code.length, obj.data.length, obj.symbols.length,
+     obj.relocs.length, obj.lines.length, entry, strings.bytesize, obj.flags].pack('VvvV8', buffer: res)
+    obj.code.pack('V*', buffer: res)
+    obj.data.pack('V*', buffer: res)
+    symbols.pack('V*', buffer: res)
+    relocs.pack('V*', buffer: res)
+    lines.pack('V*', buffer: res)
+    res << strings
+  end
+
+  # The relocatable object in a file, or nil if it is not one
+  def read_relocatable(file)
+    bytes = File.binread(file)
+    magic, version, headerwords, ncode, ndata, nsyms, nrelocs, nlines, entry, strbytes, flags = bytes.unpack('VvvV8')
+    return nil unless magic == RELOC_MAGIC && version == RELOC_VERSION
+
+    words = bytes.unpack("@#{4 * headerwords}V#{ncode + ndata + 4 * nsyms + 4 * nrelocs + 3 * nlines}")
+    strings = bytes.byteslice(bytes.bytesize - strbytes, strbytes)
+    return nil if words.length != ncode + ndata + 4 * nsyms + 4 * nrelocs + 3 * nlines || strings.nil?
+
+    str = ->(offset) { strings.byteslice(offset, strings.bytesize).unpack1('Z*').force_encoding(Encoding::UTF_8) }
+    code = words.shift(ncode)
+    data = words.shift(ndata)
+    symbols = words.shift(4 * nsyms).each_slice(4).map do |name, section, value, flags|
+      Label.new(str.call(name), SECTIONS[section], value, flags & GLOBAL != 0)
+    end
+    relocs = words.shift(4 * nrelocs).each_slice(4).map do |section, index, mask, name|
+      Reloc.new(SECTIONS[section], index, mask, str.call(name))
+    end
+    lines = words.shift(3 * nlines).each_slice(3).map { |addr, lineno, text| Line.new(addr, lineno, str.call(text)) }
+    Relocatable.new(str.call(0), code, data, symbols, relocs, lines, entry.zero? ? nil : str.call(entry - 1), flags)
+  end
+
+  # The flags of the relocatable object in a file, read from its header
+  # alone, or nil if it is not one
+  def relocatable_flags(file)
+    magic, version, headerwords, *, flags = File.binread(file, 4 * RELOC_HEADER_WORDS).to_s.unpack('VvvV8')
+    return nil unless magic == RELOC_MAGIC && version == RELOC_VERSION && headerwords == RELOC_HEADER_WORDS
+
+    flags
+  end
+end
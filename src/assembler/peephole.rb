@@ -0,0 +1,237 @@
+# class Peephole
+# Optional pass of the assembler (-O) rewriting the encoded instructions of a
+# module into fewer or cheaper ones, with the semantics of the VM:
+#   - identities are removed: addi r1,r1,0, muli r1,r1,1, ...
+#   - multiplications by a power of two become shifts
+#   - a branch on the result of seqi x,y,0 branches on y instead
+#   - computations whose result is never read are removed
+#   - when the module never writes r0, which then stays 0, operations with
+#     r0 use their immediate form, so that the rules above apply to them.
+#     Only for an executable assembled alone (Assembler#exec): another module
+#     of a relocatable object may write r0, so the command line, which links
+#     relocatable objects, leaves them out
+#
+# Code addresses must be given by labels: the instructions move, and only
+# label operands follow them. All the registers are assumed to be read after
+# a jump to a register, a system call, a stop and the end of the code.
+#
+class Peephole
+  ALL = 0xFFFFFFFF
+
+  ADD = 2
+  MUL = 6
+  DIV = 8
+  AND = 10
+  OR = 12
+  XOR = 14
+  SHL = 16
+  SHR = 18
+  SEQ = 24
+  LOAD = 27
+  STORE = 29
+  JMP = 30
+  JMPI = 31
+  BRAZ = 32
+  BRANZ = 33
+  SCALL = 34
+  VLOAD = 36
+  VSTORE = 37
+  VADD = 38
+  VDOT = 40
+  VSET = 42
+  AMOADD = 43
+  CAS = 44
+  FENCE = 45
+
+  # R operations equal to their immediate form with an immediate of 0. SLT and
+  # SLE are not: their immediate form compares unsigned.
+  R_TO_I = [ADD, ADD + 2, MUL, AND, OR, XOR, SHL, SHR, SEQ].freeze
+  COMMUTATIVE = [ADD, MUL, AND, OR, XOR, SEQ].freeze
+  # Immediate operations leaving rd = rs1 for the given immediate
+  IDENTITIES = { ADD + 1 => 0, ADD + 3 => 0, MUL + 1 => 1, DIV + 1 => 1, AND + 1 => 0xFFFF,
+                 OR + 1 => 0, XOR + 1 => 0, SHL + 1 => 0, SHR + 1 => 0 }.freeze
+
+  # words: the code, rewritten in place
+  # targets: index => code address of the label of a branch, nil if the label
+  #          is not in the code
+  # fixed: indices of the words whose immediate is a label, still 0
+  # entries: code addresses that can be jumped to
+  # r0zero: true if r0 is never written
+  def initialize(words, targets, fixed, entries, r0zero)
+    @words = words
+    @targets = targets
+    @fixed = fixed
+    @entries = entries
+    @r0zero = r0zero
+    @removed = Array.new(words.length, false)
+  end
+
+  # Runs the rules until none applies, and returns which words were removed
+  def run
+    loop do
+      changed = false
+      prev = nil
+      @words.each_index do |i|
+        next if @removed[i]
+
+        changed |= _rewrite(i, prev)
+        prev = i
+      end
+      changed |= _deadcode(_liveness)
+      break unless changed
+    end
+    @removed
+  end
+
+  def _op(word)
+    word >> 26
+  end
+
+  def _rd(word)
+    (word >> 21) & 0x1F
+  end
+
+  def _rs1(word)
+    (word >> 16) & 0x1F
+  end
+
+  def _rs2(word)
+    (word >> 11) & 0x1F
+  end
+
+  def _imm(word)
+    word & 0xFFFF
+  end
+
+  def _itype(op, rd, rs1, imm)
+    (op << 26) | (rd << 21) | (rs1 << 16) | (imm & 0xFFFF)
+  end
+
+  def _alu?(op)
+    op >= ADD && op <= SEQ + 1
+  end
+
+  # Local rules on the instruction at i, prev being the one before it
+  def _rewrite(i, prev)
+    word = @words[i]
+    op = _op(word)
+    rd = _rd(word)
+    if @r0zero && op.even? && R_TO_I.include?(op)
+      if _rs2(word).zero?
+        @words[i] = _itype(op + 1, rd, _rs1(word), 0)
+        return true
+      elsif _rs1(word).zero? && COMMUTATIVE.include?(op)
+        @words[i] = _itype(op + 1, rd, _rs2(word), 0)
+        return true
+      end
+    end
+    # The branch keeps its label: only its opcode and register change
+    if [BRAZ, BRANZ].include?(op) && !prev.nil? && !_entry?(prev, i)
+      test = @words[prev]
+      if _op(test) == SEQ + 1 && _imm(test).zero? && !@fixed.include?(prev) &&
+         _rd(test) == rd && _rs1(test) != rd
+        @words[i] = ((op == BRAZ ? BRANZ : BRAZ) << 26) | (_rs1(test) << 21) | (word & 0x1FFFF)
+        return true
+      end
+    end
+    return false if @fixed.include?(i)
+
+    if IDENTITIES.include?(op) && rd == _rs1(word) && _imm(word) == IDENTITIES[op]
+      @removed[i] = true
+      return true
+    end
+    if op == MUL + 1
+      imm = _imm(word)
+      if imm == 1
+        @words[i] = _itype(ADD + 1, rd, _rs1(word), 0)
+        return true
+      end
+      # Above 2^14, the sign extension of the immediate would change the shift
+      if imm > 1 && imm < 0x8000 && (imm & (imm - 1)).zero?
+        @words[i] = _itype(SHL + 1, rd, _rs1(word), imm.bit_length - 1)
+        return true
+      end
+    end
+    false
+  end
+
+  # True if the code can jump to i, or to a removed word between prev and i
+  def _entry?(prev, i)
+    (prev + 1..i).any? { |j| @entries.include?(j) }
+  end
+
+  # Registers read and written by a word, and where it can go next
+  def _effects(i)
+    return [0, 0, [i + 1]] if @removed[i]
+
+    word = @words[i]
+    op = _op(word)
+    rd = 1 << _rd(word)
+    rs1 = 1 << _rs1(word)
+    case op
+    when ADD..SEQ + 1
+      op.even? ? [rs1 | (1 << _rs2(word)), rd, [i + 1]] : [rs1, rd, [i + 1]]
+    when LOAD then [rs1, rd, [i + 1]]
+    when STORE then [rs1 | rd, 0, [i + 1]]
+    when JMP then [rs1, rd, nil]
+    when JMPI then [0, rd, @targets[i].nil? ? nil : [@targets[i]]]
+    when BRAZ, BRANZ then [rd, 0, @targets[i].nil? ? nil : [i + 1, @targets[i]]]
+    when SCALL then [ALL, 0, [i + 1]]
+    when VLOAD then [rs1, _block(word), [i + 1]]
+    when VSTORE then [rs1 | _block(word), 0, [i + 1]]
+    when VADD..VSET
+      use = rd | rs1 | (1 << _rs2(word)) | (1 << (word >> 6 & 0x1F))
+      [use, op == VDOT ? rd : 0, [i + 1]]
+    when AMOADD then [rs1 | (1 << _rs2(word)), rd, [i + 1]]
+    when CAS then [rd | rs1 | (1 << _rs2(word)), rd, [i + 1]]
+    when FENCE then [0, 0, [i + 1]]
+    else [ALL, 0, nil]
+    end
+  end
+
+  # Registers loaded or stored by vload and vstore
+  def _block(word)
+    ((1 << _imm(word)) - 1) << _rd(word) & ALL
+  end
+
+  # Registers live after each word, as bit masks; nil successors, like the
+  # end of the code, read every register
+  def _liveness
+    n = @words.length
+    effects = Array.new(n) { |i| _effects(i) }
+    livein = Array.new(n + 1, 0)
+    livein[n] = ALL
+    liveout = Array.new(n, 0)
+    loop do
+      changed = false
+      (n - 1).downto(0) do |i|
+        use, defs, succ = effects[i]
+        out = succ.nil? ? ALL : succ.inject(0) { |acc, s| acc | livein[[s, n].min] }
+        into = use | (out & ~defs)
+        next if out == liveout[i] && into == livein[i]
+
+        liveout[i] = out
+        livein[i] = into
+        changed = true
+      end
+      break unless changed
+    end
+    liveout
+  end
+
+  # Removes computations whose result is dead; divisions stay, they can fault
+  def _deadcode(liveout)
+    changed = false
+    @words.each_with_index do |word, i|
+      next if @removed[i]
+
+      op = _op(word)
+      next unless _alu?(op) && op != DIV && op != DIV + 1
+      next unless (liveout[i] & (1 << _rd(word))).zero?
+
+      @removed[i] = true
+      changed = true
+    end
+    changed
+  end
+end
@@ -0,0 +1,388 @@
+/** @file batch.c
+ * @brief Batch runner executing many guest programs across cores.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Runs a list of binaries, or one binary with several input vectors, on a
+ * pool of worker threads. Jobs are dealt round-robin to per-worker queues;
+ * a worker that runs out of jobs steals from the others. The output of each
+ * job is collected in a private buffer, so workers never contend on stdout, and
+ * the results are reported in job order once every job is done.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+/** @brief One guest run and its results */
+typedef struct {
+    const char *path;   // binary to run
+    char *input;        // input vector for scall 0, or NULL
+    int status;         // VM_* status, or -1 if the binary could not be loaded
+    int fault;          // VM_FAULT_* cause of a VM_FAULT status
+    int result;         // final value of r20
+    uint64_t steps;     // instructions executed
+    uint64_t memUsed;   // bytes of memory the program held
+    char *output;       // syscall output
+    size_t outputLen;
+    size_t outputCap;
+} job_t;
+
+/** @brief Queue of job indices owned by one worker
+ *
+ * The owner takes jobs from the tail, thieves take them from the head.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int *jobs;
+    int head;
+    int tail;
+} queue_t;
+
+/** @brief State shared by all the workers */
+typedef struct {
+    job_t *jobs;
+    queue_t *queues;
+    int nbrWorkers;
+    int engine;
+    uint64_t maxSteps;
+    vm_config_t config;
+} batch_t;
+
+/** @brief Arguments of a worker thread */
+typedef struct {
+    batch_t *batch;
+    int id;
+} worker_t;
+
+/**
+ * @brief Take a job from the tail of the worker's own queue
+ * @param q the queue
+ * @return job index, or -1 if the queue is empty
+ */
+static int popJob(queue_t *q) {
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        job = q->jobs[--q->tail];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/**
+ * @brief Take a job from the head of another worker's queue
+ * @param q the queue
+ * @return job index, or -1 if the queue is empty
+ */
+static int stealJob(queue_t *q) {
+    int job = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        job = q->jobs[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/**
+ * @brief Find the next job of a worker, stealing one if its queue is empty
+ * @param batch the batch
+ * @param id index of the worker
+ * @return job index, or -1 if every queue is empty
+ */
+static int nextJob(batch_t *batch, int id) {
+    int i;
+    int job = popJob(&batch->queues[id]);
+    for (i = 1; job < 0 && i < batch->nbrWorkers; i++) {
+        job = stealJob(&batch->queues[(id + i) % batch->nbrWorkers]);
+    }
+    return job;
+}
+
+/**
+ * @brief Output sink appending the output of the guest to its job
+ * @param ctx the job_t
+ * @param data bytes written by the guest
+ * @param len number of bytes
+ */
+static void jobOutput(void *ctx, const char *data, size_t len) {
+    job_t *job = ctx;
+    if (job->outputLen + len > job->outputCap) {
+        size_t cap = job->outputCap ? job->outputCap : 256;
+        while (cap < job->outputLen + len) {
+            cap *= 2;
+        }
+        char *output = realloc(job->output, cap);
+        if (output == NULL) {
+            return;
+        }
+        job->output = output;
+        job->outputCap = cap;
+    }
+    memcpy(job->output + job->outputLen, data, len);
+    job->outputLen += len;
+}
+
+/**
+ * @brief Run one job in the worker's VM
+ * @param vm the VM of the worker
+ * @param job the job
+ * @param batch the batch
+ */
+static void runJob(vm_t *vm, job_t *job, const batch_t *batch) {
+    vm_set_output_callback(vm, jobOutput, job);
+    if (job->input != NULL) {
+        vm_set_input_text(vm, job->input, strlen(job->input));
+    } else {
+        vm_set_input(vm, stdin);
+    }
+
+    if (vm_load(vm, job->path) < 0) {
+        job->status = -1;
+    } else {
+        job->status = vm_run(vm, batch->maxSteps);
+        job->result = vm_reg(vm, 20);
+        job->steps = vm_steps(vm);
+        job->memUsed = vm_mem_used(vm);
+        job->fault = vm_fault(vm, NULL);
+    }
+}
+
+/**
+ * @brief Worker thread: run jobs until none is left
+ * @param arg the worker_t of the thread
+ */
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    batch_t *batch = w->batch;
+    int job;
+
+    vm_t *vm = vm_create_config(&batch->config);
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm_set_engine(vm, batch->engine);
+    while ((job = nextJob(batch, w->id)) >= 0) {
+        runJob(vm, &batch->jobs[job], batch);
+    }
+    vm_destroy(vm);
+    return NULL;
+}
+
+/**
+ * @brief Read input vectors, one per non-empty line
+ * @param filename the file to read
+ * @param nbr set to the number of vectors
+ * @return array of vectors, or NULL if the file cannot be read
+ */
+static char **readInputs(const char *filename, int *nbr) {
+    FILE *f = fopen(filename, "r");
+    char **inputs = NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    int size = 0;
+    *nbr = 0;
+    if (f == NULL) {
+        return NULL;
+    }
+    while (getline(&line, &cap, f) >= 0) {
+        if (strspn(line, " \t\r\n") == strlen(line)) {
+            continue;
+        }
+        if (*nbr == size) {
+            size = size ? 2 * size : 64;
+            inputs = realloc(inputs, size * sizeof(char *));
+        }
+        inputs[(*nbr)++] = strdup(line);
+    }
+    free(line);
+    fclose(f);
+    return inputs;
+}
+
+/**
+ * @brief Name of a job status
+ * @param status VM_* status or -1
+ */
+static const char *statusName(int status) {
+    switch (status) {
+        case VM_HALTED:
+            return "halted";
+        case VM_BUDGET_EXHAUSTED:
+            return "budget exhausted";
+        case VM_FAULT:
+            return "fault";
+        default:
+            return "load error";
+    }
+}
+
+/** @brief Print the usage of the program */
+static void usage(const char *name) {
+    printf("Usage: %s [options] <input files>\n", name);
+    printf("       %s [options] --inputs <vectors file> <input file>\n", name);
+    printf("Options: -j threads, --engine switch|threaded|jit, --max-steps n, --mem size, --mem-limit size\n");
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if a job failed, 0 if all of them halted
+ */
+int main(int argc, char **argv) {
+    batch_t batch = { 0 };
+    char **inputs = NULL;
+    char *inputsFile = NULL;
+    char **files = calloc(argc, sizeof(char *));
+    int nbrFiles = 0, nbrInputs = 0, nbrJobs;
+    int i, failed = 0;
+    int counts[4] = { 0 };
+    pthread_t *threads;
+    worker_t *workers;
+
+    batch.nbrWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    batch.engine = VM_ENGINE_THREADED;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            batch.nbrWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) {
+                batch.engine = VM_ENGINE_SWITCH;
+            } else if (strcmp(argv[i], "threaded") == 0) {
+                batch.engine = VM_ENGINE_THREADED;
+            } else if (strcmp(argv[i], "jit") == 0) {
+                batch.engine = VM_ENGINE_JIT;
+            } else {
+                printf("Error: Unknown engine %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            batch.maxSteps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &batch.config.mem_words) < 0) {
+                printf("Error: Invalid memory size %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &batch.config.mem_limit) < 0) {
+                printf("Error: Invalid memory limit %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            batch.config.mem_limit *= sizeof(uint32_t);
+        } else if (strcmp(argv[i], "--inputs") == 0 && i + 1 < argc) {
+            inputsFile = argv[++i];
+        } else {
+            files[nbrFiles++] = argv[i];
+        }
+    }
+    if (nbrFiles == 0 || (inputsFile != NULL && nbrFiles != 1)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (inputsFile != NULL) {
+        inputs = readInputs(inputsFile, &nbrInputs);
+        if (inputs == NULL) {
+            printf("Error: Could not read input vectors from %s\n", inputsFile);
+            return EXIT_FAILURE;
+        }
+    }
+    if (batch.nbrWorkers < 1) {
+        batch.nbrWorkers = 1;
+    }
+    /* The workers create their VMs with the same options: check them once */
+    vm_t *probe = vm_create_config(&batch.config);
+    if (probe == NULL) {
+        printf("Error: Could not create a VM: %s\n",
+               errno == EINVAL ? "memory limit smaller than a page of 4 KiB" : strerror(errno));
+        return EXIT_FAILURE;
+    }
+    vm_destroy(probe);
+
+    /* Build the jobs and deal them round-robin to the workers */
+    nbrJobs = inputsFile != NULL ? nbrInputs : nbrFiles;
+    batch.jobs = calloc(nbrJobs, sizeof(job_t));
+    batch.queues = calloc(batch.nbrWorkers, sizeof(queue_t));
+    threads = calloc(batch.nbrWorkers, sizeof(pthread_t));
+    workers = calloc(batch.nbrWorkers, sizeof(worker_t));
+    for (i = 0; i < batch.nbrWorkers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].jobs = malloc((nbrJobs / batch.nbrWorkers + 1) * sizeof(int));
+    }
+    for (i = 0; i < nbrJobs; i++) {
+        queue_t *q = &batch.queues[i % batch.nbrWorkers];
+        batch.jobs[i].path = inputsFile != NULL ? files[0] : files[i];
+        batch.jobs[i].input = inputsFile != NULL ? inputs[i] : NULL;
+        batch.jobs[i].status = -1;
+        q->jobs[q->tail++] = i;
+    }
+    /* Owners pop from the tail: reverse each queue so they start with their first job */
+    for (i = 0; i < batch.nbrWorkers; i++) {
+        queue_t *q = &batch.queues[i];
+        int a, b;
+        for (a = 0, b = q->tail - 1; a < b; a++, b--) {
+            int tmp = q->jobs[a];
+            q->jobs[a] = q->jobs[b];
+            q->jobs[b] = tmp;
+        }
+    }
+
+    for (i = 0; i < batch.nbrWorkers; i++) {
+        workers[i].batch = &batch;
+        workers[i].id = i;
+        pthread_create(&threads[i], NULL, worker, &workers[i]);
+    }
+    for (i = 0; i < batch.nbrWorkers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Report the results in job order */
+    for (i = 0; i < nbrJobs; i++) {
+        job_t *job = &batch.jobs[i];
+        printf("=== JOB %d: %s", i, job->path);
+        if (job->input != NULL) {
+            printf(" < %.*s", (int) strcspn(job->input, "\r\n"), job->input);
+        }
+        printf(" ===\n");
+        if (job->outputLen > 0) {
+            fwrite(job->output, 1, job->outputLen, stdout);
+            if (job->output[job->outputLen - 1] != '\n') {
+                printf("\n");
+            }
+        }
+        printf("Status: %s", statusName(job->status));
+        if (job->status == VM_FAULT) {
+            printf(" (%s)", vm_fault_name(job->fault));
+        }
+        printf(", %llu steps, %llu KiB of memory, last output value: %d\n", (unsigned long long) job->steps,
+               (unsigned long long) (job->memUsed >> 10), job->result);
+        counts[job->status < 0 ? 3 : job->status]++;
+        if (job->status != VM_HALTED) {
+            failed = 1;
+        }
+        free(job->output);
+        free(job->input);
+    }
+    printf("=== %d jobs on %d threads: %d halted, %d budget exhausted, %d faults, %d load errors ===\n",
+           nbrJobs, batch.nbrWorkers, counts[VM_HALTED], counts[VM_BUDGET_EXHAUSTED], counts[VM_FAULT], counts[3]);
+
+    for (i = 0; i < batch.nbrWorkers; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+        free(batch.queues[i].jobs);
+    }
+    free(batch.queues);
+    free(batch.jobs);
+    free(threads);
+    free(workers);
+    free(inputs);
+    free(files);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,657 @@
+/** @file bench.c
+ * @brief Benchmark suite of the virtual machine.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Runs a fixed set of guest programs on every execution engine and reports,
+ * for each of them, the instructions per second, the nanoseconds per
+ * instruction and the startup time (creating the VM and loading the binary),
+ * as JSON so that results can be compared between changes. With
+ * --perf-counters, each result also holds the performance counters of the
+ * host during the run (see vm_enable_perf): cycles per guest instruction,
+ * IPC, branch-miss rate, cache and TLB misses, or null for those the host
+ * does not have.
+ *
+ * The kernels are the programs of src/assembler/asm (fibo, matrix_3x3 and
+ * chenillard, with a longer wait_1s loop) and synthetic ones stressing one
+ * part of the VM each: ALU, memory streaming, branches and calls, and a
+ * 256x256 matrix product with and without the vector instructions. They are
+ * encoded here rather than assembled, so the suite needs nothing but the VM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "constants.h"
+#include "vm.h"
+
+/* Registers of the kernels */
+#define LINK 31     // return address of jmp
+#define DATA 1024   // first address of the data of the kernels
+
+/** @brief A guest program being encoded */
+typedef struct {
+    u_int32_t words[DATA + 16];
+    int len;        // next code address
+} program_t;
+
+/** @brief A kernel of the suite */
+typedef struct {
+    const char *name;
+    void (*build)(program_t *p, uint64_t scale);
+    uint64_t memWords;  // size of memory, 0 for the default
+    uint64_t maxSteps;  // budget of kernels that never stop, 0 for the others
+} kernel_t;
+
+/** @brief Measures of one run */
+typedef struct {
+    int status;
+    uint64_t steps;
+    double startup;     // seconds to create the VM and load the binary
+    double run;         // seconds spent in vm_run
+    vm_perf_t perf;     // counters of the host during the run, if enabled
+} measure_t;
+
+/*--- Encoding ---*/
+
+/** @brief Append an instruction word */
+static int emit(program_t *p, u_int32_t word) {
+    p->words[p->len] = word;
+    return p->len++;
+}
+
+static int R(program_t *p, int op, int rd, int rs1, int rs2) {
+    return emit(p, (u_int32_t) op << 26 | rd << 21 | rs1 << 16 | rs2 << 11);
+}
+
+static int I(program_t *p, int op, int rd, int rs, int imm) {
+    return emit(p, (u_int32_t) op << 26 | rd << 21 | rs << 16 | (imm & 0xFFFF));
+}
+
+static int JR(program_t *p, int rd, int ra) {
+    return emit(p, (u_int32_t) OPCODE_JMPR << 26 | rd << 21 | ra << 16);
+}
+
+static int JI(program_t *p, int rd, int addr) {
+    return emit(p, (u_int32_t) OPCODE_JMPI << 26 | rd << 21 | (addr & 0x1FFFFF));
+}
+
+static int B(program_t *p, int op, int rs, int addr) {
+    return emit(p, (u_int32_t) op << 26 | rs << 21 | (addr & 0x1FFFF));
+}
+
+static int V(program_t *p, int op, int rd, int rs1, int rs2, int rn) {
+    return emit(p, (u_int32_t) op << 26 | rd << 21 | rs1 << 16 | rs2 << 11 | rn << 6);
+}
+
+static int S(program_t *p, int num) {
+    return emit(p, (u_int32_t) OPCODE_SCALL << 26 | (num & 0x3FFFFFF));
+}
+
+static int STOP(program_t *p) {
+    return emit(p, (u_int32_t) OPCODE_STOP << 26);
+}
+
+/** @brief Set the target of a forward jump or branch encoded with address 0 */
+static void patch(program_t *p, int at, int addr) {
+    p->words[at] |= addr;
+}
+
+/** @brief Load a constant below 2^31 into a register (immediates are only 16 bits) */
+static void constant(program_t *p, int reg, uint64_t value) {
+    if (value > 0x7FFFFFFF) {
+        value = 0x7FFFFFFF;
+    }
+    I(p, OPCODE_ADDI, reg, 0, (int) (value >> 16));
+    I(p, OPCODE_SHLI, reg, reg, 8);
+    I(p, OPCODE_ORI, reg, reg, (int) (value >> 8) & 0xFF);
+    I(p, OPCODE_SHLI, reg, reg, 8);
+    I(p, OPCODE_ORI, reg, reg, (int) value & 0xFF);
+}
+
+/*--- Kernels ---*/
+
+/** @brief fibo.asm, for as many terms as scale asks instead of the user input */
+static void buildFibo(program_t *p, uint64_t scale) {
+    int start;
+    constant(p, 1, 500000 * scale);
+    I(p, OPCODE_ORI, 3, 0, -1);
+    I(p, OPCODE_ORI, 4, 0, 1);
+    I(p, OPCODE_ORI, 9, 0, 0);
+    start = R(p, OPCODE_ADD, 5, 3, 4);
+    I(p, OPCODE_ADDI, 20, 5, 0);
+    S(p, 1);
+    I(p, OPCODE_ADDI, 3, 4, 0);
+    I(p, OPCODE_ADDI, 4, 5, 0);
+    I(p, OPCODE_ADDI, 9, 9, 1);
+    R(p, OPCODE_SLT, 8, 9, 1);
+    B(p, OPCODE_BRANZ, 8, start);
+    STOP(p);
+}
+
+/** @brief matrix_3x3.asm, squaring the matrix at DATA over and over */
+static void buildMatrix(program_t *p, uint64_t scale) {
+    int i;
+    int repeat, l5, l4, l2, l3, l1, toEnd, toL1, toL3;
+    for (i = 0; i < 9; i++) {
+        p->words[DATA + i] = i + 1;
+    }
+    constant(p, 12, 60000 * scale);         // repetitions
+    I(p, OPCODE_ADDI, 10, 0, 3);            // N = 3
+    R(p, OPCODE_MUL, 11, 10, 10);           // offset of the result
+    I(p, OPCODE_ADDI, 11, 11, DATA);
+    repeat = I(p, OPCODE_ADDI, 1, 0, 0);    // i = 0
+    l5 = R(p, OPCODE_SLT, 2, 1, 10);        // i < N
+    toEnd = B(p, OPCODE_BRAZ, 2, 0);
+    I(p, OPCODE_ADDI, 2, 0, 0);             // j = 0
+    l4 = R(p, OPCODE_SLT, 8, 2, 10);        // j < N
+    toL1 = B(p, OPCODE_BRAZ, 8, 0);
+    I(p, OPCODE_ADDI, 4, 0, 0);             // s = 0
+    I(p, OPCODE_ADDI, 5, 0, 0);             // k = 0
+    l2 = R(p, OPCODE_SLT, 6, 5, 10);        // k < N
+    toL3 = B(p, OPCODE_BRAZ, 6, 0);
+    R(p, OPCODE_MUL, 6, 1, 10);
+    R(p, OPCODE_ADD, 6, 6, 5);              // @[i,k]
+    R(p, OPCODE_MUL, 7, 5, 10);
+    R(p, OPCODE_ADD, 7, 7, 2);              // @[k,j]
+    I(p, OPCODE_LOAD, 8, 6, DATA);          // a[i,k]
+    I(p, OPCODE_LOAD, 9, 7, DATA);          // a[k,j]
+    R(p, OPCODE_MUL, 8, 8, 9);
+    R(p, OPCODE_ADD, 4, 4, 8);              // s += a[i,k] * a[k,j]
+    I(p, OPCODE_ADDI, 5, 5, 1);             // k++
+    JI(p, LINK, l2);
+    l3 = R(p, OPCODE_MUL, 6, 1, 10);
+    R(p, OPCODE_ADD, 6, 6, 2);
+    R(p, OPCODE_ADD, 6, 6, 11);             // @[i,j] + offset
+    I(p, OPCODE_STORE, 4, 6, 0);            // c[i,j] = s
+    I(p, OPCODE_ADDI, 2, 2, 1);             // j++
+    JI(p, LINK, l4);
+    l1 = I(p, OPCODE_ADDI, 1, 1, 1);        // i++
+    JI(p, LINK, l5);
+    patch(p, toEnd, I(p, OPCODE_SUBI, 12, 12, 1));
+    B(p, OPCODE_BRANZ, 12, repeat);
+    STOP(p);
+    patch(p, toL1, l1);
+    patch(p, toL3, l3);
+}
+
+/** @brief chenillard.asm with a 1000-iteration wait_1s; it never stops, so it runs on a budget */
+static void buildChenillard(program_t *p, uint64_t scale) {
+    int start, loop, wait, test, toStart, toFin, call[4];
+    (void) scale;
+    start = I(p, OPCODE_ADDI, 1, 0, 1);
+    call[0] = JI(p, 5, 0);
+    I(p, OPCODE_ADDI, 1, 0, 3);
+    call[1] = JI(p, 5, 0);
+    I(p, OPCODE_ADDI, 1, 0, 7);
+    call[2] = JI(p, 5, 0);
+    I(p, OPCODE_ADDI, 1, 0, 15);
+    loop = I(p, OPCODE_SEQI, 2, 1, 0);      // r2 = v == 0
+    R(p, OPCODE_SEQ, 2, 2, 0);              // r2 = v != 0
+    toStart = B(p, OPCODE_BRAZ, 2, 0);
+    call[3] = JI(p, 5, 0);
+    I(p, OPCODE_SHLI, 1, 1, 1);
+    JI(p, LINK, loop);
+    patch(p, toStart, start);
+    wait = I(p, OPCODE_ADDI, 3, 0, 0);
+    test = I(p, OPCODE_SEQI, 4, 3, 1000);
+    toFin = B(p, OPCODE_BRANZ, 4, 0);
+    I(p, OPCODE_ADDI, 3, 3, 1);
+    JI(p, LINK, test);
+    patch(p, toFin, JR(p, LINK, 5));
+    patch(p, call[0], wait);
+    patch(p, call[1], wait);
+    patch(p, call[2], wait);
+    patch(p, call[3], wait);
+}
+
+/** @brief Dense ALU: a long chain of dependent and independent arithmetic */
+static void buildAlu(program_t *p, uint64_t scale) {
+    int loop;
+    constant(p, 1, 2000000 * scale);
+    I(p, OPCODE_ADDI, 2, 0, 1);
+    I(p, OPCODE_ADDI, 3, 0, 7);
+    loop = R(p, OPCODE_ADD, 4, 2, 3);
+    R(p, OPCODE_MUL, 5, 4, 3);
+    I(p, OPCODE_XORI, 6, 5, 0x5555);
+    I(p, OPCODE_SHLI, 7, 6, 3);
+    R(p, OPCODE_SUB, 8, 7, 2);
+    I(p, OPCODE_ANDI, 9, 8, 0x7FFF);
+    R(p, OPCODE_OR, 10, 9, 4);
+    I(p, OPCODE_SHRI, 11, 10, 2);
+    R(p, OPCODE_XOR, 2, 11, 5);
+    I(p, OPCODE_ADDI, 3, 3, 1);
+    I(p, OPCODE_SUBI, 1, 1, 1);
+    B(p, OPCODE_BRANZ, 1, loop);
+    R(p, OPCODE_ADD, 20, 2, 0);
+    S(p, 1);
+    STOP(p);
+}
+
+/* Words streamed by the memory kernel */
+#define STREAM_WORDS (1 << 20)
+
+/** @brief Memory-bound streaming: b[i] = a[i] + b[i] over arrays larger than the caches */
+static void buildStream(program_t *p, uint64_t scale) {
+    int repeat, loop;
+    constant(p, 12, 4 * scale);                 // passes
+    constant(p, 13, STREAM_WORDS);              // words per array
+    repeat = I(p, OPCODE_ADDI, 1, 0, DATA);     // &a[i]
+    R(p, OPCODE_ADD, 2, 1, 13);                 // &b[i]
+    R(p, OPCODE_ADD, 3, 13, 0);                 // words left
+    loop = I(p, OPCODE_LOAD, 4, 1, 0);
+    I(p, OPCODE_LOAD, 5, 2, 0);
+    R(p, OPCODE_ADD, 5, 5, 4);
+    I(p, OPCODE_ADDI, 5, 5, 1);
+    I(p, OPCODE_STORE, 5, 2, 0);
+    I(p, OPCODE_ADDI, 1, 1, 1);
+    I(p, OPCODE_ADDI, 2, 2, 1);
+    I(p, OPCODE_SUBI, 3, 3, 1);
+    B(p, OPCODE_BRANZ, 3, loop);
+    I(p, OPCODE_SUBI, 12, 12, 1);
+    B(p, OPCODE_BRANZ, 12, repeat);
+    STOP(p);
+}
+
+/** @brief Branch-heavy: branches on the bits of a pseudo-random sequence */
+static void buildBranch(program_t *p, uint64_t scale) {
+    int loop, skip1, skip2, next;
+    constant(p, 1, 2000000 * scale);
+    constant(p, 2, 12345);                      // seed
+    constant(p, 3, 1103515245);
+    loop = R(p, OPCODE_MUL, 2, 2, 3);           // x = x * a + c
+    I(p, OPCODE_ADDI, 2, 2, 12345);
+    I(p, OPCODE_SHRI, 4, 2, 16);
+    I(p, OPCODE_ANDI, 5, 4, 1);
+    skip1 = B(p, OPCODE_BRAZ, 5, 0);
+    I(p, OPCODE_ADDI, 6, 6, 1);
+    patch(p, skip1, I(p, OPCODE_ANDI, 5, 4, 2));
+    skip2 = B(p, OPCODE_BRANZ, 5, 0);
+    I(p, OPCODE_ADDI, 7, 7, 1);
+    next = I(p, OPCODE_SUBI, 1, 1, 1);
+    patch(p, skip2, next);
+    B(p, OPCODE_BRANZ, 1, loop);
+    R(p, OPCODE_SUB, 20, 6, 7);
+    S(p, 1);
+    STOP(p);
+}
+
+/** @brief Call-heavy: a loop calling a small leaf function */
+static void buildCall(program_t *p, uint64_t scale) {
+    int loop, call, leaf;
+    constant(p, 1, 2000000 * scale);
+    loop = I(p, OPCODE_ADDI, 2, 1, 0);
+    call = JI(p, LINK, 0);
+    R(p, OPCODE_ADD, 20, 20, 3);
+    I(p, OPCODE_SUBI, 1, 1, 1);
+    B(p, OPCODE_BRANZ, 1, loop);
+    S(p, 1);
+    STOP(p);
+    leaf = I(p, OPCODE_ANDI, 3, 2, 7);          // leaf: r3 = (r2 & 7) + 1
+    I(p, OPCODE_ADDI, 3, 3, 1);
+    JR(p, 0, LINK);
+    patch(p, call, leaf);
+}
+
+/* Order of the matrices of the matmul kernels */
+#define MATRIX_N 256
+
+/**
+ * @brief c = a * b for MATRIX_N x MATRIX_N matrices, b stored transposed
+ * @param p the program
+ * @param scale passes
+ * @param vector 1 to compute each element with vdot, 0 with scalar loads
+ */
+static void buildMatmulWith(program_t *p, uint64_t scale, int vector) {
+    int repeat, rows, cols, inner = 0;
+    constant(p, 12, scale);                     // passes
+    constant(p, 10, MATRIX_N);
+    constant(p, 13, MATRIX_N * MATRIX_N);
+    repeat = I(p, OPCODE_ADDI, 1, 0, DATA);     // &a[i][0]
+    R(p, OPCODE_ADD, 3, 1, 13);
+    R(p, OPCODE_ADD, 3, 3, 13);                 // &c[i][0]
+    R(p, OPCODE_ADD, 4, 10, 0);                 // rows left
+    rows = R(p, OPCODE_ADD, 2, 13, 0);
+    I(p, OPCODE_ADDI, 2, 2, DATA);              // &bt[j][0]
+    R(p, OPCODE_ADD, 5, 10, 0);                 // columns left
+    cols = I(p, OPCODE_ADDI, 6, 0, 0);          // s = 0
+    if (vector) {
+        V(p, OPCODE_VDOT, 6, 1, 2, 10);         // s += a[i] . bt[j]
+    } else {
+        R(p, OPCODE_ADD, 7, 1, 0);              // &a[i][k]
+        R(p, OPCODE_ADD, 8, 2, 0);              // &bt[j][k]
+        R(p, OPCODE_ADD, 9, 10, 0);             // k left
+        inner = I(p, OPCODE_LOAD, 14, 7, 0);
+        I(p, OPCODE_LOAD, 15, 8, 0);
+        R(p, OPCODE_MUL, 14, 14, 15);
+        R(p, OPCODE_ADD, 6, 6, 14);             // s += a[i][k] * bt[j][k]
+        I(p, OPCODE_ADDI, 7, 7, 1);
+        I(p, OPCODE_ADDI, 8, 8, 1);
+        I(p, OPCODE_SUBI, 9, 9, 1);
+        B(p, OPCODE_BRANZ, 9, inner);
+    }
+    I(p, OPCODE_STORE, 6, 3, 0);                // c[i][j] = s
+    R(p, OPCODE_ADD, 2, 2, 10);
+    I(p, OPCODE_ADDI, 3, 3, 1);
+    I(p, OPCODE_SUBI, 5, 5, 1);
+    B(p, OPCODE_BRANZ, 5, cols);
+    R(p, OPCODE_ADD, 1, 1, 10);
+    I(p, OPCODE_SUBI, 4, 4, 1);
+    B(p, OPCODE_BRANZ, 4, rows);
+    I(p, OPCODE_SUBI, 12, 12, 1);
+    B(p, OPCODE_BRANZ, 12, repeat);
+    STOP(p);
+}
+
+/** @brief Matrix product with scalar loads and multiplications */
+static void buildMatmul(program_t *p, uint64_t scale) {
+    buildMatmulWith(p, scale, 0);
+}
+
+/** @brief The same matrix product with the vector instructions */
+static void buildMatmulVector(program_t *p, uint64_t scale) {
+    buildMatmulWith(p, scale, 1);
+}
+
+static const kernel_t kernels[] = {
+    { "fibo", buildFibo, 0, 0 },
+    { "matrix_3x3", buildMatrix, 0, 0 },
+    { "chenillard", buildChenillard, 0, 40000000 },
+    { "alu", buildAlu, 0, 0 },
+    { "stream", buildStream, DATA + 2 * STREAM_WORDS, 0 },
+    { "branch", buildBranch, 0, 0 },
+    { "call", buildCall, 0, 0 },
+    { "matmul", buildMatmul, DATA + 3 * MATRIX_N * MATRIX_N, 0 },
+    { "matmul_vector", buildMatmulVector, DATA + 3 * MATRIX_N * MATRIX_N, 0 },
+};
+
+/*--- Harness ---*/
+
+/** @brief Output sink dropping the output of the guest */
+static void discard(void *ctx, const char *data, size_t len) {
+    (void) ctx;
+    (void) data;
+    (void) len;
+}
+
+/** @brief Current time, in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Write the binary of a kernel to a temporary file
+ * @param k the kernel
+ * @param scale size factor of the kernel
+ * @param path receives the name of the file, at least 32 bytes
+ * @return 0 on success, -1 on error
+ */
+static int writeKernel(const kernel_t *k, uint64_t scale, char *path) {
+    static program_t p;
+    size_t size;
+    int fd;
+    memset(&p, 0, sizeof(p));
+    k->build(&p, scale);
+    /* Kernels with data keep it in the image, after the code */
+    size = sizeof(p.words) / sizeof(u_int32_t);
+    while (size > (size_t) p.len && p.words[size - 1] == 0) {
+        size--;
+    }
+    strcpy(path, "/tmp/archivm-bench-XXXXXX");
+    fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    if (write(fd, p.words, size * sizeof(u_int32_t)) != (ssize_t) (size * sizeof(u_int32_t))) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/**
+ * @brief Run a kernel once
+ * @param k the kernel
+ * @param path its binary
+ * @param engine VM_ENGINE_*
+ * @param perf 1 to read the performance counters of the host
+ * @param m receives the measures
+ * @return 0 on success, -1 if the VM could not be created or the binary loaded
+ */
+static int runKernel(const kernel_t *k, const char *path, int engine, int perf, measure_t *m) {
+    vm_config_t config = { 0 };
+    double start = now();
+    vm_t *vm;
+    config.mem_words = k->memWords;
+    vm = vm_create_config(&config);
+    if (vm == NULL) {
+        return -1;
+    }
+    vm_set_engine(vm, engine);
+    vm_set_output_callback(vm, discard, NULL);
+    if ((perf && vm_enable_perf(vm) < 0) || vm_load(vm, path) < 0) {
+        vm_destroy(vm);
+        return -1;
+    }
+    m->startup = now() - start;
+    start = now();
+    m->status = vm_run(vm, k->maxSteps);
+    m->run = now() - start;
+    m->steps = vm_steps(vm);
+    if (perf) {
+        vm_perf_read(vm, &m->perf);
+    }
+    vm_destroy(vm);
+    return 0;
+}
+
+/** @brief Order measures by run time */
+static int compareRun(const void *a, const void *b) {
+    double x = ((const measure_t *) a)->run, y = ((const measure_t *) b)->run;
+    return (x > y) - (x < y);
+}
+
+/** @brief Order startup times */
+static int compareStartup(const void *a, const void *b) {
+    double x = ((const measure_t *) a)->startup, y = ((const measure_t *) b)->startup;
+    return (x > y) - (x < y);
+}
+
+/** @brief Name of a vm_run status */
+static const char *statusName(int status) {
+    switch (status) {
+        case VM_HALTED:
+            return "halted";
+        case VM_BUDGET_EXHAUSTED:
+            return "budget exhausted";
+        default:
+            return "fault";
+    }
+}
+
+/** @brief Print a counter of the host as a JSON member, null if the host does not have it */
+static void printCount(FILE *out, const char *name, const vm_perf_t *perf, int counter) {
+    if (perf->available & (1u << counter)) {
+        fprintf(out, ", \"%s\": %llu", name, (unsigned long long) perf->counts[counter]);
+    } else {
+        fprintf(out, ", \"%s\": null", name);
+    }
+}
+
+/** @brief Print a ratio of two counters of the host as a JSON member, null if the host does not have them */
+static void printRatio(FILE *out, const char *name, const vm_perf_t *perf, int counter, int per) {
+    if ((perf->available & (1u << counter)) && (perf->available & (1u << per)) && perf->counts[per] != 0) {
+        fprintf(out, ", \"%s\": %.4f", name, (double) perf->counts[counter] / perf->counts[per]);
+    } else {
+        fprintf(out, ", \"%s\": null", name);
+    }
+}
+
+/** @brief Print the counters of the host during a run, as members of its JSON result */
+static void printHost(FILE *out, const measure_t *m) {
+    const vm_perf_t *perf = &m->perf;
+    printCount(out, "host_task_clock_ns", perf, VM_PERF_TASK_CLOCK);
+    printCount(out, "host_cycles", perf, VM_PERF_CYCLES);
+    if ((perf->available & (1u << VM_PERF_CYCLES)) && m->steps != 0) {
+        fprintf(out, ", \"host_cycles_per_instruction\": %.4f", (double) perf->counts[VM_PERF_CYCLES] / m->steps);
+    } else {
+        fprintf(out, ", \"host_cycles_per_instruction\": null");
+    }
+    printCount(out, "host_instructions", perf, VM_PERF_INSTRUCTIONS);
+    printRatio(out, "host_ipc", perf, VM_PERF_INSTRUCTIONS, VM_PERF_CYCLES);
+    printCount(out, "host_branch_misses", perf, VM_PERF_BRANCH_MISSES);
+    printRatio(out, "host_branch_miss_rate", perf, VM_PERF_BRANCH_MISSES, VM_PERF_BRANCHES);
+    printCount(out, "host_cache_misses", perf, VM_PERF_CACHE_MISSES);
+    printRatio(out, "host_cache_miss_rate", perf, VM_PERF_CACHE_MISSES, VM_PERF_CACHE_REFERENCES);
+    printCount(out, "host_itlb_misses", perf, VM_PERF_ITLB_MISSES);
+    printCount(out, "host_dtlb_misses", perf, VM_PERF_DTLB_MISSES);
+}
+
+/** @brief Print the usage of the program */
+static void usage(const char *name) {
+    printf("Usage: %s [--engine switch|threaded|jit] [--kernel name] [--repeat n] [--scale n] [--perf-counters] "
+           "[--output file]\n", name);
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if error, 0 if success
+ *
+ * Each kernel is run --repeat times on each engine, and the median run is
+ * reported. --scale multiplies the amount of work of the kernels.
+ * --perf-counters adds the performance counters of the host during the
+ * median run to its result.
+ */
+int main(int argc, char **argv) {
+    static const char *engineNames[] = { "switch", "threaded", "jit" };
+    const char *only = NULL;
+    const char *outputFile = NULL;
+    int engines[3] = { 1, 1, 1 };
+    int repeat = 5;
+    int perf = 0;
+    uint64_t scale = 1;
+    FILE *out = stdout;
+    measure_t *runs;
+    int first = 1;
+    size_t k;
+    int e, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            engines[0] = strcmp(argv[i], "switch") == 0;
+            engines[1] = strcmp(argv[i], "threaded") == 0;
+            engines[2] = strcmp(argv[i], "jit") == 0;
+            if (!engines[0] && !engines[1] && !engines[2]) {
+                printf("Error: Unknown engine %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf = 1;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (repeat < 1 || scale < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (outputFile != NULL) {
+        out = fopen(outputFile, "w");
+        if (out == NULL) {
+            printf("Error: Could not open %s\n", outputFile);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /* Drop the engines this build does not have */
+    for (e = 0; e < 3; e++) {
+        vm_t *vm = vm_create();
+        if (vm == NULL) {
+            printf("Error: Could not allocate the VM\n");
+            return EXIT_FAILURE;
+        }
+        if (vm_set_engine(vm, e) < 0) {
+            engines[e] = 0;
+        }
+        if (e == 0 && perf && vm_enable_perf(vm) < 0) {
+            printf("Error: Could not open the performance counters: %s\n", strerror(errno));
+            vm_destroy(vm);
+            return EXIT_FAILURE;
+        }
+        vm_destroy(vm);
+    }
+
+    runs = calloc(repeat, sizeof(measure_t));
+    fprintf(out, "{\n  \"repeat\": %d,\n  \"scale\": %llu,\n  \"results\": [", repeat, (unsigned long long) scale);
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        char path[32];
+        if (only != NULL && strcmp(only, kernels[k].name) != 0) {
+            continue;
+        }
+        if (writeKernel(&kernels[k], scale, path) < 0) {
+            printf("Error: Could not write the binary of %s\n", kernels[k].name);
+            return EXIT_FAILURE;
+        }
+        for (e = 0; e < 3; e++) {
+            measure_t median;
+            double startup;
+            if (!engines[e]) {
+                continue;
+            }
+            for (i = 0; i < repeat; i++) {
+                if (runKernel(&kernels[k], path, e, perf, &runs[i]) < 0) {
+                    printf("Error: Could not run %s\n", kernels[k].name);
+                    unlink(path);
+                    return EXIT_FAILURE;
+                }
+            }
+            qsort(runs, repeat, sizeof(measure_t), compareRun);
+            median = runs[repeat / 2];
+            qsort(runs, repeat, sizeof(measure_t), compareStartup);
+            startup = runs[repeat / 2].startup;
+
+            fprintf(out, "%s\n    {\"kernel\": \"%s\", \"engine\": \"%s\", \"status\": \"%s\", "
+                         "\"instructions\": %llu, \"seconds\": %.6f, \"instructions_per_second\": %.0f, "
+                         "\"ns_per_instruction\": %.3f, \"startup_us\": %.1f",
+                    first ? "" : ",", kernels[k].name, engineNames[e], statusName(median.status),
+                    (unsigned long long) median.steps, median.run,
+                    median.run > 0 ? median.steps / median.run : 0.0,
+                    median.steps ? median.run * 1e9 / median.steps : 0.0, startup * 1e6);
+            if (perf) {
+                printHost(out, &median);
+            }
+            fprintf(out, "}");
+            fflush(out);
+            first = 0;
+        }
+        unlink(path);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    free(runs);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return EXIT_SUCCESS;
+}
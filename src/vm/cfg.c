@@ -0,0 +1,247 @@
+/** @file cfg.c
+ * @brief Static control-flow graph of a program.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "constants.h"
+#include "isa.h"
+#include "cfg.h"
+
+/* State of a block in the walk: 0 until reached, then on the walk until WALKED */
+#define WALK_NEXT 1     // next successor to follow is next
+#define WALK_TAKEN 2    // next successor to follow is taken
+#define WALK_LAST 3     // both followed, leaves the walk on the next step
+#define WALKED 4
+
+/** @brief Tell if an instruction ends a block of the graph */
+static int endsCfgBlock(int opcode) {
+    return opcode == OPCODE_JMPR || opcode == OPCODE_JMPI || opcode == OPCODE_BRAZ || opcode == OPCODE_BRANZ
+        || opcodeType(opcode) < 0;
+}
+
+/** @brief Set the successors and flags of a block from its last instruction */
+static void linkBlock(cfgblock_t *b, const u_int32_t *code, uint32_t words) {
+    uint32_t end = b->start + b->words;
+    decoded_t d;
+    decodeInstr(code[end - 1], &d);
+    b->taken = CFG_NONE;
+    b->next = end < words ? end : CFG_NONE;
+    b->flags = 0;
+    switch (d.opcode) {
+        case OPCODE_JMPR:
+            b->next = CFG_NONE;
+            b->flags = CFG_INDIRECT;
+            break;
+        case OPCODE_JMPI:
+        case OPCODE_BRAZ:
+        case OPCODE_BRANZ:
+            if (d.addr < words) {
+                b->taken = d.addr;
+            } else {
+                b->flags = CFG_INDIRECT;
+            }
+            if (d.opcode == OPCODE_JMPI) {
+                b->flags |= CFG_CALL;
+            }
+            break;
+        default:
+            if (opcodeType(d.opcode) < 0) {
+                b->next = CFG_NONE;
+                b->flags = CFG_EXIT;
+            }
+            break;
+    }
+}
+
+/** @brief Index of the block starting at an address of the code */
+static uint32_t blockIndex(const cfg_t *cfg, uint32_t addr) {
+    return (uint32_t) (cfgFind(cfg, addr) - cfg->blocks);
+}
+
+/**
+ * @brief Walk the graph depth first from a block, marking the back edges
+ * @param cfg the graph
+ * @param root index of the first block
+ * @param state WALK_* of each block
+ * @param stack room for the indices of all the blocks
+ */
+static void walk(cfg_t *cfg, uint32_t root, uint8_t *state, uint32_t *stack) {
+    uint32_t n = 1;
+    stack[0] = root;
+    state[root] = WALK_NEXT;
+    while (n > 0) {
+        uint32_t i = stack[n - 1];
+        cfgblock_t *b = &cfg->blocks[i];
+        uint32_t succ, j;
+        int edge;
+        if (state[i] == WALK_NEXT) {
+            state[i] = WALK_TAKEN;
+            succ = b->next;
+            edge = CFG_BACK_NEXT;
+        } else if (state[i] == WALK_TAKEN) {
+            state[i] = WALK_LAST;
+            succ = b->taken;
+            edge = CFG_BACK_TAKEN;
+        } else {
+            state[i] = WALKED;
+            n--;
+            continue;
+        }
+        if (succ == CFG_NONE) {
+            continue;
+        }
+        j = blockIndex(cfg, succ);
+        if (state[j] == 0) {
+            state[j] = WALK_NEXT;
+            stack[n++] = j;
+        } else if (state[j] != WALKED) {
+            b->flags |= edge;
+            cfg->blocks[j].flags |= CFG_LOOP;
+        }
+    }
+}
+
+int cfgBuild(cfg_t *cfg, const u_int32_t *code, uint32_t words, uint32_t entry) {
+    uint8_t *leaders;
+    uint8_t *state;
+    uint32_t *stack;
+    uint32_t pc, n = 0;
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->codeWords = words;
+    if (words == 0) {
+        return 0;
+    }
+
+    /* Leaders: the first instruction of each block */
+    leaders = calloc(words, 1);
+    if (leaders == NULL) {
+        return -1;
+    }
+    leaders[0] = 1;
+    if (entry < words) {
+        leaders[entry] = 1;
+    }
+    for (pc = 0; pc < words; pc++) {
+        int opcode = (code[pc] >> 26) & 0x3F;
+        if (!endsCfgBlock(opcode)) {
+            continue;
+        }
+        if (pc + 1 < words) {
+            leaders[pc + 1] = 1;
+        }
+        if (opcode == OPCODE_JMPI || opcode == OPCODE_BRAZ || opcode == OPCODE_BRANZ) {
+            decoded_t d;
+            decodeInstr(code[pc], &d);
+            if (d.addr < words) {
+                leaders[d.addr] = 1;
+            }
+        }
+    }
+    for (pc = 0; pc < words; pc++) {
+        n += leaders[pc];
+    }
+
+    cfg->blocks = malloc(n * sizeof(cfgblock_t));
+    if (cfg->blocks == NULL) {
+        free(leaders);
+        return -1;
+    }
+    for (pc = 0; pc < words; pc++) {
+        if (leaders[pc]) {
+            cfg->blocks[cfg->nbrBlocks].start = pc;
+            cfg->blocks[cfg->nbrBlocks++].words = 0;
+        }
+        cfg->blocks[cfg->nbrBlocks - 1].words++;
+    }
+    free(leaders);
+    for (n = 0; n < cfg->nbrBlocks; n++) {
+        linkBlock(&cfg->blocks[n], code, words);
+    }
+
+    /* Back edges, from the entry point first */
+    state = calloc(cfg->nbrBlocks, 1);
+    stack = malloc(cfg->nbrBlocks * sizeof(uint32_t));
+    if (state == NULL || stack == NULL) {
+        free(state);
+        free(stack);
+        cfgFree(cfg);
+        return -1;
+    }
+    if (entry < words) {
+        walk(cfg, blockIndex(cfg, entry), state, stack);
+    }
+    for (n = 0; n < cfg->nbrBlocks; n++) {
+        if (state[n] == 0) {
+            walk(cfg, n, state, stack);
+        }
+    }
+    free(state);
+    free(stack);
+    return 0;
+}
+
+/** @brief Tell if a successor read from a file is CFG_NONE or the start of a block */
+static int validSuccessor(const cfg_t *cfg, uint32_t addr) {
+    const cfgblock_t *b = cfgFind(cfg, addr);
+    return addr == CFG_NONE || (b != NULL && b->start == addr);
+}
+
+int cfgParse(cfg_t *cfg, cfgblock_t *blocks, size_t bytes, uint32_t words) {
+    uint64_t end = 0;
+    uint32_t i;
+    cfg->blocks = blocks;
+    cfg->nbrBlocks = (uint32_t) (bytes / sizeof(cfgblock_t));
+    cfg->codeWords = words;
+    if (bytes % sizeof(cfgblock_t) != 0 || bytes / sizeof(cfgblock_t) > words) {
+        cfgFree(cfg);
+        return -1;
+    }
+    /* The blocks follow each other from address 0 to the end of the code */
+    for (i = 0; i < cfg->nbrBlocks; i++) {
+        if (blocks[i].start != end || blocks[i].words == 0 || (blocks[i].flags & ~CFG_FLAGS) != 0) {
+            cfgFree(cfg);
+            return -1;
+        }
+        end += blocks[i].words;
+    }
+    if (end != words) {
+        cfgFree(cfg);
+        return -1;
+    }
+    for (i = 0; i < cfg->nbrBlocks; i++) {
+        if (!validSuccessor(cfg, blocks[i].taken) || !validSuccessor(cfg, blocks[i].next)) {
+            cfgFree(cfg);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void cfgFree(cfg_t *cfg) {
+    free(cfg->blocks);
+    cfg->blocks = NULL;
+    cfg->nbrBlocks = 0;
+    cfg->codeWords = 0;
+}
+
+const cfgblock_t *cfgFind(const cfg_t *cfg, uint32_t pc) {
+    uint32_t lo = 0, hi = cfg->nbrBlocks;
+    if (pc >= cfg->codeWords || cfg->nbrBlocks == 0) {
+        return NULL;
+    }
+    /* Last block starting at or before pc */
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (cfg->blocks[mid].start <= pc) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return &cfg->blocks[lo];
+}
@@ -0,0 +1,87 @@
+/** \headerfile cfg.h "cfg.h"
+ *  \brief Static control-flow graph of a program
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The code is split into basic blocks at the targets of JMPI, BRAZ and BRANZ,
+ * at the entry point, and after every jump, branch and stop. A depth-first
+ * walk from the entry point, then from the blocks it did not reach, finds the
+ * back edges: the edges to a block still on the walk, which is then the
+ * header of a loop.
+ *
+ * The assembler writes the graph in the object file (see object.h), as the
+ * cfgblock_t of the blocks in address order; src/assembler/cfg.rb builds the
+ * same one. The VM rebuilds it at load when the file has none. It describes
+ * the code as loaded: engines only take it as a hint, since a program writing
+ * its code, or jumping through a register, goes where the graph does not say.
+ */
+
+#ifndef CFG_H
+#define CFG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Successor a block does not have */
+#define CFG_NONE 0xFFFFFFFFu
+
+/* Flags of a block */
+#define CFG_LOOP 1          // header of a loop: the target of a back edge
+#define CFG_BACK_TAKEN 2    // the jump or branch ending the block is a back edge
+#define CFG_BACK_NEXT 4     // falling through, or returning from the call, is a back edge
+#define CFG_CALL 8          // ends on jmpi: next is the return address, in case it is a call
+#define CFG_INDIRECT 16     // ends on a jump to a register, or to an address outside the code
+#define CFG_EXIT 32         // ends on stop, or on a word that is not an instruction
+#define CFG_FLAGS 63        // all the flags
+
+/** @brief A basic block, as written in the object file */
+typedef struct {
+    uint32_t start;     // address of the first instruction
+    uint32_t words;     // number of instructions
+    uint32_t taken;     // target of the jump or branch ending the block, CFG_NONE if none
+    uint32_t next;      // address after the block, if it goes on there, CFG_NONE otherwise
+    uint32_t flags;     // CFG_*
+} cfgblock_t;
+
+/** @brief The blocks of the code, in address order */
+typedef struct {
+    cfgblock_t *blocks;
+    uint32_t nbrBlocks;
+    uint32_t codeWords; // size of the code the blocks cover
+} cfg_t;
+
+/**
+ * @brief Build the graph of the code
+ * @param cfg the graph
+ * @param code the code, loaded at address 0
+ * @param words size of the code
+ * @param entry address of the first instruction to run
+ * @return 0 on success, -1 if out of memory
+ */
+int cfgBuild(cfg_t *cfg, const u_int32_t *code, uint32_t words, uint32_t entry);
+
+/**
+ * @brief Read the graph written in an object file
+ * @param cfg the graph, which takes ownership of blocks
+ * @param blocks the blocks read from the file
+ * @param bytes size of the table
+ * @param words size of the code
+ * @return 0 on success, -1 if the blocks do not cover the code or their
+ *         successors are not blocks; blocks is freed then
+ */
+int cfgParse(cfg_t *cfg, cfgblock_t *blocks, size_t bytes, uint32_t words);
+
+/** @brief Free the blocks of a graph, which is then empty */
+void cfgFree(cfg_t *cfg);
+
+/**
+ * @brief Find the block holding an address
+ * @param cfg the graph
+ * @param pc the address
+ * @return the block, or NULL if pc is outside the code
+ */
+const cfgblock_t *cfgFind(const cfg_t *cfg, uint32_t pc);
+
+#endif
@@ -0,0 +1,310 @@
+/** @file cli.c
+ * @brief Command line front-end of the virtual machine.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Loads a binary file into a VM and runs it until it stops.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include "vm.h"
+
+/* Instructions run between two checks for a request to save the trace */
+#define TRACE_SLICE (1 << 20)
+
+/* Snapshots and dumps of memory given on the command line */
+#define MAX_STOPS 16
+
+/** @brief A point of the run where the state of the VM is saved */
+typedef struct {
+    uint64_t steps;     // instructions since the program was loaded
+    const char *file;
+    int snapshot;       // 1 for a snapshot, 0 for a dump of memory
+} stop_t;
+
+/** @brief Set by SIGUSR1, to save the trace once the current slice ends */
+static volatile sig_atomic_t traceRequested = 0;
+
+/** @brief Handler of SIGUSR1 */
+static void requestTrace(int sig) {
+    (void) sig;
+    traceRequested = 1;
+}
+
+/** @brief Save the trace of the VM, reporting errors */
+static void saveTrace(const vm_t *vm, const char *tracefile) {
+    if (vm_trace_save(vm, tracefile) < 0) {
+        printf("Error: Could not save trace %s: %s\n", tracefile, strerror(errno));
+    }
+}
+
+/** @brief Run the program until it stops or reaches a step, saving its trace on a fault or on SIGUSR1
+ * @param vm the VM
+ * @param steps instructions since the program was loaded to stop at, 0 to run it to its end
+ * @param tracefile the file of the trace, NULL if tracing is not enabled
+ * @return the status of the last vm_run, VM_BUDGET_EXHAUSTED once the step is reached
+ */
+static int runUntil(vm_t *vm, uint64_t steps, const char *tracefile) {
+    int status;
+    if (steps != 0 && vm_steps(vm) >= steps) {
+        return VM_BUDGET_EXHAUSTED;
+    }
+    if (tracefile == NULL) {
+        return vm_run(vm, steps != 0 ? steps - vm_steps(vm) : 0);
+    }
+    do {
+        uint64_t slice = TRACE_SLICE;
+        if (steps != 0 && steps - vm_steps(vm) < slice) {
+            slice = steps - vm_steps(vm);
+        }
+        status = vm_run(vm, slice);
+        if (traceRequested) {
+            traceRequested = 0;
+            saveTrace(vm, tracefile);
+        }
+    } while (status == VM_BUDGET_EXHAUSTED && (steps == 0 || vm_steps(vm) < steps));
+    if (status == VM_FAULT) {
+        saveTrace(vm, tracefile);
+    }
+    return status;
+}
+
+/** @brief Save a snapshot or a dump of memory, reporting errors
+ * @param vm the VM
+ * @param stop what to save
+ * @param full 1 for a full dump of memory, 0 for the changes since the previous one
+ */
+static void saveStop(vm_t *vm, const stop_t *stop, int full) {
+    if (stop->snapshot) {
+        vm_snapshot_t *snap = vm_snapshot(vm);
+        if (snap == NULL || vm_snapshot_save(snap, stop->file) < 0) {
+            printf("Error: Could not save snapshot %s: %s\n", stop->file, strerror(errno));
+        }
+        vm_snapshot_free(snap);
+    } else if (vm_dump_mem(vm, stop->file, full) < 0) {
+        printf("Error: Could not save dump %s: %s\n", stop->file, strerror(errno));
+    }
+}
+
+/** @brief Add a snapshot or a dump to the points of the run, kept sorted by steps
+ * @return 0 on success, -1 if there are too many of them
+ */
+static int addStop(stop_t *stops, int *nbrStops, uint64_t steps, const char *file, int snapshot) {
+    int i;
+    if (*nbrStops == MAX_STOPS) {
+        return -1;
+    }
+    for (i = *nbrStops; i > 0 && stops[i - 1].steps > steps; i--) {
+        stops[i] = stops[i - 1];
+    }
+    stops[i].steps = steps;
+    stops[i].file = file;
+    stops[i].snapshot = snapshot;
+    (*nbrStops)++;
+    return 0;
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if error or if the program faulted, 0 if success
+ *
+ * To run, provide the name of the binary file to be run as an argument
+ * ./vm [--engine switch|threaded|jit] [--mmap] [--mem size] [--mem-limit size] [--hugepages] [--quiet]
+ *      [--profile] [--perf-counters] [--symbols file] [--snapshot-at steps file]
+ *      [--input values | --input-file file] [--trace records file] [--dump-at steps file]... <filename>
+ *
+ * --mmap maps the binary copy-on-write into memory instead of reading it.
+ * --mem sets the size of memory in bytes, with an optional K, M or G suffix.
+ * --mem-limit sets the memory the program may hold, in the same units: the
+ * pages of 4 KiB it loads or stores to. A store past it faults the program.
+ * --hugepages advises transparent huge pages for memory.
+ * --quiet only prints the output of the program, without the execution banners.
+ * --profile prints a profile of the run on stderr once the program stops.
+ * --perf-counters prints the performance counters of the host on stderr once
+ * the program stops: host cycles per guest instruction, IPC, branch and cache
+ * misses, counted only while the engine runs (Linux only).
+ * --symbols reads the symbol file written by the assembler, to show labels and
+ * source lines in the profile; by default, those of the object file are used.
+ * --snapshot-at saves a snapshot of the VM to file once the program has run
+ * that many instructions, then goes on. Giving the snapshot as the input file
+ * resumes the program from there.
+ * --input gives the integers scall 0 reads, such as 1,2,3, and --input-file
+ * a file holding them; scall 0 then reads 0. Without them, it reads stdin, and
+ * only prompts if stdin is a terminal.
+ * --trace records the last instructions the program runs, and saves them to
+ * file when it faults or when the VM receives SIGUSR1; vm-trace prints them.
+ * --dump-at saves a dump of memory to file once the program has run that many
+ * instructions, or when it stops if it stops before. It can be given several
+ * times: the first dump holds all the memory that is not zero, the next ones
+ * only the blocks the program stored to since the previous one. vm-memdump
+ * prints them, or the words that changed between two of them.
+ */
+int main(int argc, char **argv) {
+    int i;
+    int engine = -1;
+    char *engineName = NULL;
+    char *filename = NULL;
+    int mapped = 0;
+    int quiet = 0;
+    int profile = 0;
+    int perf = 0;
+    char *symfile = NULL;
+    char *input = NULL;
+    char *inputFile = NULL;
+    char *tracefile = NULL;
+    uint64_t traceRecords = 0;
+    stop_t stops[MAX_STOPS];
+    int nbrStops = 0;
+    int dumps = 0;
+    int status = VM_BUDGET_EXHAUSTED;
+    vm_config_t config = { 0 };
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            engineName = argv[++i];
+            if (strcmp(engineName, "switch") == 0) {
+                engine = VM_ENGINE_SWITCH;
+            } else if (strcmp(engineName, "threaded") == 0) {
+                engine = VM_ENGINE_THREADED;
+            } else if (strcmp(engineName, "jit") == 0) {
+                engine = VM_ENGINE_JIT;
+            } else {
+                printf("Error: Unknown engine %s\n", engineName);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+            mapped = 1;
+        } else if (strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &config.mem_words) < 0) {
+                printf("Error: Invalid memory size %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &config.mem_limit) < 0) {
+                printf("Error: Invalid memory limit %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            config.mem_limit *= sizeof(uint32_t);
+        } else if (strcmp(argv[i], "--hugepages") == 0) {
+            config.huge_pages = 1;
+        } else if (strcmp(argv[i], "--quiet") == 0 || strcmp(argv[i], "-q") == 0) {
+            quiet = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf = 1;
+        } else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symfile = argv[++i];
+        } else if ((strcmp(argv[i], "--snapshot-at") == 0 || strcmp(argv[i], "--dump-at") == 0) && i + 2 < argc) {
+            if (addStop(stops, &nbrStops, strtoull(argv[i + 1], NULL, 10), argv[i + 2],
+                        strcmp(argv[i], "--snapshot-at") == 0) < 0) {
+                printf("Error: More than %d dumps and snapshots\n", MAX_STOPS);
+                return EXIT_FAILURE;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input = argv[++i];
+        } else if (strcmp(argv[i], "--input-file") == 0 && i + 1 < argc) {
+            inputFile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 2 < argc) {
+            traceRecords = strtoull(argv[++i], NULL, 10);
+            tracefile = argv[++i];
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("Error: No input file specified\n");
+        printf("Usage: %s [--engine switch|threaded|jit] [--mmap] [--mem size] [--mem-limit size] [--hugepages] [--quiet] "
+               "[--profile] [--perf-counters] [--symbols file] [--snapshot-at steps file] "
+               "[--input values | --input-file file] [--trace records file] [--dump-at steps file]... "
+               "<input file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    vm_t *vm = vm_create_config(&config);
+    if (vm == NULL && errno == EINVAL) {
+        printf("Error: Memory limit smaller than a page of 4 KiB\n");
+        return EXIT_FAILURE;
+    }
+    if (vm == NULL) {
+        printf("Error: Could not allocate the VM\n");
+        return EXIT_FAILURE;
+    }
+    if (engine >= 0 && vm_set_engine(vm, engine) < 0) {
+        printf("Error: Engine %s not available in this build\n", engineName);
+        vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (profile && vm_enable_profile(vm) < 0) {
+        printf("Error: Could not allocate the profile\n");
+        vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (perf && vm_enable_perf(vm) < 0) {
+        printf("Error: Could not open the performance counters: %s\n", strerror(errno));
+        vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (tracefile != NULL && vm_enable_trace(vm, traceRecords) < 0) {
+        printf("Error: Could not allocate a trace of %llu instructions\n", (unsigned long long) traceRecords);
+        vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (input != NULL) {
+        vm_set_input_text(vm, input, strlen(input));
+    } else if (inputFile != NULL && vm_set_input_file(vm, inputFile) < 0) {
+        printf("Error: Could not read input file %s: %s\n", inputFile, strerror(errno));
+        vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if ((mapped ? vm_load_mapped(vm, filename) : vm_load(vm, filename)) < 0) {
+        printf("Error: Could not load file %s: %s\n", filename, strerror(errno));
+        vm_destroy(vm);
+        exit(1);
+    }
+
+    if (!quiet) {
+        printf("=== BEGINNING EXECUTION. BINARY IS %s ===\n", filename);
+        fflush(stdout);
+    }
+    if (tracefile != NULL) {
+        signal(SIGUSR1, requestTrace);
+    }
+    for (i = 0; i < nbrStops; i++) {
+        if (status == VM_BUDGET_EXHAUSTED && stops[i].steps != 0) {
+            status = runUntil(vm, stops[i].steps, tracefile);
+        }
+        /* A snapshot is only taken at its step, a dump at the end if the program stops before */
+        if (status == VM_BUDGET_EXHAUSTED || !stops[i].snapshot) {
+            saveStop(vm, &stops[i], !stops[i].snapshot && dumps++ == 0);
+        }
+    }
+    if (status == VM_BUDGET_EXHAUSTED) {
+        status = runUntil(vm, 0, tracefile);
+    }
+    if (!quiet) {
+        printf("=== END OF PROGRAM ===\n");
+        printf("Last output value: %d\n", vm_reg(vm, 20));
+    }
+    if (profile) {
+        fflush(stdout);
+        if (vm_profile_report(vm, stderr, symfile) < 0) {
+            printf("Error: Could not read symbol file %s\n", symfile);
+        }
+    }
+    if (perf) {
+        fflush(stdout);
+        vm_perf_report(vm, stderr);
+    }
+
+    vm_destroy(vm);
+    return status == VM_FAULT ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+/** @file client.c
+ * @brief Client of the execution service.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Runs programs on a vm-serve server, on one connection, and prints their
+ * output and results as vm-batch does. Each program is named by its hash
+ * first, and only sent if the server does not have it cached yet.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "service.h"
+#include "vm.h"
+
+/** @brief Read exactly a number of bytes
+ * @return 0 on success, -1 on error or at the end of the stream
+ */
+static int readFull(int fd, void *data, size_t bytes) {
+    char *dest = data;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = read(fd, dest + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Write a whole buffer
+ * @return 0 on success, -1 on error
+ */
+static int writeFull(int fd, const void *data, size_t bytes) {
+    const char *src = data;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = write(fd, src + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Connect to the Unix socket of a server
+ * @return the socket, or -1 with errno set
+ */
+static int connectUnix(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** @brief Connect to the TCP port of a server
+ * @return the socket, or -1 if the address cannot be resolved or reached
+ */
+static int connectTcp(const char *host, const char *port) {
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/** @brief Read a whole file
+ * @param filename the name of the file
+ * @param bytes set to its size
+ * @return its content, or NULL with errno set
+ */
+static char *readFile(const char *filename, size_t *bytes) {
+    struct stat st;
+    char *data = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0) {
+        data = malloc(st.st_size > 0 ? st.st_size : 1);
+    }
+    if (data != NULL && readFull(fd, data, st.st_size) < 0) {
+        free(data);
+        data = NULL;
+        errno = EIO;
+    }
+    close(fd);
+    *bytes = data != NULL ? (size_t) st.st_size : 0;
+    return data;
+}
+
+/** @brief Parse integers separated by spaces, commas or newlines
+ * @param text the integers
+ * @param count set to their number
+ * @return the integers, or NULL if out of memory
+ */
+static int32_t *parseInputs(const char *text, uint32_t *count) {
+    int32_t *values = malloc((strlen(text) / 2 + 1) * sizeof(int32_t));
+    char *end;
+    *count = 0;
+    if (values == NULL) {
+        return NULL;
+    }
+    while (*text != '\0') {
+        long value = strtol(text, &end, 10);
+        if (end == text) {
+            text++;
+            continue;
+        }
+        values[(*count)++] = (int32_t) value;
+        text = end;
+    }
+    return values;
+}
+
+/**
+ * @brief Send a request and read its response
+ * @param fd the connection
+ * @param req the request
+ * @param name name of the program
+ * @param image the image, req->imageBytes long
+ * @param inputs the integers for scall 0, req->inputs of them
+ * @param resp set to the response
+ * @param output set to the output, which the caller frees
+ * @return 0 on success, -1 if the connection failed
+ */
+static int call(int fd, const servicerequest_t *req, const char *name, const char *image,
+                const int32_t *inputs, serviceresponse_t *resp, char **output) {
+    *output = NULL;
+    if (writeFull(fd, req, sizeof(*req)) < 0 || writeFull(fd, name, req->nameBytes) < 0
+        || writeFull(fd, image, req->imageBytes) < 0
+        || writeFull(fd, inputs, req->inputs * sizeof(int32_t)) < 0
+        || readFull(fd, resp, sizeof(*resp)) < 0 || resp->magic != SERVICE_RESPONSE_MAGIC) {
+        return -1;
+    }
+    *output = malloc(resp->outputBytes + 1);
+    if (*output == NULL || readFull(fd, *output, resp->outputBytes) < 0) {
+        free(*output);
+        *output = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Name of a status
+ * @param status VM_* or SERVICE_* status
+ */
+static const char *statusName(int status) {
+    switch (status) {
+        case VM_HALTED:
+            return "halted";
+        case VM_BUDGET_EXHAUSTED:
+            return "budget exhausted";
+        case VM_FAULT:
+            return "fault";
+        case SERVICE_UNKNOWN_IMAGE:
+            return "unknown image";
+        case SERVICE_LOAD_ERROR:
+            return "load error";
+        default:
+            return "bad request";
+    }
+}
+
+/** @brief Print the usage of the program */
+static void usage(const char *name) {
+    printf("Usage: %s --socket path | --port port [--host address] [options] <input files>\n", name);
+    printf("Options: --input values, --max-steps n, --quiet\n");
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if a program did not halt or the server could not be reached, 0 otherwise
+ *
+ * --input gives the integers scall 0 reads, such as 1,2,3, to every
+ * program. --max-steps sets their budget, within that of the server.
+ * --quiet only prints the output of the programs, without their results.
+ */
+int main(int argc, char **argv) {
+    servicerequest_t req;
+    serviceresponse_t resp;
+    const char *socketPath = NULL;
+    const char *host = "127.0.0.1";
+    const char *port = NULL;
+    const char *input = "";
+    char **files = calloc(argc, sizeof(char *));
+    int32_t *inputs;
+    int nbrFiles = 0, quiet = 0, failed = 0;
+    int i, fd;
+
+    memset(&req, 0, sizeof(req));
+    req.magic = SERVICE_REQUEST_MAGIC;
+    req.version = SERVICE_VERSION;
+    req.headerWords = sizeof(req) / sizeof(uint32_t);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc) {
+            input = argv[++i];
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            req.maxSteps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--quiet") == 0 || strcmp(argv[i], "-q") == 0) {
+            quiet = 1;
+        } else {
+            files[nbrFiles++] = argv[i];
+        }
+    }
+    if (nbrFiles == 0 || (socketPath == NULL) == (port == NULL)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    inputs = parseInputs(input, &req.inputs);
+    fd = socketPath != NULL ? connectUnix(socketPath) : connectTcp(host, port);
+    if (inputs == NULL || fd < 0) {
+        printf("Error: Could not connect to %s: %s\n", socketPath != NULL ? socketPath : port, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    for (i = 0; i < nbrFiles; i++) {
+        size_t bytes;
+        char *output;
+        char *image = readFile(files[i], &bytes);
+        if (image == NULL) {
+            printf("Error: Could not read file %s: %s\n", files[i], strerror(errno));
+            failed = 1;
+            continue;
+        }
+        req.nameBytes = (uint32_t) strlen(files[i]);
+        req.imageHash = serviceHash(image, bytes);
+        req.imageBytes = 0;
+        /* Send the image only if the server does not have it */
+        if (call(fd, &req, files[i], image, inputs, &resp, &output) == 0 && resp.status == SERVICE_UNKNOWN_IMAGE) {
+            free(output);
+            req.imageBytes = bytes;
+            if (call(fd, &req, files[i], image, inputs, &resp, &output) < 0) {
+                resp.magic = 0;
+            }
+        } else if (output == NULL) {
+            resp.magic = 0;
+        }
+        free(image);
+        if (resp.magic != SERVICE_RESPONSE_MAGIC) {
+            printf("Error: Connection to the server lost\n");
+            return EXIT_FAILURE;
+        }
+        fwrite(output, 1, resp.outputBytes, stdout);
+        if (resp.outputBytes > 0 && output[resp.outputBytes - 1] != '\n') {
+            printf("\n");
+        }
+        free(output);
+        if (resp.status == SERVICE_LOAD_ERROR) {
+            printf("Error: Could not load file %s: %s\n", files[i], strerror(resp.error));
+        } else if (!quiet) {
+            printf("Status: %s", statusName(resp.status));
+            if (resp.status == VM_FAULT) {
+                printf(" (%s)", vm_fault_name(resp.fault));
+            }
+            printf(", %llu steps, %llu KiB of memory, last output value: %d\n", (unsigned long long) resp.steps,
+                   (unsigned long long) (resp.memUsed >> 10), resp.regs[20]);
+            printf("Loaded in %.1f us%s, ran in %.1f us%s\n", resp.loadNanos / 1e3,
+                   (resp.flags & SERVICE_CACHED) ? " from the cache" : "", resp.runNanos / 1e3,
+                   (resp.flags & SERVICE_TRUNCATED) ? ", output truncated" : "");
+        }
+        if (resp.status != VM_HALTED) {
+            failed = 1;
+        }
+    }
+    close(fd);
+    free(inputs);
+    free(files);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,7 +6,31 @@
  */
 
 /* Memory storage */
-#define MEMSIZE 2048
+#define MEMSIZE 2048                // default size of memory, in words
+#define MAX_MEMSIZE (1ULL << 32)    // largest memory a 32-bit address can reach, in words
+#define HUGE_PAGE_SIZE (2 << 20)    // memory is aligned and sized for 2 MiB huge pages
+#define GUEST_PAGE_SHIFT 10         // the memory limit counts pages of 2^10 words (4 KiB)
+#define GUEST_PAGE_WORDS (1 << GUEST_PAGE_SHIFT)
+
+/* Memory dumps (see dump.h) */
+#define DUMP_BLOCK_SHIFT 6          // stores mark memory dirty in blocks of 2^6 words
+#define DUMP_BLOCK_WORDS (1 << DUMP_BLOCK_SHIFT)
+
+/* Syscall output buffer */
+#define OUTPUT_BUFSIZE (64 << 10)   // bytes buffered before they are handed to the output sink
+
+/* Just-in-time compiler */
+#define JIT_THRESHOLD 64            // executions of a branch target before its block is compiled
+#define JIT_LOOP_THRESHOLD 4        // same for the header of a loop of the control-flow graph
+#define JIT_MAX_BLOCK 256           // instructions in a compiled block
+#define JIT_CODE_SIZE (16 << 20)    // bytes of native code kept before the whole cache is flushed
+
+/* Budget of vm_run */
+#define BLOCK_RUN_LONG 255          // instructions of a block checked against the budget at once; longer ones are stepped
+
+/* Harts: guest cores sharing the memory of a program (see spawnHart) */
+#define MAX_HARTS 64                // harts of a program, the first one included
+#define HART_SLICE 4096             // steps a hart runs between two checks that the program still runs
 
 /* Opcodes corresponding to operations */
 #define OPCODE_ADD 2
@@ -42,6 +66,45 @@
 #define OPCODE_SCALL 34
 #define OPCODE_STOP 35
 
+/* Vector opcodes, operating on blocks of contiguous words (see vector.h) */
+#define OPCODE_VLOAD 36             // vload rd, rs, n: n registers from rd <- mem[rs...]
+#define OPCODE_VSTORE 37            // vstore rd, rs, n: mem[rs...] <- n registers from rd
+#define OPCODE_VADD 38              // vadd rd, rs1, rs2, rn: mem[rd...] <- mem[rs1...] + mem[rs2...], rn words
+#define OPCODE_VMUL 39              // vmul rd, rs1, rs2, rn: mem[rd...] <- mem[rs1...] * mem[rs2...], rn words
+#define OPCODE_VDOT 40              // vdot rd, rs1, rs2, rn: rd <- rd + dot product of mem[rs1...] and mem[rs2...]
+#define OPCODE_VCOPY 41             // vcopy rd, rs, rn: mem[rd...] <- mem[rs...], rn words
+#define OPCODE_VSET 42              // vset rd, rs, rn: mem[rd...] <- rs, rn words
+
+/* Atomic opcodes, on the memory the harts share */
+#define OPCODE_AMOADD 43            // amoadd rd, rs1, rs2: rd <- mem[rs1], mem[rs1] <- mem[rs1] + rs2
+#define OPCODE_CAS 44               // cas rd, rs1, rs2: rd <- mem[rs1], mem[rs1] <- rs2 if it was equal to rd
+#define OPCODE_FENCE 45             // fence: the loads and stores before it are seen by the other harts before those after it
+
+/* Superinstructions: pairs of instructions fused by the decoder, never found in memory */
+#define OPCODE_SUPER 64             // first superinstruction
+#define OPCODE_SLT_BRAZ 64
+#define OPCODE_SLT_BRANZ 65
+#define OPCODE_SLTI_BRAZ 66
+#define OPCODE_SLTI_BRANZ 67
+#define OPCODE_SLE_BRAZ 68
+#define OPCODE_SLE_BRANZ 69
+#define OPCODE_SLEI_BRAZ 70
+#define OPCODE_SLEI_BRANZ 71
+#define OPCODE_SEQ_BRAZ 72
+#define OPCODE_SEQ_BRANZ 73
+#define OPCODE_SEQI_BRAZ 74
+#define OPCODE_SEQI_BRANZ 75
+#define OPCODE_LOAD_ADD 76
+#define OPCODE_LOAD_SUB 77
+#define OPCODE_LOAD_MUL 78
+#define OPCODE_ADDI_JMPI 79
+#define OPCODE_ADDI_BRAZ 80
+#define OPCODE_ADDI_BRANZ 81
+#define OPCODE_SUBI_JMPI 82
+#define OPCODE_SUBI_BRAZ 83
+#define OPCODE_SUBI_BRANZ 84
+#define NBR_OPCODES 85              // size of the dispatch tables
+
 /* Types of instructions */
 #define TYPE_R 0    // operate on registers
 #define TYPE_I 1    // operate on register and immediate
@@ -49,6 +112,8 @@
 #define TYPE_JI 3   // jump to immediate (label)
 #define TYPE_B 4    // branch to immediate (label)
 #define TYPE_S 5    // syscall
+#define TYPE_V 6    // vector, on blocks of memory whose length is in a register
+#define TYPE_A 7    // atomic, on the word at the address in a register
 
 /* Ammount of registers */
 #define NBR_REGS 32
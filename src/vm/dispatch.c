@@ -0,0 +1,472 @@
+/** @file dispatch.c
+ * @brief Microbenchmark of decode and dispatch strategies, on a toy VM.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * The toy VM has NUM_REGS registers and 16-bit instructions: the opcode in
+ * the top 4 bits, then three 4-bit register fields, the last byte doubling
+ * as an immediate. It knows three instructions:
+ *  - 0: halt
+ *  - 1: loadi r1 #imm
+ *  - 2: add r1 r2 r3
+ * It runs program[] with each strategy in turn, away from the I/O and the
+ * bookkeeping of the real VM (see engine.inc):
+ *  - switch: fetch, decode and evaluate each word through a switch,
+ *  - table: the same, calling the handler of the opcode from a table of
+ *    function pointers,
+ *  - goto: the handlers jump to one another through a table of labels
+ *    (labels as values), each with its own indirect branch,
+ *  - predecoded: the words are decoded once, before the run, and a switch
+ *    runs the decoded instructions,
+ *  - threaded: decoded once too, with the label of its handler in each
+ *    decoded instruction, as in the threaded engine of the VM.
+ * The program is repeated --length times before its halt, so that the
+ * dispatch is what the run measures, and each run makes --scale passes over
+ * it. Results are printed as JSON, like those of vm-bench. --trace instead
+ * runs program[] once with the first strategy, printing each instruction and
+ * the registers as it goes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_REGS 4
+
+/* Opcodes of the toy VM */
+#define TOY_HALT 0
+#define TOY_LOADI 1
+#define TOY_ADD 2
+#define TOY_OPCODES 16
+
+/** @brief The program: loadi r0 #100, loadi r1 #200, add r2 r0 r1, halt */
+static const uint16_t program[] = { 0x1064, 0x11C8, 0x2201, 0x0000 };
+
+/** @brief State of the toy VM */
+typedef struct {
+    const uint16_t *code;
+    unsigned regs[NUM_REGS];
+    int pc;
+    int running;    // the VM runs until this flag becomes 0
+    uint64_t steps; // instructions executed
+    int trace;      // 1 to print each instruction and the registers
+} toy_t;
+
+/** @brief Decoded form of an instruction */
+typedef struct {
+    const void *handler;    // label of the handler, for the threaded strategy
+    uint8_t instrNum;
+    uint8_t reg1;
+    uint8_t reg2;
+    uint8_t reg3;
+    unsigned imm;
+} toyinstr_t;
+
+/** @brief A decode and dispatch strategy */
+typedef struct {
+    const char *name;
+    int predecoded;     // 1 if it runs the decoded instructions
+    void (*run)(toy_t *t, const toyinstr_t *decoded);
+} strategy_t;
+
+/*--- Decoding ---*/
+
+/**
+ * @brief Decode a word
+ * @param instr the word
+ * @param i receives the fields
+ *
+ * The register fields are 4 bits wide: only their low bits name one of the
+ * NUM_REGS registers.
+ */
+static inline void decode(uint16_t instr, toyinstr_t *i) {
+    i->instrNum = (instr & 0xF000) >> 12;
+    i->reg1 = ((instr & 0xF00) >> 8) & (NUM_REGS - 1);
+    i->reg2 = ((instr & 0xF0) >> 4) & (NUM_REGS - 1);
+    i->reg3 = (instr & 0xF) & (NUM_REGS - 1);
+    i->imm = instr & 0xFF;
+}
+
+/** @brief Fetch the next word from the program */
+static inline uint16_t fetch(toy_t *t) {
+    return t->code[t->pc++];
+}
+
+/** @brief Display all registers as 4-digit hexadecimal words */
+static void showRegs(const toy_t *t) {
+    int i;
+    printf("regs = ");
+    for (i = 0; i < NUM_REGS; i++) {
+        printf("%04X ", t->regs[i]);
+    }
+    printf("\n");
+}
+
+/** @brief Print an instruction, as the toy VM traces it */
+static void showInstr(const toyinstr_t *i) {
+    switch (i->instrNum) {
+        case TOY_HALT:
+            printf("halt\n");
+            break;
+        case TOY_LOADI:
+            printf("loadi r%d #%u\n", i->reg1, i->imm);
+            break;
+        case TOY_ADD:
+            printf("add r%d r%d r%d\n", i->reg1, i->reg2, i->reg3);
+            break;
+        default:
+            printf("unknown instruction %d\n", i->instrNum);
+            break;
+    }
+}
+
+/*--- Strategies ---*/
+
+/** @brief Evaluate a decoded instruction; unknown instructions halt */
+static inline void eval(toy_t *t, const toyinstr_t *i) {
+    switch (i->instrNum) {
+        case TOY_LOADI:
+            t->regs[i->reg1] = i->imm;
+            break;
+        case TOY_ADD:
+            t->regs[i->reg1] = t->regs[i->reg2] + t->regs[i->reg3];
+            break;
+        default:
+            t->running = 0;
+            break;
+    }
+}
+
+/** @brief Fetch, decode and evaluate each word with a switch */
+static void runSwitch(toy_t *t, const toyinstr_t *decoded) {
+    toyinstr_t i;
+    (void) decoded;
+    while (t->running) {
+        if (t->trace) {
+            showRegs(t);
+        }
+        decode(fetch(t), &i);
+        if (t->trace) {
+            showInstr(&i);
+        }
+        eval(t, &i);
+        t->steps++;
+    }
+    if (t->trace) {
+        showRegs(t);
+    }
+}
+
+static void opHalt(toy_t *t, const toyinstr_t *i) {
+    (void) i;
+    t->running = 0;
+}
+
+static void opLoadi(toy_t *t, const toyinstr_t *i) {
+    t->regs[i->reg1] = i->imm;
+}
+
+static void opAdd(toy_t *t, const toyinstr_t *i) {
+    t->regs[i->reg1] = t->regs[i->reg2] + t->regs[i->reg3];
+}
+
+/** @brief Handlers of the table strategy, indexed by opcode */
+static void (*const handlers[TOY_OPCODES])(toy_t *t, const toyinstr_t *i) = {
+    opHalt, opLoadi, opAdd, opHalt, opHalt, opHalt, opHalt, opHalt,
+    opHalt, opHalt, opHalt, opHalt, opHalt, opHalt, opHalt, opHalt,
+};
+
+/** @brief Fetch and decode each word, then call its handler from a table */
+static void runTable(toy_t *t, const toyinstr_t *decoded) {
+    toyinstr_t i;
+    (void) decoded;
+    while (t->running) {
+        decode(fetch(t), &i);
+        handlers[i.instrNum](t, &i);
+        t->steps++;
+    }
+}
+
+/** @brief Run the decoded instructions with a switch */
+static void runPredecoded(toy_t *t, const toyinstr_t *decoded) {
+    unsigned *regs = t->regs;
+    const toyinstr_t *i = decoded + t->pc;
+    uint64_t steps = 0;
+    for (;;) {
+        steps++;
+        switch (i->instrNum) {
+            case TOY_LOADI:
+                regs[i->reg1] = i->imm;
+                i++;
+                continue;
+            case TOY_ADD:
+                regs[i->reg1] = regs[i->reg2] + regs[i->reg3];
+                i++;
+                continue;
+            default:
+                break;
+        }
+        break;
+    }
+    t->pc = (int) (i - decoded) + 1;
+    t->steps += steps;
+    t->running = 0;
+}
+
+#ifdef __GNUC__
+/** @brief Fetch and decode each word, each handler jumping to the next one through a table of labels */
+static void runGoto(toy_t *t, const toyinstr_t *decoded) {
+    static const void *labels[TOY_OPCODES] = {
+        [0 ... TOY_OPCODES - 1] = &&op_halt,
+        [TOY_LOADI] = &&op_loadi, [TOY_ADD] = &&op_add,
+    };
+    unsigned *regs = t->regs;
+    const uint16_t *code = t->code;
+    int pc = t->pc;
+    uint64_t steps = 0;
+    toyinstr_t i;
+    (void) decoded;
+#define GOTO_NEXT() \
+    do { \
+        decode(code[pc++], &i); \
+        steps++; \
+        goto *labels[i.instrNum]; \
+    } while (0)
+
+    GOTO_NEXT();
+    op_loadi: regs[i.reg1] = i.imm; GOTO_NEXT();
+    op_add: regs[i.reg1] = regs[i.reg2] + regs[i.reg3]; GOTO_NEXT();
+    op_halt:
+        t->pc = pc;
+        t->steps += steps;
+        t->running = 0;
+#undef GOTO_NEXT
+}
+
+/** @brief Run the decoded instructions, each holding the label of its handler */
+static void runThreaded(toy_t *t, const toyinstr_t *decoded) {
+    static const void *labels[TOY_OPCODES] = {
+        [0 ... TOY_OPCODES - 1] = &&op_halt,
+        [TOY_LOADI] = &&op_loadi, [TOY_ADD] = &&op_add,
+    };
+    unsigned *regs = t->regs;
+    const toyinstr_t *i = decoded + t->pc;
+    uint64_t steps = 0;
+    /* The decoded program is shared by the runs: its labels are filled on the first one */
+    if (i->handler == NULL) {
+        toyinstr_t *d = (toyinstr_t *) decoded;
+        int n;
+        for (n = 0; ; n++) {
+            d[n].handler = labels[d[n].instrNum];
+            if (d[n].handler == &&op_halt) {
+                break;
+            }
+        }
+    }
+#define THREADED_NEXT() \
+    do { \
+        steps++; \
+        goto *(i++)->handler; \
+    } while (0)
+
+    THREADED_NEXT();
+    op_loadi: regs[i[-1].reg1] = i[-1].imm; THREADED_NEXT();
+    op_add: regs[i[-1].reg1] = regs[i[-1].reg2] + regs[i[-1].reg3]; THREADED_NEXT();
+    op_halt:
+        t->pc = (int) (i - decoded);
+        t->steps += steps;
+        t->running = 0;
+#undef THREADED_NEXT
+}
+#endif
+
+static const strategy_t strategies[] = {
+    { "switch", 0, runSwitch },
+    { "table", 0, runTable },
+#ifdef __GNUC__
+    { "goto", 0, runGoto },
+#endif
+    { "predecoded", 1, runPredecoded },
+#ifdef __GNUC__
+    { "threaded", 1, runThreaded },
+#endif
+};
+
+/*--- Harness ---*/
+
+/** @brief Current time, in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Repeat the instructions of program[] before its halt
+ * @param length number of times
+ * @param words receives the number of words, halt included
+ * @return the code, or NULL if out of memory
+ */
+static uint16_t *buildCode(uint64_t length, uint64_t *words) {
+    const uint64_t body = sizeof(program) / sizeof(program[0]) - 1;
+    uint16_t *code;
+    uint64_t n;
+    *words = body * length + 1;
+    code = malloc(*words * sizeof(uint16_t));
+    if (code == NULL) {
+        return NULL;
+    }
+    for (n = 0; n < body * length; n++) {
+        code[n] = program[n % body];
+    }
+    code[n] = program[body];
+    return code;
+}
+
+/** @brief Order run times */
+static int compareTime(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Print the usage of the program */
+static void usage(const char *name) {
+    printf("Usage: %s [--strategy name] [--length n] [--scale n] [--repeat n] [--output file] | --trace\n", name);
+    printf("Strategies: switch, table, goto, predecoded, threaded\n");
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if error, 0 if success
+ *
+ * Each strategy runs --repeat times, and the median run is reported, with
+ * the time it took to decode the program for those that decode it first.
+ * Every run must leave the registers as the switch strategy does.
+ */
+int main(int argc, char **argv) {
+    const char *only = NULL;
+    const char *outputFile = NULL;
+    uint64_t length = 1000, scale = 10000, words, pass;
+    int repeat = 5, trace = 0, first = 1;
+    unsigned expected[NUM_REGS];
+    FILE *out = stdout;
+    uint16_t *code;
+    toyinstr_t *decoded;
+    double *times;
+    size_t s;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--strategy") == 0 && i + 1 < argc) {
+            only = argv[++i];
+        } else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc) {
+            length = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            scale = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            outputFile = argv[++i];
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace = 1;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (repeat < 1 || scale < 1 || length < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (only != NULL) {
+        for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]) && strcmp(only, strategies[s].name) != 0; s++) {
+        }
+        if (s == sizeof(strategies) / sizeof(strategies[0])) {
+            printf("Error: Unknown strategy %s\n", only);
+            return EXIT_FAILURE;
+        }
+    }
+    if (trace) {
+        toy_t t = { program, { 0 }, 0, 1, 0, 1 };
+        runSwitch(&t, NULL);
+        return EXIT_SUCCESS;
+    }
+
+    code = buildCode(length, &words);
+    decoded = code != NULL ? calloc(words, sizeof(toyinstr_t)) : NULL;
+    times = calloc(repeat, sizeof(double));
+    if (code == NULL || decoded == NULL || times == NULL) {
+        printf("Error: Could not allocate a program of %llu instructions\n", (unsigned long long) words);
+        return EXIT_FAILURE;
+    }
+    if (outputFile != NULL) {
+        out = fopen(outputFile, "w");
+        if (out == NULL) {
+            printf("Error: Could not open %s\n", outputFile);
+            return EXIT_FAILURE;
+        }
+    }
+    /* What every strategy must compute */
+    {
+        toy_t t = { code, { 0 }, 0, 1, 0, 0 };
+        runSwitch(&t, NULL);
+        memcpy(expected, t.regs, sizeof(expected));
+    }
+
+    fprintf(out, "{\n  \"words\": %llu,\n  \"scale\": %llu,\n  \"repeat\": %d,\n  \"results\": [",
+            (unsigned long long) words, (unsigned long long) scale, repeat);
+    for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]); s++) {
+        const strategy_t *st = &strategies[s];
+        double start, decodeTime = 0;
+        toy_t t;
+        if (only != NULL && strcmp(only, st->name) != 0) {
+            continue;
+        }
+        for (i = 0; i < repeat; i++) {
+            memset(&t, 0, sizeof(t));
+            t.code = code;
+            start = now();
+            if (st->predecoded) {
+                uint64_t n;
+                memset(decoded, 0, words * sizeof(toyinstr_t));
+                for (n = 0; n < words; n++) {
+                    decode(code[n], &decoded[n]);
+                }
+                decodeTime = now() - start;
+                start = now();
+            }
+            for (pass = 0; pass < scale; pass++) {
+                t.pc = 0;
+                t.running = 1;
+                st->run(&t, decoded);
+            }
+            times[i] = now() - start;
+            if (memcmp(t.regs, expected, sizeof(expected)) != 0 || t.steps != words * scale) {
+                printf("Error: Strategy %s computed a different result\n", st->name);
+                return EXIT_FAILURE;
+            }
+        }
+        qsort(times, repeat, sizeof(double), compareTime);
+        fprintf(out, "%s\n    {\"strategy\": \"%s\", \"instructions\": %llu, \"seconds\": %.6f, "
+                     "\"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f, \"decode_us\": %.1f}",
+                first ? "" : ",", st->name, (unsigned long long) t.steps, times[repeat / 2],
+                times[repeat / 2] > 0 ? t.steps / times[repeat / 2] : 0.0,
+                t.steps ? times[repeat / 2] * 1e9 / t.steps : 0.0, decodeTime * 1e6);
+        fflush(out);
+        first = 0;
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    free(times);
+    free(decoded);
+    free(code);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+/** \headerfile dump.h "dump.h"
+ *  \brief File format of the memory dumps
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The VM marks the blocks of DUMP_BLOCK_WORDS words its stores write to, so a
+ * dump only holds the memory the program changed since the previous one. The
+ * first dump of a series is usually full: it holds every block that is not
+ * zero, and the next ones apply over it.
+ *
+ * A dump file is a header followed by the program name, the symbol table of
+ * the object file and the regions. A region is a dumpregion_t followed by its
+ * words; it covers contiguous blocks, so its address and size are multiples
+ * of DUMP_BLOCK_WORDS, save for the last block of memory.
+ */
+
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdint.h>
+
+#include "constants.h"
+
+#define DUMP_MAGIC 0x444D5641   // "AVMD"
+#define DUMP_VERSION 1
+
+/* Flags of the header */
+#define DUMP_FULL 1             // memory outside the regions is zero, not unchanged
+
+/** @brief Header at the start of a dump file */
+typedef struct {
+    uint32_t magic;         // DUMP_MAGIC
+    uint16_t version;       // DUMP_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    uint64_t memWords;      // size of memory
+    uint64_t steps;         // instructions executed since the program was loaded
+    uint64_t sequence;      // dumps taken before this one since the program was loaded
+    uint64_t regions;       // number of regions in the file
+    int32_t pc;
+    uint32_t flags;         // DUMP_*
+    uint32_t nameBytes;
+    uint32_t symBytes;
+} dumpheader_t;
+
+/** @brief Header of a region; its words follow */
+typedef struct {
+    uint64_t addr;          // first word
+    uint64_t words;         // number of words
+} dumpregion_t;
+
+#endif
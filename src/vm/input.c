@@ -0,0 +1,184 @@
+/** @file input.c
+ * @brief Providers of the integers read by scall 0.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "input.h"
+
+void inputInit(input_t *in) {
+    in->map = NULL;
+    in->mapBytes = 0;
+    inputStream(in, stdin);
+}
+
+void inputFree(input_t *in) {
+    if (in->map != NULL) {
+        munmap(in->map, in->mapBytes);
+        in->map = NULL;
+        in->mapBytes = 0;
+    }
+}
+
+/** @brief Switch to a provider of the given kind, at its start */
+static void reset(input_t *in, int kind) {
+    inputFree(in);
+    in->kind = kind;
+    in->interactive = 0;
+    in->pos = 0;
+}
+
+void inputStream(input_t *in, FILE *stream) {
+    reset(in, INPUT_STREAM);
+    in->stream = stream;
+    in->interactive = isatty(fileno(stream));
+}
+
+void inputValues(input_t *in, const int *values, size_t count) {
+    reset(in, INPUT_VALUES);
+    in->values = values;
+    in->count = count;
+}
+
+void inputText(input_t *in, const char *text, size_t len) {
+    reset(in, INPUT_TEXT);
+    in->text = text;
+    in->len = len;
+}
+
+int inputMapFile(input_t *in, const char *filename) {
+    struct stat st;
+    void *map = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+    }
+    close(fd);
+    inputText(in, map, st.st_size);
+    in->map = map;
+    in->mapBytes = st.st_size;
+    return 0;
+}
+
+void inputCallback(input_t *in, vm_input_fn source, void *ctx) {
+    reset(in, INPUT_CALLBACK);
+    in->source = source;
+    in->ctx = ctx;
+}
+
+/** @brief Tell if a character separates integers: white space or a comma */
+static int isSpace(int c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f' || c == ',';
+}
+
+static int isDigit(int c) {
+    return c >= '0' && c <= '9';
+}
+
+/** @brief Parse the next integer of the text */
+static int parseText(input_t *in) {
+    const char *text = in->text;
+    size_t i = in->pos;
+    unsigned int value = 0;
+    int negative = 0;
+    size_t digits;
+    while (i < in->len && isSpace(text[i])) {
+        i++;
+    }
+    in->pos = i;
+    if (i < in->len && (text[i] == '-' || text[i] == '+')) {
+        negative = text[i] == '-';
+        i++;
+    }
+    digits = i;
+    while (i < in->len && isDigit(text[i])) {
+        value = value * 10 + (text[i] - '0');
+        i++;
+    }
+    if (i == digits) {
+        return 0;
+    }
+    in->pos = i;
+    return (int) (negative ? 0U - value : value);
+}
+
+/** @brief Parse the next integer of the stream, with the stdio buffer of the stream, which the caller locked */
+static int parseStream(FILE *stream) {
+    unsigned int value = 0;
+    int negative = 0;
+    int c;
+    do {
+        c = getc_unlocked(stream);
+    } while (isSpace(c));
+    if (c == '-' || c == '+') {
+        negative = c == '-';
+        c = getc_unlocked(stream);
+    }
+    if (!isDigit(c)) {
+        if (c != EOF) {
+            ungetc(c, stream);
+        }
+        return 0;
+    }
+    while (isDigit(c)) {
+        value = value * 10 + (c - '0');
+        c = getc_unlocked(stream);
+    }
+    if (c != EOF) {
+        ungetc(c, stream);
+    }
+    return (int) (negative ? 0U - value : value);
+}
+
+int inputInt(input_t *in, int *value) {
+    switch (in->kind) {
+        case INPUT_STREAM:
+            /* VMs on other threads may read the same stream: each integer is read whole */
+            flockfile(in->stream);
+            *value = parseStream(in->stream);
+            funlockfile(in->stream);
+            return 0;
+        case INPUT_VALUES:
+            *value = in->pos < in->count ? in->values[in->pos++] : 0;
+            return 0;
+        case INPUT_TEXT:
+            *value = parseText(in);
+            return 0;
+        case INPUT_CALLBACK:
+            switch (in->source(in->ctx, value)) {
+                case 1:
+                    return 0;
+                case VM_INPUT_WAIT:
+                    return -1;
+                default:
+                    *value = 0;
+                    return 0;
+            }
+        default:
+            *value = 0;
+            return 0;
+    }
+}
@@ -0,0 +1,80 @@
+/** \headerfile input.h "input.h"
+ *  \brief Providers of the integers read by scall 0
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * scall 0 takes its integers from one of these providers:
+ *  - a stdio stream, stdin by default, read without scanf,
+ *  - an array of values,
+ *  - integers written as text, in memory or in a file mapped read-only,
+ *  - a callback of the host, which may have no integer yet: scall 0 then
+ *    waits for one (see VM_WAITING).
+ * Integers written as text are separated by white space or commas.
+ * Only a stream that is a terminal is interactive: scall 0 then prompts for
+ * each integer. The other providers are read without a prompt or a flush of
+ * the output, so reading the input costs about as much as parsing it.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+/* Kinds of providers */
+#define INPUT_STREAM 0      // stdio stream
+#define INPUT_VALUES 1      // array of integers
+#define INPUT_TEXT 2        // integers written as text
+#define INPUT_CALLBACK 3    // callback of the host
+
+/** @brief Provider of the input and where it is at */
+typedef struct {
+    int kind;               // INPUT_*
+    int interactive;        // 1 if the stream is a terminal
+    FILE *stream;
+    const int *values;      // INPUT_VALUES
+    size_t count;
+    const char *text;       // INPUT_TEXT
+    size_t len;
+    size_t pos;             // next value or character
+    vm_input_fn source;     // INPUT_CALLBACK
+    void *ctx;
+    void *map;              // file mapped for the text, NULL if none
+    size_t mapBytes;
+} input_t;
+
+/** @brief Read from stdin */
+void inputInit(input_t *in);
+
+/** @brief Release the file mapped by inputMapFile, if any */
+void inputFree(input_t *in);
+
+/** @brief Read from a stdio stream, interactive if it is a terminal */
+void inputStream(input_t *in, FILE *stream);
+
+/** @brief Read the values of an array, which is not copied */
+void inputValues(input_t *in, const int *values, size_t count);
+
+/** @brief Read integers written as text, which is not copied */
+void inputText(input_t *in, const char *text, size_t len);
+
+/** @brief Read integers written as text in a file, mapped read-only
+ * @return 0 on success, -1 with errno set if the file cannot be mapped
+ */
+int inputMapFile(input_t *in, const char *filename);
+
+/** @brief Read from a callback of the host */
+void inputCallback(input_t *in, vm_input_fn source, void *ctx);
+
+/** @brief Get the next integer
+ * @param in the provider
+ * @param value set to the integer, or to 0 at the end of the input or if the
+ *        next text is not an integer, which is not consumed, like scanf would
+ * @return 0, or -1 if the callback has no integer yet and value is not set
+ */
+int inputInt(input_t *in, int *value);
+
+#endif
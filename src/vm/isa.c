@@ -0,0 +1,186 @@
+/** @file isa.c
+ * @brief Description of the instruction set.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "isa.h"
+
+int opcodeType(int opcode) {
+    switch (opcode) {
+        case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL: case OPCODE_DIV:
+        case OPCODE_AND: case OPCODE_OR: case OPCODE_XOR:
+        case OPCODE_SHL: case OPCODE_SHR:
+        case OPCODE_SLT: case OPCODE_SLE: case OPCODE_SEQ:
+            return TYPE_R;
+        case OPCODE_ADDI: case OPCODE_SUBI: case OPCODE_MULI: case OPCODE_DIVI:
+        case OPCODE_ANDI: case OPCODE_ORI: case OPCODE_XORI:
+        case OPCODE_SHLI: case OPCODE_SHRI:
+        case OPCODE_SLTI: case OPCODE_SLEI: case OPCODE_SEQI:
+        case OPCODE_LOAD: case OPCODE_STORE:
+        case OPCODE_VLOAD: case OPCODE_VSTORE:
+            return TYPE_I;
+        case OPCODE_JMPR:
+            return TYPE_JR;
+        case OPCODE_JMPI:
+            return TYPE_JI;
+        case OPCODE_BRAZ: case OPCODE_BRANZ:
+            return TYPE_B;
+        case OPCODE_SCALL:
+            return TYPE_S;
+        case OPCODE_VADD: case OPCODE_VMUL: case OPCODE_VDOT:
+        case OPCODE_VCOPY: case OPCODE_VSET:
+            return TYPE_V;
+        case OPCODE_AMOADD: case OPCODE_CAS: case OPCODE_FENCE:
+            return TYPE_A;
+        default:
+            return -1;
+    }
+}
+
+const char *opcodeName(int opcode) {
+    switch (opcode) {
+        case OPCODE_ADD: return "add";
+        case OPCODE_ADDI: return "addi";
+        case OPCODE_SUB: return "sub";
+        case OPCODE_SUBI: return "subi";
+        case OPCODE_MUL: return "mul";
+        case OPCODE_MULI: return "muli";
+        case OPCODE_DIV: return "div";
+        case OPCODE_DIVI: return "divi";
+        case OPCODE_AND: return "and";
+        case OPCODE_ANDI: return "andi";
+        case OPCODE_OR: return "or";
+        case OPCODE_ORI: return "ori";
+        case OPCODE_XOR: return "xor";
+        case OPCODE_XORI: return "xori";
+        case OPCODE_SHL: return "shl";
+        case OPCODE_SHLI: return "shli";
+        case OPCODE_SHR: return "shr";
+        case OPCODE_SHRI: return "shri";
+        case OPCODE_SLT: return "slt";
+        case OPCODE_SLTI: return "slti";
+        case OPCODE_SLE: return "sle";
+        case OPCODE_SLEI: return "slei";
+        case OPCODE_SEQ: return "seq";
+        case OPCODE_SEQI: return "seqi";
+        case OPCODE_LOAD: return "load";
+        case OPCODE_STORE: return "store";
+        case OPCODE_JMPR: return "jmp";
+        case OPCODE_JMPI: return "jmpi";
+        case OPCODE_BRAZ: return "braz";
+        case OPCODE_BRANZ: return "branz";
+        case OPCODE_SCALL: return "scall";
+        case OPCODE_VLOAD: return "vload";
+        case OPCODE_VSTORE: return "vstore";
+        case OPCODE_VADD: return "vadd";
+        case OPCODE_VMUL: return "vmul";
+        case OPCODE_VDOT: return "vdot";
+        case OPCODE_VCOPY: return "vcopy";
+        case OPCODE_VSET: return "vset";
+        case OPCODE_AMOADD: return "amoadd";
+        case OPCODE_CAS: return "cas";
+        case OPCODE_FENCE: return "fence";
+        case 0:
+        case OPCODE_STOP: return "stop";
+        default: return "?";
+    }
+}
+
+const char *typeName(int type) {
+    switch (type) {
+        case TYPE_R: return "R";
+        case TYPE_I: return "I";
+        case TYPE_JR: return "JR";
+        case TYPE_JI: return "JI";
+        case TYPE_B: return "B";
+        case TYPE_S: return "S";
+        case TYPE_V: return "V";
+        case TYPE_A: return "A";
+        default: return "-";
+    }
+}
+
+void decodeInstr(u_int32_t instr, decoded_t *d) {
+    d->opcode = (instr >> 26) & 0x3F;
+    d->rd = d->rs1 = d->rs2 = 0;
+    d->imm = d->addr = 0;
+    switch (opcodeType(d->opcode)) {
+        case TYPE_R:  /* Registry-type */
+        case TYPE_A:  /* Atomic, with the fields of TYPE_R */
+            d->rd = (instr >> 21) & 0x1F;
+            d->rs1 = (instr >> 16) & 0x1F;
+            d->rs2 = (instr >> 11) & 0x1F;
+            break;
+        case TYPE_I:  /* Immediate-type */
+            d->rd = (instr >> 21) & 0x1F;
+            d->rs1 = (instr >> 16) & 0x1F;
+            d->imm = instr & 0x0000FFFF;
+            if ((d->imm & 0x00008000) != 0) {
+                d->imm |= 0xFFFF0000;
+            }
+            break;
+        case TYPE_JR:  /* Jump to register */
+            d->rd = (instr >> 21) & 0x1F;
+            d->rs1 = (instr >> 16) & 0x1F;
+            break;
+        case TYPE_JI:  /* Jump to immediate */
+            d->rd = (instr >> 21) & 0x1F;
+            d->addr = instr & 0x001FFFFF;
+            break;
+        case TYPE_B:  /* Branch */
+            d->rs1 = (instr >> 21) & 0x1F;
+            d->addr = instr & 0x1FFFF;
+            break;
+        case TYPE_S:  /* Scall */
+            d->imm = instr & 0x3FFFFFF;
+            break;
+        case TYPE_V:  /* Vector */
+            d->rd = (instr >> 21) & 0x1F;
+            d->rs1 = (instr >> 16) & 0x1F;
+            d->rs2 = (instr >> 11) & 0x1F;
+            d->imm = (instr >> 6) & 0x1F;
+        default:
+            break;
+    }
+    d->op = d->opcode;
+    d->fused = 0;
+    d->handler = NULL;
+    d->ready = 1;
+}
+
+int endsBlock(int opcode) {
+    return (opcode < OPCODE_ADD || opcode > OPCODE_SEQI) && opcode != OPCODE_LOAD;
+}
+
+int superOpcode(int first, int second) {
+    int branch;
+    switch (second) {
+        case OPCODE_BRAZ: branch = 0; break;
+        case OPCODE_BRANZ: branch = 1; break;
+        case OPCODE_JMPI: branch = 2; break;
+        default: branch = -1; break;
+    }
+    if (first >= OPCODE_SLT && first <= OPCODE_SEQI && branch >= 0 && branch < 2) {
+        return OPCODE_SLT_BRAZ + 2 * (first - OPCODE_SLT) + branch;
+    }
+    if (first == OPCODE_ADDI && branch >= 0) {
+        return (branch == 2) ? OPCODE_ADDI_JMPI : OPCODE_ADDI_BRAZ + branch;
+    }
+    if (first == OPCODE_SUBI && branch >= 0) {
+        return (branch == 2) ? OPCODE_SUBI_JMPI : OPCODE_SUBI_BRAZ + branch;
+    }
+    if (first == OPCODE_LOAD) {
+        switch (second) {
+            case OPCODE_ADD: return OPCODE_LOAD_ADD;
+            case OPCODE_SUB: return OPCODE_LOAD_SUB;
+            case OPCODE_MUL: return OPCODE_LOAD_MUL;
+            default: break;
+        }
+    }
+    return first;
+}
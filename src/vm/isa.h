@@ -0,0 +1,83 @@
+/** \headerfile isa.h "isa.h"
+ *  \brief Description of the instruction set
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ */
+
+#ifndef ISA_H
+#define ISA_H
+
+#include <sys/types.h>
+
+/** @brief Decoded form of an instruction word
+ *
+ * Every field the instruction types need is extracted once, so the
+ * interpreter only has to index the cache instead of decoding mem[pc].
+ */
+typedef struct {
+    const void *handler; // handler label, filled by the threaded engine
+    u_int32_t imm;      // sign-extended immediate (TYPE_I), syscall number (TYPE_S) or length register (TYPE_V)
+    u_int32_t addr;     // jump or branch target (TYPE_JI, TYPE_B)
+    u_int8_t opcode;
+    u_int8_t op;        // what the engines dispatch on: opcode, or a superinstruction
+    u_int8_t rd;
+    u_int8_t rs1;       // rs for TYPE_I and TYPE_B, ra for TYPE_JR
+    u_int8_t rs2;
+    u_int8_t ready;     // 0 until the word has been decoded
+    u_int8_t fused;     // 0 until the engine has looked for a superinstruction
+    u_int8_t run;       // instructions up to the end of the block starting here, 0 until counted (see endsBlock)
+} decoded_t;
+
+/**
+ * @brief Get the type of an instruction from its opcode
+ * @param opcode Opcode of the instruction
+ * @return type of instruction (R, I, JR, JI, B, S, V, A), or -1 if it has no operands
+ */
+int opcodeType(int opcode);
+
+/**
+ * @brief Get the mnemonic of an opcode, as written in the assembler
+ * @param opcode Opcode of the instruction
+ * @return the mnemonic, or "?" for an invalid opcode
+ */
+const char *opcodeName(int opcode);
+
+/**
+ * @brief Get the name of an instruction type
+ * @param type TYPE_* value, or -1
+ * @return "R", "I", "JR", "JI", "B", "S", "V", "A", or "-" for instructions without operands
+ */
+const char *typeName(int type);
+
+/**
+ * @brief Decode an instruction word into the cache
+ * @param instr instruction word, as read from memory
+ * @param d cache entry to fill
+ */
+void decodeInstr(u_int32_t instr, decoded_t *d);
+
+/**
+ * @brief Tell if an instruction ends a block, where the engines check the budget
+ * @param opcode Opcode of the instruction
+ * @return 0 for the operations and the load, 1 for the others
+ *
+ * Jumps, branches, system calls and stops end blocks, and so do the
+ * instructions writing memory, which may be the code of the block.
+ */
+int endsBlock(int opcode);
+
+/**
+ * @brief Get the superinstruction running two instructions in a row
+ * @param first Opcode of the first instruction
+ * @param second Opcode of the instruction following it
+ * @return the superinstruction, or first if the pair has none
+ *
+ * A superinstruction runs the first instruction with its own decoded
+ * fields, then the second one with the fields of the next cache entry.
+ * The pairs are the common ones: compare and branch, load and operate,
+ * increment and jump back.
+ */
+int superOpcode(int first, int second);
+
+#endif
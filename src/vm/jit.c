@@ -0,0 +1,820 @@
+/** @file jit.c
+ * @brief Basic-block compiler to native x86-64 code.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * A block runs from a branch target to the next jump or branch, or up to the
+ * first instruction the compiler does not handle. Its native code:
+ *  - takes the whole block out of the budget on entry, or returns to the
+ *    interpreter if the budget cannot cover it,
+ *  - loads the guest registers it uses most into host registers, and works
+ *    on the others in the register file,
+ *  - stores the registers it wrote back before leaving, then jumps to the
+ *    block of its successor if it is compiled, or returns to the caller.
+ * A block branching back to itself loops without leaving its registers.
+ *
+ * Host registers: r12 holds the guest register file, r13 guest memory, r14
+ * the jitctx_t, r15 the budget left. rax, rcx and rdx are scratch, and
+ * rbx, rbp, rsi, rdi, r8-r11 hold guest registers.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+
+/** @brief Map zeroed memory for one entry per guest word, populated lazily */
+static void *mapTable(size_t bytes, int prot) {
+    void *table = mmap(NULL, bytes, prot, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+#if defined(__x86_64__)
+
+/* Host registers */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+#define REGS R12
+#define MEM R13
+#define CTX R14
+#define LEFT R15
+
+/* Host registers guest registers can be held in */
+static const int pinnable[] = { RBX, RBP, RSI, RDI, R8, R9, R10, R11 };
+#define NBR_PINNABLE 8
+
+/* Opcodes, as op r32, r/m32 unless noted */
+#define X_ADD 0x03
+#define X_OR 0x0B
+#define X_AND 0x23
+#define X_SUB 0x2B
+#define X_XOR 0x33
+#define X_CMP 0x3B
+#define X_TEST 0x85     // test r/m32, r32
+#define X_MOV_STORE 0x89 // mov r/m32, r32
+#define X_MOV_LOAD 0x8B
+#define X_IMUL 0x0FAF
+#define X_IMUL_IMM 0x69
+#define X_MOVZX8 0x0FB6
+#define X_SETCC 0x0F90  // + condition
+#define X_GRP1 0x81     // op r/m32, imm32, with the /ext below
+#define X_GRP1_IMM8 0x83
+#define X_SHIFT_IMM 0xC1
+#define X_SHIFT_CL 0xD3
+#define X_MOV_IMM 0xC7
+#define X_MOV_IMM8 0xC6 // mov r/m8, imm8
+#define X_CMP_IMM8 0x80 // cmp r/m8, imm8
+#define X_JMP_RM 0xFF
+
+/* /ext of the group opcodes */
+#define EXT_ADD 0
+#define EXT_OR 1
+#define EXT_AND 4
+#define EXT_SUB 5
+#define EXT_XOR 6
+#define EXT_CMP 7
+#define EXT_SHL 4
+#define EXT_SHR 5
+#define EXT_SAR 7
+
+/* Conditions */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_L 0xC
+#define CC_LE 0xE
+
+/* Upper bound of the native code of one guest instruction, with its stubs */
+#define MAX_INSTR_BYTES 384
+
+/** @brief A register or a memory operand [base + index * scale + disp] */
+typedef struct {
+    int reg;    // register, or -1 for memory
+    int base;
+    int index;  // -1 for none
+    int scale;
+    int32_t disp;
+} operand_t;
+
+/* Out-of-line exits of a block */
+#define STUB_BUDGET 0   // not enough budget to enter the block
+#define STUB_LOOP 1     // not enough budget to loop to the start of the block
+#define STUB_FAULT 2    // load or store out of bounds
+#define STUB_STORE 3    // store to a decoded word
+
+/** @brief An out-of-line exit, emitted after the body of the block */
+typedef struct {
+    int kind;
+    int k;          // index of the instruction in the block
+    uint8_t *jump;  // rel32 of the conditional jump to the stub
+} stub_t;
+
+/** @brief State of the compilation of one block */
+typedef struct {
+    jit_t *jit;
+    uint8_t *p;             // next byte of code
+    uint32_t pc;            // address of the block
+    int len;                // number of guest instructions
+    int host[NBR_REGS];     // host register of each guest register, -1 if in the register file
+    int written[NBR_REGS];  // 1 for each guest register the block writes
+    uint8_t *loop;          // start of the body, after the registers are loaded
+    stub_t stubs[3 * JIT_MAX_BLOCK + 2];    // up to three for a store: bounds, page held, decoded word
+    int nbrStubs;
+} emitter_t;
+
+static void byte(emitter_t *e, int b) {
+    *e->p++ = (uint8_t) b;
+}
+
+static void dword(emitter_t *e, uint32_t v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void qword(emitter_t *e, uint64_t v) {
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+static operand_t reg(int r) {
+    operand_t o = { r, -1, -1, 1, 0 };
+    return o;
+}
+
+static operand_t mem(int base, int32_t disp) {
+    operand_t o = { -1, base, -1, 1, disp };
+    return o;
+}
+
+static operand_t memIndex(int base, int index, int scale, int32_t disp) {
+    operand_t o = { -1, base, index, scale, disp };
+    return o;
+}
+
+/** @brief Operand of a guest register: its host register, or its slot in the register file */
+static operand_t guest(const emitter_t *e, int g) {
+    return e->host[g] >= 0 ? reg(e->host[g]) : mem(REGS, 4 * g);
+}
+
+/**
+ * @brief Encode an instruction with a ModRM operand
+ * @param e the emitter
+ * @param w 1 for a 64-bit operation
+ * @param op opcode, one or two bytes
+ * @param r register or /ext of the ModRM reg field
+ * @param rm register or memory operand
+ */
+static void encode(emitter_t *e, int w, int op, int r, operand_t rm) {
+    int rex = (w ? 8 : 0) | ((r & 8) ? 4 : 0);
+    int mod;
+    if (rm.reg >= 0) {
+        rex |= (rm.reg & 8) ? 1 : 0;
+    } else {
+        rex |= (rm.index >= 0 && (rm.index & 8)) ? 2 : 0;
+        rex |= (rm.base & 8) ? 1 : 0;
+    }
+    if (rex != 0) {
+        byte(e, 0x40 | rex);
+    }
+    if (op > 0xFF) {
+        byte(e, op >> 8);
+    }
+    byte(e, op & 0xFF);
+
+    if (rm.reg >= 0) {
+        byte(e, 0xC0 | (r & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+    if (rm.disp == 0 && (rm.base & 7) != RBP) {
+        mod = 0;
+    } else if (rm.disp >= -128 && rm.disp <= 127) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    if (rm.index >= 0 || (rm.base & 7) == RSP) {
+        int scale = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+        byte(e, mod << 6 | (r & 7) << 3 | 4);
+        byte(e, scale << 6 | ((rm.index >= 0 ? rm.index : RSP) & 7) << 3 | (rm.base & 7));
+    } else {
+        byte(e, mod << 6 | (r & 7) << 3 | (rm.base & 7));
+    }
+    if (mod == 1) {
+        byte(e, rm.disp);
+    } else if (mod == 2) {
+        dword(e, rm.disp);
+    }
+}
+
+/** @brief op r/m, imm with the group 1 opcodes */
+static void aluImm(emitter_t *e, int w, int ext, operand_t rm, int32_t imm) {
+    if (imm >= -128 && imm <= 127) {
+        encode(e, w, X_GRP1_IMM8, ext, rm);
+        byte(e, imm);
+    } else {
+        encode(e, w, X_GRP1, ext, rm);
+        dword(e, imm);
+    }
+}
+
+/** @brief mov dword r/m, imm32 */
+static void movImm(emitter_t *e, operand_t rm, uint32_t imm) {
+    encode(e, 0, X_MOV_IMM, 0, rm);
+    dword(e, imm);
+}
+
+/** @brief jmp rel32
+ * @return location of the rel32, to patch the target
+ */
+static uint8_t *jump(emitter_t *e, const uint8_t *target) {
+    uint8_t *rel;
+    byte(e, 0xE9);
+    rel = e->p;
+    dword(e, (uint32_t) (target - (rel + 4)));
+    return rel;
+}
+
+/** @brief jcc rel32, with the target patched later
+ * @return location of the rel32
+ */
+static uint8_t *jumpIf(emitter_t *e, int cc) {
+    uint8_t *rel;
+    byte(e, 0x0F);
+    byte(e, 0x80 | cc);
+    rel = e->p;
+    dword(e, 0);
+    return rel;
+}
+
+/** @brief Point a rel32 at a target */
+static void patch(uint8_t *rel, const uint8_t *target) {
+    int32_t v = (int32_t) (target - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+
+/** @brief Copy a guest register into a host register */
+static void loadGuest(emitter_t *e, int host, int g) {
+    if (e->host[g] != host) {
+        encode(e, 0, X_MOV_LOAD, host, guest(e, g));
+    }
+}
+
+/** @brief Copy a host register into a guest register */
+static void storeGuest(emitter_t *e, int g, int host) {
+    if (e->host[g] != host) {
+        encode(e, 0, X_MOV_STORE, host, guest(e, g));
+    }
+    e->written[g] = 1;
+}
+
+/** @brief Host register to compute a result for rd in */
+static int accumulator(const emitter_t *e, int rd) {
+    return e->host[rd] >= 0 ? e->host[rd] : RAX;
+}
+
+/** @brief Store the guest registers the block wrote back to the register file */
+static void writeBack(emitter_t *e) {
+    int g;
+    for (g = 0; g < NBR_REGS; g++) {
+        if (e->host[g] >= 0 && e->written[g]) {
+            encode(e, 0, X_MOV_STORE, e->host[g], mem(REGS, 4 * g));
+        }
+    }
+}
+
+/** @brief Set the pc and reason the native code returns with */
+static void setExit(emitter_t *e, uint32_t pc, int reason) {
+    movImm(e, mem(CTX, offsetof(jitctx_t, pc)), pc);
+    if (reason != JIT_EXIT_BRANCH) {
+        movImm(e, mem(CTX, offsetof(jitctx_t, reason)), reason);
+    }
+}
+
+/** @brief Add an out-of-line exit taken by a conditional jump */
+static void addStub(emitter_t *e, int kind, int k, int cc) {
+    stub_t *s = &e->stubs[e->nbrStubs++];
+    s->kind = kind;
+    s->k = k;
+    s->jump = jumpIf(e, cc);
+}
+
+/** @brief Take the block out of the budget, going to a stub if it cannot */
+static void chargeBudget(emitter_t *e, int kind) {
+    aluImm(e, 1, EXT_CMP, reg(LEFT), e->len);
+    addStub(e, kind, 0, CC_B);
+    aluImm(e, 1, EXT_SUB, reg(LEFT), e->len);
+}
+
+/**
+ * @brief Leave the block for a known guest address
+ * @param e the emitter
+ * @param target the address
+ *
+ * A jump to the start of the block loops in place. Otherwise the registers
+ * are written back and the code jumps to the block of the target, or returns
+ * until that block is compiled.
+ */
+static void exitTo(emitter_t *e, uint32_t target) {
+    jit_t *jit = e->jit;
+    if (target == e->pc) {
+        chargeBudget(e, STUB_LOOP);
+        jump(e, e->loop);
+        return;
+    }
+    writeBack(e);
+    setExit(e, target, JIT_EXIT_BRANCH);
+    if (target < jit->words && jit->entries[target] != NULL) {
+        jump(e, jit->entries[target]);
+    } else {
+        uint8_t *rel = jump(e, jit->epilogue);
+        if (jit->nbrLinks == jit->capLinks) {
+            jitlink_t *links = realloc(jit->links, (jit->capLinks ? 2 * jit->capLinks : 64) * sizeof(jitlink_t));
+            if (links == NULL) {
+                return; // the exit stays unchained
+            }
+            jit->links = links;
+            jit->capLinks = jit->capLinks ? 2 * jit->capLinks : 64;
+        }
+        jit->links[jit->nbrLinks].target = target;
+        jit->links[jit->nbrLinks].jump = rel;
+        jit->nbrLinks++;
+    }
+}
+
+/** @brief Compute the address of a load or store into rax and check its bounds */
+static void effectiveAddress(emitter_t *e, const decoded_t *d, int k) {
+    loadGuest(e, RAX, d->rs1);
+    if (d->imm != 0) {
+        aluImm(e, 0, EXT_ADD, reg(RAX), (int32_t) d->imm);
+    }
+    /* 32-bit operations zero the upper half of rax: any address is below 2^32 */
+    if (e->jit->words < MAX_MEMSIZE) {
+        encode(e, 1, X_CMP, RAX, mem(CTX, offsetof(jitctx_t, memWords)));
+        addStub(e, STUB_FAULT, k, CC_AE);
+    }
+}
+
+/** @brief Register-register operation */
+static void emitBinary(emitter_t *e, int op, const decoded_t *d) {
+    /* Compute in the register of rd, unless that would overwrite rs2 before it is read */
+    int acc = (e->host[d->rd] >= 0 && (d->rd == d->rs1 || d->rd != d->rs2)) ? e->host[d->rd] : RAX;
+    loadGuest(e, acc, d->rs1);
+    encode(e, 0, op, acc, guest(e, d->rs2));
+    storeGuest(e, d->rd, acc);
+}
+
+/** @brief Register-immediate operation */
+static void emitImmediate(emitter_t *e, int ext, const decoded_t *d) {
+    int acc = accumulator(e, d->rd);
+    loadGuest(e, acc, d->rs1);
+    aluImm(e, 0, ext, reg(acc), (int32_t) d->imm);
+    storeGuest(e, d->rd, acc);
+}
+
+/** @brief Shift by a register (ext EXT_SHL or EXT_SAR) */
+static void emitShift(emitter_t *e, int ext, const decoded_t *d) {
+    int acc = accumulator(e, d->rd);
+    loadGuest(e, RCX, d->rs2);
+    loadGuest(e, acc, d->rs1);
+    encode(e, 0, X_SHIFT_CL, ext, reg(acc));
+    storeGuest(e, d->rd, acc);
+}
+
+/** @brief Shift by an immediate */
+static void emitShiftImm(emitter_t *e, int ext, const decoded_t *d) {
+    int acc = accumulator(e, d->rd);
+    loadGuest(e, acc, d->rs1);
+    encode(e, 0, X_SHIFT_IMM, ext, reg(acc));
+    byte(e, d->imm & 31);
+    storeGuest(e, d->rd, acc);
+}
+
+/** @brief Comparison, with rs2 or the immediate if imm is set */
+static void emitCompare(emitter_t *e, int cc, int imm, const decoded_t *d) {
+    loadGuest(e, RAX, d->rs1);
+    if (imm) {
+        aluImm(e, 0, EXT_CMP, reg(RAX), (int32_t) d->imm);
+    } else {
+        encode(e, 0, X_CMP, RAX, guest(e, d->rs2));
+    }
+    encode(e, 0, X_SETCC | cc, 0, reg(RAX));
+    encode(e, 0, X_MOVZX8, RAX, reg(RAX));
+    storeGuest(e, d->rd, RAX);
+}
+
+/** @brief Emit the out-of-line exits of the block */
+static void emitStubs(emitter_t *e) {
+    int i;
+    for (i = 0; i < e->nbrStubs; i++) {
+        stub_t *s = &e->stubs[i];
+        patch(s->jump, e->p);
+        switch (s->kind) {
+            case STUB_BUDGET:
+                setExit(e, e->pc, JIT_EXIT_BUDGET);
+                break;
+            case STUB_LOOP:
+                writeBack(e);
+                setExit(e, e->pc, JIT_EXIT_BUDGET);
+                break;
+            case STUB_FAULT:
+                /* Give back the instructions that did not run: the interpreter runs the faulting one */
+                aluImm(e, 1, EXT_ADD, reg(LEFT), e->len - s->k);
+                writeBack(e);
+                setExit(e, e->pc + s->k, JIT_EXIT_FAULT);
+                break;
+            case STUB_STORE:
+                if (e->len - s->k - 1 > 0) {
+                    aluImm(e, 1, EXT_ADD, reg(LEFT), e->len - s->k - 1);
+                }
+                encode(e, 1, X_MOV_STORE, RAX, mem(CTX, offsetof(jitctx_t, addr)));
+                writeBack(e);
+                setExit(e, e->pc + s->k + 1, JIT_EXIT_STORE);
+                break;
+            default:
+                break;
+        }
+        jump(e, e->jit->epilogue);
+    }
+}
+
+/** @brief 1 if the compiler can translate an opcode */
+static int compilable(int opcode) {
+    switch (opcode) {
+        case OPCODE_ADD: case OPCODE_ADDI: case OPCODE_SUB: case OPCODE_SUBI:
+        case OPCODE_MUL: case OPCODE_MULI:
+        case OPCODE_AND: case OPCODE_ANDI: case OPCODE_OR: case OPCODE_ORI:
+        case OPCODE_XOR: case OPCODE_XORI:
+        case OPCODE_SHL: case OPCODE_SHLI: case OPCODE_SHR: case OPCODE_SHRI:
+        case OPCODE_SLT: case OPCODE_SLTI: case OPCODE_SLE: case OPCODE_SLEI:
+        case OPCODE_SEQ: case OPCODE_SEQI:
+        case OPCODE_LOAD: case OPCODE_STORE:
+        case OPCODE_JMPR: case OPCODE_JMPI: case OPCODE_BRAZ: case OPCODE_BRANZ:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/** @brief Count the uses of guest registers by an instruction */
+static void countUses(const decoded_t *d, int *uses) {
+    switch (opcodeType(d->opcode)) {
+        case TYPE_R:
+            uses[d->rd]++;
+            uses[d->rs1]++;
+            uses[d->rs2]++;
+            break;
+        case TYPE_I:
+        case TYPE_JR:
+            uses[d->rd]++;
+            uses[d->rs1]++;
+            break;
+        case TYPE_JI:
+            uses[d->rd]++;
+            break;
+        case TYPE_B:
+            uses[d->rs1]++;
+            break;
+        default:
+            break;
+    }
+}
+
+/** @brief Hold the guest registers used most in host registers */
+static void pinRegisters(emitter_t *e, const int *uses) {
+    int picked[NBR_REGS] = { 0 };
+    int i, g;
+    for (g = 0; g < NBR_REGS; g++) {
+        e->host[g] = -1;
+    }
+    for (i = 0; i < NBR_PINNABLE; i++) {
+        int best = -1;
+        for (g = 0; g < NBR_REGS; g++) {
+            if (!picked[g] && uses[g] >= 2 && (best < 0 || uses[g] > uses[best])) {
+                best = g;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        picked[best] = 1;
+        e->host[best] = pinnable[i];
+    }
+}
+
+/** @brief Emit the jump or branch ending a block */
+static void emitTerminator(emitter_t *e, const decoded_t *d, uint32_t pc) {
+    uint8_t *taken;
+    switch (d->opcode) {
+        case OPCODE_JMPI:
+            movImm(e, guest(e, d->rd), pc + 1);
+            e->written[d->rd] = 1;
+            exitTo(e, d->addr);
+            break;
+        case OPCODE_JMPR:
+            /* rd is written before ra is read, as in the interpreter */
+            movImm(e, guest(e, d->rd), pc + 1);
+            e->written[d->rd] = 1;
+            loadGuest(e, RAX, d->rs1);
+            writeBack(e);
+            encode(e, 0, X_MOV_STORE, RAX, mem(CTX, offsetof(jitctx_t, pc)));
+            jump(e, e->jit->epilogue);
+            break;
+        case OPCODE_BRAZ:
+        case OPCODE_BRANZ:
+            if (e->host[d->rs1] >= 0) {
+                encode(e, 0, X_TEST, e->host[d->rs1], reg(e->host[d->rs1]));
+            } else {
+                aluImm(e, 0, EXT_CMP, guest(e, d->rs1), 0);
+            }
+            taken = jumpIf(e, d->opcode == OPCODE_BRAZ ? CC_E : CC_NE);
+            exitTo(e, pc + 1);
+            patch(taken, e->p);
+            exitTo(e, d->addr);
+            break;
+        default:
+            /* The block stopped before an instruction it cannot run */
+            exitTo(e, pc + 1);
+            break;
+    }
+}
+
+/** @brief Emit the code of one instruction of the body */
+static void emitInstr(emitter_t *e, const decoded_t *d, int k) {
+    int acc;
+    switch (d->opcode) {
+        case OPCODE_ADD: emitBinary(e, X_ADD, d); break;
+        case OPCODE_SUB: emitBinary(e, X_SUB, d); break;
+        case OPCODE_MUL: emitBinary(e, X_IMUL, d); break;
+        case OPCODE_AND: emitBinary(e, X_AND, d); break;
+        case OPCODE_OR: emitBinary(e, X_OR, d); break;
+        case OPCODE_XOR: emitBinary(e, X_XOR, d); break;
+        case OPCODE_ADDI: emitImmediate(e, EXT_ADD, d); break;
+        case OPCODE_SUBI: emitImmediate(e, EXT_SUB, d); break;
+        case OPCODE_ANDI: emitImmediate(e, EXT_AND, d); break;
+        case OPCODE_ORI: emitImmediate(e, EXT_OR, d); break;
+        case OPCODE_XORI: emitImmediate(e, EXT_XOR, d); break;
+        case OPCODE_MULI:
+            acc = accumulator(e, d->rd);
+            encode(e, 0, X_IMUL_IMM, acc, guest(e, d->rs1));
+            dword(e, d->imm);
+            storeGuest(e, d->rd, acc);
+            break;
+        case OPCODE_SHL: emitShift(e, EXT_SHL, d); break;
+        case OPCODE_SHR: emitShift(e, EXT_SAR, d); break;
+        case OPCODE_SHLI: emitShiftImm(e, EXT_SHL, d); break;
+        case OPCODE_SHRI: emitShiftImm(e, EXT_SAR, d); break;
+        /* The immediate is unsigned, so the interpreter compares it unsigned */
+        case OPCODE_SLT: emitCompare(e, CC_L, 0, d); break;
+        case OPCODE_SLTI: emitCompare(e, CC_B, 1, d); break;
+        case OPCODE_SLE: emitCompare(e, CC_LE, 0, d); break;
+        case OPCODE_SLEI: emitCompare(e, CC_BE, 1, d); break;
+        case OPCODE_SEQ: emitCompare(e, CC_E, 0, d); break;
+        case OPCODE_SEQI: emitCompare(e, CC_E, 1, d); break;
+        case OPCODE_LOAD:
+            effectiveAddress(e, d, k);
+            acc = accumulator(e, d->rd);
+            encode(e, 0, X_MOV_LOAD, acc, memIndex(MEM, RAX, 4, 0));
+            storeGuest(e, d->rd, acc);
+            break;
+        case OPCODE_STORE:
+            effectiveAddress(e, d, k);
+            /* The interpreter holds the pages stored to for the first time */
+            encode(e, 0, X_MOV_LOAD, RDX, reg(RAX));
+            encode(e, 0, X_SHIFT_IMM, EXT_SHR, reg(RDX));
+            byte(e, GUEST_PAGE_SHIFT);
+            byte(e, 0x48);      // mov rcx, imm64
+            byte(e, 0xB9);
+            qword(e, (uint64_t) (uintptr_t) e->jit->touched);
+            encode(e, 0, X_CMP_IMM8, EXT_CMP, memIndex(RCX, RDX, 1, 0));
+            byte(e, 0);
+            addStub(e, STUB_FAULT, k, CC_E);
+            if (e->host[d->rd] >= 0) {
+                acc = e->host[d->rd];
+            } else {
+                acc = RCX;
+                loadGuest(e, RCX, d->rd);
+            }
+            encode(e, 0, X_MOV_STORE, acc, memIndex(MEM, RAX, 4, 0));
+            /* Mark the block dirty for the dumps */
+            encode(e, 0, X_MOV_LOAD, RDX, reg(RAX));
+            encode(e, 0, X_SHIFT_IMM, EXT_SHR, reg(RDX));
+            byte(e, DUMP_BLOCK_SHIFT);
+            byte(e, 0x48);      // mov rcx, imm64
+            byte(e, 0xB9);
+            qword(e, (uint64_t) (uintptr_t) e->jit->dirty);
+            encode(e, 0, X_MOV_IMM8, 0, memIndex(RCX, RDX, 1, 0));
+            byte(e, 1);
+            /* A decoded word may be code: let the caller invalidate it */
+            encode(e, 1, X_IMUL_IMM, RDX, reg(RAX));
+            dword(e, sizeof(decoded_t));
+            byte(e, 0x48);      // mov rcx, imm64
+            byte(e, 0xB9);
+            qword(e, (uint64_t) (uintptr_t) &e->jit->dcache->ready);
+            encode(e, 0, X_CMP_IMM8, EXT_CMP, memIndex(RCX, RDX, 1, 0));
+            byte(e, 0);
+            addStub(e, STUB_STORE, k, CC_NE);
+            break;
+        default:
+            break;
+    }
+}
+
+/** @brief Emit the trampoline entering native code and the epilogue leaving it */
+static void emitTrampoline(jit_t *jit) {
+    emitter_t e;
+    static const uint8_t enter[] = {
+        0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,    // push rbx, rbp, r12-r15
+    };
+    static const uint8_t leave[] = {
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B,    // pop r15-r12, rbp, rbx
+        0xC3,                                                          // ret
+    };
+    memset(&e, 0, sizeof(e));
+    e.jit = jit;
+    e.p = jit->code;
+    /* void enter(jitctx_t *ctx (rdi), void *code (rsi)) */
+    memcpy(e.p, enter, sizeof(enter));
+    e.p += sizeof(enter);
+    encode(&e, 1, X_MOV_LOAD, CTX, reg(RDI));
+    encode(&e, 1, X_MOV_LOAD, REGS, mem(CTX, offsetof(jitctx_t, regs)));
+    encode(&e, 1, X_MOV_LOAD, MEM, mem(CTX, offsetof(jitctx_t, mem)));
+    encode(&e, 1, X_MOV_LOAD, LEFT, mem(CTX, offsetof(jitctx_t, left)));
+    encode(&e, 0, X_JMP_RM, 4, reg(RSI));
+    jit->epilogue = e.p;
+    encode(&e, 1, X_MOV_STORE, LEFT, mem(CTX, offsetof(jitctx_t, left)));
+    memcpy(e.p, leave, sizeof(leave));
+    e.p += sizeof(leave);
+    jit->codeBase = jit->codeUsed = e.p - jit->code;
+}
+
+jit_t *jitCreate(uint64_t words, decoded_t *dcache, uint8_t *dirty, const uint8_t *touched) {
+    jit_t *jit = calloc(1, sizeof(jit_t));
+    if (jit == NULL) {
+        return NULL;
+    }
+    jit->words = words;
+    jit->dcache = dcache;
+    jit->dirty = dirty;
+    jit->touched = touched;
+    jit->entriesBytes = words * sizeof(void *);
+    jit->countsBytes = words * sizeof(uint16_t);
+    jit->coveredBytes = words;
+    jit->entries = mapTable(jit->entriesBytes, PROT_READ | PROT_WRITE);
+    jit->counts = mapTable(jit->countsBytes, PROT_READ | PROT_WRITE);
+    jit->covered = mapTable(jit->coveredBytes, PROT_READ | PROT_WRITE);
+    jit->code = mapTable(JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC);
+    if (jit->entries == NULL || jit->counts == NULL || jit->covered == NULL || jit->code == NULL) {
+        jitDestroy(jit);
+        return NULL;
+    }
+    emitTrampoline(jit);
+    return jit;
+}
+
+void *jitCompile(jit_t *jit, uint32_t pc, const u_int32_t *image) {
+    emitter_t e;
+    int uses[NBR_REGS] = { 0 };
+    const decoded_t *last = NULL;
+    uint8_t *entry;
+    uint64_t i;
+    int k;
+
+    /* Find the extent of the block */
+    memset(&e, 0, sizeof(e));
+    e.jit = jit;
+    e.pc = pc;
+    for (i = pc; i < jit->words && e.len < JIT_MAX_BLOCK; i++) {
+        decoded_t *d = &jit->dcache[i];
+        if (!d->ready) {
+            decodeInstr(image[i], d);
+        }
+        if (!compilable(d->opcode)) {
+            break;
+        }
+        countUses(d, uses);
+        e.len++;
+        if (opcodeType(d->opcode) == TYPE_JR || opcodeType(d->opcode) == TYPE_JI || opcodeType(d->opcode) == TYPE_B) {
+            last = d;
+            break;
+        }
+    }
+    if (e.len == 0) {
+        jit->counts[pc] = JIT_NEVER;
+        return NULL;
+    }
+    if (jit->codeUsed + (size_t) (e.len + 2) * MAX_INSTR_BYTES > JIT_CODE_SIZE) {
+        jitFlush(jit);
+    }
+    if (jit->nbrBlocks == jit->capBlocks) {
+        jitblock_t *blocks = realloc(jit->blocks, (jit->capBlocks ? 2 * jit->capBlocks : 64) * sizeof(jitblock_t));
+        if (blocks == NULL) {
+            return NULL;
+        }
+        jit->blocks = blocks;
+        jit->capBlocks = jit->capBlocks ? 2 * jit->capBlocks : 64;
+    }
+
+    /* Entry: budget, then the pinned registers */
+    pinRegisters(&e, uses);
+    entry = e.p = jit->code + jit->codeUsed;
+    chargeBudget(&e, STUB_BUDGET);
+    for (k = 0; k < NBR_REGS; k++) {
+        if (e.host[k] >= 0) {
+            encode(&e, 0, X_MOV_LOAD, e.host[k], mem(REGS, 4 * k));
+        }
+    }
+    e.loop = e.p;
+
+    /* Body and exits */
+    for (k = 0; k < e.len - (last != NULL); k++) {
+        emitInstr(&e, &jit->dcache[pc + k], k);
+    }
+    emitTerminator(&e, last != NULL ? last : &jit->dcache[pc + e.len - 1], pc + e.len - 1);
+    emitStubs(&e);
+    jit->codeUsed = e.p - jit->code;
+
+    /* Register the block and chain the exits waiting for it */
+    jit->entries[pc] = entry;
+    memset(jit->covered + pc, 1, e.len);
+    jit->blocks[jit->nbrBlocks].start = pc;
+    jit->blocks[jit->nbrBlocks].len = e.len;
+    jit->nbrBlocks++;
+    for (k = 0; k < jit->nbrLinks; k++) {
+        if (jit->links[k].target == pc) {
+            patch(jit->links[k].jump, entry);
+            jit->links[k--] = jit->links[--jit->nbrLinks];
+        }
+    }
+    return entry;
+}
+
+void jitRun(jit_t *jit, void *code, jitctx_t *ctx) {
+    void (*enter)(jitctx_t *, void *) = (void (*)(jitctx_t *, void *)) (void *) jit->code;
+    enter(ctx, code);
+}
+
+#else
+
+jit_t *jitCreate(uint64_t words, decoded_t *dcache, uint8_t *dirty, const uint8_t *touched) {
+    (void) words;
+    (void) dcache;
+    (void) dirty;
+    (void) touched;
+    (void) mapTable;
+    return NULL;
+}
+
+void *jitCompile(jit_t *jit, uint32_t pc, const u_int32_t *mem) {
+    (void) jit;
+    (void) pc;
+    (void) mem;
+    return NULL;
+}
+
+void jitRun(jit_t *jit, void *code, jitctx_t *ctx) {
+    (void) jit;
+    (void) code;
+    (void) ctx;
+}
+
+#endif
+
+void jitDestroy(jit_t *jit) {
+    if (jit == NULL) {
+        return;
+    }
+    if (jit->entries != NULL) {
+        munmap(jit->entries, jit->entriesBytes);
+    }
+    if (jit->counts != NULL) {
+        munmap(jit->counts, jit->countsBytes);
+    }
+    if (jit->covered != NULL) {
+        munmap(jit->covered, jit->coveredBytes);
+    }
+    if (jit->code != NULL) {
+        munmap(jit->code, JIT_CODE_SIZE);
+    }
+    free(jit->blocks);
+    free(jit->links);
+    free(jit);
+}
+
+void jitFlush(jit_t *jit) {
+    int i;
+    for (i = 0; i < jit->nbrBlocks; i++) {
+        jit->entries[jit->blocks[i].start] = NULL;
+        memset(jit->covered + jit->blocks[i].start, 0, jit->blocks[i].len);
+    }
+    jit->nbrBlocks = 0;
+    jit->nbrLinks = 0;
+    jit->codeUsed = jit->codeBase;
+}
+
+void jitReset(jit_t *jit) {
+    jitFlush(jit);
+    madvise(jit->counts, jit->countsBytes, MADV_DONTNEED);
+}
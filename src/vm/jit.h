@@ -0,0 +1,165 @@
+/** \headerfile jit.h "jit.h"
+ *  \brief Basic-block compiler to native code
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The tiered engine interprets the program and counts how often each target
+ * of JMPI, BRAZ and BRANZ is reached. Once a target is hot, the basic block
+ * starting there is compiled to native code, with the guest registers it
+ * uses most held in host registers. Compiled blocks jump straight to each
+ * other, and hand back to the interpreter for code they cannot run: system
+ * calls, divisions, stop, stores to words that have been decoded, and the
+ * first store to each page of memory, which the interpreter counts against
+ * the memory limit. The headers of the loops found in the control-flow graph
+ * (see cfg.h) become hot after fewer runs than the other targets.
+ *
+ * Only x86-64 has a code generator; elsewhere jitCreate fails and the
+ * tiered engine is not available.
+ */
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+#include "isa.h"
+
+/* Why the native code returned */
+#define JIT_EXIT_BRANCH 0   // reached a guest address that is not compiled
+#define JIT_EXIT_STORE 1    // stored to a decoded word at addr: the caller must invalidate it
+#define JIT_EXIT_FAULT 2    // stopped before a load or store out of bounds, or the first store to a page, for the interpreter to run
+#define JIT_EXIT_BUDGET 3   // not enough budget left for the next block
+
+/* Count of a target whose block cannot be compiled */
+#define JIT_NEVER 0xFFFF
+
+/** @brief State shared with the native code */
+typedef struct {
+    int *regs;          // guest registers
+    u_int32_t *mem;     // guest memory
+    uint64_t memWords;  // size of mem in words
+    uint64_t left;      // instructions left in the budget, updated by the native code
+    uint64_t addr;      // address of the store, for JIT_EXIT_STORE
+    uint32_t pc;        // next guest instruction when the native code returns
+    uint32_t reason;    // JIT_EXIT_*
+} jitctx_t;
+
+/** @brief An exit of a block waiting for its target to be compiled */
+typedef struct {
+    uint32_t target;
+    uint8_t *jump;      // rel32 of the jump to patch
+} jitlink_t;
+
+/** @brief A compiled block */
+typedef struct {
+    uint32_t start;
+    uint32_t len;       // number of guest instructions
+} jitblock_t;
+
+/** @brief Compiled code and the counters deciding what to compile */
+typedef struct {
+    uint64_t words;     // size of guest memory
+    decoded_t *dcache;  // decoded instruction cache of the VM
+    uint8_t *dirty;     // dirty blocks of the VM, marked by native stores (see dump.h)
+    const uint8_t *touched; // pages the program holds: native stores leave the others to the interpreter
+    void **entries;     // native entry of each guest address, NULL if not compiled
+    uint16_t *counts;   // times each address was reached as a branch target
+    uint8_t *covered;   // 1 for each guest word inside a compiled block
+    size_t entriesBytes;
+    size_t countsBytes;
+    size_t coveredBytes;
+
+    uint8_t *code;      // executable buffer: trampoline, then the blocks
+    size_t codeUsed;
+    size_t codeBase;    // start of the blocks in code
+    uint8_t *epilogue;  // return from native code to C
+
+    jitblock_t *blocks;
+    int nbrBlocks;
+    int capBlocks;
+    jitlink_t *links;
+    int nbrLinks;
+    int capLinks;
+} jit_t;
+
+/** @brief Create a compiler for a memory of the given size
+ * @param words size of guest memory
+ * @param dcache decoded instruction cache of the VM
+ * @param dirty dirty blocks of the VM, one byte per DUMP_BLOCK_WORDS words
+ * @param touched pages the program holds, one byte per GUEST_PAGE_WORDS words
+ * @return the compiler, or NULL if out of memory or if the host has no code generator
+ */
+jit_t *jitCreate(uint64_t words, decoded_t *dcache, uint8_t *dirty, const uint8_t *touched);
+
+/** @brief Free a compiler and its code */
+void jitDestroy(jit_t *jit);
+
+/** @brief Drop all the compiled code, keeping the counters */
+void jitFlush(jit_t *jit);
+
+/** @brief Drop all the compiled code and the counters, before loading a program */
+void jitReset(jit_t *jit);
+
+/**
+ * @brief Compile the block starting at an address
+ * @param jit the compiler
+ * @param pc address of the block
+ * @param image guest memory
+ * @return the native entry of the block, or NULL if it cannot be compiled
+ */
+void *jitCompile(jit_t *jit, uint32_t pc, const u_int32_t *image);
+
+/**
+ * @brief Run compiled code until it reaches code that is not compiled
+ * @param jit the compiler
+ * @param code native entry to start at
+ * @param ctx guest state: left and reason are updated, pc is set
+ */
+void jitRun(jit_t *jit, void *code, jitctx_t *ctx);
+
+/**
+ * @brief Drop the compiled code of a word that was written
+ * @param jit the compiler
+ * @param addr address of the word, in bounds
+ */
+static inline void jitInvalidate(jit_t *jit, uint32_t addr) {
+    if (jit->covered[addr]) {
+        jitFlush(jit);
+    }
+}
+
+/**
+ * @brief Make a loop header hot after JIT_LOOP_THRESHOLD branches to it
+ * @param jit the compiler, with the counters of the program
+ * @param pc the header
+ */
+static inline void jitHintLoop(jit_t *jit, uint32_t pc) {
+    if (pc < jit->words && jit->counts[pc] < JIT_THRESHOLD - JIT_LOOP_THRESHOLD) {
+        jit->counts[pc] = JIT_THRESHOLD - JIT_LOOP_THRESHOLD;
+    }
+}
+
+/**
+ * @brief Count a branch to an address
+ * @param jit the compiler
+ * @param pc the target of the branch
+ * @return 1 if the block at pc is compiled or just became hot, 0 otherwise
+ */
+static inline int jitHotTarget(jit_t *jit, uint32_t pc) {
+    if (pc >= jit->words) {
+        return 0;
+    }
+    if (jit->entries[pc] != NULL) {
+        return 1;
+    }
+    if (jit->counts[pc] < JIT_THRESHOLD) {
+        jit->counts[pc]++;
+        return 0;
+    }
+    return jit->counts[pc] == JIT_THRESHOLD;
+}
+
+#endif
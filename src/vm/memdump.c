@@ -0,0 +1,329 @@
+/** @file memdump.c
+ * @brief Reader of the memory dumps of the virtual machine.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Prints the dumps saved by vm_dump_mem, eight words per line with their
+ * address as a number and as label+offset. With --diff, the first dump is the
+ * base and each next one is applied over it: only the words it changed are
+ * printed, with their old and new values.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "constants.h"
+#include "dump.h"
+#include "symbols.h"
+
+/* Words printed per line */
+#define LINE_WORDS 8
+
+/** @brief A dump read into memory */
+typedef struct {
+    dumpheader_t h;
+    char *name;
+    char *symtext;
+    uint8_t *regions;   // the regions, each a dumpregion_t followed by its words
+    size_t bytes;       // size of regions
+} dump_t;
+
+/** @brief Read a field of the dump of the given size
+ * @return the field, null-terminated, or NULL if out of memory or the file is truncated
+ */
+static char *readField(FILE *f, uint32_t bytes) {
+    char *field = malloc(bytes + 1);
+    if (field != NULL && fread(field, 1, bytes, f) != bytes) {
+        free(field);
+        return NULL;
+    }
+    if (field != NULL) {
+        field[bytes] = '\0';
+    }
+    return field;
+}
+
+/** @brief Read the rest of a file
+ * @param f the file
+ * @param bytes set to the size read
+ * @return the data, or NULL if out of memory
+ */
+static uint8_t *readRest(FILE *f, size_t *bytes) {
+    size_t size = 64 << 10;
+    uint8_t *data = malloc(size);
+    size_t n;
+    *bytes = 0;
+    while (data != NULL && (n = fread(data + *bytes, 1, size - *bytes, f)) > 0) {
+        *bytes += n;
+        if (*bytes == size) {
+            uint8_t *grown = realloc(data, size * 2);
+            if (grown == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            size *= 2;
+        }
+    }
+    return data;
+}
+
+/** @brief Free what readDump allocated */
+static void freeDump(dump_t *d) {
+    free(d->name);
+    free(d->symtext);
+    free(d->regions);
+}
+
+/** @brief Find the next region of a dump
+ * @param d the dump
+ * @param offset offset of the region in the regions of the dump, moved past it
+ * @param r set to the header of the region
+ * @return the words of the region, or NULL if the dump is truncated or the region out of memory
+ */
+static const u_int32_t *nextRegion(const dump_t *d, size_t *offset, dumpregion_t *r) {
+    const u_int32_t *words;
+    if (d->bytes - *offset < sizeof(*r)) {
+        return NULL;
+    }
+    memcpy(r, d->regions + *offset, sizeof(*r));
+    if (r->addr > d->h.memWords || r->words > d->h.memWords - r->addr
+        || r->words > (d->bytes - *offset - sizeof(*r)) / sizeof(u_int32_t)) {
+        return NULL;
+    }
+    words = (const u_int32_t *) (d->regions + *offset + sizeof(*r));
+    *offset += sizeof(*r) + r->words * sizeof(u_int32_t);
+    return words;
+}
+
+/** @brief Read a dump
+ * @param d the dump
+ * @param filename the name of the file
+ * @return 0 on success, -1 after printing an error
+ */
+static int readDump(dump_t *d, const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    memset(d, 0, sizeof(*d));
+    if (f == NULL) {
+        printf("Error: Could not open dump %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fread(&d->h, sizeof(d->h), 1, f) != 1 || d->h.magic != DUMP_MAGIC || d->h.version != DUMP_VERSION
+        || d->h.headerWords * sizeof(uint32_t) < sizeof(d->h)) {
+        printf("Error: %s is not a memory dump\n", filename);
+        fclose(f);
+        return -1;
+    }
+    fseek(f, (long) (d->h.headerWords * sizeof(uint32_t) - sizeof(d->h)), SEEK_CUR);
+    d->name = readField(f, d->h.nameBytes);
+    d->symtext = readField(f, d->h.symBytes);
+    d->regions = readRest(f, &d->bytes);
+    fclose(f);
+    if (d->name == NULL || d->symtext == NULL || d->regions == NULL) {
+        printf("Error: Could not read dump %s\n", filename);
+        freeDump(d);
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Print the words of a dump
+ * @param d the dump
+ * @param syms symbol table, may be NULL
+ */
+static void printDump(const dump_t *d, const symbols_t *syms) {
+    char location[64];
+    dumpregion_t r;
+    const u_int32_t *words;
+    size_t offset = 0;
+    uint64_t n, i;
+    printf("=== %s DUMP %llu OF %s AT STEP %llu, PC %d: %llu REGIONS ===\n",
+           (d->h.flags & DUMP_FULL) ? "FULL" : "INCREMENTAL", (unsigned long long) d->h.sequence, d->name,
+           (unsigned long long) d->h.steps, d->h.pc, (unsigned long long) d->h.regions);
+    for (n = 0; n < d->h.regions; n++) {
+        if ((words = nextRegion(d, &offset, &r)) == NULL) {
+            printf("Error: Dump is truncated after %llu regions\n", (unsigned long long) n);
+            return;
+        }
+        for (i = 0; i < r.words; i++) {
+            if (i % LINE_WORDS == 0) {
+                symbolsFormat(syms, (uint32_t) (r.addr + i), location, sizeof(location));
+                printf("%s%10llu  %-20s", i > 0 ? "\n" : "", (unsigned long long) (r.addr + i), location);
+            }
+            printf(" %11d", (int) words[i]);
+        }
+        printf("\n");
+    }
+}
+
+/** @brief Print a word a dump changes, and apply it
+ * @return 1 if the word changed, 0 otherwise
+ */
+static int changeWord(u_int32_t *mem, uint64_t addr, u_int32_t value, const symbols_t *syms) {
+    char location[64];
+    if (mem[addr] == value) {
+        return 0;
+    }
+    symbolsFormat(syms, (uint32_t) addr, location, sizeof(location));
+    printf("%10llu  %-20s %11d -> %d\n", (unsigned long long) addr, location, (int) mem[addr], (int) value);
+    mem[addr] = value;
+    return 1;
+}
+
+/** @brief Print the words a dump changes, and apply them
+ * @param d the dump
+ * @param mem memory as of the previous dump
+ * @param syms symbol table, may be NULL
+ * @return 0 on success, -1 if the dump is truncated
+ */
+static int diffDump(const dump_t *d, u_int32_t *mem, const symbols_t *syms) {
+    dumpregion_t r;
+    const u_int32_t *words;
+    size_t offset = 0;
+    uint64_t changed = 0;
+    uint64_t next = 0;  // first word after the previous region
+    uint64_t n, i;
+    printf("=== CHANGES OF DUMP %llu AT STEP %llu, PC %d ===\n", (unsigned long long) d->h.sequence,
+           (unsigned long long) d->h.steps, d->h.pc);
+    for (n = 0; n < d->h.regions; n++) {
+        if ((words = nextRegion(d, &offset, &r)) == NULL) {
+            printf("Error: Dump is truncated after %llu regions\n", (unsigned long long) n);
+            return -1;
+        }
+        /* Memory between the regions of a full dump is zero */
+        for (i = next; (d->h.flags & DUMP_FULL) && i < r.addr; i++) {
+            changed += changeWord(mem, i, 0, syms);
+        }
+        for (i = 0; i < r.words; i++) {
+            changed += changeWord(mem, r.addr + i, words[i], syms);
+        }
+        next = r.addr + r.words;
+    }
+    for (i = next; (d->h.flags & DUMP_FULL) && i < d->h.memWords; i++) {
+        changed += changeWord(mem, i, 0, syms);
+    }
+    printf("=== %llu WORDS CHANGED ===\n", (unsigned long long) changed);
+    return 0;
+}
+
+/** @brief Apply the words of a dump, without printing them
+ * @return 0 on success, -1 if the dump is truncated
+ */
+static int applyDump(const dump_t *d, u_int32_t *mem) {
+    dumpregion_t r;
+    const u_int32_t *words;
+    size_t offset = 0;
+    uint64_t n;
+    for (n = 0; n < d->h.regions; n++) {
+        if ((words = nextRegion(d, &offset, &r)) == NULL) {
+            printf("Error: Dump is truncated after %llu regions\n", (unsigned long long) n);
+            return -1;
+        }
+        memcpy(mem + r.addr, words, r.words * sizeof(u_int32_t));
+    }
+    return 0;
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if error, 0 if success
+ *
+ * ./vm-memdump [--symbols file] [--diff] <dump file>...
+ *
+ * --symbols reads the symbol file written by the assembler; by default, the
+ * symbol table saved with the first dump is used.
+ * --diff prints the words each dump changes over the previous ones instead
+ * of all its words. The first dump is the base, best a full one: memory it
+ * does not hold reads as zero.
+ */
+int main(int argc, char **argv) {
+    int i;
+    int diff = 0;
+    char *symfile = NULL;
+    char **files = calloc(argc, sizeof(char *));
+    int nbrFiles = 0;
+    dump_t d;
+    symbols_t syms;
+    int loaded = 0;
+    u_int32_t *mem = NULL;
+    size_t memBytes = 0;
+    uint64_t memWords = 0;
+    int ret = EXIT_SUCCESS;
+    if (files == NULL) {
+        printf("Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symfile = argv[++i];
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            diff = 1;
+        } else {
+            files[nbrFiles++] = argv[i];
+        }
+    }
+    if (nbrFiles == 0 || (diff && nbrFiles < 2)) {
+        printf("Error: %s\n", nbrFiles == 0 ? "No dump file specified" : "--diff needs a base and a dump");
+        printf("Usage: %s [--symbols file] [--diff] <dump file>...\n", argv[0]);
+        free(files);
+        return EXIT_FAILURE;
+    }
+    if (symfile != NULL) {
+        if (symbolsLoad(&syms, symfile) < 0) {
+            printf("Error: Could not read symbol file %s\n", symfile);
+        } else {
+            loaded = 1;
+        }
+    }
+
+    for (i = 0; i < nbrFiles && ret == EXIT_SUCCESS; i++) {
+        if (readDump(&d, files[i]) < 0) {
+            ret = EXIT_FAILURE;
+            break;
+        }
+        if (symfile == NULL && !loaded && d.h.symBytes > 0 && symbolsParse(&syms, d.symtext, d.h.symBytes) == 0) {
+            loaded = 1;
+        }
+        if (!diff) {
+            printDump(&d, loaded ? &syms : NULL);
+        } else if (i == 0) {
+            /* Memory as of the base, populated as the dumps touch it */
+            memWords = d.h.memWords;
+            memBytes = memWords * sizeof(u_int32_t);
+            mem = mmap(NULL, memBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (mem == MAP_FAILED) {
+                printf("Error: Could not allocate a memory of %llu words\n", (unsigned long long) memWords);
+                mem = NULL;
+                ret = EXIT_FAILURE;
+            } else if (applyDump(&d, mem) < 0) {
+                ret = EXIT_FAILURE;
+            } else {
+                printf("=== BASE: %s DUMP %llu OF %s AT STEP %llu, PC %d ===\n",
+                       (d.h.flags & DUMP_FULL) ? "FULL" : "INCREMENTAL", (unsigned long long) d.h.sequence,
+                       d.name, (unsigned long long) d.h.steps, d.h.pc);
+            }
+        } else if (d.h.memWords != memWords) {
+            printf("Error: %s is a dump of a memory of %llu words, not %llu\n", files[i],
+                   (unsigned long long) d.h.memWords, (unsigned long long) memWords);
+            ret = EXIT_FAILURE;
+        } else if (diffDump(&d, mem, loaded ? &syms : NULL) < 0) {
+            ret = EXIT_FAILURE;
+        }
+        freeDump(&d);
+    }
+
+    if (loaded) {
+        symbolsFree(&syms);
+    }
+    if (mem != NULL) {
+        munmap(mem, memBytes);
+    }
+    free(files);
+    return ret;
+}
@@ -0,0 +1,46 @@
+/** \headerfile object.h "object.h"
+ *  \brief Object files written by the assembler
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * An object file is a header followed by its sections, all little-endian:
+ *  - the code, loaded at address 0,
+ *  - the data, loaded at dataAddr,
+ *  - an optional symbol table, in the text format of symbols.h,
+ *  - an optional control-flow graph of the code, as the cfgblock_t of cfg.h.
+ * Sections are raw words, ready to be copied (or mapped, when the assembler
+ * aligns them on pages) into memory as they are. Files without the magic
+ * number are raw images, loaded at address 0.
+ *
+ * Headers of OBJ_HEADER_MIN words, written before the graph was added, end
+ * with symBytes: the VM builds the graph of their code itself.
+ */
+
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <stdint.h>
+
+#define OBJ_MAGIC 0x4F4D5641    // "AVMO"
+#define OBJ_VERSION 1
+#define OBJ_HEADER_MIN 10       // words of the smallest header, up to symBytes
+
+/** @brief Header at the start of an object file */
+typedef struct {
+    uint32_t magic;         // OBJ_MAGIC
+    uint16_t version;       // OBJ_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    uint32_t entry;         // address of the first instruction to run
+    uint32_t codeOffset;    // offset of the code in the file, in bytes
+    uint32_t codeWords;
+    uint32_t dataOffset;    // offset of the data in the file, in bytes
+    uint32_t dataAddr;      // address the data is loaded at
+    uint32_t dataWords;
+    uint32_t symOffset;     // offset of the symbol table in the file, in bytes
+    uint32_t symBytes;      // size of the symbol table, 0 if there is none
+    uint32_t cfgOffset;     // offset of the control-flow graph in the file, in bytes
+    uint32_t cfgBytes;      // size of the graph, 0 if there is none
+} objheader_t;
+
+#endif
@@ -0,0 +1,67 @@
+/** @file output.c
+ * @brief Buffered output of the syscalls.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+int outputInit(output_t *o) {
+    o->buf = malloc(OUTPUT_BUFSIZE);
+    o->len = 0;
+    o->sink = outputFile;
+    o->ctx = stdout;
+    return o->buf == NULL ? -1 : 0;
+}
+
+void outputFree(output_t *o) {
+    if (o->buf != NULL) {
+        outputFlush(o);
+        free(o->buf);
+        o->buf = NULL;
+    }
+}
+
+void outputFlush(output_t *o) {
+    if (o->len > 0) {
+        o->sink(o->ctx, o->buf, o->len);
+        o->len = 0;
+    }
+}
+
+void outputWrite(output_t *o, const char *data, size_t len) {
+    if (o->len + len > OUTPUT_BUFSIZE) {
+        outputFlush(o);
+        if (len > OUTPUT_BUFSIZE) {
+            o->sink(o->ctx, data, len);
+            return;
+        }
+    }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+}
+
+void outputInt(output_t *o, int value) {
+    char tmp[12];
+    char *p = tmp + sizeof(tmp);
+    unsigned int u = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+    do {
+        *--p = (char) ('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (value < 0) {
+        *--p = '-';
+    }
+    outputWrite(o, p, tmp + sizeof(tmp) - p);
+}
+
+void outputFile(void *ctx, const char *data, size_t len) {
+    FILE *f = ctx;
+    fwrite(data, 1, len, f);
+    fflush(f);
+}
@@ -0,0 +1,57 @@
+/** \headerfile output.h "output.h"
+ *  \brief Buffered output of the syscalls
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * Syscalls append their text to a large buffer, which is handed to a sink
+ * only when it is full, when the guest waits for input, or when vm_run
+ * returns. Programs printing one character per syscall thus cost one
+ * memory write per character instead of one stdio call.
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+
+#include "constants.h"
+#include "vm.h"
+
+/** @brief Output buffer and the sink it is flushed to */
+typedef struct {
+    char *buf;          // OUTPUT_BUFSIZE bytes
+    size_t len;         // bytes waiting in buf
+    vm_output_fn sink;  // receives the flushed bytes
+    void *ctx;          // passed to sink
+} output_t;
+
+/** @brief Allocate the buffer, flushed to stdout by default
+ * @return 0 on success, -1 if out of memory
+ */
+int outputInit(output_t *o);
+
+/** @brief Flush and free the buffer */
+void outputFree(output_t *o);
+
+/** @brief Hand the buffered bytes to the sink */
+void outputFlush(output_t *o);
+
+/** @brief Append bytes to the buffer */
+void outputWrite(output_t *o, const char *data, size_t len);
+
+/** @brief Append a decimal integer to the buffer */
+void outputInt(output_t *o, int value);
+
+/** @brief Sink writing to a FILE *, given as ctx */
+void outputFile(void *ctx, const char *data, size_t len);
+
+/** @brief Append one character to the buffer */
+static inline void outputChar(output_t *o, char c) {
+    if (o->len == OUTPUT_BUFSIZE) {
+        outputFlush(o);
+    }
+    o->buf[o->len++] = c;
+}
+
+#endif
@@ -0,0 +1,193 @@
+/** @file perf.c
+ * @brief Hardware performance counters of the host.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perf.h"
+
+/** @brief Names of the counters in the report */
+static const char *const names[VM_PERF_COUNTERS] = {
+    "task clock (ns)", "cycles", "instructions", "branches", "branch misses",
+    "cache references", "cache misses", "iTLB misses", "dTLB misses"
+};
+
+#ifdef __linux__
+
+/** @brief Type and config of each counter for perf_event_open */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[VM_PERF_COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_ITLB | PERF_COUNT_HW_CACHE_OP_READ << 8
+                          | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8
+                          | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+};
+
+int perfOpen(perf_t *p) {
+    struct perf_event_attr attr;
+    int i, opened = 0, error = 0;
+    p->steps = 0;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        /* This thread, on any CPU */
+        p->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (p->fds[i] >= 0) {
+            opened++;
+        } else if (error == 0) {
+            error = errno;
+        }
+    }
+    if (opened == 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void perfClose(perf_t *p) {
+    int i;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        if (p->fds[i] >= 0) {
+            close(p->fds[i]);
+            p->fds[i] = -1;
+        }
+    }
+}
+
+void perfReset(perf_t *p) {
+    int i;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        if (p->fds[i] >= 0) {
+            ioctl(p->fds[i], PERF_EVENT_IOC_RESET, 0);
+        }
+    }
+    p->steps = 0;
+}
+
+void perfStart(perf_t *p) {
+    int i;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        if (p->fds[i] >= 0) {
+            ioctl(p->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perfStop(perf_t *p, uint64_t steps) {
+    int i;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        if (p->fds[i] >= 0) {
+            ioctl(p->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    p->steps += steps;
+}
+
+void perfRead(const perf_t *p, vm_perf_t *out) {
+    int i;
+    memset(out, 0, sizeof(*out));
+    out->steps = p->steps;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        uint64_t data[3];   // value, time enabled, time running
+        if (p->fds[i] < 0 || read(p->fds[i], data, sizeof(data)) != (ssize_t) sizeof(data)) {
+            continue;
+        }
+        out->available |= 1u << i;
+        out->counts[i] = data[0];
+        /* Multiplexed: the counter only ran part of the time it was enabled */
+        if (data[2] != 0 && data[2] < data[1]) {
+            out->counts[i] = (uint64_t) ((double) data[0] * (double) data[1] / (double) data[2]);
+        }
+    }
+}
+
+#else
+
+int perfOpen(perf_t *p) {
+    int i;
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        p->fds[i] = -1;
+    }
+    p->steps = 0;
+    errno = ENOSYS;
+    return -1;
+}
+
+void perfClose(perf_t *p) {
+    (void) p;
+}
+
+void perfReset(perf_t *p) {
+    p->steps = 0;
+}
+
+void perfStart(perf_t *p) {
+    (void) p;
+}
+
+void perfStop(perf_t *p, uint64_t steps) {
+    p->steps += steps;
+}
+
+void perfRead(const perf_t *p, vm_perf_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->steps = p->steps;
+}
+
+#endif
+
+/** @brief Share of a count in a total, in percent */
+static double percent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * (double) count / (double) total : 0.0;
+}
+
+void perfReport(const perf_t *p, FILE *out) {
+    vm_perf_t c;
+    int i;
+    perfRead(p, &c);
+    fprintf(out, "=== HOST COUNTERS: %llu guest instructions ===\n", (unsigned long long) c.steps);
+    fprintf(out, "  %-18s %16s %14s\n", "counter", "count", "per guest instr");
+    for (i = 0; i < VM_PERF_COUNTERS; i++) {
+        if (!(c.available & (1u << i))) {
+            fprintf(out, "  %-18s %16s\n", names[i], "not available");
+            continue;
+        }
+        fprintf(out, "  %-18s %16llu %14.3f", names[i], (unsigned long long) c.counts[i],
+                c.steps ? (double) c.counts[i] / (double) c.steps : 0.0);
+        if (i == VM_PERF_INSTRUCTIONS && (c.available & (1u << VM_PERF_CYCLES)) && c.counts[VM_PERF_CYCLES]) {
+            fprintf(out, "   %.2f per cycle", (double) c.counts[i] / (double) c.counts[VM_PERF_CYCLES]);
+        } else if (i == VM_PERF_BRANCH_MISSES && (c.available & (1u << VM_PERF_BRANCHES))) {
+            fprintf(out, "   %.2f%% of branches", percent(c.counts[i], c.counts[VM_PERF_BRANCHES]));
+        } else if (i == VM_PERF_CACHE_MISSES && (c.available & (1u << VM_PERF_CACHE_REFERENCES))) {
+            fprintf(out, "   %.2f%% of references", percent(c.counts[i], c.counts[VM_PERF_CACHE_REFERENCES]));
+        }
+        fprintf(out, "\n");
+    }
+}
@@ -0,0 +1,60 @@
+/** \headerfile perf.h "perf.h"
+ *  \brief Hardware performance counters of the host
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The counters of vm_perf_t, opened with perf_event_open on Linux. They count
+ * the thread that opens them, in user space only, and are only enabled while
+ * the engines run: the host code between two calls of vm_run is left out.
+ * Each counter is opened on its own, so that those the host does not have
+ * (the hardware ones, in most virtual machines) do not keep the others from
+ * counting. When there are more of them than the PMU has registers, the
+ * kernel multiplexes them, and their counts are scaled to the time they ran.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "vm.h"
+
+/** @brief Counters of a VM */
+typedef struct {
+    int fds[VM_PERF_COUNTERS];  // -1 for the counters the host does not have
+    uint64_t steps;             // guest instructions run while the counters were enabled
+} perf_t;
+
+/** @brief Open the counters, disabled
+ * @return 0 if at least one counter could be opened, -1 with errno set otherwise
+ *         (ENOSYS on hosts other than Linux)
+ */
+int perfOpen(perf_t *p);
+
+/** @brief Close the counters */
+void perfClose(perf_t *p);
+
+/** @brief Clear the counts */
+void perfReset(perf_t *p);
+
+/** @brief Enable the counters, before the engine runs */
+void perfStart(perf_t *p);
+
+/** @brief Disable the counters, once the engine returns
+ * @param p the counters
+ * @param steps guest instructions the engine ran
+ */
+void perfStop(perf_t *p, uint64_t steps);
+
+/** @brief Read the counts, scaled if the counters were multiplexed */
+void perfRead(const perf_t *p, vm_perf_t *out);
+
+/** @brief Print the counts, per guest instruction
+ * @param p the counters
+ * @param out stream to print to
+ */
+void perfReport(const perf_t *p, FILE *out);
+
+#endif
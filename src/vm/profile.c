@@ -0,0 +1,214 @@
+/** @file profile.c
+ * @brief Instruction-level profiler.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "constants.h"
+#include "isa.h"
+#include "profile.h"
+
+/* Number of addresses listed in the hot-spot report */
+#define HOT_SPOTS 20
+
+int profileInit(profile_t *p, uint64_t words) {
+    memset(p, 0, sizeof(*p));
+    p->pcsBytes = words * sizeof(pcprofile_t);
+    p->pcs = mmap(NULL, p->pcsBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p->pcs == MAP_FAILED) {
+        p->pcs = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void profileFree(profile_t *p) {
+    if (p->pcs != NULL) {
+        munmap(p->pcs, p->pcsBytes);
+        p->pcs = NULL;
+    }
+}
+
+void profileReset(profile_t *p) {
+    madvise(p->pcs, p->pcsBytes, MADV_DONTNEED);
+    memset(p->opcodes, 0, sizeof(p->opcodes));
+    p->hiPc = 0;
+}
+
+/** @brief Share of a count in a total, in percent */
+static double percent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * (double) count / (double) total : 0.0;
+}
+
+/** @brief Profile being sorted by compareHot */
+static const profile_t *sorted;
+
+/** @brief Iterations of a loop */
+typedef struct {
+    uint32_t header;
+    uint64_t iterations;    // times a back edge to the header was followed
+} loopprofile_t;
+
+/** @brief Times an edge leaving a block was followed
+ * @param p the counters
+ * @param mem memory of the VM
+ * @param b the block
+ * @param taken 1 for the jump or branch ending the block, 0 for the other edge
+ */
+static uint64_t edgeCount(const profile_t *p, const uint32_t *mem, const cfgblock_t *b, int taken) {
+    uint32_t last = b->start + b->words - 1;
+    const pcprofile_t *c = &p->pcs[last];
+    int opcode = (mem[last] >> 26) & 0x3F;
+    if (opcodeType(opcode) == TYPE_B) {
+        return taken ? c->taken : c->count - c->taken;
+    }
+    /* A block ending on jmpi always jumps, and is returned to as often, if it is a call */
+    return c->count;
+}
+
+/** @brief Find the loop of a header among loops in address order, NULL if it did not run */
+static loopprofile_t *findLoop(loopprofile_t *loops, int nbrLoops, uint32_t header) {
+    int lo = 0, hi = nbrLoops;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (loops[mid].header < header) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < nbrLoops && loops[lo].header == header ? &loops[lo] : NULL;
+}
+
+/** @brief Order loops by decreasing iterations */
+static int compareLoops(const void *a, const void *b) {
+    uint64_t x = ((const loopprofile_t *) a)->iterations;
+    uint64_t y = ((const loopprofile_t *) b)->iterations;
+    return (x < y) - (x > y);
+}
+
+/** @brief Print the loops of the graph that ran, by decreasing iterations */
+static void reportLoops(const profile_t *p, const uint32_t *mem, const cfg_t *cfg, const symbols_t *syms,
+                        FILE *out) {
+    loopprofile_t *loops;
+    uint32_t i;
+    int j, nbrLoops = 0;
+    char where[64];
+    if (cfg->nbrBlocks == 0) {
+        return;
+    }
+    loops = calloc(cfg->nbrBlocks, sizeof(loopprofile_t));
+    if (loops == NULL) {
+        return;
+    }
+    for (i = 0; i < cfg->nbrBlocks; i++) {
+        if ((cfg->blocks[i].flags & CFG_LOOP) && p->pcs[cfg->blocks[i].start].count != 0) {
+            loops[nbrLoops++].header = cfg->blocks[i].start;
+        }
+    }
+    /* Back edges, added to their header */
+    for (i = 0; i < cfg->nbrBlocks; i++) {
+        const cfgblock_t *b = &cfg->blocks[i];
+        loopprofile_t *loop;
+        if ((b->flags & CFG_BACK_TAKEN) && (loop = findLoop(loops, nbrLoops, b->taken)) != NULL) {
+            loop->iterations += edgeCount(p, mem, b, 1);
+        }
+        if ((b->flags & CFG_BACK_NEXT) && (loop = findLoop(loops, nbrLoops, b->next)) != NULL) {
+            loop->iterations += edgeCount(p, mem, b, 0);
+        }
+    }
+    qsort(loops, nbrLoops, sizeof(loopprofile_t), compareLoops);
+    fprintf(out, "Loops:\n");
+    fprintf(out, "  %8s %-20s %14s %14s %12s\n", "header", "location", "iterations", "entries", "per entry");
+    for (j = 0; j < nbrLoops && j < HOT_SPOTS; j++) {
+        uint64_t count = p->pcs[loops[j].header].count;
+        uint64_t entries = count > loops[j].iterations ? count - loops[j].iterations : 0;
+        symbolsFormat(syms, loops[j].header, where, sizeof(where));
+        fprintf(out, "  %8u %-20s %14llu %14llu %12.1f\n", loops[j].header, where,
+                (unsigned long long) loops[j].iterations, (unsigned long long) entries,
+                entries ? (double) loops[j].iterations / (double) entries : 0.0);
+    }
+    free(loops);
+}
+
+/** @brief Order addresses by decreasing execution count */
+static int compareHot(const void *a, const void *b) {
+    uint64_t x = sorted->pcs[*(const uint32_t *) a].count;
+    uint64_t y = sorted->pcs[*(const uint32_t *) b].count;
+    return (x < y) - (x > y);
+}
+
+void profileReport(const profile_t *p, const uint32_t *mem, const cfg_t *cfg, const symbols_t *syms, FILE *out) {
+    uint64_t total = 0, types[TYPE_A + 2] = { 0 };
+    uint32_t pc, *hot;
+    int i, nbrHot = 0;
+    char where[64];
+
+    for (i = 0; i < 64; i++) {
+        total += p->opcodes[i];
+        types[opcodeType(i) + 1] += p->opcodes[i];
+    }
+    fprintf(out, "=== PROFILE: %llu instructions ===\n", (unsigned long long) total);
+
+    fprintf(out, "Instruction types:\n");
+    for (i = TYPE_R; i <= TYPE_A; i++) {
+        fprintf(out, "  %-6s %14llu %6.2f%%\n", typeName(i), (unsigned long long) types[i + 1],
+                percent(types[i + 1], total));
+    }
+    fprintf(out, "  %-6s %14llu %6.2f%%\n", "other", (unsigned long long) types[0], percent(types[0], total));
+
+    fprintf(out, "Opcodes:\n");
+    for (i = 0; i < 64; i++) {
+        if (p->opcodes[i] != 0) {
+            fprintf(out, "  %-6s %14llu %6.2f%%\n", opcodeName(i), (unsigned long long) p->opcodes[i],
+                    percent(p->opcodes[i], total));
+        }
+    }
+
+    hot = malloc(p->hiPc * sizeof(uint32_t));
+    if (hot == NULL) {
+        return;
+    }
+    for (pc = 0; pc < p->hiPc; pc++) {
+        if (p->pcs[pc].count != 0) {
+            hot[nbrHot++] = pc;
+        }
+    }
+
+    fprintf(out, "Branches:\n");
+    for (i = 0; i < nbrHot; i++) {
+        const pcprofile_t *c = &p->pcs[hot[i]];
+        int opcode = (mem[hot[i]] >> 26) & 0x3F;
+        if (opcodeType(opcode) == TYPE_B) {
+            symbolsFormat(syms, hot[i], where, sizeof(where));
+            fprintf(out, "  %-20s %-6s %14llu taken %14llu not taken %6.2f%% taken\n", where, opcodeName(opcode),
+                    (unsigned long long) c->taken, (unsigned long long) (c->count - c->taken),
+                    percent(c->taken, c->count));
+        }
+    }
+
+    reportLoops(p, mem, cfg, syms, out);
+
+    sorted = p;
+    qsort(hot, nbrHot, sizeof(uint32_t), compareHot);
+    fprintf(out, "Hot spots:\n");
+    fprintf(out, "  %8s %-20s %14s %7s  %s\n", "address", "location", "count", "share", "source");
+    for (i = 0; i < nbrHot && i < HOT_SPOTS; i++) {
+        const sourceline_t *line = syms != NULL ? symbolsLine(syms, hot[i]) : NULL;
+        int opcode = (mem[hot[i]] >> 26) & 0x3F;
+        symbolsFormat(syms, hot[i], where, sizeof(where));
+        fprintf(out, "  %8u %-20s %14llu %6.2f%%  ", hot[i], where, (unsigned long long) p->pcs[hot[i]].count,
+                percent(p->pcs[hot[i]].count, total));
+        if (line != NULL) {
+            fprintf(out, "%d: %s\n", line->line, line->text);
+        } else {
+            fprintf(out, "%s\n", opcodeName(opcode));
+        }
+    }
+    free(hot);
+}
@@ -0,0 +1,68 @@
+/** \headerfile profile.h "profile.h"
+ *  \brief Instruction-level profiler
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The counters are only updated by the profiling instances of the engines
+ * (see engine.inc), so a VM without profiling pays nothing for them.
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "cfg.h"
+#include "symbols.h"
+
+/** @brief Counters of one address */
+typedef struct {
+    uint64_t count;     // executions of the instruction
+    uint64_t taken;     // executions that branched (BRAZ, BRANZ)
+} pcprofile_t;
+
+/** @brief Counters of a run */
+typedef struct {
+    pcprofile_t *pcs;   // parallel to mem, populated lazily
+    size_t pcsBytes;
+    uint64_t opcodes[64];
+    uint32_t hiPc;      // one past the highest address executed
+} profile_t;
+
+/** @brief Allocate the counters of a memory of the given size
+ * @return 0 on success, -1 if out of memory
+ */
+int profileInit(profile_t *p, uint64_t words);
+
+/** @brief Free the counters */
+void profileFree(profile_t *p);
+
+/** @brief Clear the counters */
+void profileReset(profile_t *p);
+
+/** @brief Count the execution of an instruction */
+static inline void profileInstr(profile_t *p, uint32_t pc, int opcode) {
+    p->pcs[pc].count++;
+    p->opcodes[opcode]++;
+    if (pc >= p->hiPc) {
+        p->hiPc = pc + 1;
+    }
+}
+
+/** @brief Count a taken branch */
+static inline void profileTaken(profile_t *p, uint32_t pc) {
+    p->pcs[pc].taken++;
+}
+
+/** @brief Print the hot-spot report
+ * @param p the counters
+ * @param mem memory of the VM, to find the opcode of each address
+ * @param cfg control-flow graph of the program, to count the iterations of its loops
+ * @param syms symbol table of the program, may be NULL
+ * @param out stream to print to
+ */
+void profileReport(const profile_t *p, const uint32_t *mem, const cfg_t *cfg, const symbols_t *syms, FILE *out);
+
+#endif
@@ -0,0 +1,439 @@
+/** @file sched.c
+ * @brief Scheduler running many guests on a few threads.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Only the worker running a guest parks it, and only a push of input, or its
+ * closing, wakes it up; both happen under the lock of the guest, so a wake-up
+ * is never lost between a guest finding no input and being parked.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sched.h"
+
+/* States of a guest */
+#define TASK_READY 0        // in a run queue, or run by a worker
+#define TASK_PARKED 1       // waiting for input, in no run queue
+#define TASK_DONE 2         // halted, faulted or out of budget
+
+/** @brief A guest of the scheduler */
+struct vm_task {
+    vm_sched_t *sched;
+    vm_t *vm;
+    uint64_t left;          // steps left in the budget, UINT64_MAX for no limit
+    vm_done_fn done;
+    void *ctx;
+    pthread_mutex_t lock;   // guards the state and the input
+    int state;              // TASK_*
+    int *input;             // integers pushed and not read yet, from head to count
+    size_t head;
+    size_t count;
+    size_t cap;
+    int closed;             // 1 once the input is closed
+    vm_task_t *next;        // next guest of the scheduler, to free them all
+};
+
+/** @brief Run queue of a worker, a ring of guests
+ *
+ * The owner takes guests from the head and puts them back at the tail;
+ * thieves take them from the tail.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    vm_task_t **tasks;
+    size_t head;
+    size_t count;
+    size_t cap;
+} runqueue_t;
+
+/** @brief Arguments of a worker thread */
+typedef struct {
+    vm_sched_t *sched;
+    int id;
+} worker_t;
+
+struct vm_sched {
+    uint64_t slice;
+    int nbrWorkers;
+    runqueue_t *queues;
+    worker_t *workers;
+    pthread_t *threads;
+
+    pthread_mutex_t lock;   // guards the counts below and the list of guests
+    pthread_cond_t work;    // signaled when a guest is queued or the workers stop
+    pthread_cond_t idle;    // signaled when the last guest is done
+    int ready;              // guests in the run queues
+    int live;               // guests not done
+    int stop;               // 1 when the workers have to stop
+    unsigned int nextQueue; // queue of the next guest woken up by the host
+    vm_task_t *tasks;
+};
+
+/**
+ * @brief Put a guest at the tail of a run queue and wake up a worker
+ * @param sched the scheduler
+ * @param id index of the queue
+ * @param task the guest, TASK_READY
+ * @return 0 on success, -1 if out of memory
+ */
+static int enqueue(vm_sched_t *sched, int id, vm_task_t *task) {
+    runqueue_t *q = &sched->queues[id];
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->cap) {
+        size_t cap = q->cap ? 2 * q->cap : 64;
+        size_t i;
+        vm_task_t **tasks = malloc(cap * sizeof(vm_task_t *));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&q->lock);
+            return -1;
+        }
+        for (i = 0; i < q->count; i++) {
+            tasks[i] = q->tasks[(q->head + i) % q->cap];
+        }
+        free(q->tasks);
+        q->tasks = tasks;
+        q->head = 0;
+        q->cap = cap;
+    }
+    q->tasks[(q->head + q->count) % q->cap] = task;
+    q->count++;
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->ready++;
+    pthread_cond_signal(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    return 0;
+}
+
+/**
+ * @brief Take a guest from a run queue
+ * @param q the queue
+ * @param head 1 to take it from the head, as the owner, 0 from the tail, as a thief
+ * @return the guest, or NULL if the queue is empty
+ */
+static vm_task_t *dequeue(runqueue_t *q, int head) {
+    vm_task_t *task = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        if (head) {
+            task = q->tasks[q->head];
+            q->head = (q->head + 1) % q->cap;
+        } else {
+            task = q->tasks[(q->head + q->count - 1) % q->cap];
+        }
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return task;
+}
+
+/**
+ * @brief Find the next guest of a worker, stealing one if its queue is empty
+ * @param sched the scheduler
+ * @param id index of the worker
+ * @return the guest, or NULL if every queue is empty
+ */
+static vm_task_t *nextTask(vm_sched_t *sched, int id) {
+    int i;
+    vm_task_t *task = dequeue(&sched->queues[id], 1);
+    for (i = 1; task == NULL && i < sched->nbrWorkers; i++) {
+        task = dequeue(&sched->queues[(id + i) % sched->nbrWorkers], 0);
+    }
+    if (task != NULL) {
+        pthread_mutex_lock(&sched->lock);
+        sched->ready--;
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return task;
+}
+
+/** @brief Tell if the workers have to stop, after the slice they run */
+static int stopping(vm_sched_t *sched) {
+    int stop;
+    pthread_mutex_lock(&sched->lock);
+    stop = sched->stop;
+    pthread_mutex_unlock(&sched->lock);
+    return stop;
+}
+
+/**
+ * @brief Input callback of the guests: the integers pushed by the host
+ * @param ctx the vm_task_t
+ * @param value set to the integer
+ * @return 1 if value is set, 0 if the input is closed, VM_INPUT_WAIT otherwise
+ */
+static int taskInput(void *ctx, int *value) {
+    vm_task_t *task = ctx;
+    int res = VM_INPUT_WAIT;
+    pthread_mutex_lock(&task->lock);
+    if (task->head < task->count) {
+        *value = task->input[task->head++];
+        res = 1;
+    } else if (task->closed) {
+        res = 0;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return res;
+}
+
+/**
+ * @brief Take a guest out of the scheduler
+ * @param task the guest
+ * @param status its last status
+ */
+static void finish(vm_task_t *task, int status) {
+    vm_sched_t *sched = task->sched;
+    pthread_mutex_lock(&task->lock);
+    task->state = TASK_DONE;
+    pthread_mutex_unlock(&task->lock);
+    if (task->done != NULL) {
+        task->done(task->ctx, task->vm, status);
+    }
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->live == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/**
+ * @brief Run a guest for a slice, then queue it again, park it or finish it
+ * @param sched the scheduler
+ * @param id index of the worker
+ * @param task the guest, TASK_READY
+ *
+ * Once the scheduler stops, a guest that could run on is left out of the
+ * queues, for the host to run it again.
+ */
+static void runTask(vm_sched_t *sched, int id, vm_task_t *task) {
+    uint64_t budget = task->left < sched->slice ? task->left : sched->slice;
+    uint64_t steps = vm_steps(task->vm);
+    int status;
+
+    status = vm_run(task->vm, budget);
+    if (task->left != UINT64_MAX) {
+        task->left -= vm_steps(task->vm) - steps;
+    }
+
+    switch (status) {
+        case VM_BUDGET_EXHAUSTED:
+            if (task->left == 0) {
+                finish(task, status);
+                return;
+            }
+            break;
+        case VM_WAITING:
+            pthread_mutex_lock(&task->lock);
+            if (task->head == task->count && !task->closed) {
+                task->state = TASK_PARKED;
+                pthread_mutex_unlock(&task->lock);
+                return;
+            }
+            pthread_mutex_unlock(&task->lock);
+            break;
+        default:
+            finish(task, status);
+            return;
+    }
+    if (stopping(sched)) {
+        return;
+    }
+    if (enqueue(sched, id, task) < 0) {
+        finish(task, status);
+    }
+}
+
+/**
+ * @brief Worker thread: run guests until the scheduler stops
+ * @param arg the worker_t of the thread
+ */
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    vm_sched_t *sched = w->sched;
+    vm_task_t *task;
+
+    while (!stopping(sched)) {
+        task = nextTask(sched, w->id);
+        if (task != NULL) {
+            runTask(sched, w->id, task);
+            continue;
+        }
+        pthread_mutex_lock(&sched->lock);
+        while (sched->ready == 0 && !sched->stop) {
+            pthread_cond_wait(&sched->work, &sched->lock);
+        }
+        pthread_mutex_unlock(&sched->lock);
+    }
+    return NULL;
+}
+
+vm_sched_t *vm_sched_create(int threads, uint64_t slice) {
+    vm_sched_t *sched = calloc(1, sizeof(vm_sched_t));
+    int i;
+    if (sched == NULL) {
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+    sched->slice = slice == 0 ? UINT64_MAX : slice;
+    sched->nbrWorkers = threads;
+    sched->queues = calloc(threads, sizeof(runqueue_t));
+    sched->workers = calloc(threads, sizeof(worker_t));
+    sched->threads = calloc(threads, sizeof(pthread_t));
+    if (sched->queues == NULL || sched->workers == NULL || sched->threads == NULL) {
+        free(sched->queues);
+        free(sched->workers);
+        free(sched->threads);
+        free(sched);
+        return NULL;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+    for (i = 0; i < threads; i++) {
+        pthread_mutex_init(&sched->queues[i].lock, NULL);
+    }
+    for (i = 0; i < threads; i++) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].id = i;
+        if (pthread_create(&sched->threads[i], NULL, worker, &sched->workers[i]) != 0) {
+            sched->nbrWorkers = i;
+            vm_sched_destroy(sched);
+            return NULL;
+        }
+    }
+    return sched;
+}
+
+vm_task_t *vm_sched_add(vm_sched_t *sched, vm_t *vm, uint64_t max_steps, vm_done_fn done, void *ctx) {
+    vm_task_t *task = calloc(1, sizeof(vm_task_t));
+    int id;
+    if (task == NULL) {
+        return NULL;
+    }
+    task->sched = sched;
+    task->vm = vm;
+    task->left = max_steps == 0 ? UINT64_MAX : max_steps;
+    task->done = done;
+    task->ctx = ctx;
+    task->state = TASK_READY;
+    pthread_mutex_init(&task->lock, NULL);
+    vm_set_input_callback(vm, taskInput, task);
+
+    pthread_mutex_lock(&sched->lock);
+    task->next = sched->tasks;
+    sched->tasks = task;
+    sched->live++;
+    id = sched->nextQueue++ % sched->nbrWorkers;
+    pthread_mutex_unlock(&sched->lock);
+    if (enqueue(sched, id, task) < 0) {
+        task->done = NULL;
+        finish(task, VM_FAULT);
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * @brief Queue a guest again if it is parked
+ * @param task the guest, locked: this unlocks it
+ */
+static void wake(vm_task_t *task) {
+    vm_sched_t *sched = task->sched;
+    int id;
+    if (task->state != TASK_PARKED) {
+        pthread_mutex_unlock(&task->lock);
+        return;
+    }
+    task->state = TASK_READY;
+    pthread_mutex_unlock(&task->lock);
+
+    pthread_mutex_lock(&sched->lock);
+    id = sched->nextQueue++ % sched->nbrWorkers;
+    pthread_mutex_unlock(&sched->lock);
+    if (enqueue(sched, id, task) < 0) {
+        finish(task, VM_FAULT);
+    }
+}
+
+int vm_sched_push_input(vm_task_t *task, const int *values, size_t count) {
+    pthread_mutex_lock(&task->lock);
+    if (task->head == task->count) {
+        task->head = task->count = 0;
+    }
+    if (task->count + count > task->cap) {
+        size_t cap = task->cap ? task->cap : 16;
+        int *input;
+        while (cap < task->count + count) {
+            cap *= 2;
+        }
+        input = realloc(task->input, cap * sizeof(int));
+        if (input == NULL) {
+            pthread_mutex_unlock(&task->lock);
+            return -1;
+        }
+        task->input = input;
+        task->cap = cap;
+    }
+    memcpy(task->input + task->count, values, count * sizeof(int));
+    task->count += count;
+    wake(task);
+    return 0;
+}
+
+void vm_sched_close_input(vm_task_t *task) {
+    pthread_mutex_lock(&task->lock);
+    task->closed = 1;
+    wake(task);
+}
+
+void vm_sched_wait(vm_sched_t *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->live > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void vm_sched_destroy(vm_sched_t *sched) {
+    int i;
+    vm_task_t *task, *next;
+    if (sched == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&sched->lock);
+    sched->stop = 1;
+    pthread_cond_broadcast(&sched->work);
+    pthread_mutex_unlock(&sched->lock);
+    for (i = 0; i < sched->nbrWorkers; i++) {
+        pthread_join(sched->threads[i], NULL);
+    }
+
+    for (task = sched->tasks; task != NULL; task = next) {
+        next = task->next;
+        pthread_mutex_destroy(&task->lock);
+        free(task->input);
+        free(task);
+    }
+    for (i = 0; i < sched->nbrWorkers; i++) {
+        pthread_mutex_destroy(&sched->queues[i].lock);
+        free(sched->queues[i].tasks);
+    }
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->work);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->queues);
+    free(sched->workers);
+    free(sched->threads);
+    free(sched);
+}
@@ -0,0 +1,87 @@
+/** \headerfile sched.h "sched.h"
+ *  \brief Scheduler running many guests on a few threads
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * A scheduler owns a pool of worker threads, each with its own queue of
+ * guests ready to run. A worker runs the guest at the head of its queue for a
+ * slice of steps, then puts it back at the tail, so that the guests of a
+ * thread take turns; a worker whose queue is empty steals from the others.
+ * A guest whose scall 0 finds no input is parked, in no queue, until the host
+ * pushes input for it: a session waiting for its user holds no thread.
+ *
+ *     vm_sched_t *sched = vm_sched_create(0, 10000);
+ *     vm_task_t *task = vm_sched_add(sched, vm, 0, done, ctx);
+ *     ...
+ *     vm_sched_push_input(task, values, count);
+ *     vm_sched_close_input(task);
+ *     vm_sched_wait(sched);
+ *     vm_sched_destroy(sched);
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+typedef struct vm_sched vm_sched_t;
+typedef struct vm_task vm_task_t;
+
+/** @brief Called by a worker when a guest leaves the scheduler
+ * @param ctx context given with the guest
+ * @param vm the VM of the guest
+ * @param status VM_HALTED, VM_FAULT, or VM_BUDGET_EXHAUSTED when it ran max_steps
+ */
+typedef void (*vm_done_fn)(void *ctx, vm_t *vm, int status);
+
+/** @brief Create a scheduler and start its workers
+ * @param threads number of worker threads, 0 for one per core
+ * @param slice steps a guest runs before the next one of its thread takes its turn
+ * @return the scheduler, or NULL if out of memory or if a thread cannot be started
+ */
+vm_sched_t *vm_sched_create(int threads, uint64_t slice);
+
+/** @brief Hand a loaded VM to the scheduler
+ * @param sched the scheduler
+ * @param vm the VM, which the host must not use until done is called
+ * @param max_steps maximum number of instructions to execute, 0 for no limit
+ * @param done called when the guest halts, faults or runs max_steps, may be NULL
+ * @param ctx passed to done
+ * @return the guest, valid until the scheduler is destroyed, or NULL if out of memory
+ *
+ * scall 0 of the VM reads the integers pushed with vm_sched_push_input.
+ */
+vm_task_t *vm_sched_add(vm_sched_t *sched, vm_t *vm, uint64_t max_steps, vm_done_fn done, void *ctx);
+
+/** @brief Queue integers for scall 0 of a guest, and wake it up if it waits for them
+ * @param task the guest
+ * @param values the integers, copied
+ * @param count number of integers
+ * @return 0 on success, -1 if out of memory
+ *
+ * Any thread may push input, at any time.
+ */
+int vm_sched_push_input(vm_task_t *task, const int *values, size_t count);
+
+/** @brief End the input of a guest: once the queued integers are read, scall 0 reads 0 */
+void vm_sched_close_input(vm_task_t *task);
+
+/** @brief Wait until every guest is done
+ *
+ * Guests waiting for input are not done: their input must be pushed or closed.
+ */
+void vm_sched_wait(vm_sched_t *sched);
+
+/** @brief Stop the workers once they finish their slice, and free the scheduler and its guests
+ * @param sched the scheduler, may be NULL
+ *
+ * The VMs are not destroyed: they belong to the host. Those not done yet
+ * can be run again with vm_run, once their input is set again.
+ */
+void vm_sched_destroy(vm_sched_t *sched);
+
+#endif
@@ -0,0 +1,587 @@
+/** @file serve.c
+ * @brief Execution service running the jobs of its clients on a pool of VMs.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Listens on a Unix socket or a TCP port and runs the jobs clients send in
+ * the protocol of service.h. Each worker thread owns a VM, created at start,
+ * and serves one connection at a time: the jobs cost neither a process nor
+ * a VM each. The images are cached by hash as snapshots, so a program run
+ * by many jobs is only loaded once. The snapshots keep the control-flow
+ * graph of the code: the tiered engine hints the loops of a cached image
+ * as it does those of one it loads.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "service.h"
+#include "vm.h"
+
+#define DEFAULT_CACHE 64    // images kept in the cache
+#define BACKLOG 64          // connections waiting for a worker
+
+/** @brief An image in the cache */
+typedef struct {
+    uint64_t hash;
+    vm_snapshot_t *snap;    // state of a VM right after loading the image
+    int refs;               // 1 while in the cache, plus the jobs restoring it
+    uint64_t lastUse;       // clock of the cache when it was last used
+} image_t;
+
+/** @brief Images by hash, least recently used first out */
+typedef struct {
+    pthread_mutex_t lock;
+    image_t **images;
+    int nbrImages;
+    int capImages;
+    uint64_t clock;
+} cache_t;
+
+/** @brief State shared by the workers */
+typedef struct {
+    int listener;
+    int tcp;            // 1 if the listener is a TCP socket
+    uint64_t maxSteps;  // budget of a job, 0 for no limit
+    cache_t cache;
+} server_t;
+
+/** @brief A worker thread, its VM and its buffers */
+typedef struct {
+    server_t *server;
+    vm_t *vm;
+    char *output;       // output of the current job
+    size_t outputLen;
+    size_t outputCap;
+    int truncated;      // 1 if the output went past SERVICE_MAX_OUTPUT
+    char *image;        // image of the current request
+    size_t imageCap;
+    int32_t *inputs;    // integers of the current request
+    size_t inputsCap;
+    char name[SERVICE_MAX_NAME + 1];
+} worker_t;
+
+/** @brief Path of the Unix socket, removed when the server stops */
+static const char *socketPath;
+
+/*--- Cache of images ---*/
+
+/** @brief Drop a reference to an image, freeing it with the last one
+ * @param image the image, with the lock of the cache held
+ */
+static void dropImage(image_t *image) {
+    if (--image->refs == 0) {
+        vm_snapshot_free(image->snap);
+        free(image);
+    }
+}
+
+/**
+ * @brief Find an image in the cache
+ * @param cache the cache
+ * @param hash hash of the image
+ * @return the image, which the caller releases with releaseImage, or NULL if it is not cached
+ */
+static image_t *findImage(cache_t *cache, uint64_t hash) {
+    image_t *found = NULL;
+    int i;
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->nbrImages; i++) {
+        if (cache->images[i]->hash == hash) {
+            found = cache->images[i];
+            found->refs++;
+            found->lastUse = ++cache->clock;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+/** @brief Release an image found with findImage */
+static void releaseImage(cache_t *cache, image_t *image) {
+    pthread_mutex_lock(&cache->lock);
+    dropImage(image);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/**
+ * @brief Add an image to the cache, evicting the least recently used one if it is full
+ * @param cache the cache
+ * @param hash hash of the image
+ * @param snap snapshot of a VM that loaded it, which the cache takes
+ *
+ * Jobs restoring an evicted image keep it until they release it. The image
+ * is dropped if another worker cached the same one meanwhile.
+ */
+static void addImage(cache_t *cache, uint64_t hash, vm_snapshot_t *snap) {
+    image_t *image = malloc(sizeof(image_t));
+    int i, oldest = 0;
+    if (image == NULL) {
+        vm_snapshot_free(snap);
+        return;
+    }
+    image->hash = hash;
+    image->snap = snap;
+    image->refs = 1;
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < cache->nbrImages; i++) {
+        if (cache->images[i]->hash == hash) {
+            pthread_mutex_unlock(&cache->lock);
+            vm_snapshot_free(snap);
+            free(image);
+            return;
+        }
+        if (cache->images[i]->lastUse < cache->images[oldest]->lastUse) {
+            oldest = i;
+        }
+    }
+    if (cache->nbrImages == cache->capImages) {
+        dropImage(cache->images[oldest]);
+        cache->images[oldest] = cache->images[--cache->nbrImages];
+    }
+    image->lastUse = ++cache->clock;
+    cache->images[cache->nbrImages++] = image;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*--- Connections ---*/
+
+/**
+ * @brief Read exactly a number of bytes
+ * @return 1 on success, 0 at the end of the stream before the first byte, -1 on error or if cut short
+ */
+static int readFull(int fd, void *data, size_t bytes) {
+    char *dest = data;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = read(fd, dest + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return (n == 0 && done == 0) ? 0 : -1;
+        }
+        done += n;
+    }
+    return 1;
+}
+
+/** @brief Write a whole buffer
+ * @return 0 on success, -1 on error
+ */
+static int writeFull(int fd, const void *data, size_t bytes) {
+    const char *src = data;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = write(fd, src + done, bytes - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Grow a buffer of a worker to hold at least a size
+ * @return 0 on success, -1 if out of memory
+ */
+static int reserve(void **buf, size_t *cap, size_t bytes) {
+    void *grown;
+    if (bytes <= *cap) {
+        return 0;
+    }
+    grown = realloc(*buf, bytes);
+    if (grown == NULL) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = bytes;
+    return 0;
+}
+
+/**
+ * @brief Output sink appending the output of the guest to the buffer of its worker
+ * @param ctx the worker_t
+ * @param data bytes written by the guest
+ * @param len number of bytes
+ */
+static void jobOutput(void *ctx, const char *data, size_t len) {
+    worker_t *w = ctx;
+    size_t cap = w->outputCap ? w->outputCap : 4096;
+    if (w->outputLen + len > SERVICE_MAX_OUTPUT) {
+        len = SERVICE_MAX_OUTPUT - w->outputLen;
+        w->truncated = 1;
+    }
+    while (cap < w->outputLen + len) {
+        cap *= 2;
+    }
+    if (reserve((void **) &w->output, &w->outputCap, cap) < 0) {
+        w->truncated = 1;
+        return;
+    }
+    memcpy(w->output + w->outputLen, data, len);
+    w->outputLen += len;
+}
+
+/** @brief Monotonic time in nanoseconds */
+static uint64_t nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @brief Load the image of a request into the VM of a worker and cache it
+ * @param w the worker, holding the image and the name
+ * @param bytes size of the image
+ * @param hash hash of the image
+ * @return 0 on success, -1 with errno set if the image cannot be loaded
+ */
+static int loadImage(worker_t *w, size_t bytes, uint64_t hash) {
+    vm_snapshot_t *snap;
+    if (vm_load_image(w->vm, w->image, bytes, w->name) < 0) {
+        return -1;
+    }
+    /* Not caching it only costs the next jobs a load */
+    snap = vm_snapshot(w->vm);
+    if (snap != NULL) {
+        addImage(&w->server->cache, hash, snap);
+    }
+    return 0;
+}
+
+/**
+ * @brief Read a request, run its job and send the response
+ * @param w the worker
+ * @param fd the connection
+ * @return 0 to go on with the next request, -1 to close the connection
+ */
+static int serveRequest(worker_t *w, int fd) {
+    servicerequest_t req;
+    serviceresponse_t resp;
+    vm_fault_t fault;
+    image_t *image;
+    uint64_t start, budget;
+    size_t extra;
+    int loaded = 0;
+    int i, ret = readFull(fd, &req, sizeof(req));
+    if (ret <= 0) {
+        return -1;
+    }
+    memset(&resp, 0, sizeof(resp));
+    resp.magic = SERVICE_RESPONSE_MAGIC;
+    resp.version = SERVICE_VERSION;
+    resp.headerWords = sizeof(resp) / sizeof(uint32_t);
+    if (req.magic != SERVICE_REQUEST_MAGIC || req.version != SERVICE_VERSION
+        || req.headerWords * sizeof(uint32_t) < sizeof(req) || req.nameBytes > SERVICE_MAX_NAME
+        || req.imageBytes > SERVICE_MAX_IMAGE || req.inputs > SERVICE_MAX_INPUTS) {
+        resp.status = SERVICE_BAD_REQUEST;
+        writeFull(fd, &resp, sizeof(resp));
+        return -1;
+    }
+
+    /* Read the whole request, so that the next one starts where it ends */
+    extra = req.headerWords * sizeof(uint32_t) - sizeof(req);
+    if (reserve((void **) &w->image, &w->imageCap, extra > req.imageBytes ? extra : req.imageBytes) < 0
+        || reserve((void **) &w->inputs, &w->inputsCap, req.inputs * sizeof(int32_t)) < 0) {
+        return -1;
+    }
+    if (readFull(fd, w->image, extra) < 0 || readFull(fd, w->name, req.nameBytes) < 0
+        || readFull(fd, w->image, req.imageBytes) < 0
+        || readFull(fd, w->inputs, req.inputs * sizeof(int32_t)) < 0) {
+        return -1;
+    }
+    resp.imageHash = req.imageBytes > 0 ? serviceHash(w->image, req.imageBytes) : req.imageHash;
+    w->name[req.nameBytes] = '\0';
+    if (req.nameBytes == 0) {
+        snprintf(w->name, sizeof(w->name), "%016llx", (unsigned long long) resp.imageHash);
+    }
+
+    /* Restore the image if it is cached, load it otherwise */
+    start = nanos();
+    image = findImage(&w->server->cache, resp.imageHash);
+    if (image != NULL) {
+        loaded = vm_restore(w->vm, image->snap) == 0;
+        resp.error = loaded ? 0 : errno;
+        releaseImage(&w->server->cache, image);
+        resp.flags |= SERVICE_CACHED;
+    } else if (req.imageBytes > 0) {
+        loaded = loadImage(w, req.imageBytes, resp.imageHash) == 0;
+        resp.error = loaded ? 0 : errno;
+    }
+    resp.loadNanos = nanos() - start;
+    if (!loaded) {
+        resp.status = (image == NULL && req.imageBytes == 0) ? SERVICE_UNKNOWN_IMAGE : SERVICE_LOAD_ERROR;
+        return writeFull(fd, &resp, sizeof(resp));
+    }
+
+    /* Run the job within the budgets of the request and of the server */
+    budget = w->server->maxSteps;
+    if (req.maxSteps != 0 && (budget == 0 || req.maxSteps < budget)) {
+        budget = req.maxSteps;
+    }
+    w->outputLen = 0;
+    w->truncated = 0;
+    vm_set_input_values(w->vm, (const int *) w->inputs, req.inputs);
+    start = nanos();
+    resp.status = vm_run(w->vm, budget);
+    resp.runNanos = nanos() - start;
+    resp.flags |= w->truncated ? SERVICE_TRUNCATED : 0;
+    resp.outputBytes = (uint32_t) w->outputLen;
+    resp.steps = vm_steps(w->vm);
+    resp.memUsed = vm_mem_used(w->vm);
+    resp.fault = vm_fault(w->vm, &fault);
+    resp.faultAddr = fault.addr;
+    resp.pc = vm_pc(w->vm);
+    for (i = 0; i < NBR_REGS; i++) {
+        resp.regs[i] = vm_reg(w->vm, i);
+    }
+    if (writeFull(fd, &resp, sizeof(resp)) < 0 || writeFull(fd, w->output, w->outputLen) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Worker thread: serve the connections it accepts, one at a time
+ * @param arg the worker_t of the thread
+ */
+static void *worker(void *arg) {
+    worker_t *w = arg;
+    int one = 1;
+    for (;;) {
+        int fd = accept(w->server->listener, NULL, NULL);
+        if (fd < 0) {
+            /* Out of descriptors, most likely: give the connections served time to close */
+            if (errno != EINTR && errno != ECONNABORTED) {
+                struct timespec pause = { 0, 10000000 };
+                nanosleep(&pause, NULL);
+            }
+            continue;
+        }
+        if (w->server->tcp) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        while (serveRequest(w, fd) == 0) {
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*--- Listening ---*/
+
+/** @brief Listen on a Unix socket, replacing the socket a previous server left
+ * @return the socket, or -1 with errno set
+ */
+static int listenUnix(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, BACKLOG) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** @brief Listen on a TCP port
+ * @param host address to listen on
+ * @param port the port
+ * @return the socket, or -1 if the address cannot be resolved or bound
+ */
+static int listenTcp(const char *host, const char *port) {
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, one = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    for (ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, BACKLOG) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/** @brief Remove the Unix socket and stop, on SIGINT or SIGTERM */
+static void stopServer(int sig) {
+    (void) sig;
+    if (socketPath != NULL) {
+        unlink(socketPath);
+    }
+    _exit(EXIT_SUCCESS);
+}
+
+/** @brief Print the usage of the program */
+static void usage(const char *name) {
+    printf("Usage: %s --socket path | --port port [--host address]\n", name);
+    printf("Options: -j workers, --engine switch|threaded|jit, --max-steps n, --mem size, "
+           "--mem-limit size, --cache images\n");
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if the server cannot start; it runs until it is stopped otherwise
+ *
+ * -j sets the number of workers, one per core by default: each serves one
+ * connection at a time, the others wait for a worker to be free. --max-steps
+ * caps the budget of every job. --mem and --mem-limit set the memory of the
+ * VMs, as for vm. --cache sets the number of images cached, 64 by default.
+ */
+int main(int argc, char **argv) {
+    server_t server;
+    worker_t *workers;
+    pthread_t thread;
+    vm_config_t config = { 0 };
+    int engine = VM_ENGINE_THREADED;
+    int nbrWorkers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    const char *host = "127.0.0.1";
+    const char *port = NULL;
+    int i;
+
+    memset(&server, 0, sizeof(server));
+    server.cache.capImages = DEFAULT_CACHE;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = argv[++i];
+        } else if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nbrWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) {
+                engine = VM_ENGINE_SWITCH;
+            } else if (strcmp(argv[i], "threaded") == 0) {
+                engine = VM_ENGINE_THREADED;
+            } else if (strcmp(argv[i], "jit") == 0) {
+                engine = VM_ENGINE_JIT;
+            } else {
+                printf("Error: Unknown engine %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            server.maxSteps = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &config.mem_words) < 0) {
+                printf("Error: Invalid memory size %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--mem-limit") == 0 && i + 1 < argc) {
+            if (vm_parse_mem_size(argv[++i], &config.mem_limit) < 0) {
+                printf("Error: Invalid memory limit %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            config.mem_limit *= sizeof(uint32_t);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            server.cache.capImages = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if ((socketPath == NULL) == (port == NULL)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (nbrWorkers < 1) {
+        nbrWorkers = 1;
+    }
+    if (server.cache.capImages < 1) {
+        server.cache.capImages = 1;
+    }
+
+    /* The pool: every VM is ready before the first connection */
+    workers = calloc(nbrWorkers, sizeof(worker_t));
+    server.cache.images = calloc(server.cache.capImages, sizeof(image_t *));
+    if (workers == NULL || server.cache.images == NULL) {
+        printf("Error: Could not allocate the workers\n");
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&server.cache.lock, NULL);
+    for (i = 0; i < nbrWorkers; i++) {
+        workers[i].server = &server;
+        workers[i].vm = vm_create_config(&config);
+        if (workers[i].vm == NULL) {
+            printf("Error: Could not create a VM: %s\n",
+                   errno == EINVAL ? "memory limit smaller than a page of 4 KiB" : strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (vm_set_engine(workers[i].vm, engine) < 0) {
+            printf("Error: Engine not available in this build\n");
+            return EXIT_FAILURE;
+        }
+        vm_set_output_callback(workers[i].vm, jobOutput, &workers[i]);
+    }
+
+    server.tcp = port != NULL;
+    server.listener = server.tcp ? listenTcp(host, port) : listenUnix(socketPath);
+    if (server.listener < 0) {
+        printf("Error: Could not listen on %s: %s\n", server.tcp ? port : socketPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    /* A client leaving before its response must not stop the server */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+    printf("=== SERVING ON %s%s%s WITH %d WORKERS ===\n", server.tcp ? host : socketPath,
+           server.tcp ? ":" : "", server.tcp ? port : "", nbrWorkers);
+    fflush(stdout);
+
+    for (i = 1; i < nbrWorkers; i++) {
+        if (pthread_create(&thread, NULL, worker, &workers[i]) != 0) {
+            printf("Error: Could not start worker %d\n", i);
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    worker(&workers[0]);
+    return EXIT_SUCCESS;
+}
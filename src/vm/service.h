@@ -0,0 +1,94 @@
+/** \headerfile service.h "service.h"
+ *  \brief Protocol of the execution service
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * vm-serve keeps a pool of VMs, created once, and runs the jobs its clients
+ * send on a Unix or TCP socket. A client sends requests on a connection and
+ * reads a response to each of them, in order, until it closes it.
+ *
+ * A request is a servicerequest_t followed by the name of the program, the
+ * image, if any, then the integers scall 0 reads, as int32_t. A response is
+ * a serviceresponse_t followed by the output of the program. Both are in the
+ * byte order of the host, as the files of the VM are.
+ *
+ * Images are cached by their hash, as snapshots of a VM that loaded them: a
+ * job names a cached image by its hash alone, and its VM restores the
+ * snapshot copy-on-write instead of loading the file. A client sends the
+ * hash first, and the image only if the server answers SERVICE_UNKNOWN_IMAGE.
+ * The hash is FNV-1a: the service trusts its clients not to forge images of
+ * the same hash.
+ */
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+#define SERVICE_REQUEST_MAGIC 0x51525641    // "AVRQ"
+#define SERVICE_RESPONSE_MAGIC 0x53525641   // "AVRS"
+#define SERVICE_VERSION 2
+
+/* Largest parts of a request and a response */
+#define SERVICE_MAX_NAME 4096               // bytes of the name of a program
+#define SERVICE_MAX_IMAGE (256 << 20)       // bytes of an image
+#define SERVICE_MAX_INPUTS (4 << 20)        // integers for scall 0
+#define SERVICE_MAX_OUTPUT (16 << 20)       // bytes of output kept, the rest is dropped
+
+/* Status of a response: VM_HALTED, VM_BUDGET_EXHAUSTED, VM_FAULT, or one of these */
+#define SERVICE_UNKNOWN_IMAGE 16    // the image of the hash is not cached: send it
+#define SERVICE_LOAD_ERROR 17       // the image cannot be loaded, error holds the errno
+#define SERVICE_BAD_REQUEST 18      // the request is not valid: the server closes the connection
+
+/* Flags of a response */
+#define SERVICE_CACHED 1            // the image came from the cache
+#define SERVICE_TRUNCATED 2         // the output was longer than SERVICE_MAX_OUTPUT
+
+/** @brief Header of a request */
+typedef struct {
+    uint32_t magic;         // SERVICE_REQUEST_MAGIC
+    uint16_t version;       // SERVICE_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    uint64_t imageHash;     // hash of the image, if imageBytes is 0
+    uint64_t imageBytes;    // size of the image following the name, 0 to run a cached one
+    uint64_t maxSteps;      // budget of the run, 0 for the limit of the server
+    uint32_t inputs;        // number of integers for scall 0
+    uint32_t nameBytes;     // size of the name, which the syscalls print, used if the image is loaded
+} servicerequest_t;
+
+/** @brief Header of a response */
+typedef struct {
+    uint32_t magic;         // SERVICE_RESPONSE_MAGIC
+    uint16_t version;       // SERVICE_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    int32_t status;         // VM_* or SERVICE_*
+    int32_t error;          // errno of SERVICE_LOAD_ERROR
+    uint32_t flags;         // SERVICE_*
+    uint32_t outputBytes;   // size of the output following the header
+    uint64_t imageHash;     // hash of the image that ran
+    uint64_t steps;         // instructions executed
+    uint64_t memUsed;       // bytes of memory the program held (see vm_mem_used)
+    uint64_t loadNanos;     // time taken to load or restore the image
+    uint64_t runNanos;      // time taken by the run
+    int32_t fault;          // VM_FAULT_* cause of a VM_FAULT status, at pc
+    uint32_t faultAddr;     // address of the fault (see vm_fault_t)
+    int32_t pc;
+    int32_t regs[NBR_REGS];
+} serviceresponse_t;
+
+/** @brief Hash of an image, FNV-1a on 64 bits */
+static inline uint64_t serviceHash(const void *data, size_t bytes) {
+    const unsigned char *p = data;
+    uint64_t h = 0xCBF29CE484222325ULL;
+    size_t i;
+    for (i = 0; i < bytes; i++) {
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/** \headerfile snapshot.h "snapshot.h"
+ *  \brief Snapshot files of the state of a VM
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * A snapshot is a header followed by, all little-endian:
+ *  - the program name, the output not flushed yet, the symbol table of the
+ *    object file and the control-flow graph of the code (see cfg.h), back
+ *    to back,
+ *  - the whole memory, from SNAP_ALIGN aligned offset memOffset.
+ * Blocks of memory that are zero are left as holes, so the file is sparse and
+ * only as large as the memory the program used. The memory is mapped
+ * copy-on-write when the snapshot is restored: every VM restored from one
+ * snapshot shares its pages until it writes to them.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "constants.h"
+
+#define SNAP_MAGIC 0x534D5641   // "AVMS"
+#define SNAP_VERSION 2
+#define SNAP_ALIGN (64 << 10)   // alignment of the memory, for the largest pages of the hosts
+
+/* Flags of the state */
+#define SNAP_RUNNING 1          // the program can be resumed
+#define SNAP_FAULTED 2          // the program stopped on an error
+
+/** @brief Header at the start of a snapshot */
+typedef struct {
+    uint32_t magic;         // SNAP_MAGIC
+    uint16_t version;       // SNAP_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    uint64_t memWords;      // size of memory, which the VM restored must have
+    uint64_t memOffset;     // offset of the memory in the file, in bytes
+    uint64_t steps;         // instructions executed since the program was loaded
+    int32_t regs[NBR_REGS];
+    int32_t pc;
+    uint32_t flags;         // SNAP_*
+    uint32_t nameBytes;
+    uint32_t outputBytes;
+    uint32_t symBytes;
+    uint32_t fault;         // VM_FAULT_* cause if SNAP_FAULTED, at pc
+    uint32_t faultAddr;     // address of the fault (see vm_fault_t)
+    uint32_t cfgBytes;      // size of the blocks of the graph, 0 if the VM had none
+} snapheader_t;
+
+#endif
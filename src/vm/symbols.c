@@ -0,0 +1,133 @@
+/** @file symbols.c
+ * @brief Symbol files written by the assembler.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "symbols.h"
+
+/** @brief Order labels by address */
+static int compareLabels(const void *a, const void *b) {
+    const symbol_t *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/** @brief Order source lines by address */
+static int compareLines(const void *a, const void *b) {
+    const sourceline_t *x = a, *y = b;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/** @brief Read the entries of a symbol file and sort them
+ * @param syms the table to fill, empty
+ * @param f the stream to read, closed on return
+ */
+static void readSymbols(symbols_t *syms, FILE *f) {
+    char *line = NULL;
+    size_t cap = 0;
+    int labelsSize = 0, linesSize = 0;
+    while (getline(&line, &cap, f) >= 0) {
+        unsigned int addr;
+        int lineno, offset = 0;
+        char name[256];
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "label %u %255s", &addr, name) == 2) {
+            if (syms->nbrLabels == labelsSize) {
+                labelsSize = labelsSize ? 2 * labelsSize : 64;
+                syms->labels = realloc(syms->labels, labelsSize * sizeof(symbol_t));
+            }
+            syms->labels[syms->nbrLabels].addr = addr;
+            syms->labels[syms->nbrLabels].name = strdup(name);
+            syms->nbrLabels++;
+        } else if (sscanf(line, "line %u %d %n", &addr, &lineno, &offset) == 2 && offset > 0) {
+            if (syms->nbrLines == linesSize) {
+                linesSize = linesSize ? 2 * linesSize : 256;
+                syms->lines = realloc(syms->lines, linesSize * sizeof(sourceline_t));
+            }
+            syms->lines[syms->nbrLines].addr = addr;
+            syms->lines[syms->nbrLines].line = lineno;
+            syms->lines[syms->nbrLines].text = strdup(line + offset);
+            syms->nbrLines++;
+        }
+    }
+    free(line);
+    fclose(f);
+    qsort(syms->labels, syms->nbrLabels, sizeof(symbol_t), compareLabels);
+    qsort(syms->lines, syms->nbrLines, sizeof(sourceline_t), compareLines);
+}
+
+int symbolsLoad(symbols_t *syms, const char *filename) {
+    FILE *f = fopen(filename, "r");
+    memset(syms, 0, sizeof(*syms));
+    if (f == NULL) {
+        return -1;
+    }
+    readSymbols(syms, f);
+    return 0;
+}
+
+int symbolsParse(symbols_t *syms, const char *text, size_t len) {
+    FILE *f = fmemopen((void *) text, len, "r");
+    memset(syms, 0, sizeof(*syms));
+    if (f == NULL) {
+        return -1;
+    }
+    readSymbols(syms, f);
+    return 0;
+}
+
+void symbolsFree(symbols_t *syms) {
+    int i;
+    for (i = 0; i < syms->nbrLabels; i++) {
+        free(syms->labels[i].name);
+    }
+    for (i = 0; i < syms->nbrLines; i++) {
+        free(syms->lines[i].text);
+    }
+    free(syms->labels);
+    free(syms->lines);
+    memset(syms, 0, sizeof(*syms));
+}
+
+const symbol_t *symbolsLabel(const symbols_t *syms, uint32_t addr) {
+    int lo = 0, hi = syms->nbrLabels;
+    /* First label after addr */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (syms->labels[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? &syms->labels[lo - 1] : NULL;
+}
+
+const sourceline_t *symbolsLine(const symbols_t *syms, uint32_t addr) {
+    int lo = 0, hi = syms->nbrLines;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (syms->lines[mid].addr < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (lo < syms->nbrLines && syms->lines[lo].addr == addr) ? &syms->lines[lo] : NULL;
+}
+
+void symbolsFormat(const symbols_t *syms, uint32_t addr, char *buf, int size) {
+    const symbol_t *label = syms != NULL ? symbolsLabel(syms, addr) : NULL;
+    if (label == NULL) {
+        snprintf(buf, size, "%u", addr);
+    } else if (label->addr == addr) {
+        snprintf(buf, size, "%s", label->name);
+    } else {
+        snprintf(buf, size, "%s+%u", label->name, addr - label->addr);
+    }
+}
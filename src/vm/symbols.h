@@ -0,0 +1,79 @@
+/** \headerfile symbols.h "symbols.h"
+ *  \brief Symbol files written by the assembler
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * A symbol file maps addresses back to the assembly source. It is a text
+ * file with one entry per line:
+ *
+ *     label <address> <name>
+ *     line <address> <source line number> <source text>
+ *
+ * Other lines (such as # comments) are ignored.
+ */
+
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** @brief A label and the address it names */
+typedef struct {
+    uint32_t addr;
+    char *name;
+} symbol_t;
+
+/** @brief The source line an address was assembled from */
+typedef struct {
+    uint32_t addr;
+    int line;
+    char *text;
+} sourceline_t;
+
+/** @brief Labels and source lines, sorted by address */
+typedef struct {
+    symbol_t *labels;
+    int nbrLabels;
+    sourceline_t *lines;
+    int nbrLines;
+} symbols_t;
+
+/** @brief Read a symbol file
+ * @param syms the table to fill
+ * @param filename the symbol file
+ * @return 0 on success, -1 if the file cannot be read
+ */
+int symbolsLoad(symbols_t *syms, const char *filename);
+
+/** @brief Read a symbol table held in memory, such as the one of an object file
+ * @param syms the table to fill
+ * @param text the entries, in the format of a symbol file
+ * @param len size of text in bytes
+ * @return 0 on success, -1 if out of memory
+ */
+int symbolsParse(symbols_t *syms, const char *text, size_t len);
+
+/** @brief Free a symbol table */
+void symbolsFree(symbols_t *syms);
+
+/** @brief Find the last label at or before an address
+ * @return the label, or NULL if there is none
+ */
+const symbol_t *symbolsLabel(const symbols_t *syms, uint32_t addr);
+
+/** @brief Find the source line of an address
+ * @return the line, or NULL if the address has none
+ */
+const sourceline_t *symbolsLine(const symbols_t *syms, uint32_t addr);
+
+/** @brief Format an address as label+offset, or as a plain number without label
+ * @param syms the symbol table, may be NULL
+ * @param addr the address
+ * @param buf buffer receiving the text
+ * @param size size of buf
+ */
+void symbolsFormat(const symbols_t *syms, uint32_t addr, char *buf, int size);
+
+#endif
@@ -0,0 +1,192 @@
+/** @file trace.c
+ * @brief Execution traces and their file format.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+/* Bytes of encoded records buffered before they are written */
+#define WRITE_BUFSIZE (64 << 10)
+
+int traceInit(trace_t *t, uint64_t records) {
+    memset(t, 0, sizeof(*t));
+    t->size = records;
+    t->recordsBytes = records * sizeof(tracerecord_t);
+    t->records = mmap(NULL, t->recordsBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->records == MAP_FAILED) {
+        t->records = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void traceFree(trace_t *t) {
+    if (t->records != NULL) {
+        munmap(t->records, t->recordsBytes);
+        t->records = NULL;
+    }
+}
+
+void traceReset(trace_t *t) {
+    t->next = 0;
+    t->count = 0;
+    t->lastReg = 0;
+}
+
+uint64_t traceRecords(const trace_t *t) {
+    return t->count < t->size ? t->count : t->size;
+}
+
+/** @brief Write a varint: 7 bits per byte, low bits first, high bit set on all bytes but the last */
+static uint8_t *putVarint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+/** @brief Map a difference to an unsigned number, small for small differences of both signs */
+static uint32_t zigzag(uint32_t delta) {
+    return (delta << 1) ^ (0u - (delta >> 31));
+}
+
+/** @brief Encode a record
+ * @param c state of the encoding
+ * @param out where to write, with room for TRACE_RECORD_MAX bytes
+ * @param r the record
+ * @return the byte after the record
+ */
+static uint8_t *encodeRecord(tracecodec_t *c, uint8_t *out, const tracerecord_t *r) {
+    int reg = traceReg(r->instr);
+    uint32_t slot = r->pc & (TRACE_CACHE - 1);
+    uint32_t delta = r->pc - (c->pc + 1);
+    int32_t old = c->values[reg];
+    int flags = (delta == 0 ? TRACE_PC_NEXT : 0)
+        | (c->cache[slot].pc == r->pc && c->cache[slot].instr == r->instr ? TRACE_SAME_INSTR : 0)
+        | (old == r->value ? TRACE_SAME_VALUE : 0);
+    /* The state is updated first: the bytes written could alias it as far as the compiler knows */
+    c->pc = r->pc;
+    c->values[reg] = r->value;
+    c->cache[slot].pc = r->pc;
+    c->cache[slot].instr = r->instr;
+    *out++ = (uint8_t) flags;
+    if (!(flags & TRACE_PC_NEXT)) {
+        out = putVarint(out, zigzag(delta));
+    }
+    if (!(flags & TRACE_SAME_INSTR)) {
+        out[0] = (uint8_t) r->instr;
+        out[1] = (uint8_t) (r->instr >> 8);
+        out[2] = (uint8_t) (r->instr >> 16);
+        out[3] = (uint8_t) (r->instr >> 24);
+        out += 4;
+    }
+    if (!(flags & TRACE_SAME_VALUE)) {
+        out = putVarint(out, zigzag((uint32_t) r->value - (uint32_t) old));
+    }
+    return out;
+}
+
+int traceWrite(const trace_t *t, const int *regs, FILE *out) {
+    uint64_t n = traceRecords(t);
+    uint64_t slot = t->count < t->size ? 0 : t->next;
+    uint64_t i;
+    tracecodec_t *codec = calloc(1, sizeof(tracecodec_t));
+    uint8_t *buf = malloc(WRITE_BUFSIZE);
+    uint8_t *end = buf;
+    int ret = 0;
+    if (codec == NULL || buf == NULL) {
+        ret = -1;
+        n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        tracerecord_t r = t->records[slot];
+        if (++slot == t->size) {
+            slot = 0;
+        }
+        /* The value of a record is in the slot after it, that of the newest one still in its register */
+        r.value = i + 1 < n ? t->records[slot].value : regs[t->lastReg];
+        end = encodeRecord(codec, end, &r);
+        if (end - buf > WRITE_BUFSIZE - TRACE_RECORD_MAX || i + 1 == n) {
+            if (fwrite(buf, 1, end - buf, out) != (size_t) (end - buf)) {
+                ret = -1;
+                break;
+            }
+            end = buf;
+        }
+    }
+    free(codec);
+    free(buf);
+    return ret;
+}
+
+/** @brief Read a varint written by putVarint
+ * @return 0 on success, -1 if the chunk ends within it
+ */
+static int getVarint(const uint8_t **in, const uint8_t *end, uint32_t *value) {
+    int shift = 0;
+    uint8_t byte;
+    *value = 0;
+    do {
+        if (*in == end || shift > 28) {
+            return -1;
+        }
+        byte = *(*in)++;
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return 0;
+}
+
+/** @brief Invert zigzag */
+static uint32_t unzigzag(uint32_t value) {
+    return (value >> 1) ^ (0u - (value & 1));
+}
+
+int traceDecode(tracecodec_t *c, const uint8_t **in, const uint8_t *end, tracerecord_t *r) {
+    uint32_t value;
+    uint32_t slot;
+    uint8_t flags;
+    int reg;
+    if (*in == end) {
+        return -1;
+    }
+    flags = *(*in)++;
+    r->pc = c->pc + 1;
+    if (!(flags & TRACE_PC_NEXT)) {
+        if (getVarint(in, end, &value) < 0) {
+            return -1;
+        }
+        r->pc += unzigzag(value);
+    }
+    slot = r->pc & (TRACE_CACHE - 1);
+    if (flags & TRACE_SAME_INSTR) {
+        r->instr = c->cache[slot].instr;
+    } else {
+        if (end - *in < 4) {
+            return -1;
+        }
+        r->instr = (*in)[0] | (*in)[1] << 8 | (*in)[2] << 16 | (uint32_t) (*in)[3] << 24;
+        *in += 4;
+        c->cache[slot].pc = r->pc;
+        c->cache[slot].instr = r->instr;
+    }
+    reg = traceReg(r->instr);
+    r->value = c->values[reg];
+    if (!(flags & TRACE_SAME_VALUE)) {
+        if (getVarint(in, end, &value) < 0) {
+            return -1;
+        }
+        r->value = (int32_t) ((uint32_t) r->value + unzigzag(value));
+        c->values[reg] = r->value;
+    }
+    c->pc = r->pc;
+    return 0;
+}
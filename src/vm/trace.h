@@ -0,0 +1,151 @@
+/** \headerfile trace.h "trace.h"
+ *  \brief Execution traces and their file format
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * A trace keeps the last instructions the VM executed in a ring: for each of
+ * them, its address, its word and the value its register holds once it ran.
+ * Like the profile counters, it is only recorded by the profiling instances
+ * of the engines (see engine.inc), so a VM without trace pays nothing for it.
+ * The engines store the records as they are, which costs a few stores per
+ * instruction; they are only compressed when the trace is saved.
+ *
+ * A trace file is a header followed by the program name, the symbol table of
+ * the object file and the records, oldest first. Each record is a byte of
+ * TRACE_* flags, followed by the fields these flags do not elide:
+ *  - the pc, as the zigzag varint of its distance to the pc after the
+ *    previous record,
+ *  - the instruction word, in 4 little-endian bytes; instructions are elided
+ *    when they are those last written in their entry of an instruction cache
+ *    of TRACE_CACHE words, indexed by the low bits of the pc,
+ *  - the value of the register, as the zigzag varint of its difference with
+ *    the value of the previous record of that register.
+ * Loops thus take one or two bytes per instruction.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "constants.h"
+
+#define TRACE_MAGIC 0x544D5641  // "AVMT"
+#define TRACE_VERSION 1
+#define TRACE_CACHE 4096        // entries of the instruction cache of the encoding, a power of two
+#define TRACE_RECORD_MAX 15     // largest size of an encoded record: flags, two varints and a word
+
+/* Flags of a record */
+#define TRACE_PC_NEXT 1         // the pc follows the one of the previous record
+#define TRACE_SAME_INSTR 2      // the instruction is the one in the cache entry of its pc
+#define TRACE_SAME_VALUE 4      // the register holds the value of its previous record
+
+/* Flags of the header */
+#define TRACE_FAULTED 1         // the program stopped on an error, at the last record or after it for VM_FAULT_PC
+
+/** @brief Header at the start of a trace file */
+typedef struct {
+    uint32_t magic;         // TRACE_MAGIC
+    uint16_t version;       // TRACE_VERSION
+    uint16_t headerWords;   // size of this header, in words
+    uint64_t records;       // number of records in the file
+    uint64_t first;         // instructions recorded since the program was loaded, before the first record
+    uint32_t flags;         // TRACE_*
+    uint32_t nameBytes;
+    uint32_t symBytes;
+    uint32_t fault;         // VM_FAULT_* cause if TRACE_FAULTED, 0 otherwise
+} traceheader_t;
+
+/** @brief One executed instruction */
+typedef struct {
+    uint32_t pc;
+    uint32_t instr;
+    int32_t value;      // register of the instruction (see traceReg), after it ran
+} tracerecord_t;
+
+/** @brief Ring of the last records
+ *
+ * The value of a record is only known once the next instruction is fetched:
+ * each slot of the ring holds the value of the record before it.
+ */
+typedef struct {
+    tracerecord_t *records;
+    size_t recordsBytes;
+    uint64_t size;      // capacity of the ring
+    uint64_t next;      // slot of the next record
+    uint64_t count;     // records since the last reset, including those overwritten
+    int lastReg;        // register of the newest record
+} trace_t;
+
+/** @brief State of the encoding, shared by the encoder and the decoder, zero at the start */
+typedef struct {
+    uint32_t pc;                // pc of the previous record
+    int32_t values[NBR_REGS];   // value of the previous record of each register
+    struct {
+        uint32_t pc;
+        uint32_t instr;
+    } cache[TRACE_CACHE];
+} tracecodec_t;
+
+/** @brief Register whose value is recorded with an instruction
+ * @return r20 for system calls, which read into it, and the rd field of the
+ *         word otherwise: the destination, the tested register of branches or
+ *         the stored one of stores
+ */
+static inline int traceReg(uint32_t instr) {
+    return (instr >> 26) == OPCODE_SCALL ? 20 : (instr >> 21) & 0x1F;
+}
+
+/** @brief Allocate a ring of the given number of records
+ * @return 0 on success, -1 if out of memory
+ */
+int traceInit(trace_t *t, uint64_t records);
+
+/** @brief Free the ring */
+void traceFree(trace_t *t);
+
+/** @brief Empty the ring */
+void traceReset(trace_t *t);
+
+/** @brief Record an instruction about to run
+ * @param t the ring
+ * @param regs registers of the VM, holding the results of the previous instruction
+ * @param pc address of the instruction
+ * @param instr its word
+ */
+static inline void traceInstr(trace_t *t, const int *regs, uint32_t pc, uint32_t instr) {
+    uint64_t next = t->next;
+    tracerecord_t *r = &t->records[next];
+    int value = regs[t->lastReg];
+    t->next = next + 1 == t->size ? 0 : next + 1;
+    t->count++;
+    t->lastReg = traceReg(instr);
+    r->pc = pc;
+    r->instr = instr;
+    r->value = value;
+}
+
+/** @brief Number of records traceWrite writes */
+uint64_t traceRecords(const trace_t *t);
+
+/** @brief Encode the records of the ring, oldest first
+ * @param t the ring
+ * @param regs registers of the VM, holding the result of the newest record
+ * @param out stream to write to, after the header, name and symbols
+ * @return 0 on success, -1 if out of memory or the stream cannot be written
+ */
+int traceWrite(const trace_t *t, const int *regs, FILE *out);
+
+/** @brief Decode the next record
+ * @param c state of the decoding, zero before the first record
+ * @param in next byte of the records, moved past the record
+ * @param end end of the records
+ * @param r the record
+ * @return 0 on success, -1 if the records end within this one
+ */
+int traceDecode(tracecodec_t *c, const uint8_t **in, const uint8_t *end, tracerecord_t *r);
+
+#endif
@@ -0,0 +1,249 @@
+/** @file tracedump.c
+ * @brief Decoder of the execution traces of the virtual machine.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ *
+ * Prints a trace saved by vm_trace_save, one instruction per line: its step,
+ * its address as a number and as label+offset, the instruction disassembled
+ * in the syntax of the assembler, the register it wrote (or tested, or
+ * stored) with its value, and the source line the instruction came from.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "constants.h"
+#include "isa.h"
+#include "symbols.h"
+#include "trace.h"
+#include "vm.h"
+
+/** @brief Disassemble an instruction word
+ * @param instr the word
+ * @param syms symbol table, to name the targets of jumps and branches, may be NULL
+ * @param buf buffer receiving the text
+ * @param size size of buf
+ */
+static void disassemble(uint32_t instr, const symbols_t *syms, char *buf, int size) {
+    decoded_t d;
+    char target[64];
+    const char *name;
+    decodeInstr(instr, &d);
+    name = opcodeName(d.opcode);
+    switch (opcodeType(d.opcode)) {
+        case TYPE_R:
+            snprintf(buf, size, "%s r%d, r%d, r%d", name, d.rd, d.rs1, d.rs2);
+            break;
+        case TYPE_I:
+            snprintf(buf, size, "%s r%d, r%d, %d", name, d.rd, d.rs1, (int) d.imm);
+            break;
+        case TYPE_JR:
+            snprintf(buf, size, "jmp r%d, r%d", d.rs1, d.rd);
+            break;
+        case TYPE_JI:
+            symbolsFormat(syms, d.addr, target, sizeof(target));
+            snprintf(buf, size, "jmp %s, r%d", target, d.rd);
+            break;
+        case TYPE_B:
+            symbolsFormat(syms, d.addr, target, sizeof(target));
+            snprintf(buf, size, "%s r%d, %s", name, d.rs1, target);
+            break;
+        case TYPE_S:
+            snprintf(buf, size, "scall %u", d.imm);
+            break;
+        case TYPE_V:
+            if (d.opcode == OPCODE_VCOPY || d.opcode == OPCODE_VSET) {
+                snprintf(buf, size, "%s r%d, r%d, r%u", name, d.rd, d.rs1, d.imm);
+            } else {
+                snprintf(buf, size, "%s r%d, r%d, r%d, r%u", name, d.rd, d.rs1, d.rs2, d.imm);
+            }
+            break;
+        case TYPE_A:
+            if (d.opcode == OPCODE_FENCE) {
+                snprintf(buf, size, "fence");
+            } else {
+                snprintf(buf, size, "%s r%d, r%d, r%d", name, d.rd, d.rs1, d.rs2);
+            }
+            break;
+        default:
+            if (d.opcode == OPCODE_STOP || d.opcode == 0) {
+                snprintf(buf, size, "stop");
+            } else {
+                snprintf(buf, size, "? 0x%08x", instr);
+            }
+            break;
+    }
+}
+
+/** @brief Read a field of the trace of the given size
+ * @return the field, null-terminated, or NULL if out of memory or the file is truncated
+ */
+static char *readField(FILE *f, uint32_t bytes) {
+    char *field = malloc(bytes + 1);
+    if (field != NULL && fread(field, 1, bytes, f) != bytes) {
+        free(field);
+        return NULL;
+    }
+    if (field != NULL) {
+        field[bytes] = '\0';
+    }
+    return field;
+}
+
+/** @brief Read the records of the trace
+ * @param f the trace, after the header, the name and the symbol table
+ * @param bytes set to the size of the records
+ * @return the records, or NULL if out of memory
+ */
+static uint8_t *readRecords(FILE *f, size_t *bytes) {
+    size_t size = 64 << 10;
+    uint8_t *data = malloc(size);
+    size_t n;
+    *bytes = 0;
+    while (data != NULL && (n = fread(data + *bytes, 1, size - *bytes, f)) > 0) {
+        *bytes += n;
+        if (*bytes == size) {
+            uint8_t *grown = realloc(data, size * 2);
+            if (grown == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+            size *= 2;
+        }
+    }
+    return data;
+}
+
+/** @brief Print a record
+ * @param r the record
+ * @param step instructions recorded before it since the program was loaded
+ * @param syms symbol table, may be NULL
+ */
+static void printRecord(const tracerecord_t *r, uint64_t step, const symbols_t *syms) {
+    char location[64], text[96], value[32];
+    const sourceline_t *line = syms != NULL ? symbolsLine(syms, r->pc) : NULL;
+    symbolsFormat(syms, r->pc, location, sizeof(location));
+    disassemble(r->instr, syms, text, sizeof(text));
+    value[0] = '\0';
+    if (opcodeType(r->instr >> 26) >= 0) {
+        snprintf(value, sizeof(value), "r%d = %d", traceReg(r->instr), r->value);
+    }
+    printf("%12llu %10u  %-20s %-28s ", (unsigned long long) step, r->pc, location, text);
+    if (line != NULL && line->addr == r->pc) {
+        printf("%-18s ; %d: %s\n", value, line->line, line->text);
+    } else {
+        printf("%s\n", value);
+    }
+}
+
+/** @brief Main function
+ *
+ * @param argc Number of arguments
+ * @param argv Array of arguments
+ * @return 1 if error, 0 if success
+ *
+ * ./vm-trace [--symbols file] [--last n] <trace file>
+ *
+ * --symbols reads the symbol file written by the assembler; by default, the
+ * symbol table saved with the trace is used.
+ * --last only prints the last n instructions of the trace.
+ */
+int main(int argc, char **argv) {
+    int i;
+    char *filename = NULL;
+    char *symfile = NULL;
+    uint64_t last = 0;
+    traceheader_t h;
+    tracecodec_t codec = { 0 };
+    tracerecord_t r;
+    uint8_t *data;
+    size_t bytes;
+    const uint8_t *in;
+    symbols_t syms;
+    int loaded = 0;
+    char *name;
+    char *symtext;
+    uint64_t n;
+    FILE *f;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc) {
+            symfile = argv[++i];
+        } else if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+            last = strtoull(argv[++i], NULL, 10);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        printf("Error: No trace file specified\n");
+        printf("Usage: %s [--symbols file] [--last n] <trace file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("Error: Could not open trace %s: %s\n", filename, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION
+        || h.headerWords * sizeof(uint32_t) < sizeof(h)) {
+        printf("Error: %s is not a trace\n", filename);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    fseek(f, (long) (h.headerWords * sizeof(uint32_t) - sizeof(h)), SEEK_CUR);
+    name = readField(f, h.nameBytes);
+    symtext = readField(f, h.symBytes);
+    if (name == NULL || symtext == NULL) {
+        printf("Error: Trace %s is truncated\n", filename);
+        free(name);
+        free(symtext);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    if (symfile != NULL) {
+        if (symbolsLoad(&syms, symfile) < 0) {
+            printf("Error: Could not read symbol file %s\n", symfile);
+        } else {
+            loaded = 1;
+        }
+    } else if (h.symBytes > 0 && symbolsParse(&syms, symtext, h.symBytes) == 0) {
+        loaded = 1;
+    }
+
+    printf("=== TRACE OF %s: %llu INSTRUCTIONS FROM STEP %llu ===\n", name,
+           (unsigned long long) h.records, (unsigned long long) h.first);
+    printf("%12s %10s  %-20s %-28s %s\n", "step", "address", "location", "instruction", "register");
+    data = readRecords(f, &bytes);
+    if (data == NULL) {
+        printf("Error: Could not read the records of %s\n", filename);
+    }
+    in = data;
+    for (n = 0; data != NULL && n < h.records; n++) {
+        if (traceDecode(&codec, &in, data + bytes, &r) < 0) {
+            printf("Error: Trace %s is truncated after %llu instructions\n", filename, (unsigned long long) n);
+            break;
+        }
+        if (last == 0 || h.records - n <= last) {
+            printRecord(&r, h.first + n, loaded ? &syms : NULL);
+        }
+    }
+    if (h.flags & TRACE_FAULTED) {
+        printf("=== THE PROGRAM STOPPED ON AN ERROR %s: %s ===\n",
+               h.fault == VM_FAULT_PC ? "AFTER THE LAST INSTRUCTION" : "AT THE LAST INSTRUCTION",
+               vm_fault_name((int) h.fault));
+    }
+
+    if (loaded) {
+        symbolsFree(&syms);
+    }
+    free(data);
+    free(name);
+    free(symtext);
+    fclose(f);
+    return EXIT_SUCCESS;
+}
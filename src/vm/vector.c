@@ -0,0 +1,187 @@
+/** @file vector.c
+ * @brief Host kernels of the vector instructions.
+ * @author Thomas Prévost, CSN 2024 @ ENSTA Bretagne
+ * @version 1.0
+ * @date 2022
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vector.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+/** @brief Number of words processed by each iteration of the SIMD kernels */
+#define LANES_AVX2 8
+#define LANES_NEON 4
+
+/**
+ * @brief Tell if a destination starts inside a source
+ * @param dst destination
+ * @param src source
+ * @param n number of words of both
+ * @return 1 if writing dst forward changes words of src still to be read
+ *
+ * Such blocks are left to the scalar loops, whose order defines the result.
+ */
+static int overlaps(const uint32_t *dst, const uint32_t *src, size_t n) {
+    return dst > src && dst < src + n;
+}
+
+static void addScalar(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] + b[i];
+    }
+}
+
+static void mulScalar(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] * b[i];
+    }
+}
+
+static uint32_t dotScalar(const uint32_t *a, const uint32_t *b, size_t n) {
+    uint32_t sum = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef HAVE_AVX2
+/* Only these functions use AVX2: the others run on any x86-64 */
+__attribute__((target("avx2")))
+static size_t addAvx2(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i + LANES_AVX2 <= n; i += LANES_AVX2) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_add_epi32(x, y));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t mulAvx2(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i + LANES_AVX2 <= n; i += LANES_AVX2) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_mullo_epi32(x, y));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t dotAvx2(const uint32_t *a, const uint32_t *b, size_t n, uint32_t *sum) {
+    __m256i acc = _mm256_setzero_si256();
+    __m128i half;
+    size_t i;
+    for (i = 0; i + LANES_AVX2 <= n; i += LANES_AVX2) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *) (b + i));
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(x, y));
+    }
+    half = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+    *sum = (uint32_t) _mm_cvtsi128_si32(half);
+    return i;
+}
+
+/** @brief Tell if the CPU runs the AVX2 kernels */
+static int hasAvx2(void) {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#ifdef HAVE_NEON
+static size_t addNeon(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i + LANES_NEON <= n; i += LANES_NEON) {
+        vst1q_u32(dst + i, vaddq_u32(vld1q_u32(a + i), vld1q_u32(b + i)));
+    }
+    return i;
+}
+
+static size_t mulNeon(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i;
+    for (i = 0; i + LANES_NEON <= n; i += LANES_NEON) {
+        vst1q_u32(dst + i, vmulq_u32(vld1q_u32(a + i), vld1q_u32(b + i)));
+    }
+    return i;
+}
+
+static size_t dotNeon(const uint32_t *a, const uint32_t *b, size_t n, uint32_t *sum) {
+    uint32x4_t acc = vdupq_n_u32(0);
+    size_t i;
+    for (i = 0; i + LANES_NEON <= n; i += LANES_NEON) {
+        acc = vmlaq_u32(acc, vld1q_u32(a + i), vld1q_u32(b + i));
+    }
+    *sum = vaddvq_u32(acc);
+    return i;
+}
+#endif
+
+void vecAdd(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t done = 0;
+    if (overlaps(dst, a, n) || overlaps(dst, b, n)) {
+        addScalar(dst, a, b, n);
+        return;
+    }
+#if defined(HAVE_AVX2)
+    if (hasAvx2()) {
+        done = addAvx2(dst, a, b, n);
+    }
+#elif defined(HAVE_NEON)
+    done = addNeon(dst, a, b, n);
+#endif
+    addScalar(dst + done, a + done, b + done, n - done);
+}
+
+void vecMul(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t done = 0;
+    if (overlaps(dst, a, n) || overlaps(dst, b, n)) {
+        mulScalar(dst, a, b, n);
+        return;
+    }
+#if defined(HAVE_AVX2)
+    if (hasAvx2()) {
+        done = mulAvx2(dst, a, b, n);
+    }
+#elif defined(HAVE_NEON)
+    done = mulNeon(dst, a, b, n);
+#endif
+    mulScalar(dst + done, a + done, b + done, n - done);
+}
+
+uint32_t vecDot(const uint32_t *a, const uint32_t *b, size_t n) {
+    uint32_t sum = 0;
+    size_t done = 0;
+#if defined(HAVE_AVX2)
+    if (hasAvx2()) {
+        done = dotAvx2(a, b, n, &sum);
+    }
+#elif defined(HAVE_NEON)
+    done = dotNeon(a, b, n, &sum);
+#endif
+    return sum + dotScalar(a + done, b + done, n - done);
+}
+
+void vecFill(uint32_t *dst, uint32_t value, size_t n) {
+    size_t i;
+    /* Simple enough for the compiler to vectorize */
+    for (i = 0; i < n; i++) {
+        dst[i] = value;
+    }
+}
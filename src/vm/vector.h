@@ -0,0 +1,55 @@
+/** \headerfile vector.h "vector.h"
+ *  \brief Host kernels of the vector instructions
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * The vector instructions operate on blocks of contiguous guest words. Each
+ * kernel runs over guest memory with the widest SIMD instructions of the
+ * host: AVX2 when the CPU has it, NEON on AArch64, plain C elsewhere. All of
+ * them compute modulo 2^32, like the scalar instructions, and give the same
+ * result as a loop over the words in increasing order.
+ */
+
+#ifndef VECTOR_H
+#define VECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Add two blocks of words: dst[i] = a[i] + b[i]
+ * @param dst destination, which may overlap the operands
+ * @param a first operand
+ * @param b second operand
+ * @param n number of words
+ */
+void vecAdd(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n);
+
+/**
+ * @brief Multiply two blocks of words: dst[i] = a[i] * b[i]
+ * @param dst destination, which may overlap the operands
+ * @param a first operand
+ * @param b second operand
+ * @param n number of words
+ */
+void vecMul(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n);
+
+/**
+ * @brief Dot product of two blocks of words
+ * @param a first operand
+ * @param b second operand
+ * @param n number of words
+ * @return the sum of a[i] * b[i]
+ */
+uint32_t vecDot(const uint32_t *a, const uint32_t *b, size_t n);
+
+/**
+ * @brief Fill a block of words with a value
+ * @param dst destination
+ * @param value word to store
+ * @param n number of words
+ */
+void vecFill(uint32_t *dst, uint32_t value, size_t n);
+
+#endif
@@ -8,375 +8,2360 @@
  * capable of reading and executing instructions from a binary file.
  */
 
+#define _GNU_SOURCE     // memfd_create, SEEK_DATA
+
 #include <stdio.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "constants.h" // Definitions of constants
+#include "vm.h"
+#include "output.h"
+#include "input.h"
+#include "isa.h"
+#include "jit.h"
+#include "perf.h"
+#include "profile.h"
+#include "symbols.h"
+#include "trace.h"
+#include "cfg.h"
+#include "object.h"
+#include "snapshot.h"
+#include "dump.h"
+#include "vector.h"
+
+#if defined(VM_THREADED_DISPATCH) && defined(__GNUC__)
+#define HAVE_THREADED_DISPATCH
+#define DEFAULT_ENGINE VM_ENGINE_THREADED
+#else
+#define DEFAULT_ENGINE VM_ENGINE_SWITCH
+#endif
+
+#if defined(VM_JIT)
+#define HAVE_JIT
+#endif
+
+/** @brief Harts a program spawned, and the threads running them (see spawnHart) */
+typedef struct {
+    pthread_mutex_t lock;   // guards the fields below, and the pages held, the input and the output of the program
+    pthread_cond_t changed; // broadcast when a hart stops or parks, and when the program pauses, resumes or stops
+    vm_t *vms[MAX_HARTS];   // VM of each hart not joined yet, NULL for the free ids; 0 is the VM of the host
+    pthread_t threads[MAX_HARTS];
+    int running[MAX_HARTS]; // 1 until the hart stops
+    int live;       // harts running
+    int parked;     // harts waiting for the program to resume, or for the hart they join
+    int paused;     // 1 between two runs of the program
+    int stopping;   // 1 once the program stops: the harts stop after their slice
+    uint64_t runs;  // runs of the program, which the harts whose scall 0 waits for input wait for
+    uint64_t steps; // steps of the harts, not counted in those of the program yet
+    uint64_t hostSteps; // steps of the VM of the host in this run, as of its last slice
+    uint64_t budget;    // steps all of them may run in this run of the program
+    vm_fault_t fault;   // first fault of a hart, which stops the program
+} harts_t;
+
+/** @brief State of one virtual machine */
+struct vm {
+    /* Memory */
+    u_int32_t *mem;
+    /* Decoded instruction cache, parallel to mem */
+    decoded_t *dcache;
+    /* 1 for each block of DUMP_BLOCK_WORDS words stored to since the last dump */
+    uint8_t *dirty;
+    /* 1 for each page of GUEST_PAGE_WORDS words the program holds: loaded or stored to */
+    uint8_t *touched;
+    /* Regs */
+    int regs[NBR_REGS];
+    /* Program counter */
+    int pc;
+
+    uint64_t memWords;  // size of mem in words
+    size_t memBytes;    // size of the mapping of mem
+    size_t dcacheBytes; // size of the mapping of dcache
+    size_t dirtyBytes;  // size of the mapping of dirty
+    size_t touchedBytes;    // size of the mapping of touched
+    uint64_t pagesUsed;     // pages marked in touched
+    uint64_t pageLimit;     // pages the program may hold, 0 for no limit
+    size_t mappedBytes; // bytes of an image file mapped over the start of mem
+    int hugePages;      // 1 if transparent huge pages are advised for mem
+    int isRunning;  // program runs while this is 1
+    vm_fault_t error;   // fault that stopped the program, of cause VM_FAULT_NONE if none
+    int waiting;    // 1 if the last run stopped on scall 0 waiting for input
+    int engine;     // VM_ENGINE_*
+    uint64_t steps; // instructions executed since load
+    uint64_t dumps; // dumps of memory taken since load
+
+    char *progname;
+    char *symbols;      // symbol table embedded in the object file, NULL if none
+    size_t symbolsLen;
+    cfg_t cfg;          // control-flow graph of the code, empty if it could not be built
+    input_t in;     // read by scall 0
+    output_t out;   // written by the other syscalls and error messages
+    profile_t *profile; // counters of the profiling engines, NULL when not profiling
+    trace_t *trace;     // last instructions run by the profiling engines, NULL when not tracing
+    perf_t *perf;       // performance counters of the host, NULL when not counting
+    jit_t *jit;         // compiled code of the tiered engine, NULL until it is selected
+    const void *lastEngine; // engine of the previous run, which owns the handlers in dcache
+
+    vm_t *root;         // VM of the host, for a hart: it shares its memory, input and output
+    harts_t *harts;     // harts of the program, NULL until it spawns one
+    int hartId;         // 0 for the VM of the host
+    int yielding;       // 1 when a system call returns to vm_run, which then runs the harts (see sysCall)
+    int joining;        // 1 if the last run stopped on scall 5, the budget spent before the hart did
+};
+
+/*--- The program itself ---*/
+
+/** @brief Map zeroed memory aligned for huge pages
+ * @param bytes size of the mapping, a multiple of HUGE_PAGE_SIZE
+ * @param hugePages 1 to advise transparent huge pages
+ * @param flags extra mmap flags
+ * @return the mapping, or NULL if out of memory
+ *
+ * Pages are only populated when first touched.
+ */
+static void *mapZeroed(size_t bytes, int hugePages, int flags) {
+    size_t extra = bytes + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    char *aligned;
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    /* Trim the mapping down to an aligned window */
+    aligned = (char *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (raw + extra > aligned + bytes) {
+        munmap(aligned + bytes, raw + extra - (aligned + bytes));
+    }
+#ifdef MADV_HUGEPAGE
+    if (hugePages) {
+        madvise(aligned, bytes, MADV_HUGEPAGE);
+    }
+#else
+    (void) hugePages;
+#endif
+    return aligned;
+}
+
+/** @brief Round a size up to a multiple of HUGE_PAGE_SIZE */
+static size_t roundHuge(uint64_t bytes) {
+    return (bytes + HUGE_PAGE_SIZE - 1) & ~(uint64_t) (HUGE_PAGE_SIZE - 1);
+}
+
+/*--- Harts ---*/
+
+/**
+ * @brief Lock what the harts of a program share
+ * @param vm the VM of a hart, or of the host
+ * @return the VM of the host, which holds the pages, the input and the output
+ *         of the program; it is locked if the program has harts
+ */
+static vm_t *lockShared(vm_t *vm) {
+    vm_t *root = vm->root != NULL ? vm->root : vm;
+    if (root->harts != NULL) {
+        pthread_mutex_lock(&root->harts->lock);
+    }
+    return root;
+}
+
+/** @brief Tell if the harts spent the budget of the run, with h->lock held */
+static inline int hartsSpent(const harts_t *h) {
+    return h->hostSteps + h->steps >= h->budget;
+}
+
+/** @brief Unlock the VM of the host locked by lockShared */
+static void unlockShared(vm_t *root) {
+    if (root->harts != NULL) {
+        pthread_mutex_unlock(&root->harts->lock);
+    }
+}
+
+/**
+ * @brief Create the VM of a hart
+ * @param root the VM of the host
+ * @return the VM, not running yet, or NULL if out of memory
+ *
+ * It shares the memory of the host, and the marks of the pages and blocks
+ * stored to, but has a decoded instruction cache of its own, and compiled
+ * code of its own with the tiered engine.
+ */
+static vm_t *createHart(vm_t *root) {
+    vm_t *hart = calloc(1, sizeof(vm_t));
+    if (hart == NULL) {
+        return NULL;
+    }
+    hart->root = root;
+    hart->mem = root->mem;
+    hart->memWords = root->memWords;
+    hart->dirty = root->dirty;
+    hart->touched = root->touched;
+    hart->progname = root->progname;
+    hart->engine = root->engine;
+    hart->dcacheBytes = root->dcacheBytes;
+    hart->dcache = mapZeroed(hart->dcacheBytes, 0, MAP_NORESERVE);
+    if (hart->dcache == NULL) {
+        free(hart);
+        return NULL;
+    }
+    if (hart->engine == VM_ENGINE_JIT) {
+        hart->jit = jitCreate(hart->memWords, hart->dcache, hart->dirty, hart->touched);
+        if (hart->jit == NULL) {
+            munmap(hart->dcache, hart->dcacheBytes);
+            free(hart);
+            return NULL;
+        }
+    }
+    return hart;
+}
+
+/** @brief Free the VM of a hart, whose thread is done */
+static void destroyHart(vm_t *hart) {
+    munmap(hart->dcache, hart->dcacheBytes);
+    jitDestroy(hart->jit);
+    free(hart);
+}
+
+/**
+ * @brief Thread of a hart: run it in slices until it stops, or the program does
+ * @param arg the VM of the hart
+ *
+ * Between two slices, the hart parks while the program is paused or has
+ * spent its budget, and after its scall 0 waited for input, until the next
+ * run of the program. A fault stops the program.
+ */
+static void *runHart(void *arg) {
+    vm_t *hart = arg;
+    harts_t *h = hart->root->harts;
+    int status = VM_BUDGET_EXHAUSTED;
+    uint64_t runs, steps, slice;
+
+    pthread_mutex_lock(&h->lock);
+    runs = h->runs;
+    while (status == VM_BUDGET_EXHAUSTED || status == VM_WAITING) {
+        while (!h->stopping && (h->paused || hartsSpent(h) || (status == VM_WAITING && runs == h->runs))) {
+            h->parked++;
+            pthread_cond_broadcast(&h->changed);
+            pthread_cond_wait(&h->changed, &h->lock);
+            h->parked--;
+        }
+        if (h->stopping) {
+            break;
+        }
+        runs = h->runs;
+        slice = h->budget - h->hostSteps - h->steps;
+        pthread_mutex_unlock(&h->lock);
+        steps = hart->steps;
+        status = vm_run(hart, slice < HART_SLICE ? slice : HART_SLICE);
+        pthread_mutex_lock(&h->lock);
+        h->steps += hart->steps - steps;
+    }
+    if (status == VM_FAULT && h->fault.cause == VM_FAULT_NONE) {
+        h->fault = hart->error;
+        h->fault.hart = hart->hartId;
+        h->stopping = 1;
+    }
+    h->running[hart->hartId] = 0;
+    h->live--;
+    pthread_cond_broadcast(&h->changed);
+    pthread_mutex_unlock(&h->lock);
+    return NULL;
+}
+
+/** @brief Wait for the threads of the harts, which are done, and free them */
+static void freeHarts(vm_t *vm) {
+    harts_t *h = vm->harts;
+    int id;
+    for (id = 1; id < MAX_HARTS; id++) {
+        if (h->vms[id] != NULL) {
+            pthread_join(h->threads[id], NULL);
+            destroyHart(h->vms[id]);
+        }
+    }
+    pthread_cond_destroy(&h->changed);
+    pthread_mutex_destroy(&h->lock);
+    free(h);
+    vm->harts = NULL;
+}
+
+/** @brief Stop the harts of a program after their slice, and free them
+ * @param vm the VM of the host
+ */
+static void stopHarts(vm_t *vm) {
+    harts_t *h = vm->harts;
+    if (h == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&h->lock);
+    h->stopping = 1;
+    pthread_cond_broadcast(&h->changed);
+    while (h->live > 0) {
+        pthread_cond_wait(&h->changed, &h->lock);
+    }
+    pthread_mutex_unlock(&h->lock);
+    freeHarts(vm);
+}
+
+/** @brief Let the harts of a program run again, as vm_run starts
+ * @param vm the VM of the host
+ * @param budget steps the run may take, of all the harts
+ */
+static void resumeHarts(vm_t *vm, uint64_t budget) {
+    harts_t *h = vm->harts;
+    pthread_mutex_lock(&h->lock);
+    h->paused = 0;
+    h->runs++;
+    h->hostSteps = 0;
+    h->budget = budget;
+    pthread_cond_broadcast(&h->changed);
+    pthread_mutex_unlock(&h->lock);
+}
+
+/**
+ * @brief Bring the harts of a program to rest, before vm_run returns
+ * @param vm the VM of the host
+ *
+ * They are stopped if the program stopped or one of them faulted, paused
+ * otherwise, after their slice. Their steps are counted with those of the
+ * program, and the fault of a hart becomes that of the program. Once every
+ * hart is joined, the program runs as if it never had any.
+ */
+static void settleHarts(vm_t *vm) {
+    harts_t *h = vm->harts;
+    int id, idle = 1;
+    pthread_mutex_lock(&h->lock);
+    if (!vm->isRunning || h->stopping) {
+        h->stopping = 1;
+    } else {
+        h->paused = 1;
+    }
+    pthread_cond_broadcast(&h->changed);
+    while (h->stopping ? h->live > 0 : h->parked < h->live) {
+        pthread_cond_wait(&h->changed, &h->lock);
+    }
+    vm->steps += h->steps;
+    h->steps = 0;
+    if (h->fault.cause != VM_FAULT_NONE && vm->error.cause == VM_FAULT_NONE) {
+        vm->error = h->fault;
+        vm->isRunning = 0;
+    }
+    for (id = 1; id < MAX_HARTS; id++) {
+        idle &= h->vms[id] == NULL;
+    }
+    pthread_mutex_unlock(&h->lock);
+    if (h->stopping || idle) {
+        freeHarts(vm);
+    }
+}
+
+/**
+ * @brief Count the steps of the VM of the host against the budget of the run
+ * @param vm the VM of the host
+ * @param budget steps the run may take, of all the harts
+ * @param steps steps of the VM of the host in this run
+ * @return the steps all the harts took in this run, or budget if the program
+ *         stops, a hart having faulted
+ *
+ * The harts spawned since the run started wait for it to set the budget.
+ */
+static uint64_t syncHarts(vm_t *vm, uint64_t budget, uint64_t steps) {
+    harts_t *h = vm->harts;
+    uint64_t spent;
+    pthread_mutex_lock(&h->lock);
+    h->hostSteps = steps;
+    h->budget = budget;
+    spent = h->stopping ? budget : steps + h->steps;
+    /* Wake the harts that join another one: they stop waiting for it */
+    if (spent >= budget) {
+        pthread_cond_broadcast(&h->changed);
+    }
+    pthread_mutex_unlock(&h->lock);
+    return spent;
+}
+
+vm_t *vm_create(void) {
+    return vm_create_config(NULL);
+}
+
+vm_t *vm_create_config(const vm_config_t *config) {
+    uint64_t words = (config != NULL && config->mem_words != 0) ? config->mem_words : MEMSIZE;
+    uint64_t limit = config != NULL ? config->mem_limit : 0;
+    vm_t *vm;
+    if (words > MAX_MEMSIZE || (limit != 0 && limit < GUEST_PAGE_WORDS * sizeof(u_int32_t))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    vm = calloc(1, sizeof(vm_t));
+    if (vm == NULL) {
+        return NULL;
+    }
+    vm->memWords = words;
+    vm->hugePages = config != NULL && config->huge_pages;
+    vm->pageLimit = limit / (GUEST_PAGE_WORDS * sizeof(u_int32_t));
+    /* Anonymous mappings: populated lazily, and vm_load_mapped can map an image over mem */
+    vm->memBytes = roundHuge(words * sizeof(u_int32_t));
+    vm->dcacheBytes = roundHuge(words * sizeof(decoded_t));
+    vm->dirtyBytes = roundHuge((words + DUMP_BLOCK_WORDS - 1) >> DUMP_BLOCK_SHIFT);
+    vm->touchedBytes = roundHuge((words + GUEST_PAGE_WORDS - 1) >> GUEST_PAGE_SHIFT);
+    /* They only hold what the guest touches: no need to reserve swap for all of them */
+    vm->mem = mapZeroed(vm->memBytes, vm->hugePages, MAP_NORESERVE);
+    vm->dcache = mapZeroed(vm->dcacheBytes, 0, MAP_NORESERVE);
+    vm->dirty = mapZeroed(vm->dirtyBytes, 0, MAP_NORESERVE);
+    vm->touched = mapZeroed(vm->touchedBytes, 0, MAP_NORESERVE);
+    if (vm->mem == NULL || vm->dcache == NULL || vm->dirty == NULL || vm->touched == NULL
+        || outputInit(&vm->out) < 0) {
+        vm_destroy(vm);
+        return NULL;
+    }
+    vm->engine = DEFAULT_ENGINE;
+    inputInit(&vm->in);
+    return vm;
+}
+
+void vm_destroy(vm_t *vm) {
+    if (vm == NULL) {
+        return;
+    }
+    stopHarts(vm);
+    if (vm->mem != NULL) {
+        munmap(vm->mem, vm->memBytes);
+    }
+    if (vm->dcache != NULL) {
+        munmap(vm->dcache, vm->dcacheBytes);
+    }
+    if (vm->dirty != NULL) {
+        munmap(vm->dirty, vm->dirtyBytes);
+    }
+    if (vm->touched != NULL) {
+        munmap(vm->touched, vm->touchedBytes);
+    }
+    outputFree(&vm->out);
+    inputFree(&vm->in);
+    jitDestroy(vm->jit);
+    if (vm->profile != NULL) {
+        profileFree(vm->profile);
+        free(vm->profile);
+    }
+    if (vm->trace != NULL) {
+        traceFree(vm->trace);
+        free(vm->trace);
+    }
+    if (vm->perf != NULL) {
+        perfClose(vm->perf);
+        free(vm->perf);
+    }
+    free(vm->progname);
+    free(vm->symbols);
+    cfgFree(&vm->cfg);
+    free(vm);
+}
+
+/** @brief Give pages back to the system, they read as zero on next touch
+ * @param addr start of the range, page aligned
+ * @param bytes size of the range
+ * @return 0 on success, -1 on error
+ */
+static int dropPages(void *addr, size_t bytes) {
+    return madvise(addr, bytes, MADV_DONTNEED);
+}
+
+/** @brief Reset memory, registers and execution state before loading a program
+ * @param vm the VM
+ * @return 0 on success, -1 if memory could not be reset
+ */
+static int resetVM(vm_t *vm) {
+    stopHarts(vm);
+    if (vm->mappedBytes > 0) {
+        /* Replace the file mapping of the previous image with zero pages */
+        if (mmap(vm->mem, vm->mappedBytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        if (vm->hugePages) {
+            madvise(vm->mem, vm->mappedBytes, MADV_HUGEPAGE);
+        }
+#endif
+    }
+    if (dropPages(vm->mem, vm->memBytes) < 0 || dropPages(vm->dcache, vm->dcacheBytes) < 0
+        || dropPages(vm->dirty, vm->dirtyBytes) < 0 || dropPages(vm->touched, vm->touchedBytes) < 0) {
+        return -1;
+    }
+    if (vm->profile != NULL) {
+        profileReset(vm->profile);
+    }
+    if (vm->trace != NULL) {
+        traceReset(vm->trace);
+    }
+    if (vm->perf != NULL) {
+        perfReset(vm->perf);
+    }
+    if (vm->jit != NULL) {
+        jitReset(vm->jit);
+    }
+    vm->mappedBytes = 0;
+    vm->pagesUsed = 0;
+    free(vm->symbols);
+    vm->symbols = NULL;
+    vm->symbolsLen = 0;
+    cfgFree(&vm->cfg);
+    memset(vm->regs, 0, sizeof(vm->regs));
+    vm->pc = 0;
+    vm->steps = 0;
+    vm->dumps = 0;
+    vm->isRunning = 0;
+    memset(&vm->error, 0, sizeof(vm->error));
+    return 0;
+}
+
+/** @brief Tell if a block of memory is all zeros */
+static int isZero(const u_int32_t *words, size_t count) {
+    u_int32_t any = 0;
+    size_t i;
+    for (i = 0; i < count; i++) {
+        any |= words[i];
+    }
+    return any == 0;
+}
+
+/** @brief Count the pages of a block of memory as held by the program
+ * @param vm the VM
+ * @param address first word of the block, which is in bounds
+ * @param words number of words
+ * @return 0 on success, -1 if the pages it did not hold yet take the program
+ *         over its memory limit: none of them is counted then
+ */
+static int holdPages(vm_t *vm, uint64_t address, uint64_t words) {
+    uint64_t first = address >> GUEST_PAGE_SHIFT;
+    uint64_t last, page, added = 0;
+    vm_t *root;
+    int ret = -1;
+    if (words == 0) {
+        return 0;
+    }
+    last = (address + words - 1) >> GUEST_PAGE_SHIFT;
+    /* The harts hold the pages of the program */
+    root = lockShared(vm);
+    for (page = first; page <= last; page++) {
+        added += !root->touched[page];
+    }
+    if (root->pageLimit == 0 || root->pagesUsed + added <= root->pageLimit) {
+        for (page = first; page <= last; page++) {
+            root->touched[page] = 1;
+        }
+        root->pagesUsed += added;
+        ret = 0;
+    }
+    unlockShared(root);
+    return ret;
+}
+
+/** @brief Read a section of a file into memory
+ * @param vm the VM
+ * @param fd the file
+ * @param offset offset of the section in the file
+ * @param bytes size of the section, a multiple of the word size
+ * @param addr address the section is loaded at, in words
+ * @return 0 on success, -1 with errno set if the file cannot be read
+ *
+ * A section cut short by the end of the file is loaded as far as it goes.
+ */
+static int readSection(vm_t *vm, int fd, off_t offset, size_t bytes, uint64_t addr) {
+    char *dest = (char *) (vm->mem + addr);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = pread(fd, dest + done, bytes - done, offset + done);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return -1;
+            }
+            break;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Map a section of a file copy-on-write straight into memory
+ * @param vm the VM
+ * @param fd the file
+ * @param offset offset of the section in the file
+ * @param bytes size of the section, a multiple of the word size
+ * @param addr address the section is loaded at, in words
+ * @return 0 on success, -1 with errno set if the file cannot be mapped
+ *
+ * Pages of the section are only read from the page cache when the guest
+ * touches them, and only copied when it writes to them. A section that does
+ * not start on a page both in the file and in memory is read instead.
+ */
+static int mapSection(vm_t *vm, int fd, off_t offset, size_t bytes, uint64_t addr) {
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = addr * sizeof(u_int32_t);
+    size_t end = start + bytes;
+    size_t tail = end % page;
+    if (bytes == 0) {
+        return 0;
+    }
+    if (offset % page != 0 || start % page != 0) {
+        return readSection(vm, fd, offset, bytes, addr);
+    }
+    if (mmap((char *) vm->mem + start, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        return -1;
+    }
+    if (end > vm->mappedBytes) {
+        vm->mappedBytes = end;
+    }
+    /* The rest of the last page holds whatever follows the section in the file */
+    if (tail != 0) {
+        memset((char *) vm->mem + end, 0, page - tail);
+    }
+    return 0;
+}
+
+/** @brief Load the sections of an object file
+ * @param vm the VM
+ * @param fd the file
+ * @param size size of the file in bytes
+ * @param loader readSection or mapSection
+ * @return 0 on success, -1 with errno set: ENOEXEC if the header is invalid,
+ *         EFBIG if a section does not fit in memory
+ *
+ * The control-flow graph of the code is built if the file has none.
+ */
+static int loadObject(vm_t *vm, int fd, size_t size,
+                      int (*loader)(vm_t *, int, off_t, size_t, uint64_t)) {
+    objheader_t h;
+    cfgblock_t *blocks;
+    memset(&h, 0, sizeof(h));
+    if (pread(fd, &h, sizeof(h), 0) < (ssize_t) (OBJ_HEADER_MIN * sizeof(u_int32_t))) {
+        errno = ENOEXEC;
+        return -1;
+    }
+    /* What follows a header without a graph is not part of it */
+    if (h.headerWords * sizeof(u_int32_t) < sizeof(h)) {
+        h.cfgOffset = 0;
+        h.cfgBytes = 0;
+    }
+    /* Every section must lie inside the file */
+    if (h.version != OBJ_VERSION || h.headerWords < OBJ_HEADER_MIN
+        || h.codeOffset % sizeof(u_int32_t) != 0 || h.dataOffset % sizeof(u_int32_t) != 0
+        || (uint64_t) h.codeOffset + (uint64_t) h.codeWords * sizeof(u_int32_t) > size
+        || (uint64_t) h.dataOffset + (uint64_t) h.dataWords * sizeof(u_int32_t) > size
+        || (uint64_t) h.symOffset + h.symBytes > size
+        || (uint64_t) h.cfgOffset + h.cfgBytes > size
+        || (h.dataWords > 0 && h.dataAddr < h.codeWords)) {
+        errno = ENOEXEC;
+        return -1;
+    }
+    if (h.codeWords > vm->memWords || (uint64_t) h.dataAddr + h.dataWords > vm->memWords
+        || h.entry >= vm->memWords) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (holdPages(vm, 0, h.codeWords) < 0 || holdPages(vm, h.dataAddr, h.dataWords) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (loader(vm, fd, h.codeOffset, (size_t) h.codeWords * sizeof(u_int32_t), 0) < 0
+        || loader(vm, fd, h.dataOffset, (size_t) h.dataWords * sizeof(u_int32_t), h.dataAddr) < 0) {
+        return -1;
+    }
+    /* Kept as text: it is only parsed if a profile report asks for it */
+    if (h.symBytes > 0) {
+        vm->symbols = malloc(h.symBytes);
+        if (vm->symbols == NULL || pread(fd, vm->symbols, h.symBytes, h.symOffset) != (ssize_t) h.symBytes) {
+            free(vm->symbols);
+            vm->symbols = NULL;
+            errno = ENOEXEC;
+            return -1;
+        }
+        vm->symbolsLen = h.symBytes;
+    }
+    if (h.cfgBytes == 0) {
+        if (cfgBuild(&vm->cfg, vm->mem, h.codeWords, h.entry) < 0) {
+            return -1;
+        }
+    } else {
+        blocks = malloc(h.cfgBytes);
+        if (blocks == NULL || pread(fd, blocks, h.cfgBytes, h.cfgOffset) != (ssize_t) h.cfgBytes) {
+            free(blocks);
+            errno = ENOEXEC;
+            return -1;
+        }
+        /* The blocks are freed if they are rejected */
+        if (cfgParse(&vm->cfg, blocks, h.cfgBytes, h.codeWords) < 0) {
+            errno = ENOEXEC;
+            return -1;
+        }
+    }
+    vm->pc = (int) h.entry;
+    return 0;
+}
+
+/** @brief Count the pages of a range of memory that are not zero as held
+ * @param vm the VM
+ * @param first first page
+ * @param last page after the range
+ * @return 0 on success, -1 if they take the program over its memory limit
+ */
+static int holdWritten(vm_t *vm, uint64_t first, uint64_t last) {
+    uint64_t page;
+    for (page = first; page < last; page++) {
+        uint64_t addr = page << GUEST_PAGE_SHIFT;
+        uint64_t words = vm->memWords - addr < GUEST_PAGE_WORDS ? vm->memWords - addr : GUEST_PAGE_WORDS;
+        if (!isZero(vm->mem + addr, words) && holdPages(vm, addr, words) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Count the pages of a restored snapshot that are not zero as held
+ * @param vm the VM, with the memory of the snapshot loaded
+ * @param fd the file
+ * @param offset offset of the memory in the file
+ * @return 0 on success, -1 with errno set to ENOMEM if they take the program
+ *         over its memory limit
+ *
+ * Snapshots leave the blocks of memory that are zero as holes: only the
+ * others are read through, or all of memory where the file system cannot
+ * tell where the holes are.
+ */
+static int holdSnapshot(vm_t *vm, int fd, off_t offset) {
+    uint64_t pages = (vm->memWords + GUEST_PAGE_WORDS - 1) >> GUEST_PAGE_SHIFT;
+    uint64_t page = 0;
+    off_t pageBytes = GUEST_PAGE_WORDS * sizeof(u_int32_t);
+#ifdef SEEK_DATA
+    while (page < pages) {
+        off_t data = lseek(fd, offset + (off_t) page * pageBytes, SEEK_DATA);
+        off_t hole;
+        uint64_t last;
+        if (data < 0 && errno == ENXIO) {
+            return 0;   // only holes from page on
+        }
+        hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            break;      // the file system cannot tell
+        }
+        page = (uint64_t) (data - offset) / pageBytes;
+        last = (uint64_t) (hole - offset + pageBytes - 1) / pageBytes;
+        if (holdWritten(vm, page, last < pages ? last : pages) < 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        page = last;
+    }
+#else
+    (void) fd;
+    (void) offset;
+    (void) pageBytes;
+#endif
+    if (holdWritten(vm, page, pages) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Restore the state saved in a snapshot file
+ * @param vm the VM, reset
+ * @param fd the file
+ * @param size size of the file in bytes
+ * @param loader readSection or mapSection, for the memory
+ * @return 0 on success, -1 with errno set: ENOEXEC if the header is invalid,
+ *         EINVAL if the memory of the VM is not the size of that of the snapshot
+ */
+static int restoreState(vm_t *vm, int fd, size_t size,
+                        int (*loader)(vm_t *, int, off_t, size_t, uint64_t)) {
+    snapheader_t h;
+    uint64_t strings;
+    uint64_t cfgWords = 0;
+    char *name;
+    char *syms = NULL;
+    cfgblock_t *blocks = NULL;
+    uint32_t i;
+    if (pread(fd, &h, sizeof(h), 0) != (ssize_t) sizeof(h)) {
+        errno = ENOEXEC;
+        return -1;
+    }
+    strings = (uint64_t) h.headerWords * sizeof(u_int32_t);
+    if (h.magic != SNAP_MAGIC || h.version != SNAP_VERSION || strings < sizeof(h)
+        || h.memOffset % SNAP_ALIGN != 0 || h.outputBytes > OUTPUT_BUFSIZE
+        || strings + h.nameBytes + h.outputBytes + h.symBytes + h.cfgBytes > h.memOffset
+        || h.memOffset + h.memWords * sizeof(u_int32_t) > size) {
+        errno = ENOEXEC;
+        return -1;
+    }
+    if (h.memWords != vm->memWords) {
+        errno = EINVAL;
+        return -1;
+    }
+    name = malloc(h.nameBytes + 1);
+    if (h.symBytes > 0) {
+        syms = malloc(h.symBytes);
+    }
+    if (h.cfgBytes > 0) {
+        blocks = malloc(h.cfgBytes);
+    }
+    if (name == NULL || (h.symBytes > 0 && syms == NULL) || (h.cfgBytes > 0 && blocks == NULL)) {
+        free(name);
+        free(syms);
+        free(blocks);
+        return -1;
+    }
+    outputFlush(&vm->out);
+    if (pread(fd, name, h.nameBytes, strings) != (ssize_t) h.nameBytes
+        || pread(fd, vm->out.buf, h.outputBytes, strings + h.nameBytes) != (ssize_t) h.outputBytes
+        || pread(fd, syms, h.symBytes, strings + h.nameBytes + h.outputBytes) != (ssize_t) h.symBytes
+        || pread(fd, blocks, h.cfgBytes, strings + h.nameBytes + h.outputBytes + h.symBytes)
+           != (ssize_t) h.cfgBytes) {
+        free(name);
+        free(syms);
+        free(blocks);
+        errno = ENOEXEC;
+        return -1;
+    }
+    name[h.nameBytes] = '\0';
+    free(vm->progname);
+    vm->progname = name;
+    vm->symbols = syms;
+    vm->symbolsLen = h.symBytes;
+    vm->out.len = h.outputBytes;
+    /* The blocks cover the code from address 0: their sum is its size */
+    for (i = 0; i < h.cfgBytes / sizeof(cfgblock_t); i++) {
+        cfgWords += blocks[i].words;
+    }
+    if (cfgWords > h.memWords) {
+        free(blocks);
+        errno = ENOEXEC;
+        return -1;
+    }
+    if (blocks != NULL && cfgParse(&vm->cfg, blocks, h.cfgBytes, (uint32_t) cfgWords) < 0) {
+        errno = ENOEXEC;
+        return -1;
+    }
+    if (loader(vm, fd, h.memOffset, h.memWords * sizeof(u_int32_t), 0) < 0
+        || holdSnapshot(vm, fd, h.memOffset) < 0) {
+        return -1;
+    }
+    memcpy(vm->regs, h.regs, sizeof(vm->regs));
+    vm->pc = h.pc;
+    vm->steps = h.steps;
+    vm->isRunning = (h.flags & SNAP_RUNNING) != 0;
+    memset(&vm->error, 0, sizeof(vm->error));
+    if (h.flags & SNAP_FAULTED) {
+        vm->error.cause = (int) h.fault;
+        vm->error.pc = h.pc;
+        vm->error.addr = h.faultAddr;
+    }
+    return 0;
+}
+
+/** @brief Load an object file, or a raw image at address 0
+ * @param vm the VM
+ * @param fd the file, read from offset 0
+ * @param loader readSection or mapSection
+ * @return 0 on success, -1 with errno set (EFBIG if the program does not fit in memory)
+ *
+ * Only whole 32-bit words of a raw image are loaded: trailing bytes are ignored.
+ * Snapshots are restored instead.
+ */
+static int loadFile(vm_t *vm, int fd, int (*loader)(vm_t *, int, off_t, size_t, uint64_t)) {
+    struct stat st;
+    uint32_t magic;
+    int ret;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (pread(fd, &magic, sizeof(magic), 0) != (ssize_t) sizeof(magic)) {
+        magic = 0;
+    }
+    if (magic == OBJ_MAGIC) {
+        ret = loadObject(vm, fd, st.st_size, loader);
+    } else if (magic == SNAP_MAGIC) {
+        ret = restoreState(vm, fd, st.st_size, loader);
+    } else if ((uint64_t) st.st_size > vm->memWords * sizeof(u_int32_t)) {
+        errno = EFBIG;
+        ret = -1;
+    } else if (holdPages(vm, 0, st.st_size / sizeof(u_int32_t)) < 0) {
+        errno = ENOMEM;
+        ret = -1;
+    } else {
+        ret = loader(vm, fd, 0, st.st_size - st.st_size % sizeof(u_int32_t), 0);
+        if (ret == 0) {
+            ret = cfgBuild(&vm->cfg, vm->mem, (uint32_t) (st.st_size / sizeof(u_int32_t)), 0);
+        }
+    }
+    return ret;
+}
+
+/** @brief Let the JIT compile the loops of the program sooner than the other blocks
+ * @param vm the VM, with the tiered engine
+ */
+static void hintLoops(vm_t *vm) {
+    uint32_t i;
+    for (i = 0; i < vm->cfg.nbrBlocks; i++) {
+        if (vm->cfg.blocks[i].flags & CFG_LOOP) {
+            jitHintLoop(vm->jit, vm->cfg.blocks[i].start);
+        }
+    }
+}
+
+/** @brief Load a program with the given section loader
+ * @param vm the VM
+ * @param fd the file, or -1 to open the file called name
+ * @param name name of the program
+ * @param loader readSection or mapSection
+ * @return 0 on success, -1 with errno set on error
+ */
+static int loadWith(vm_t *vm, int fd, const char *name,
+                    int (*loader)(vm_t *, int, off_t, size_t, uint64_t)) {
+    int opened = -1;
+    int ret;
+    if (resetVM(vm) < 0) {
+        return -1;
+    }
+    free(vm->progname);
+    vm->progname = strdup(name);
+    if (fd < 0) {
+        fd = opened = open(name, O_RDONLY);
+    }
+    /* A snapshot restores its own state */
+    vm->isRunning = 1;
+    ret = vm->progname == NULL || fd < 0 ? -1 : loadFile(vm, fd, loader);
+    if (opened >= 0) {
+        close(opened);
+    }
+    if (ret < 0) {
+        vm->isRunning = 0;
+        return -1;
+    }
+    if (vm->jit != NULL) {
+        hintLoops(vm);
+    }
+    return 0;
+}
+
+int vm_load(vm_t *vm, const char *filename) {
+    return loadWith(vm, -1, filename, readSection);
+}
+
+int vm_load_mapped(vm_t *vm, const char *filename) {
+    return loadWith(vm, -1, filename, mapSection);
+}
+
+
+/*--- Snapshots ---*/
+
+/** @brief Snapshot of a VM: a file in the format of snapshot.h */
+struct vm_snapshot {
+    int fd;
+};
+
+/** @brief Write a buffer at an offset of a file
+ * @return 0 on success, -1 with errno set on error
+ */
+static int writeAt(int fd, const void *data, size_t bytes, off_t offset) {
+    const char *src = data;
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t n = pwrite(fd, src + done, bytes - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+/** @brief Write the state of a VM in the format of snapshot.h
+ * @param vm the VM
+ * @param fd an empty file
+ * @return 0 on success, -1 with errno set if the file cannot be written
+ */
+static int writeSnapshot(const vm_t *vm, int fd) {
+    snapheader_t h;
+    uint64_t memBytes = vm->memWords * sizeof(u_int32_t);
+    uint64_t offset;
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAP_MAGIC;
+    h.version = SNAP_VERSION;
+    h.headerWords = sizeof(h) / sizeof(u_int32_t);
+    h.memWords = vm->memWords;
+    h.steps = vm->steps;
+    memcpy(h.regs, vm->regs, sizeof(h.regs));
+    h.pc = vm->pc;
+    h.flags = (vm->isRunning ? SNAP_RUNNING : 0) | (vm->error.cause != VM_FAULT_NONE ? SNAP_FAULTED : 0);
+    h.fault = vm->error.cause;
+    h.faultAddr = vm->error.addr;
+    h.nameBytes = vm->progname != NULL ? strlen(vm->progname) : 0;
+    h.outputBytes = vm->out.len;
+    h.symBytes = vm->symbolsLen;
+    h.cfgBytes = vm->cfg.nbrBlocks * sizeof(cfgblock_t);
+    offset = sizeof(h) + h.nameBytes + h.outputBytes + h.symBytes + h.cfgBytes;
+    h.memOffset = (offset + SNAP_ALIGN - 1) / SNAP_ALIGN * SNAP_ALIGN;
+    if (writeAt(fd, &h, sizeof(h), 0) < 0
+        || writeAt(fd, vm->progname, h.nameBytes, sizeof(h)) < 0
+        || writeAt(fd, vm->out.buf, h.outputBytes, sizeof(h) + h.nameBytes) < 0
+        || writeAt(fd, vm->symbols, h.symBytes, sizeof(h) + h.nameBytes + h.outputBytes) < 0
+        || writeAt(fd, vm->cfg.blocks, h.cfgBytes,
+                   sizeof(h) + h.nameBytes + h.outputBytes + h.symBytes) < 0) {
+        return -1;
+    }
+    /* Zero blocks stay holes; the size of the file covers the last page a restore maps */
+    for (offset = 0; offset < memBytes; offset += SNAP_ALIGN) {
+        size_t bytes = memBytes - offset < SNAP_ALIGN ? memBytes - offset : SNAP_ALIGN;
+        const u_int32_t *block = vm->mem + offset / sizeof(u_int32_t);
+        if (!isZero(block, bytes / sizeof(u_int32_t))
+            && writeAt(fd, block, bytes, h.memOffset + offset) < 0) {
+            return -1;
+        }
+    }
+    return ftruncate(fd, h.memOffset + (memBytes + SNAP_ALIGN - 1) / SNAP_ALIGN * SNAP_ALIGN);
+}
+
+/** @brief Create an anonymous file, in memory where the system allows it
+ * @return the file descriptor, or -1 with errno set
+ */
+static int anonymousFile(void) {
+#ifdef MFD_CLOEXEC
+    return memfd_create("archivm-snapshot", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/archivm-snapshot-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+    return fd;
+#endif
+}
+
+int vm_load_image(vm_t *vm, const void *data, size_t bytes, const char *name) {
+    int ret;
+    int fd = anonymousFile();
+    if (fd < 0) {
+        return -1;
+    }
+    /* Through a file, to load it as any other */
+    ret = writeAt(fd, data, bytes, 0);
+    if (ret == 0) {
+        ret = loadWith(vm, fd, name, readSection);
+    }
+    close(fd);
+    return ret;
+}
+
+vm_snapshot_t *vm_snapshot(const vm_t *vm) {
+    vm_snapshot_t *snap;
+    if (vm->harts != NULL) {
+        errno = EBUSY;
+        return NULL;
+    }
+    snap = malloc(sizeof(vm_snapshot_t));
+    if (snap == NULL) {
+        return NULL;
+    }
+    snap->fd = anonymousFile();
+    if (snap->fd < 0 || writeSnapshot(vm, snap->fd) < 0) {
+        vm_snapshot_free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+int vm_restore(vm_t *vm, const vm_snapshot_t *snap) {
+    struct stat st;
+    if (fstat(snap->fd, &st) < 0 || resetVM(vm) < 0
+        || restoreState(vm, snap->fd, st.st_size, mapSection) < 0) {
+        return -1;
+    }
+    if (vm->jit != NULL) {
+        hintLoops(vm);
+    }
+    return 0;
+}
+
+int vm_snapshot_save(const vm_snapshot_t *snap, const char *filename) {
+    struct stat st;
+    char *block;
+    off_t offset;
+    int ret = 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    block = malloc(SNAP_ALIGN);
+    if (block == NULL || fstat(snap->fd, &st) < 0) {
+        ret = -1;
+    }
+    /* Copy the blocks that are not zero, so that the file stays sparse */
+    for (offset = 0; ret == 0 && offset < st.st_size; offset += SNAP_ALIGN) {
+        ssize_t n = pread(snap->fd, block, SNAP_ALIGN, offset);
+        if (n < 0) {
+            ret = -1;
+        } else if (!isZero((const u_int32_t *) block, n / sizeof(u_int32_t))) {
+            ret = writeAt(fd, block, n, offset);
+        }
+    }
+    if (ret == 0) {
+        ret = ftruncate(fd, st.st_size);
+    }
+    free(block);
+    if (close(fd) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+vm_snapshot_t *vm_snapshot_open(const char *filename) {
+    vm_snapshot_t *snap;
+    uint32_t magic;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (pread(fd, &magic, sizeof(magic), 0) != (ssize_t) sizeof(magic) || magic != SNAP_MAGIC) {
+        close(fd);
+        errno = ENOEXEC;
+        return NULL;
+    }
+    snap = malloc(sizeof(vm_snapshot_t));
+    if (snap == NULL) {
+        close(fd);
+        return NULL;
+    }
+    snap->fd = fd;
+    return snap;
+}
+
+void vm_snapshot_free(vm_snapshot_t *snap) {
+    if (snap == NULL) {
+        return;
+    }
+    if (snap->fd >= 0) {
+        close(snap->fd);
+    }
+    free(snap);
+}
+
+/** @brief Tell if a dump holds a block of memory
+ * @param vm the VM
+ * @param block number of the block, in bounds
+ * @param full 1 for a full dump, which holds the blocks that are not zero,
+ *        0 for one that holds those stored to since the previous dump
+ */
+static int dumpsBlock(const vm_t *vm, uint64_t block, int full) {
+    uint64_t addr = block << DUMP_BLOCK_SHIFT;
+    if (!full) {
+        return vm->dirty[block];
+    }
+    return !isZero(vm->mem + addr, vm->memWords - addr < DUMP_BLOCK_WORDS ? vm->memWords - addr : DUMP_BLOCK_WORDS);
+}
+
+/** @brief Find the next block a dump holds
+ * @return the number of the block, or blocks if there is none from block on
+ */
+static uint64_t nextDumped(const vm_t *vm, uint64_t block, uint64_t blocks, int full) {
+    uint64_t marks;
+    while (block < blocks && !dumpsBlock(vm, block, full)) {
+        /* Skip the clean parts of a large memory eight marks at a time */
+        if (!full && block % 8 == 0 && block + 8 <= blocks) {
+            memcpy(&marks, vm->dirty + block, sizeof(marks));
+            if (marks == 0) {
+                block += 8;
+                continue;
+            }
+        }
+        block++;
+    }
+    return block;
+}
+
+/** @brief Find the end of the region of a dump starting at a block
+ * @return the number of the first block after the region
+ */
+static uint64_t regionEnd(const vm_t *vm, uint64_t block, uint64_t blocks, int full) {
+    while (block < blocks && dumpsBlock(vm, block, full)) {
+        block++;
+    }
+    return block;
+}
+
+int vm_dump_mem(vm_t *vm, const char *filename, int full) {
+    dumpheader_t h;
+    dumpregion_t r;
+    uint64_t blocks = (vm->memWords + DUMP_BLOCK_WORDS - 1) >> DUMP_BLOCK_SHIFT;
+    uint64_t block, end;
+    FILE *f;
+    int ret = 0;
+    memset(&h, 0, sizeof(h));
+    h.magic = DUMP_MAGIC;
+    h.version = DUMP_VERSION;
+    h.headerWords = sizeof(h) / sizeof(u_int32_t);
+    h.memWords = vm->memWords;
+    h.steps = vm->steps;
+    h.sequence = vm->dumps;
+    h.pc = vm->pc;
+    h.flags = full ? DUMP_FULL : 0;
+    h.nameBytes = vm->progname != NULL ? strlen(vm->progname) : 0;
+    h.symBytes = vm->symbolsLen;
+    for (block = nextDumped(vm, 0, blocks, full); block < blocks; block = nextDumped(vm, end, blocks, full)) {
+        end = regionEnd(vm, block, blocks, full);
+        h.regions++;
+    }
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fwrite(&h, sizeof(h), 1, f) != 1
+        || fwrite(vm->progname, 1, h.nameBytes, f) != h.nameBytes
+        || fwrite(vm->symbols, 1, h.symBytes, f) != h.symBytes) {
+        ret = -1;
+    }
+    for (block = nextDumped(vm, 0, blocks, full); ret == 0 && block < blocks; block = nextDumped(vm, end, blocks, full)) {
+        end = regionEnd(vm, block, blocks, full);
+        r.addr = block << DUMP_BLOCK_SHIFT;
+        r.words = (end << DUMP_BLOCK_SHIFT < vm->memWords ? end << DUMP_BLOCK_SHIFT : vm->memWords) - r.addr;
+        if (fwrite(&r, sizeof(r), 1, f) != 1
+            || fwrite(vm->mem + r.addr, sizeof(u_int32_t), r.words, f) != r.words) {
+            ret = -1;
+        }
+    }
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        /* The next dump starts from here; only the marks set are cleared, to populate no clean pages */
+        for (block = nextDumped(vm, 0, blocks, 0); block < blocks; block = nextDumped(vm, end, blocks, 0)) {
+            end = regionEnd(vm, block, blocks, 0);
+            memset(vm->dirty + block, 0, end - block);
+        }
+        vm->dumps++;
+    }
+    return ret;
+}
+
+int vm_parse_mem_size(const char *text, uint64_t *words) {
+    char *end;
+    uint64_t bytes = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'K': case 'k':
+            bytes <<= 10;
+            end++;
+            break;
+        case 'M': case 'm':
+            bytes <<= 20;
+            end++;
+            break;
+        case 'G': case 'g':
+            bytes <<= 30;
+            end++;
+            break;
+        default:
+            break;
+    }
+    if (end == text || *end != '\0' || bytes == 0 || bytes % sizeof(u_int32_t) != 0
+        || bytes / sizeof(u_int32_t) > MAX_MEMSIZE) {
+        return -1;
+    }
+    *words = bytes / sizeof(u_int32_t);
+    return 0;
+}
 
-#include "constants.h" // Definitions of constants
+int vm_set_engine(vm_t *vm, int engine) {
+    switch (engine) {
+        case VM_ENGINE_SWITCH:
+#ifdef HAVE_THREADED_DISPATCH
+        case VM_ENGINE_THREADED:
+#endif
+            vm->engine = engine;
+            return 0;
+#ifdef HAVE_JIT
+        case VM_ENGINE_JIT:
+            if (vm->jit == NULL) {
+                vm->jit = jitCreate(vm->memWords, vm->dcache, vm->dirty, vm->touched);
+                if (vm->jit == NULL) {
+                    return -1;
+                }
+                hintLoops(vm);
+            }
+            vm->engine = engine;
+            return 0;
+#endif
+        default:
+            return -1;
+    }
+}
 
-/* Memory */
-u_int32_t mem[MEMSIZE];
-/* Regs */
-int regs[NBR_REGS];
-/* Program counter */
-int pc = 0;
+void vm_set_input(vm_t *vm, FILE *in) {
+    inputStream(&vm->in, in);
+}
 
-/*--- Global variables for the execution ---*/
-/* Vars */
-int instr;
-int opcode = 0;  // current opcode
+void vm_set_input_values(vm_t *vm, const int *values, size_t count) {
+    inputValues(&vm->in, values, count);
+}
 
-/* Init working registers and values */
-int rd = 0;
-int rs = 0;
-int rs1, rs2 = 0;
-int ra = 0;
-int addr = 0;
-int val = 0;
+void vm_set_input_text(vm_t *vm, const char *text, size_t len) {
+    inputText(&vm->in, text, len);
+}
 
-char *progname;
+int vm_set_input_file(vm_t *vm, const char *filename) {
+    return inputMapFile(&vm->in, filename);
+}
 
-u_int32_t imm = 0;  // immediate value
+void vm_set_input_callback(vm_t *vm, vm_input_fn source, void *ctx) {
+    inputCallback(&vm->in, source, ctx);
+}
 
-int isRunning = 1;  // program runs while this is 1
+void vm_set_output(vm_t *vm, FILE *out) {
+    vm_set_output_callback(vm, outputFile, out);
+}
 
-/*--- The program itself ---*/
+void vm_set_output_callback(vm_t *vm, vm_output_fn sink, void *ctx) {
+    outputFlush(&vm->out);
+    vm->out.sink = sink;
+    vm->out.ctx = ctx;
+}
 
-/** @brief Read a file into memory
- * @param filename the name of the file to read
- *
- */
-void readSource(char *filename) {
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        printf("Error: Could not open file %s\n", filename);
-        exit(1);
+int vm_reg(const vm_t *vm, int reg) {
+    return vm->regs[reg];
+}
+
+int vm_pc(const vm_t *vm) {
+    return vm->pc;
+}
+
+int vm_fault(const vm_t *vm, vm_fault_t *fault) {
+    if (fault != NULL) {
+        *fault = vm->error;
     }
-    int i = 0;
-    while (read(fd, &mem[i], 4) == 4) {  // read 4 bytes at a time
-        i++;
+    return vm->error.cause;
+}
+
+const char *vm_fault_name(int cause) {
+    switch (cause) {
+        case VM_FAULT_NONE:
+            return "no fault";
+        case VM_FAULT_OPCODE:
+            return "invalid opcode";
+        case VM_FAULT_LOAD:
+            return "load out of bounds";
+        case VM_FAULT_STORE:
+            return "store out of bounds";
+        case VM_FAULT_VECTOR:
+            return "vector block out of bounds";
+        case VM_FAULT_REGISTERS:
+            return "register range out of bounds";
+        case VM_FAULT_MEM_LIMIT:
+            return "memory limit reached";
+        case VM_FAULT_PC:
+            return "program counter out of bounds";
+        case VM_FAULT_DIVIDE:
+            return "division by zero";
+        case VM_FAULT_HART:
+            return "join of an invalid hart";
+        default:
+            return "unknown fault";
     }
-    close(fd);
 }
 
-/** @brief Display registers and their values */
-void displayRegs(){
+uint64_t vm_steps(const vm_t *vm) {
+    return vm->steps;
+}
+
+uint64_t vm_mem_used(const vm_t *vm) {
+    return (vm->pagesUsed << GUEST_PAGE_SHIFT) * sizeof(u_int32_t);
+}
+
+/** @brief Count the bytes of a mapping resident in memory
+ * @param addr start of the mapping, page aligned
+ * @param bytes size of the mapping
+ */
+static uint64_t residentBytes(void *addr, size_t bytes) {
+    unsigned char pages[4096];
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t done, i;
+    uint64_t resident = 0;
+    for (done = 0; done < bytes; done += sizeof(pages) * page) {
+        size_t len = bytes - done < sizeof(pages) * page ? bytes - done : sizeof(pages) * page;
+        if (mincore((char *) addr + done, len, pages) < 0) {
+            continue;
+        }
+        for (i = 0; i < (len + page - 1) / page; i++) {
+            resident += pages[i] & 1;
+        }
+    }
+    return resident * page;
+}
+
+uint64_t vm_resident(const vm_t *vm) {
+    return residentBytes(vm->mem, vm->memBytes) + residentBytes(vm->dcache, vm->dcacheBytes)
+        + residentBytes(vm->dirty, vm->dirtyBytes) + residentBytes(vm->touched, vm->touchedBytes);
+}
+
+void vm_display_regs(const vm_t *vm){
     int reg;
     printf("Registers:\n");
     for(reg = 0; reg < NBR_REGS; reg++) {
-        printf("r%d: %d ", reg, regs[reg]);
+        printf("r%d: %d ", reg, vm->regs[reg]);
     }
     printf("\n");
 }
 
-/** @brief Display the memory */
-void displayMem(){
-    int i;
+void vm_display_mem(const vm_t *vm){
+    uint64_t i;
     printf("Memory:\n");
-    for(i = 0; i < MEMSIZE; i++) {
-        printf("%d: %d ", i, mem[i]);
+    for(i = 0; i < vm->memWords; i++) {
+        printf("%llu: %d ", (unsigned long long) i, vm->mem[i]);
     }
     printf("\n");
 }
 
 /**
  * @brief Write a value to a register
+ * @param regs Register file
  * @param reg Register to be written to
  * @param val Value to be written
  */
-void writeReg(int reg, int value){
+static inline void writeReg(int *regs, int reg, int value){
     regs[reg] = (value == 0) ? 0 : value;
 }
 
 /**
- * @brief Decode instructions by type
- * @param type: type of instruction (R, I, JR, JI, B, S)
- */
-void decodeInstr(int type) {
-    switch (type) {
-        case TYPE_R:  /* Registry-type */
-            rd = (instr >> 21) & 0x1F;
-            rs1 = (instr >> 16) & 0x1F;
-            rs2 = (instr >> 11) & 0x1F;
-            break;
-        case TYPE_I:  /* Immediate-type */
-            rd = (instr >> 21) & 0x1F;
-            rs = (instr >> 16) & 0x1F;
-            imm = instr & 0x0000FFFF;
-            if ((imm & 0x00008000) != 0) {
-                imm |= 0xFFFF0000;
+ * @brief Drop the decoded form of a memory word
+ * @param vm the VM
+ * @param address address of the word that was written, in bounds
+ */
+static inline void invalidateInstr(vm_t *vm, u_int32_t address) {
+    u_int32_t i;
+    if (vm->dcache[address].ready) {
+        vm->dcache[address].ready = 0;
+        vm->dcache[address].fused = 0;
+        vm->dcache[address].handler = NULL;
+        vm->dcache[address].run = 0;
+        /* The blocks counted through the word may now end elsewhere */
+        for (i = address; i > 0 && address - i < BLOCK_RUN_LONG; i--) {
+            decoded_t *prev = &vm->dcache[i - 1];
+            if (!prev->ready || endsBlock(prev->opcode)) {
+                break;
             }
-            break;
-        case TYPE_JR:  /* Jump to register */
-            rd = (instr >> 21) & 0x1F;
-            ra = (instr >> 16) & 0x1F;
-            break;
-        case TYPE_JI:  /* Jump to immediate */
-            rd = (instr >> 21) & 0x1F;
-            addr = instr & 0x001FFFFF;
-            break;
-        case TYPE_B:  /* Branch */
-            rs = (instr >> 21) & 0x1F;
-            addr = instr & 0x1FFFF;
-            break;
-        case TYPE_S:  /* Scall */
-            val = instr & 0x3FFFFFF;
-        default:
-            break;
+            prev->run = 0;
+        }
+        /* A superinstruction before the word runs its old decoded form */
+        if (address > 0 && vm->dcache[address - 1].op >= OPCODE_SUPER) {
+            vm->dcache[address - 1].ready = 0;
+            vm->dcache[address - 1].fused = 0;
+            vm->dcache[address - 1].handler = NULL;
+        }
+        if (vm->jit != NULL) {
+            jitInvalidate(vm->jit, address);
+        }
     }
 }
 
 /**
- * @brief Execute a given instruction
- * @param opcode Opcode of the instruction
+ * @brief Count the instructions of the block starting at pc
+ * @param vm the VM
+ * @param pc address of the first instruction
+ * @return instructions up to and including the one ending the block (see
+ *         endsBlock), or BLOCK_RUN_LONG if there are at least as many
  *
- * Decodes the instruction using appropriate type, then executes it
- * using binary operations or updating programCount.
- */
-void execOp(int opcode){
-    switch (opcode) {
-        /* Add */
-        case OPCODE_ADD:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] + regs[rs2]);
-            break;
-        case OPCODE_ADDI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] + imm);
-            break;
+ * The engines take the whole block out of the budget when they enter it, so
+ * they only check the budget once per block. The words of the block are
+ * decoded: a store into one of them resets the count (see invalidateInstr).
+ */
+static u_int32_t countBlock(vm_t *vm, u_int32_t pc) {
+    u_int32_t n;
+    if (vm->dcache[pc].run != 0) {
+        return vm->dcache[pc].run;
+    }
+    for (n = 0; n < BLOCK_RUN_LONG - 1 && (uint64_t) pc + n < vm->memWords; n++) {
+        decoded_t *d = &vm->dcache[pc + n];
+        if (!d->ready) {
+            decodeInstr(vm->mem[pc + n], d);
+        }
+        if (endsBlock(d->opcode)) {
+            vm->dcache[pc].run = n + 1;
+            return n + 1;
+        }
+    }
+    vm->dcache[pc].run = BLOCK_RUN_LONG;
+    return BLOCK_RUN_LONG;
+}
 
-        /* Subtract */
-        case OPCODE_SUB:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] - regs[rs2]);
-            break;
-        case OPCODE_SUBI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] - imm);
-            break;
+/**
+ * @brief Count the instructions of a counted block after one of them
+ * @param vm the VM
+ * @param pc address of the instruction, in a block counted by countBlock
+ * @return instructions after it, up to and including the one ending the block
+ */
+static u_int32_t blockRest(const vm_t *vm, u_int32_t pc) {
+    u_int32_t n = 0;
+    while ((uint64_t) pc + n < vm->memWords && !endsBlock(vm->dcache[pc + n].opcode)) {
+        n++;
+    }
+    return n;
+}
 
-        /* Multiply */
-        case OPCODE_MUL:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] * regs[rs2]);
-            break;
-        case OPCODE_MULI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] * imm);
-            break;
+/**
+ * @brief Fuse a decoded instruction with the next word into a superinstruction
+ * @param vm the VM
+ * @param pc address of the instruction
+ * @param d its decoded form
+ *
+ * The next word is decoded too: the superinstruction runs it from its cache
+ * entry, which stays valid as long as the fused one (see invalidateInstr).
+ */
+static inline void fuseInstr(vm_t *vm, u_int32_t pc, decoded_t *d) {
+    decoded_t *next;
+    d->fused = 1;
+    if ((uint64_t) pc + 1 >= vm->memWords) {
+        return;
+    }
+    next = &vm->dcache[pc + 1];
+    if (!next->ready) {
+        decodeInstr(vm->mem[pc + 1], next);
+    }
+    d->op = superOpcode(d->opcode, next->opcode);
+}
 
-        /* Divide */
-        case OPCODE_DIV:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] / regs[rs2]);
-            break;
-        case OPCODE_DIVI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] / imm);
-            break;
+/**
+ * @brief Stop the program on an error
+ * @param vm the VM
+ * @param cause VM_FAULT_*
+ * @param addr address accessed, 0 if none
+ *
+ * The engine then reports the fault at the pc of the instruction (see reportFault).
+ */
+static void fault(vm_t *vm, int cause, u_int32_t addr) {
+    vm->error.cause = cause;
+    vm->error.addr = addr;
+    vm->isRunning = 0;
+}
 
-        /* And */
-        case OPCODE_AND:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] & regs[rs2]);
-            break;
-        case OPCODE_ANDI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] & imm);
+/**
+ * @brief Write the error of the program to the output
+ * @param vm the VM, stopped by fault
+ * @param pc address of the instruction that faulted, or the pc out of memory
+ *
+ * The error of a hart other than the first one names it.
+ */
+static void reportFault(vm_t *vm, u_int32_t pc) {
+    const char *name = vm_fault_name(vm->error.cause);
+    char message[128];
+    vm_t *root;
+    int len;
+    vm->error.pc = pc;
+    root = lockShared(vm);
+    switch (vm->error.cause) {
+        case VM_FAULT_OPCODE:
+            len = snprintf(message, sizeof(message), "Invalid opcode %u at pc %u", vm->mem[pc] >> 26, pc);
             break;
-
-        /* Or */
-        case OPCODE_OR:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] | regs[rs2]);
+        case VM_FAULT_PC:
+            len = snprintf(message, sizeof(message), "Program counter %u out of bounds", pc);
             break;
-        case OPCODE_ORI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] | imm);
+        case VM_FAULT_MEM_LIMIT:
+            len = snprintf(message, sizeof(message), "Memory limit of %llu bytes reached at pc %u, address %u",
+                           (unsigned long long) (root->pageLimit << GUEST_PAGE_SHIFT) * sizeof(u_int32_t),
+                           pc, vm->error.addr);
             break;
-
-        /* Xor */
-        case OPCODE_XOR:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] ^ regs[rs2]);
+        case VM_FAULT_LOAD:
+        case VM_FAULT_STORE:
+        case VM_FAULT_VECTOR:
+            len = snprintf(message, sizeof(message), "%c%s at pc %u, address %u",
+                           toupper((unsigned char) name[0]), name + 1, pc, vm->error.addr);
             break;
-        case OPCODE_XORI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] ^ imm);
+        default:
+            len = snprintf(message, sizeof(message), "%c%s at pc %u", toupper((unsigned char) name[0]), name + 1, pc);
             break;
+    }
+    if (len >= (int) sizeof(message)) {
+        len = sizeof(message) - 1;
+    }
+    outputWrite(&root->out, "Error: ", 7);
+    if (vm->hartId != 0) {
+        outputWrite(&root->out, "Hart ", 5);
+        outputInt(&root->out, vm->hartId);
+        outputWrite(&root->out, ": ", 2);
+    }
+    outputWrite(&root->out, message, len);
+    outputChar(&root->out, '\n');
+    unlockShared(root);
+}
 
-        /* Shift-left */
-        case OPCODE_SHL:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] << regs[rs2]);
-            break;
-        case OPCODE_SHLI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] << imm);
-            break;
+/**
+ * @brief Stop the program on a pc out of memory, before fetching anything there
+ * @param vm the VM
+ * @param pc the pc
+ */
+static void pcFault(vm_t *vm, u_int32_t pc) {
+    fault(vm, VM_FAULT_PC, pc);
+    reportFault(vm, pc);
+}
 
-        /* Shift-right */
-        case OPCODE_SHR:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] >> regs[rs2]);
-            break;
-        case OPCODE_SHRI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] >> imm);
-            break;
+/**
+ * @brief Load a word into a register
+ * @param vm the VM
+ * @param rd destination register
+ * @param address address of the word
+ * @return 0 on success, -1 if the program faulted
+ *
+ * With a constant rd, as in the specialized handlers of the threaded engine,
+ * the register is written at a fixed offset.
+ */
+static inline int loadAt(vm_t *vm, int rd, u_int32_t address) {
+    if (__builtin_expect(address < vm->memWords, 1)) {
+        writeReg(vm->regs, rd, vm->mem[address]);
+        return 0;
+    }
+    fault(vm, VM_FAULT_LOAD, address);
+    return -1;
+}
 
-        /* Less than */
-        case OPCODE_SLT:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] < regs[rs2]);
-            break;
-        case OPCODE_SLTI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] < imm);
-            break;
+/**
+ * @brief Execute a load instruction
+ * @param vm the VM
+ * @param d Decoded instruction
+ * @return 0 on success, -1 if the program faulted
+ */
+static inline int loadWord(vm_t *vm, const decoded_t *d) {
+    return loadAt(vm, d->rd, vm->regs[d->rs1] + d->imm);
+}
 
-        /* Less than or equals */
-        case OPCODE_SLE:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] <= regs[rs2]);
-            break;
-        case OPCODE_SLEI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] <= imm);
-            break;
+/**
+ * @brief Count the pages of a block the program stores to as held
+ * @param vm the VM
+ * @param address first word of the block, which is in bounds
+ * @param words number of words
+ * @return 0 on success, -1 if the program faulted on its memory limit
+ */
+static int holdStored(vm_t *vm, u_int32_t address, u_int32_t words) {
+    if (holdPages(vm, address, words) < 0) {
+        fault(vm, VM_FAULT_MEM_LIMIT, address);
+        return -1;
+    }
+    return 0;
+}
 
-        /* Equals */
-        case OPCODE_SEQ:
-            decodeInstr(TYPE_R);
-            writeReg(rd, regs[rs1] == regs[rs2]);
-            break;
-        case OPCODE_SEQI:
-            decodeInstr(TYPE_I);
-            writeReg(rd, regs[rs] == imm);
-            break;
+/**
+ * @brief Execute a store instruction
+ * @param vm the VM
+ * @param d Decoded instruction
+ *
+ * @return 0 on success, -1 if the program faulted
+ *
+ * The stored word may be code, so its decoded form is dropped. Its block is
+ * marked dirty for the next dump. The first store to a page counts it as held
+ * by the program, which faults if that takes it over its memory limit.
+ */
+static inline int storeWord(vm_t *vm, const decoded_t *d) {
+    u_int32_t address = vm->regs[d->rs1] + d->imm;
+    /* Only store if address is in bounds */
+    if (__builtin_expect(address < vm->memWords, 1)) {
+        if (!vm->touched[address >> GUEST_PAGE_SHIFT] && holdStored(vm, address, 1) < 0) {
+            return -1;
+        }
+        vm->mem[address] = vm->regs[d->rd];
+        vm->dirty[address >> DUMP_BLOCK_SHIFT] = 1;
+        invalidateInstr(vm, address);
+        return 0;
+    }
+    fault(vm, VM_FAULT_STORE, address);
+    return -1;
+}
+
+/**
+ * @brief Execute a division by a register
+ * @param vm the VM
+ * @param rd destination register
+ * @param a dividend
+ * @param b divisor
+ * @return 0 on success, -1 if the program faulted on a division by zero
+ *
+ * The quotient is rounded toward zero, and INT_MIN / -1 wraps to INT_MIN
+ * instead of trapping as the division of the host does. Divisions are rare:
+ * kept out of the engines, they leave their registers to the common cases.
+ */
+__attribute__((noinline))
+static int divide(vm_t *vm, int rd, int a, int b) {
+    if (__builtin_expect(b == 0, 0)) {
+        fault(vm, VM_FAULT_DIVIDE, 0);
+        return -1;
+    }
+    writeReg(vm->regs, rd, b == -1 ? (int) (0u - (u_int32_t) a) : a / b);
+    return 0;
+}
+
+/**
+ * @brief Execute a division by an immediate
+ * @param vm the VM
+ * @param rd destination register
+ * @param a dividend
+ * @param imm divisor, sign-extended
+ * @return 0 on success, -1 if the program faulted on a division by zero
+ *
+ * As for slti and slei, the immediate is compared unsigned: the division is
+ * unsigned too, and cannot overflow.
+ */
+__attribute__((noinline))
+static int divideImm(vm_t *vm, int rd, int a, u_int32_t imm) {
+    if (__builtin_expect(imm == 0, 0)) {
+        fault(vm, VM_FAULT_DIVIDE, 0);
+        return -1;
+    }
+    writeReg(vm->regs, rd, (int) ((u_int32_t) a / imm));
+    return 0;
+}
+
+/**
+ * @brief Tell if a block of memory of a vector instruction is in bounds
+ * @param vm the VM
+ * @param address first word of the block
+ * @param words number of words
+ * @return 1 if every word of the block is in memory, 0 once the program faulted on it
+ */
+static inline int blockInBounds(vm_t *vm, u_int32_t address, u_int32_t words) {
+    if ((uint64_t) address + words <= vm->memWords) {
+        return 1;
+    }
+    fault(vm, VM_FAULT_VECTOR, address);
+    return 0;
+}
+
+/**
+ * @brief Account for a block of memory the program stored to
+ * @param vm the VM
+ * @param address first word of the block, which is in bounds
+ * @param words number of words
+ *
+ * The block is marked dirty for the next dump and its decoded form is dropped.
+ */
+static void storedBlock(vm_t *vm, u_int32_t address, u_int32_t words) {
+    uint64_t block;
+    u_int32_t i;
+    if (words == 0) {
+        return;
+    }
+    for (block = address >> DUMP_BLOCK_SHIFT; block <= ((uint64_t) address + words - 1) >> DUMP_BLOCK_SHIFT; block++) {
+        vm->dirty[block] = 1;
+    }
+    for (i = 0; i < words; i++) {
+        invalidateInstr(vm, address + i);
+    }
+}
 
-        /* Load */
-        case OPCODE_LOAD:
-            decodeInstr(TYPE_I);
-            if (rs + imm < MEMSIZE) {
-                writeReg(rd, mem[regs[rs] + imm]);
+/**
+ * @brief Execute a vector instruction
+ * @param vm the VM
+ * @param d Decoded instruction
+ * @return 0 on success, -1 if the program faulted
+ *
+ * The blocks of memory are whole or the instruction faults without changing
+ * anything. Blocks stored to may be code, so their decoded form is dropped;
+ * they are marked dirty for the next dump, and their pages held.
+ */
+static int vectorOp(vm_t *vm, const decoded_t *d) {
+    int *regs = vm->regs;
+    u_int32_t *mem = vm->mem;
+    u_int32_t dst = regs[d->rd], a = regs[d->rs1], b = regs[d->rs2];
+    u_int32_t n = regs[d->imm & 0x1F];  // for TYPE_V
+    u_int32_t i;
+    switch (d->opcode) {
+        case OPCODE_VLOAD:
+        case OPCODE_VSTORE:
+            n = d->imm;
+            if ((uint64_t) d->rd + n > NBR_REGS) {
+                fault(vm, VM_FAULT_REGISTERS, 0);
+                return -1;
+            }
+            if (!blockInBounds(vm, a, n)) {
+                break;
+            }
+            if (d->opcode == OPCODE_VLOAD) {
+                for (i = 0; i < n; i++) {
+                    writeReg(regs, d->rd + i, mem[a + i]);
+                }
             } else {
-                printf("Error: Memory address out of bounds\n");
-                exit(1);
+                if (holdStored(vm, a, n) < 0) {
+                    return -1;
+                }
+                for (i = 0; i < n; i++) {
+                    mem[a + i] = regs[d->rd + i];
+                }
+                storedBlock(vm, a, n);
             }
-            break;
-
-        /* Store */
-        case OPCODE_STORE:
-            decodeInstr(TYPE_I);
-            if (rs + imm < MEMSIZE || rs + imm > 0) {
-                /* Only store if address is in bounds */
-                mem[regs[rs] + imm] = regs[rd];
+            return 0;
+        case OPCODE_VADD:
+        case OPCODE_VMUL:
+            if (!blockInBounds(vm, dst, n) || !blockInBounds(vm, a, n) || !blockInBounds(vm, b, n)) {
+                break;
+            }
+            if (holdStored(vm, dst, n) < 0) {
+                return -1;
+            }
+            if (d->opcode == OPCODE_VADD) {
+                vecAdd(mem + dst, mem + a, mem + b, n);
             } else {
-                printf("Error: Memory address out of bounds\n");
-                exit(1);
+                vecMul(mem + dst, mem + a, mem + b, n);
+            }
+            storedBlock(vm, dst, n);
+            return 0;
+        case OPCODE_VDOT:
+            if (!blockInBounds(vm, a, n) || !blockInBounds(vm, b, n)) {
+                break;
+            }
+            writeReg(regs, d->rd, regs[d->rd] + (int) vecDot(mem + a, mem + b, n));
+            return 0;
+        case OPCODE_VCOPY:
+            if (!blockInBounds(vm, dst, n) || !blockInBounds(vm, a, n)) {
+                break;
+            }
+            if (holdStored(vm, dst, n) < 0) {
+                return -1;
             }
+            memmove(mem + dst, mem + a, (size_t) n * sizeof(u_int32_t));
+            storedBlock(vm, dst, n);
+            return 0;
+        case OPCODE_VSET:
+            if (!blockInBounds(vm, dst, n)) {
+                break;
+            }
+            if (holdStored(vm, dst, n) < 0) {
+                return -1;
+            }
+            vecFill(mem + dst, a, n);
+            storedBlock(vm, dst, n);
+            return 0;
+        default:
+            fault(vm, VM_FAULT_OPCODE, 0);
             break;
+    }
+    return -1;
+}
 
-        /* Jump */
-        case OPCODE_JMPR:  // Jump to register
-            decodeInstr(TYPE_JR);
-            writeReg(rd, pc);
-            pc = regs[ra];
-            break;
-        case OPCODE_JMPI:  // Jump to immediate (label)
-            decodeInstr(TYPE_JI);
-            writeReg(rd, pc);
-            pc = addr;
-            break;
+/**
+ * @brief Execute an atomic instruction or a fence
+ * @param vm the VM
+ * @param d Decoded instruction
+ * @return 0 on success, -1 if the program faulted
+ *
+ * amoadd and cas read and write their word in one step, which the other
+ * harts see as a whole, and order the loads and stores around them as fence
+ * does: the loads and stores before them are seen by the other harts before
+ * those after them. Plain loads and stores of words are not torn, but harts
+ * may see them out of order. A word out of memory faults as a store would.
+ * Like a store, they drop the decoded form of their word, but only for the
+ * hart running them: a hart that already decoded code another hart writes
+ * keeps running the code it decoded.
+ */
+__attribute__((noinline))
+static int atomicOp(vm_t *vm, const decoded_t *d) {
+    u_int32_t address = vm->regs[d->rs1];
+    u_int32_t old;
+    if (d->opcode == OPCODE_FENCE) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return 0;
+    }
+    if (__builtin_expect(address >= vm->memWords, 0)) {
+        fault(vm, VM_FAULT_STORE, address);
+        return -1;
+    }
+    if (!vm->touched[address >> GUEST_PAGE_SHIFT] && holdStored(vm, address, 1) < 0) {
+        return -1;
+    }
+    if (d->opcode == OPCODE_AMOADD) {
+        old = __atomic_fetch_add(&vm->mem[address], (u_int32_t) vm->regs[d->rs2], __ATOMIC_SEQ_CST);
+    } else {
+        /* On failure, old is set to the word found */
+        old = (u_int32_t) vm->regs[d->rd];
+        __atomic_compare_exchange_n(&vm->mem[address], &old, (u_int32_t) vm->regs[d->rs2], 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+    writeReg(vm->regs, d->rd, (int) old);
+    vm->dirty[address >> DUMP_BLOCK_SHIFT] = 1;
+    invalidateInstr(vm, address);
+    return 0;
+}
 
-        /* Branch */
-        case OPCODE_BRAZ:  // Branch if zero
-            decodeInstr(TYPE_B);
-            if (regs[rs] == 0) {
-                pc = addr;
-            }
+/**
+ * @brief Start a hart, for scall 4
+ * @param vm the VM of the hart spawning it
+ * @param pc address the hart starts at
+ * @return the id of the hart, or -1 if the program has MAX_HARTS harts or
+ *         the host cannot start one more
+ *
+ * The hart starts with the registers of the one spawning it, but for r20,
+ * which holds its id, and runs on a thread of its own until it stops, or the
+ * program does. The first hart a program spawns makes the engine return to
+ * vm_run, which then runs the VM of the host in slices (see runEngine).
+ */
+static int spawnHart(vm_t *vm, u_int32_t pc) {
+    vm_t *root = vm->root != NULL ? vm->root : vm;
+    harts_t *h = root->harts;
+    vm_t *hart;
+    int id;
+    /* Without harts, only the VM of the host runs */
+    if (h == NULL) {
+        h = calloc(1, sizeof(harts_t));
+        if (h == NULL) {
+            return -1;
+        }
+        if (pthread_mutex_init(&h->lock, NULL) != 0 || pthread_cond_init(&h->changed, NULL) != 0) {
+            free(h);
+            return -1;
+        }
+        root->harts = h;
+        vm->yielding = 1;
+    }
+    hart = createHart(root);
+    if (hart == NULL) {
+        return -1;
+    }
+    memcpy(hart->regs, vm->regs, sizeof(hart->regs));
+    hart->pc = (int) pc;
+    hart->isRunning = 1;
+    pthread_mutex_lock(&h->lock);
+    for (id = 1; id < MAX_HARTS && h->vms[id] != NULL; id++) {
+    }
+    if (id < MAX_HARTS && !h->stopping) {
+        hart->hartId = id;
+        hart->regs[20] = id;
+        if (pthread_create(&h->threads[id], NULL, runHart, hart) == 0) {
+            h->vms[id] = hart;
+            h->running[id] = 1;
+            h->live++;
+            pthread_mutex_unlock(&h->lock);
+            return id;
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+    destroyHart(hart);
+    return -1;
+}
+
+/**
+ * @brief Wait for a hart to stop, and free it, for scall 5
+ * @param vm the VM of the hart joining it
+ * @param id the hart
+ * @return 0 with r20 set to the r20 of the hart when it stopped, or -1 if the
+ *         program faulted on an invalid hart, or if it stops meanwhile: the
+ *         engine then returns to vm_run (vm->yielding); also -1 if the run
+ *         spends its budget before the hart stops: the system call then runs
+ *         again when the program resumes (vm->joining)
+ *
+ * Its id is free once it is joined, for the next hart spawned.
+ */
+static int joinHart(vm_t *vm, int id) {
+    vm_t *root = vm->root != NULL ? vm->root : vm;
+    harts_t *h = root->harts;
+    vm_t *hart = NULL;
+    pthread_t thread;
+    int stopping, spent;
+    if (h == NULL || id <= 0 || id >= MAX_HARTS || id == vm->hartId) {
+        fault(vm, VM_FAULT_HART, 0);
+        return -1;
+    }
+    pthread_mutex_lock(&h->lock);
+    /* Not running guest code: the program may pause meanwhile */
+    h->parked++;
+    pthread_cond_broadcast(&h->changed);
+    while (h->vms[id] != NULL && !h->stopping && (h->running[id] || h->paused) && !hartsSpent(h)) {
+        pthread_cond_wait(&h->changed, &h->lock);
+    }
+    h->parked--;
+    stopping = h->stopping;
+    spent = h->vms[id] != NULL && (h->running[id] || h->paused);
+    if (!stopping && !spent && h->vms[id] != NULL) {
+        hart = h->vms[id];
+        thread = h->threads[id];
+        h->vms[id] = NULL;
+    }
+    pthread_mutex_unlock(&h->lock);
+    if (stopping || spent) {
+        vm->yielding = 1;
+        vm->joining = !stopping;
+        return -1;
+    }
+    if (hart == NULL) {
+        fault(vm, VM_FAULT_HART, 0);
+        return -1;
+    }
+    pthread_join(thread, NULL);
+    writeReg(vm->regs, 20, hart->regs[20]);
+    destroyHart(hart);
+    return 0;
+}
+
+/**
+ * @brief Execute a system call
+ * @param vm the VM
+ * @param num number of the system call
+ * @return 0, or -1 if the engine has to return: if scall 0 waits for input
+ *         (vm->waiting) or scall 5 for a hart past the budget (vm->joining),
+ *         it leaves the pc on the system call, which runs again when the
+ *         program resumes; if the system call faulted, it reports
+ *         the fault; otherwise, it returns after the system call to vm_run
+ *         (vm->yielding)
+ *
+ * The harts read the input and write the output of the VM of the host, one
+ * at a time. scall 4 spawns a hart at the address in r20, and sets r20 to its
+ * id, or to -1 if it cannot (see spawnHart); scall 5 waits for the hart whose
+ * id is in r20 to stop, and sets r20 to the r20 it stopped with (see joinHart).
+ */
+static int sysCall(vm_t *vm, u_int32_t num) {
+    vm_t *io;
+    int value, ret = 0;
+    switch (num) {
+        case 4:
+            writeReg(vm->regs, 20, spawnHart(vm, vm->regs[20]));
+            return vm->yielding ? -1 : 0;
+        case 5:
+            return joinHart(vm, vm->regs[20]);
+        default:
             break;
-        case OPCODE_BRANZ:  // Branch if not zero
-            decodeInstr(TYPE_B);
-            if (regs[rs] != 0) {
-                pc = addr;
+    }
+    io = lockShared(vm);
+    switch (num) {
+        case 0:  // user input, only prompted for on a terminal
+            if (io->in.interactive) {
+                outputWrite(&io->out, "Please enter an integer: ", 25);
+                outputFlush(&io->out);
             }
-            break;
-
-        /* System call */
-        case OPCODE_SCALL:
-            decodeInstr(TYPE_S);
-            int usrInput;
-            switch (val) {
-                case 0:  // user input
-                    printf("Please enter an integer: ");
-                    scanf("%d", &usrInput);
-                    writeReg(20, usrInput);
-                    break;
-                case 1:
-                    printf("[%s // Out]: %d\n", progname, regs[20]);
-                    break;
-                case 2:
-                    printf("%d", regs[20]);
-                    break;
-                case 3:
-                    printf("%c", regs[20] & 0x7f);
-                    break;
-                default:
-                    break;
+            if (inputInt(&io->in, &value) < 0) {
+                vm->waiting = 1;
+                ret = -1;
+                break;
             }
+            writeReg(vm->regs, 20, value);
             break;
-
-        /* Stop */
-        case 0:  // ensure compatibility with other assemblers
-        case OPCODE_STOP:  // opcode as defined in assembler
-            isRunning = 0;
+        case 1:
+            outputChar(&io->out, '[');
+            outputWrite(&io->out, io->progname, strlen(io->progname));
+            outputWrite(&io->out, " // Out]: ", 10);
+            outputInt(&io->out, vm->regs[20]);
+            outputChar(&io->out, '\n');
+            break;
+        case 2:
+            outputInt(&io->out, vm->regs[20]);
+            break;
+        case 3:
+            outputChar(&io->out, vm->regs[20] & 0x7f);
             break;
         default:
-            printf("Error: Invalid opcode %d\n", opcode);
-            isRunning = 0;
             break;
     }
+    unlockShared(io);
+    return ret;
 }
 
+/*
+ * The execution engines: stepping through the blocks the budget cannot cover,
+ * plain, with the profiler, and the interpreter tier of the JIT
+ */
+#define ENGINE_SWITCH_FN execSwitchStepped
+#define ENGINE_PROFILE 0
+#define ENGINE_TIERED 0
+#define ENGINE_BLOCKS 0
+#define ENGINE_SPECIAL 0
+#include "engine.inc"
+
+#define ENGINE_SWITCH_FN execSwitch
+#define ENGINE_THREADED_FN execThreaded
+#define ENGINE_PROFILE 0
+#define ENGINE_TIERED 0
+#define ENGINE_BLOCKS 1
+#define ENGINE_SPECIAL 1
+#include "engine.inc"
+
+#define ENGINE_SWITCH_FN execSwitchProfiled
+#define ENGINE_THREADED_FN execThreadedProfiled
+#define ENGINE_PROFILE 1
+#define ENGINE_TIERED 0
+#define ENGINE_BLOCKS 0
+#define ENGINE_SPECIAL 0
+#include "engine.inc"
+
+#ifdef HAVE_JIT
+/* Only the engine that execInterpreted names is needed */
+#ifndef HAVE_THREADED_DISPATCH
+#define ENGINE_SWITCH_FN execSwitchTiered
+#endif
+#define ENGINE_THREADED_FN execThreadedTiered
+#define ENGINE_PROFILE 0
+#define ENGINE_TIERED 1
+#define ENGINE_BLOCKS 1
+#define ENGINE_SPECIAL 0
+#include "engine.inc"
+
+#ifdef HAVE_THREADED_DISPATCH
+#define execInterpreted execThreadedTiered
+#else
+#define execInterpreted execSwitchTiered
+#endif
+
 /**
- * @brief Executes program
+ * @brief Run the program with the tiered engine
+ * @param vm the VM
+ * @param budget maximum number of instructions to execute
+ * @return number of instructions executed
  *
- * Instructions are read from memory and executed until the program stops, or an error is encountered
+ * The interpreter runs until it branches to a block that is compiled or hot;
+ * that block is then compiled if needed and run natively until it leaves
+ * compiled code, and so on.
  */
-void exec(){
-    printf("=== BEGINNING EXECUTION. BINARY IS %s ===\n", progname);
-    while (isRunning) {
-        instr = mem[pc++];
-        opcode = (instr >> 26) & 0x3F;
-        execOp(opcode);
+static uint64_t execTiered(vm_t *vm, uint64_t budget) {
+    jit_t *jit = vm->jit;
+    uint64_t left = budget;
+    jitctx_t ctx;
+    ctx.regs = vm->regs;
+    ctx.mem = vm->mem;
+    ctx.memWords = vm->memWords;
+
+    while (vm->isRunning && !vm->waiting && !vm->yielding && left != 0) {
+        uint32_t pc = vm->pc;
+        void *code = NULL;
+        if (pc < vm->memWords) {
+            code = jit->entries[pc];
+            if (code == NULL && jitHotTarget(jit, pc)) {
+                code = jitCompile(jit, pc, vm->mem);
+            }
+        }
+        if (code != NULL) {
+            ctx.left = left;
+            ctx.reason = JIT_EXIT_BRANCH;
+            jitRun(jit, code, &ctx);
+            left = ctx.left;
+            vm->pc = ctx.pc;
+            if (ctx.reason == JIT_EXIT_STORE) {
+                invalidateInstr(vm, ctx.addr);
+            }
+            if (ctx.reason == JIT_EXIT_BRANCH || ctx.reason == JIT_EXIT_STORE) {
+                continue;
+            }
+        }
+        /* Cold code, or code the native blocks left to the interpreter (faults, lack of budget) */
+        left -= execInterpreted(vm, left);
     }
-    printf("=== END OF PROGRAM ===\n");
-    printf("Last output value: %d\n", regs[20]);
+    return budget - left;
 }
+#endif
 
-/** @brief Main function
- *
- * @param argc Number of arguments
- * @param argv Array of arguments
- * @return 1 if error, 0 if success
+/** @brief Engine of each VM_ENGINE_*, plain and profiling */
+typedef uint64_t (*engine_fn)(vm_t *vm, uint64_t budget);
+
+/**
+ * @brief Run the program with an engine
+ * @param vm the VM
+ * @param engine the engine
+ * @param budget maximum number of instructions to execute
+ * @return number of instructions executed
  *
- * To run, provide the name of the binary file to be run as an argument
- * ./vm <filename>
- */
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Error: No input file specified\n");
-        printf("Usage: %s <input file>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-    char *filename = argv[1];
-    progname = filename;
-    readSource(filename);
-    exec();
-
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+ * Once the program has harts, the engine runs in slices of HART_SLICE steps,
+ * between which the VM checks that none of them faulted, and counts their
+ * steps against the budget.
+ */
+static uint64_t runEngine(vm_t *vm, engine_fn engine, uint64_t budget) {
+    uint64_t steps = 0, spent = 0;
+    do {
+        uint64_t left = budget - spent;
+        vm->yielding = 0;
+        steps += engine(vm, (vm->harts != NULL && left > HART_SLICE) ? HART_SLICE : left);
+        spent = vm->harts != NULL ? syncHarts(vm, budget, steps) : steps;
+    } while (vm->isRunning && !vm->waiting && spent < budget && vm->harts != NULL);
+    return steps;
+}
+
+int vm_run(vm_t *vm, uint64_t max_steps) {
+    uint64_t budget = (max_steps == 0) ? UINT64_MAX : max_steps;
+    int profiled = vm->profile != NULL || vm->trace != NULL;
+    engine_fn engine = profiled ? execSwitchProfiled : execSwitch;
+#ifdef HAVE_THREADED_DISPATCH
+    if (vm->engine == VM_ENGINE_THREADED || vm->engine == VM_ENGINE_JIT) {
+        engine = profiled ? execThreadedProfiled : execThreaded;
+    }
+#endif
+#ifdef HAVE_JIT
+    /* The profiler and the trace see what is interpreted: their runs stay in the interpreter */
+    if (vm->engine == VM_ENGINE_JIT && !profiled) {
+        engine = execTiered;
+    }
+#endif
+    /* Handlers in dcache are labels of the engine that decoded them */
+    if (vm->lastEngine != NULL && vm->lastEngine != (const void *) engine) {
+        dropPages(vm->dcache, vm->dcacheBytes);
+        if (vm->jit != NULL) {
+            jitFlush(vm->jit);
+        }
+    }
+    vm->lastEngine = (const void *) engine;
+    vm->waiting = 0;
+    vm->joining = 0;
+    if (vm->harts != NULL) {
+        resumeHarts(vm, budget);
+    }
+    if (vm->isRunning && vm->perf != NULL) {
+        uint64_t steps;
+        perfStart(vm->perf);
+        steps = runEngine(vm, engine, budget);
+        perfStop(vm->perf, steps);
+        vm->steps += steps;
+    } else if (vm->isRunning) {
+        vm->steps += runEngine(vm, engine, budget);
+    }
+    if (vm->harts != NULL) {
+        settleHarts(vm);
+    }
+    /* The harts write to the output of the host, flushed by its own runs */
+    if (vm->root == NULL) {
+        outputFlush(&vm->out);
+    }
+    if (vm->error.cause != VM_FAULT_NONE) {
+        return VM_FAULT;
+    }
+    if (vm->waiting) {
+        return VM_WAITING;
+    }
+    return vm->isRunning ? VM_BUDGET_EXHAUSTED : VM_HALTED;
+}
+
+int vm_enable_profile(vm_t *vm) {
+    if (vm->profile != NULL) {
+        return 0;
+    }
+    vm->profile = malloc(sizeof(profile_t));
+    if (vm->profile == NULL) {
+        return -1;
+    }
+    if (profileInit(vm->profile, vm->memWords) < 0) {
+        free(vm->profile);
+        vm->profile = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int vm_profile_report(const vm_t *vm, FILE *out, const char *symfile) {
+    symbols_t syms;
+    int loaded = 0;
+    if (vm->profile == NULL) {
+        return -1;
+    }
+    if (symfile != NULL) {
+        if (symbolsLoad(&syms, symfile) < 0) {
+            return -1;
+        }
+        loaded = 1;
+    } else if (vm->symbols != NULL) {
+        if (symbolsParse(&syms, vm->symbols, vm->symbolsLen) < 0) {
+            return -1;
+        }
+        loaded = 1;
+    }
+    profileReport(vm->profile, vm->mem, &vm->cfg, loaded ? &syms : NULL, out);
+    if (loaded) {
+        symbolsFree(&syms);
+    }
+    return 0;
+}
+
+int vm_enable_perf(vm_t *vm) {
+    if (vm->perf != NULL) {
+        return 0;
+    }
+    vm->perf = malloc(sizeof(perf_t));
+    if (vm->perf == NULL) {
+        return -1;
+    }
+    if (perfOpen(vm->perf) < 0) {
+        free(vm->perf);
+        vm->perf = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int vm_perf_read(const vm_t *vm, vm_perf_t *perf) {
+    if (vm->perf == NULL) {
+        return -1;
+    }
+    perfRead(vm->perf, perf);
+    return 0;
+}
+
+int vm_perf_report(const vm_t *vm, FILE *out) {
+    if (vm->perf == NULL) {
+        return -1;
+    }
+    perfReport(vm->perf, out);
+    return 0;
+}
+
+int vm_enable_trace(vm_t *vm, uint64_t records) {
+    trace_t *trace;
+    if (records == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    trace = malloc(sizeof(trace_t));
+    if (trace == NULL) {
+        return -1;
+    }
+    if (traceInit(trace, records) < 0) {
+        free(trace);
+        return -1;
+    }
+    if (vm->trace != NULL) {
+        traceFree(vm->trace);
+        free(vm->trace);
+    }
+    vm->trace = trace;
+    return 0;
+}
+
+int vm_trace_save(const vm_t *vm, const char *filename) {
+    traceheader_t h;
+    FILE *f;
+    int ret = 0;
+    if (vm->trace == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    h.headerWords = sizeof(h) / sizeof(u_int32_t);
+    h.records = traceRecords(vm->trace);
+    h.first = vm->trace->count - h.records;
+    h.flags = vm->error.cause != VM_FAULT_NONE ? TRACE_FAULTED : 0;
+    h.fault = vm->error.cause;
+    h.nameBytes = vm->progname != NULL ? strlen(vm->progname) : 0;
+    h.symBytes = vm->symbolsLen;
+    f = fopen(filename, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    if (fwrite(&h, sizeof(h), 1, f) != 1
+        || fwrite(vm->progname, 1, h.nameBytes, f) != h.nameBytes
+        || fwrite(vm->symbols, 1, h.symBytes, f) != h.symBytes
+        || traceWrite(vm->trace, vm->regs, f) < 0) {
+        ret = -1;
+    }
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,445 @@
+/** \headerfile vm.h "vm.h"
+ *  \brief Embeddable API of the virtual machine
+ *  \author T. Prévost, CSN 2024 @ ENSTA Bretagne
+ *  \version 1.0
+ *  \date 2022
+ *
+ * All the state of a guest program lives in a vm_t context, so a host can
+ * run as many guests as it wants in one process:
+ *
+ *     vm_t *vm = vm_create();
+ *     if (vm_load(vm, "program.bin") == 0) {
+ *         vm_run(vm, 0);
+ *     }
+ *     vm_destroy(vm);
+ */
+
+#ifndef VM_H
+#define VM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Execution engines */
+#define VM_ENGINE_SWITCH 0      // portable switch dispatch
+#define VM_ENGINE_THREADED 1    // direct-threaded dispatch (labels as values)
+#define VM_ENGINE_JIT 2         // interpreter compiling hot basic blocks to native code (x86-64)
+
+/* Status returned by vm_run */
+#define VM_HALTED 0             // the program reached a stop instruction
+#define VM_BUDGET_EXHAUSTED 1   // max_steps instructions ran, the program can be resumed
+#define VM_FAULT 2              // the program stopped on an error, described by vm_fault
+#define VM_WAITING 3            // scall 0 waits for input, the program resumes on the next call
+
+/* Causes of the faults of vm_fault_t */
+#define VM_FAULT_NONE 0         // the program did not fault
+#define VM_FAULT_OPCODE 1       // invalid opcode
+#define VM_FAULT_LOAD 2         // load out of memory
+#define VM_FAULT_STORE 3        // store out of memory
+#define VM_FAULT_VECTOR 4       // vector instruction on a block of memory that does not fit in it
+#define VM_FAULT_REGISTERS 5    // vector load or store past the last register
+#define VM_FAULT_MEM_LIMIT 6    // store to a new page over the memory limit
+#define VM_FAULT_PC 7           // program counter out of memory, by a jump or past the last word
+#define VM_FAULT_DIVIDE 8       // division by zero
+#define VM_FAULT_HART 9         // join of a hart that was not spawned, has been joined, or is the one joining
+
+/* Returned by a vm_input_fn that has no integer yet */
+#define VM_INPUT_WAIT (-1)
+
+/* Host counters of vm_perf_t */
+#define VM_PERF_TASK_CLOCK 0        // nanoseconds the host thread ran
+#define VM_PERF_CYCLES 1
+#define VM_PERF_INSTRUCTIONS 2      // host instructions
+#define VM_PERF_BRANCHES 3
+#define VM_PERF_BRANCH_MISSES 4
+#define VM_PERF_CACHE_REFERENCES 5  // last-level cache
+#define VM_PERF_CACHE_MISSES 6
+#define VM_PERF_ITLB_MISSES 7
+#define VM_PERF_DTLB_MISSES 8       // read misses
+#define VM_PERF_COUNTERS 9
+
+typedef struct vm vm_t;
+typedef struct vm_snapshot vm_snapshot_t;
+
+/** @brief Receives the output of the guest
+ * @param ctx context given with the callback
+ * @param data bytes written by the guest (not null-terminated)
+ * @param len number of bytes
+ */
+typedef void (*vm_output_fn)(void *ctx, const char *data, size_t len);
+
+/** @brief Gives the next integer scall 0 reads
+ * @param ctx context given with the callback
+ * @param value set to the integer
+ * @return 1 if value is set, 0 at the end of the input (scall 0 then reads 0),
+ *         or VM_INPUT_WAIT if there is no integer yet: vm_run then returns
+ *         VM_WAITING, and scall 0 asks again when the program is resumed
+ */
+typedef int (*vm_input_fn)(void *ctx, int *value);
+
+/** @brief Counts of the host while the engines ran */
+typedef struct {
+    uint64_t counts[VM_PERF_COUNTERS];  // indexed by VM_PERF_*
+    uint32_t available;     // 1 << VM_PERF_* for each counter the host has
+    uint64_t steps;         // guest instructions run while counting
+} vm_perf_t;
+
+/** @brief Fault that stopped a program */
+typedef struct {
+    int cause;          // VM_FAULT_*
+    uint32_t pc;        // address of the faulting instruction, or the pc out of memory for VM_FAULT_PC
+    uint32_t addr;      // address accessed, the first word of the block for VM_FAULT_VECTOR, 0 for the other causes
+    int hart;           // hart that faulted, 0 for the one the host runs
+} vm_fault_t;
+
+/** @brief Options of a VM, fixed at creation */
+typedef struct {
+    uint64_t mem_words;     // size of memory in words, 0 for MEMSIZE
+    int huge_pages;         // 1 to advise transparent huge pages for memory
+    uint64_t mem_limit;     // bytes of memory the program may hold, 0 for no limit
+} vm_config_t;
+
+/** @brief Create a VM with zeroed memory and registers
+ * @return the new VM, or NULL if out of memory
+ */
+vm_t *vm_create(void);
+
+/** @brief Create a VM with the given options
+ * @param config the options, NULL for the defaults
+ * @return the new VM, or NULL if out of memory or if the options are invalid
+ *
+ * Memory is mapped without reserving swap for it, and only populated as the
+ * guest touches it, so a large memory with a small working set stays cheap.
+ * The program holds the pages of 4 KiB it loads or stores to: once it holds
+ * mem_limit bytes, a store to a new page faults the program instead of taking
+ * more memory from the host, which thus runs many VMs without the risk of
+ * running out of it. Options are invalid if mem_limit is less than a page.
+ */
+vm_t *vm_create_config(const vm_config_t *config);
+
+/** @brief Parse a memory size such as 8192, 64K, 64M or 4G
+ * @param text the size, in bytes, with an optional K, M or G suffix
+ * @param words set to the size in 32-bit words
+ * @return 0 on success, -1 if the size is invalid or not a multiple of 4 bytes
+ */
+int vm_parse_mem_size(const char *text, uint64_t *words);
+
+/** @brief Free a VM and everything it owns
+ * @param vm the VM to destroy, may be NULL
+ */
+void vm_destroy(vm_t *vm);
+
+/** @brief Load a binary file into memory and reset the execution state
+ * @param vm the VM
+ * @param filename the name of the file to read
+ * @return 0 on success, -1 with errno set if the file cannot be read
+ *         (EFBIG if it does not fit in memory, ENOMEM if it is larger than the
+ *         memory limit, ENOEXEC if it is a corrupt object file)
+ *
+ * The file is either an object file written by the assembler (see object.h),
+ * whose sections are copied to their addresses and whose entry point becomes
+ * the pc, a snapshot saved by vm_snapshot_save, which is restored, or a raw
+ * image loaded at address 0.
+ */
+int vm_load(vm_t *vm, const char *filename);
+
+/** @brief Same as vm_load, but map the file copy-on-write instead of reading it
+ * @param vm the VM
+ * @param filename the name of the file to map
+ * @return 0 on success, -1 with errno set if the file cannot be mapped
+ *
+ * Only the pages the guest touches are read, which makes loading large images
+ * almost free. The file must not be truncated while the VM uses it. Sections
+ * of an object file that are not page aligned are read instead. The code of a
+ * raw image, or of an object file without a control-flow graph, is read
+ * through once, to build the graph (see cfg.h).
+ */
+int vm_load_mapped(vm_t *vm, const char *filename);
+
+/** @brief Same as vm_load, from an image in the memory of the host
+ * @param vm the VM
+ * @param data the content of the file, such as an image received from a client
+ * @param bytes size of the image
+ * @param name name of the program, as vm_load takes it from the file name
+ * @return 0 on success, -1 with errno set, as vm_load
+ */
+int vm_load_image(vm_t *vm, const void *data, size_t bytes, const char *name);
+
+/** @brief Select the execution engine
+ * @param vm the VM
+ * @param engine VM_ENGINE_SWITCH, VM_ENGINE_THREADED or VM_ENGINE_JIT
+ * @return 0 on success, -1 if the engine is not available in this build or on this host
+ */
+int vm_set_engine(vm_t *vm, int engine);
+
+/** @brief Set the stream scall 0 reads integers from (stdin by default)
+ *
+ * scall 0 only prompts for the integers, flushing the output first, when the
+ * stream is a terminal. The other providers below never prompt.
+ */
+void vm_set_input(vm_t *vm, FILE *in);
+
+/** @brief Make scall 0 read the values of an array, then 0
+ * @param vm the VM
+ * @param values the integers, not copied: they must outlive their use by the VM
+ * @param count number of integers
+ */
+void vm_set_input_values(vm_t *vm, const int *values, size_t count);
+
+/** @brief Make scall 0 read integers written as text, separated by spaces, commas or newlines
+ * @param vm the VM
+ * @param text the integers, not copied: they must outlive their use by the VM
+ * @param len length of the text
+ */
+void vm_set_input_text(vm_t *vm, const char *text, size_t len);
+
+/** @brief Make scall 0 read the integers written as text in a file, mapped into memory
+ * @param vm the VM
+ * @param filename the name of the file
+ * @return 0 on success, -1 with errno set if the file cannot be mapped
+ */
+int vm_set_input_file(vm_t *vm, const char *filename);
+
+/** @brief Make scall 0 ask a callback for each integer
+ * @param vm the VM
+ * @param source the callback
+ * @param ctx passed to each call of the callback
+ */
+void vm_set_input_callback(vm_t *vm, vm_input_fn source, void *ctx);
+
+/** @brief Set the stream syscalls and error messages write to (stdout by default) */
+void vm_set_output(vm_t *vm, FILE *out);
+
+/** @brief Send the output of the guest to a callback instead of a stream
+ * @param vm the VM
+ * @param sink the callback
+ * @param ctx passed to each call of the callback
+ *
+ * Output is buffered: the callback is called when the buffer is full, before
+ * scall 0 prompts for input, and before vm_run returns.
+ */
+void vm_set_output_callback(vm_t *vm, vm_output_fn sink, void *ctx);
+
+/** @brief Execute the loaded program
+ * @param vm the VM
+ * @param max_steps maximum number of instructions to execute, 0 for no limit
+ * @return VM_HALTED, VM_BUDGET_EXHAUSTED, VM_FAULT, or VM_WAITING if the input
+ *         callback has no integer for scall 0 yet
+ *
+ * A program stopped by its budget or waiting for input resumes where it left
+ * off on the next call; the scall 0 that waits is not counted in the steps
+ * until it reads its integer. A host can thus share a thread between guests
+ * by running each of them for a slice of steps in turn, and set aside those
+ * that wait (see sched.h). The budget is exact, yet the engines check it only
+ * once per basic block: it costs next to nothing, however small the slices.
+ *
+ * An instruction that faults has no effect but to stop the program: the pc
+ * is left on it, and the steps count it. A pc out of memory faults before
+ * anything runs there. The error is written to the output, and vm_fault
+ * tells its cause.
+ *
+ * The program may spawn harts, guest cores with registers and a pc of their
+ * own, each run by a thread of the VM over the memory of the program, until
+ * it stops or is joined (scall 4 and 5). vm_run runs the first hart, the one
+ * of vm_reg and vm_pc, and the others meanwhile, pausing them before it
+ * returns. max_steps then counts the steps of all of them, but is only
+ * checked between their slices of HART_SLICE steps: a run may go over it by
+ * a slice per hart. A scall 5 still waiting for its hart once the budget is
+ * spent runs again on the next call. The program halts when the first hart
+ * does, stopping the others, and faults when any of them does. Only the
+ * first hart is profiled, traced and counted by vm_enable_perf. While harts
+ * run, the output callback is called from their threads too, one at a time.
+ */
+int vm_run(vm_t *vm, uint64_t max_steps);
+
+/** @brief Get the fault that stopped the program
+ * @param vm the VM
+ * @param fault set to the fault, cleared if the program did not fault; may be NULL
+ * @return the cause, VM_FAULT_NONE unless vm_run returned VM_FAULT since the
+ *         program was loaded
+ */
+int vm_fault(const vm_t *vm, vm_fault_t *fault);
+
+/** @brief Get a short description of a cause of fault, such as "load out of bounds"
+ * @param cause VM_FAULT_*
+ */
+const char *vm_fault_name(int cause);
+
+/** @brief Take a snapshot of the state of the VM
+ * @param vm the VM, between two calls to vm_run
+ * @return the snapshot, or NULL with errno set if it cannot be written (EBUSY
+ *         if the program has harts it did not join)
+ *
+ * The snapshot holds the memory, the registers, the pc, the count of steps,
+ * the output not flushed yet, the program name, the symbol table and the
+ * control-flow graph of the code. It is kept in an anonymous file: its
+ * memory is not part of the address space of the host until a VM is
+ * restored from it.
+ */
+vm_snapshot_t *vm_snapshot(const vm_t *vm);
+
+/** @brief Restore the state of a VM from a snapshot
+ * @param vm the VM, whose memory must be the size of that of the snapshot
+ * @param snap the snapshot
+ * @return 0 on success, -1 with errno set (EINVAL if the sizes of memory differ,
+ *         ENOMEM if the memory of the snapshot is larger than the memory limit)
+ *
+ * The memory of the snapshot is mapped copy-on-write: restoring costs almost
+ * nothing, and the VMs restored from one snapshot share the pages none of
+ * them wrote to. The engine, the input and the output sink of the VM stay as
+ * they are; the profile counters and the trace are cleared. The VM holds the
+ * blocks of the snapshot that are not zero, as the file leaves them out.
+ * With the tiered engine, the loops of the graph are hinted again, as when
+ * the program was loaded.
+ */
+int vm_restore(vm_t *vm, const vm_snapshot_t *snap);
+
+/** @brief Save a snapshot to a file, which vm_snapshot_open or vm_load read back
+ * @param snap the snapshot
+ * @param filename the name of the file to write
+ * @return 0 on success, -1 with errno set if the file cannot be written
+ *
+ * Memory that is zero takes no room in the file (see snapshot.h).
+ */
+int vm_snapshot_save(const vm_snapshot_t *snap, const char *filename);
+
+/** @brief Open a snapshot saved by vm_snapshot_save
+ * @param filename the name of the file
+ * @return the snapshot, or NULL with errno set (ENOEXEC if the file is not a snapshot)
+ *
+ * The file must not be modified while the snapshot or VMs restored from it are used.
+ */
+vm_snapshot_t *vm_snapshot_open(const char *filename);
+
+/** @brief Free a snapshot; the VMs restored from it keep their memory
+ * @param snap the snapshot, may be NULL
+ */
+void vm_snapshot_free(vm_snapshot_t *snap);
+
+/** @brief Save the memory the program changed since the previous dump, which vm-memdump prints
+ * @param vm the VM, between two calls to vm_run
+ * @param filename the name of the file to write
+ * @param full 1 to save every block of memory that is not zero instead, as a
+ *        base the next dumps apply over
+ * @return 0 on success, -1 with errno set if the file cannot be written
+ *
+ * Stores mark the blocks of memory they write to, at the cost of one more
+ * store each; the dump only holds the marked blocks, in a binary format (see
+ * dump.h), then clears the marks. Loading a program clears them too, so the
+ * first dump after a load holds what the program changed since. vm-memdump
+ * compares two dumps, to show the words a part of the program changed.
+ */
+int vm_dump_mem(vm_t *vm, const char *filename, int full);
+
+/** @brief Count the instructions the VM executes, for vm_profile_report
+ * @param vm the VM
+ * @return 0 on success, -1 if out of memory
+ *
+ * The counters are only updated by separate profiling engines, so a VM that
+ * is not profiled runs at full speed. Loading a program clears them.
+ */
+int vm_enable_profile(vm_t *vm);
+
+/** @brief Print the instruction mix, branch statistics, loops and hot spots of the program
+ * @param vm the VM, with profiling enabled
+ * @param out stream to print to
+ * @param symfile symbol file written by the assembler, to show labels and
+ *        source lines, or NULL for the symbol table of the object file, if any
+ * @return 0 on success, -1 if profiling is not enabled or the symbol file cannot be read
+ */
+int vm_profile_report(const vm_t *vm, FILE *out, const char *symfile);
+
+/** @brief Count what the host does while the engines run, with its performance counters
+ * @param vm the VM
+ * @return 0 on success, -1 with errno set if the host has none of the counters
+ *         (ENOSYS on hosts other than Linux, EACCES if perf_event_paranoid forbids them)
+ *
+ * The counters count the thread that enables them, in user space only: vm_run
+ * must be called from that thread. They are enabled and disabled around each
+ * run of the engine, which costs a few system calls per call of vm_run.
+ * Loading a program clears them.
+ */
+int vm_enable_perf(vm_t *vm);
+
+/** @brief Read the performance counters
+ * @param vm the VM, with the counters enabled
+ * @param perf set to the counts
+ * @return 0 on success, -1 if the counters are not enabled
+ */
+int vm_perf_read(const vm_t *vm, vm_perf_t *perf);
+
+/** @brief Print the performance counters, per guest instruction, with the IPC and miss rates of the host
+ * @param vm the VM, with the counters enabled
+ * @param out stream to print to
+ * @return 0 on success, -1 if the counters are not enabled
+ */
+int vm_perf_report(const vm_t *vm, FILE *out);
+
+/** @brief Record the last instructions the VM executes, for vm_trace_save
+ * @param vm the VM
+ * @param records number of instructions the trace keeps: each new one
+ *        replaces the oldest, and takes 12 bytes of memory
+ * @return 0 on success, -1 with errno set if out of memory or records is 0
+ *
+ * Like the profile, the trace is recorded by the profiling engines, so that
+ * a VM that is not traced runs at full speed. Enabling it again resizes it
+ * and clears it; loading a program clears it.
+ */
+int vm_enable_trace(vm_t *vm, uint64_t records);
+
+/** @brief Save the trace of the last instructions, which vm-trace prints
+ * @param vm the VM, with tracing enabled, between two calls to vm_run
+ * @param filename the name of the file to write
+ * @return 0 on success, -1 with errno set if tracing is not enabled or the file cannot be written
+ *
+ * The trace is compressed (see trace.h) and holds the symbol table of the
+ * object file, if any. It is not cleared: a later save holds the same records
+ * and the following ones.
+ */
+int vm_trace_save(const vm_t *vm, const char *filename);
+
+/** @brief Read a register
+ * @param vm the VM
+ * @param reg register number
+ * @return value of the register
+ */
+int vm_reg(const vm_t *vm, int reg);
+
+/** @brief Get the program counter */
+int vm_pc(const vm_t *vm);
+
+/** @brief Get the number of instructions executed since the program was loaded */
+uint64_t vm_steps(const vm_t *vm);
+
+/** @brief Get the memory the program holds, which the memory limit applies to
+ * @param vm the VM
+ * @return bytes of the pages of memory loaded or stored to since the program was loaded
+ *
+ * Pages the program only reads are not counted: they read as zero without
+ * taking memory from the host.
+ */
+uint64_t vm_mem_used(const vm_t *vm);
+
+/** @brief Get the memory of the host the VM takes
+ * @param vm the VM
+ * @return bytes of the mappings of the VM resident in memory: guest memory,
+ *         with the pages of an image file it maps, its decoded form and the
+ *         marks of the pages and blocks stored to
+ *
+ * Unlike vm_mem_used, this counts whole huge pages when they are advised, the
+ * zero pages mapped by reads, and the decoded form of the code, which takes
+ * several times the code it decodes. The compiled code of the tiered engine
+ * is left out.
+ * It asks the system for each page, so it costs a system call per 16 MiB of
+ * memory: it is meant for monitoring, not for each slice of steps.
+ */
+uint64_t vm_resident(const vm_t *vm);
+
+/** @brief Display registers and their values */
+void vm_display_regs(const vm_t *vm);
+
+/** @brief Display the memory */
+void vm_display_mem(const vm_t *vm);
+
+#endif